@@ -0,0 +1,119 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "def.h"
+#include "record_copy.h"
+
+// 运行: ./bench/copy_bench [--benchmark_filter=...]
+// 目标是一块提前page fault过的共享映射(和log的mmap一样)，大小超过LLC，
+// 每次写入batch条记录并在下一条记录的位置写commit标记，和MmapWriter::AppendBatch相同
+
+const size_t CopyBenchRegionSize = (size_t)RecordSize * (1 << 20) + 8; // 272MB
+const int CopyBenchUserNum = 1024;
+
+class CopyTarget {
+ public:
+  CopyTarget() : start_(nullptr), curr_(nullptr), src_(CopyBenchUserNum * RecordSize) {
+    void *ptr = mmap(NULL, CopyBenchRegionSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    start_ = ptr == MAP_FAILED ? nullptr : reinterpret_cast<char *>(ptr);
+    curr_ = start_;
+    for (size_t i = 0; i < src_.size(); i++) {
+      src_[i] = static_cast<char>(i * 31);
+    }
+  }
+  ~CopyTarget() {
+    if (start_ != nullptr) {
+      munmap(start_, CopyBenchRegionSize);
+    }
+  }
+  bool Ok() const { return start_ != nullptr; }
+  // 下一段batch条记录的写入位置，写到末尾时从头开始
+  char *Next(size_t batch) {
+    if (curr_ + (batch + 1) * RecordSize > start_ + CopyBenchRegionSize) {
+      curr_ = start_;
+    }
+    char *dst = curr_;
+    curr_ += batch * RecordSize;
+    return dst;
+  }
+  const char *Src(size_t i, size_t batch) const {
+    return src_.data() + (i * batch % (CopyBenchUserNum - batch)) * RecordSize;
+  }
+
+ private:
+  char *start_;
+  char *curr_;
+  std::vector<char> src_;
+};
+
+// 原来的MmapWriter::Append: 三次memcpy + commit标记
+static void BM_MemcpyAppend(benchmark::State& state) {
+  size_t batch = state.range(0);
+  CopyTarget target;
+  if (!target.Ok()) {
+    state.SkipWithError("mmap failed");
+    return;
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    char *dst = target.Next(batch);
+    const char *src = target.Src(i++, batch);
+    for (size_t j = 0; j < batch; j++) {
+      memcpy(dst, src, 256);
+      memcpy(dst + 256, src + 256, 16);
+      dst += RecordSize;
+      src += RecordSize;
+    }
+    *(uint64_t *)dst = CommitFlag;
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+  state.SetBytesProcessed(state.iterations() * batch * RecordSize);
+}
+
+// 参数: kernel, batch, non-temporal
+static void BM_RecordCopyAppend(benchmark::State& state) {
+  if (SetRecordCopyKernel(state.range(0)) != 0) {
+    state.SkipWithError("kernel not supported by this cpu");
+    return;
+  }
+  size_t batch = state.range(1);
+  RecordCopyFn copy = state.range(2) ? StreamRecords : CopyRecords;
+  CopyTarget target;
+  if (!target.Ok()) {
+    state.SkipWithError("mmap failed");
+    return;
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    char *dst = target.Next(batch);
+    copy(dst, target.Src(i++, batch), batch);
+    *(uint64_t *)(dst + batch * RecordSize) = CommitFlag;
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+  state.SetBytesProcessed(state.iterations() * batch * RecordSize);
+  state.SetLabel(RecordCopyKernelName(state.range(0)));
+  SetRecordCopyKernel(BestRecordCopyKernel());
+}
+
+static void BatchArgs(benchmark::internal::Benchmark* b) {
+  b->Arg(1)->Arg(16)->Arg(64)->Arg(256)->ArgName("batch");
+}
+
+static void KernelArgs(benchmark::internal::Benchmark* b) {
+  for (int kernel : {RecordCopyKernel::CopySSE2, RecordCopyKernel::CopyAVX2, RecordCopyKernel::CopyAVX512}) {
+    for (int batch : {1, 16, 64, 256}) {
+      for (int nt : {0, 1}) {
+        b->Args({kernel, batch, nt});
+      }
+    }
+  }
+  b->ArgNames({"kernel", "batch", "nt"});
+}
+
+BENCHMARK(BM_MemcpyAppend)->Apply(BatchArgs);
+BENCHMARK(BM_RecordCopyAppend)->Apply(KernelArgs);
+
+BENCHMARK_MAIN();
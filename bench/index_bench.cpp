@@ -0,0 +1,179 @@
+#include <mutex>
+#include <random>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "hash_table8.hpp"
+#include "partitioned_index.h"
+#include "indexer.h"
+
+// 运行: ./bench/index_bench [--benchmark_filter=...]
+// hybrid阶段的混合读写: 每个线程每次迭代写入一条记录，再按id/user_id/salary轮流查reads次已经写入的记录，
+// 比较原来的全局锁(一把mutex + 单个hash表)、按key分shard读者不加锁的索引、按写线程分区的索引，
+// 以及WriteOnly阶段写入delta表由后台线程合并、读同时查delta表和索引的方式随线程数的扩展性
+
+const int BenchIndexUsers = 1 << 16;
+const int BenchIndexSalaryDup = 4;  // 每个salary对应的记录数
+
+using primary_key = emhash8::HashMap<int64_t, size_t>;
+using unique_key  = emhash8::HashMap<BlizardHashWrapper, size_t>;
+using normal_key  = emhash8::HashMap<int64_t, LocationsWrapper>;
+
+// 原来engine中的做法，所有读写都持有同一把锁
+class GlobalLockIndex {
+ public:
+  void Insert(const User *user) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    users_.push_back(*user);
+    size_t record_slot = users_.size() - 1;
+    idx_id_.insert({user->id, record_slot});
+    idx_user_id_.emplace(BlizardHashWrapper(user->user_id, UseridLen), record_slot);
+    idx_salary_[user->salary].Push(record_slot);
+  }
+  template <typename F>
+  size_t FindId(int64_t id, F f) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto iter = idx_id_.find(id);
+    if (iter == idx_id_.end()) {
+      return 0;
+    }
+    f(users_[iter->second]);
+    return 1;
+  }
+  template <typename F>
+  size_t FindUserId(const char *user_id, F f) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto iter = idx_user_id_.find(BlizardHashWrapper(user_id, UseridLen));
+    if (iter == idx_user_id_.end()) {
+      return 0;
+    }
+    f(users_[iter->second]);
+    return 1;
+  }
+  template <typename F>
+  size_t FindSalary(int64_t salary, F f) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto iter = idx_salary_.find(salary);
+    if (iter == idx_salary_.end()) {
+      return 0;
+    }
+    for (size_t i = 0; i < iter->second.Size(); i++) {
+      f(users_[iter->second[i]]);
+    }
+    return iter->second.Size();
+  }
+
+ private:
+  std::mutex mtx_;
+  std::vector<User> users_;
+  primary_key idx_id_;
+  unique_key idx_user_id_;
+  normal_key idx_salary_;
+};
+
+// 每个benchmark线程写自己的分区
+static thread_local int bench_partition = 0;
+
+class PartitionedBenchIndex {
+ public:
+  PartitionedBenchIndex() : index_(64) {}
+  void Insert(const User *user) { index_.Insert(bench_partition, user); }
+  template <typename F>
+  size_t FindId(int64_t id, F f) { return index_.FindId(id, f); }
+  template <typename F>
+  size_t FindUserId(const char *user_id, F f) { return index_.FindUserId(user_id, f); }
+  template <typename F>
+  size_t FindSalary(int64_t salary, F f) { return index_.FindSalary(salary, f); }
+
+ private:
+  PartitionedIndex index_;
+};
+
+// 写线程只追加到自己的delta表，后台线程合并到按写线程分区的索引
+class DeltaBenchIndex {
+ public:
+  DeltaBenchIndex() : index_(IndexLayout::WriterPartitionedLayout, 64), indexer_(&index_, 64, IndexerThreads) {}
+  void Insert(const User *user) { indexer_.Add(bench_partition, user); }
+  template <typename F>
+  size_t FindId(int64_t id, F f) { return indexer_.FindId(id, f); }
+  template <typename F>
+  size_t FindUserId(const char *user_id, F f) { return indexer_.FindUserId(user_id, f); }
+  template <typename F>
+  size_t FindSalary(int64_t salary, F f) { return indexer_.FindSalary(salary, f); }
+
+ private:
+  HybridIndex index_;
+  BackgroundIndexer indexer_;
+};
+
+static std::vector<User> GenIndexUsers() {
+  std::mt19937_64 rng(0);
+  std::vector<User> users(BenchIndexUsers);
+  for (int i = 0; i < BenchIndexUsers; i++) {
+    for (int j = 0; j < 16; j++) {
+      users[i].user_id[j] = 'a' + rng() % 26;
+      users[i].name[j] = 'a' + rng() % 26;
+    }
+  }
+  return users;
+}
+
+// 参数: reads
+template <typename Index>
+static void BM_IndexMixed(benchmark::State& state) {
+  const int reads = state.range(0);
+  static Index *index = nullptr;
+  static const std::vector<User> users = GenIndexUsers();
+  if (state.thread_index() == 0) {
+    index = new Index();
+  }
+  const int64_t threads = state.threads();
+  bench_partition = state.thread_index();
+  std::mt19937_64 rng(state.thread_index());
+  User user, query;
+  int64_t i = 0;
+  int64_t found = 0;
+  char res[128];
+  auto copy_name = [&res](const User &u) { memcpy(res, u.name, sizeof(res)); };
+  for (auto _ : state) {
+    // 每个线程写入不重复的id和user_id(前8字节)，name取自预先生成的记录
+    int64_t k = i * threads + state.thread_index();
+    user = users[k % BenchIndexUsers];
+    user.id = k + 1;
+    user.salary = k / BenchIndexSalaryDup;
+    memcpy(user.user_id, &k, sizeof(k));
+    index->Insert(&user);
+    i++;
+
+    for (int j = 0; j < reads; j++) {
+      int64_t r = (rng() % i) * threads + state.thread_index();
+      switch (j % 3) {
+        case 0:
+          found += index->FindId(r + 1, copy_name);
+          break;
+        case 1:
+          memcpy(query.user_id, &r, sizeof(r));
+          found += index->FindUserId(query.user_id, copy_name);
+          break;
+        default:
+          found += index->FindSalary(r / BenchIndexSalaryDup, copy_name) > 0;
+          break;
+      }
+    }
+    benchmark::DoNotOptimize(res);
+  }
+  state.SetItemsProcessed(state.iterations() * (1 + reads));
+  state.counters["hit"] = benchmark::Counter(reads == 0 ? 0 : double(found) / (state.iterations() * reads),
+                                             benchmark::Counter::kAvgThreads);
+  if (state.thread_index() == 0) {
+    delete index;
+    index = nullptr;
+  }
+}
+
+// 写为主(1:1)、写多(1:3)和读多(1:30)的比例; 按写线程分区的索引只适合前两种
+BENCHMARK_TEMPLATE(BM_IndexMixed, GlobalLockIndex)->Arg(3)->Arg(30)->ArgName("reads")->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_IndexMixed, ShardedIndex)->Arg(1)->Arg(3)->Arg(30)->ArgName("reads")->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_IndexMixed, PartitionedBenchIndex)->Arg(1)->Arg(3)->ArgName("reads")->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_IndexMixed, DeltaBenchIndex)->Arg(1)->Arg(3)->ArgName("reads")->ThreadRange(1, 16)->UseRealTime();
+
+BENCHMARK_MAIN();
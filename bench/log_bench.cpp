@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <memory>
+#include <random>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include "log.h"
+#include "util.h"
+
+// 运行: ./bench/log_bench [--benchmark_filter=...]
+// LOG_BENCH_DIR 指定写入的目录(默认/tmp/log_bench)，应该放在要测试的ssd上
+// PMEM_BENCH_DIR 指定pmem log的目录(默认和LOG_BENCH_DIR相同)，应该放在要测试的pmem上
+
+const int BenchMmapSize = RecordSize * 200000 + 8;
+const int BenchUserNum = 4096;
+
+static std::string BenchDir() {
+  const char *dir = getenv("LOG_BENCH_DIR");
+  return dir == nullptr ? "/tmp/log_bench" : dir;
+}
+
+static std::string PmemBenchDir() {
+  const char *dir = getenv("PMEM_BENCH_DIR");
+  return dir == nullptr ? BenchDir() : dir;
+}
+
+static void RemoveLog(const std::string &path) {
+  unlink(path.c_str());
+  for (int c = 0; c < 4; c++) {
+    unlink((path + ColumnFileSuffix[c]).c_str());
+  }
+}
+
+// fill_len: user_id/name中非0的字节数，128表示完全不能压缩
+static std::vector<User> GenUsers(int fill_len) {
+  std::mt19937_64 rng(fill_len);
+  std::vector<User> users(BenchUserNum);
+  for (int i = 0; i < BenchUserNum; i++) {
+    users[i].id = i + 1;
+    users[i].salary = rng();
+    for (int j = 0; j < fill_len; j++) {
+      users[i].user_id[j] = 'a' + rng() % 26;
+      users[i].name[j] = 'a' + rng() % 26;
+    }
+  }
+  return users;
+}
+
+// 每次写入的延迟，结束时把分位数(ns)写入counters
+class Latencies {
+ public:
+  Latencies() { ns_.reserve(1 << 22); }
+  void Add(std::chrono::steady_clock::time_point start) {
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+    if (ns_.size() < ns_.capacity()) {
+      ns_.push_back(std::min<uint64_t>(ns, UINT32_MAX));
+    }
+  }
+  void Report(benchmark::State& state) {
+    std::sort(ns_.begin(), ns_.end());
+    auto percentile = [this](double p) {
+      return ns_.empty() ? 0.0 : double(ns_[std::min(ns_.size() - 1, size_t(ns_.size() * p))]);
+    };
+    state.counters["p50_ns"] = percentile(0.50);
+    state.counters["p99_ns"] = percentile(0.99);
+    state.counters["p999_ns"] = percentile(0.999);
+    state.counters["max_ns"] = ns_.empty() ? 0 : ns_.back();
+  }
+
+ private:
+  std::vector<uint32_t> ns_;
+};
+
+// 参数: format, fill_len
+static void BM_DiskLogAppend(benchmark::State& state) {
+  int format = state.range(0);
+  std::vector<User> users = GenUsers(state.range(1));
+  mkdir(BenchDir().c_str(), 0755);
+  std::string path = Util::DataFileName(BenchDir(), "BENCH", format);
+  RemoveLog(path);
+  Util::CreateIfNotExists(path);
+  std::unique_ptr<DiskLogWriter> writer(NewDiskLogWriter(format, path, BenchMmapSize));
+
+  uint64_t records = 0, raw_bytes = 0, used_bytes = 0;
+  size_t i = 0;
+  for (auto _ : state) {
+    if (unlikely(writer->FreeSlot() == 0)) {
+      state.PauseTiming();
+      used_bytes += writer->UsedBytes();
+      writer.reset();
+      RemoveLog(path);
+      Util::CreateIfNotExists(path);
+      writer.reset(NewDiskLogWriter(format, path, BenchMmapSize));
+      state.ResumeTiming();
+    }
+    writer->Append(&users[i++ % BenchUserNum]);
+    records++;
+  }
+  used_bytes += writer->UsedBytes();
+  raw_bytes = records * RecordSize;
+  writer.reset();
+  RemoveLog(path);
+
+  state.SetItemsProcessed(records);
+  state.SetBytesProcessed(raw_bytes);
+  state.counters["ratio"] = used_bytes == 0 ? 0 : double(raw_bytes) / used_bytes;
+}
+
+static void BM_DiskLogReplay(benchmark::State& state) {
+  int format = state.range(0);
+  std::vector<User> users = GenUsers(state.range(1));
+  mkdir(BenchDir().c_str(), 0755);
+  std::string path = Util::DataFileName(BenchDir(), "BENCH", format);
+  RemoveLog(path);
+  Util::CreateIfNotExists(path);
+  {
+    std::unique_ptr<DiskLogWriter> writer(NewDiskLogWriter(format, path, BenchMmapSize));
+    for (size_t i = 0; writer->FreeSlot() > 0 && i < 100000; i++) {
+      writer->Append(&users[i % BenchUserNum]);
+    }
+  }
+  uint64_t records = 0;
+  for (auto _ : state) {
+    std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(format, path, BenchMmapSize));
+    char *record;
+    while (reader->ReadRecord(record, RecordSize)) {
+      benchmark::DoNotOptimize(record);
+      records++;
+    }
+  }
+  RemoveLog(path);
+  state.SetItemsProcessed(records);
+  state.SetBytesProcessed(records * RecordSize);
+}
+
+// 打开一个写了BenchMmapSize一半的log并统计记录数(engine启动和重建索引时的开销)
+static void BM_DiskLogOpen(benchmark::State& state) {
+  int format = state.range(0);
+  std::vector<User> users = GenUsers(state.range(1));
+  mkdir(BenchDir().c_str(), 0755);
+  std::string path = Util::DataFileName(BenchDir(), "BENCH", format);
+  RemoveLog(path);
+  Util::CreateIfNotExists(path);
+  {
+    std::unique_ptr<DiskLogWriter> writer(NewDiskLogWriter(format, path, BenchMmapSize));
+    for (size_t i = 0; writer->FreeSlot() > 0 && i < 100000; i++) {
+      writer->Append(&users[i % BenchUserNum]);
+    }
+  }
+  for (auto _ : state) {
+    std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(format, path, BenchMmapSize));
+    benchmark::DoNotOptimize(reader->Count());
+  }
+  RemoveLog(path);
+}
+
+// 参数: backend(DiskBackend)，行存log每次Append的延迟分位数。
+// 文件写满时重新创建(不计时)，mmap的缺页和回写、direct io的提交都计入延迟
+static void BM_DiskBackendAppend(benchmark::State& state) {
+  const int backend = state.range(0);
+  std::vector<User> users = GenUsers(128);
+  mkdir(BenchDir().c_str(), 0755);
+  std::string path = Util::DataFileName(BenchDir(), "BENCH_BACKEND", backend);
+  RemoveLog(path);
+  Util::CreateIfNotExists(path);
+  std::unique_ptr<DiskLogWriter> writer(NewDiskLogWriter(DiskLogFormat::RowLog, path, BenchMmapSize, backend));
+  Latencies latency;
+  size_t i = 0;
+  for (auto _ : state) {
+    if (unlikely(writer->FreeSlot() == 0)) {
+      state.PauseTiming();
+      writer.reset();
+      RemoveLog(path);
+      Util::CreateIfNotExists(path);
+      writer.reset(NewDiskLogWriter(DiskLogFormat::RowLog, path, BenchMmapSize, backend));
+      state.ResumeTiming();
+    }
+    auto start = std::chrono::steady_clock::now();
+    writer->Append(&users[i++ % BenchUserNum]);
+    latency.Add(start);
+  }
+  writer.reset();
+  RemoveLog(path);
+
+  state.SetItemsProcessed(i);
+  state.SetBytesProcessed(i * RecordSize);
+  latency.Report(state);
+}
+
+static void RemovePmemLog(const std::string &path, size_t segments) {
+  unlink((path + PmapBufferWriterFileNameSuffix).c_str());
+  for (size_t i = 0; i < segments; i++) {
+    unlink(SegmentFileName(path, i).c_str());
+  }
+}
+
+// 参数: background(0: 写满的buffer由writer同步刷入pmem，1: 由BufferFlusher在后台刷入)
+// 每次Append单独计时，counters中是Append延迟的分位数(ns)，每16次Append有一次要刷buffer
+static void BM_PmemAppend(benchmark::State& state) {
+  const bool background = state.range(0) != 0;
+  const size_t max_segments = 1 << 10;
+  std::vector<User> users = GenUsers(128);
+  mkdir(PmemBenchDir().c_str(), 0755);
+  std::string path = Util::DataFileName(PmemBenchDir(), "BENCH_PMEM", background);
+  RemovePmemLog(path, max_segments);
+  Util::CreateIfNotExists(path + PmapBufferWriterFileNameSuffix);
+  std::unique_ptr<BufferFlusher> flusher(background ? new BufferFlusher() : nullptr);
+  std::unique_ptr<PmapBufferWriter> writer(
+    new PmapBufferWriter(path, PmemSegmentSize, max_segments, Durability::Async, nullptr, flusher.get()));
+
+  Latencies latency;
+  size_t i = 0;
+  for (auto _ : state) {
+    auto start = std::chrono::steady_clock::now();
+    writer->Append(&users[i++ % BenchUserNum]);
+    latency.Add(start);
+  }
+  const DurabilityStats stats = writer->Stats();
+  writer.reset();
+  flusher.reset();
+  RemovePmemLog(path, max_segments);
+
+  state.SetItemsProcessed(i);
+  state.SetBytesProcessed(i * RecordSize);
+  latency.Report(state);
+  state.counters["wait_ns_per_flush"] = stats.flushes == 0 ? 0 : double(stats.flush_wait_ns) / stats.flushes;
+}
+
+// 参数: layout(PmemLayout), durability(Async/PerRecord/GroupCommit)，多线程时每个线程写自己的log，
+// GroupCommit的线程共用一个GroupCommitter。
+// 写入带宽，以及按显式刷出的XPLine估计的写放大: 介质写入字节数(XPLine数 * 256) / 记录字节数，
+// partial_per_record是每条记录平均多少个没有整条写满、需要读-改-写的XPLine。
+// counters按线程求和，每个线程的迭代次数相同，records_per_drain和avg_commit_us都是所有线程合计的平均值
+static void BM_PmemLayout(benchmark::State& state) {
+  const int layout = state.range(0);
+  const int durability = state.range(1);
+  const size_t max_segments = 1 << 10;
+  // 不同线程数的运行之间复用，不释放
+  static GroupCommitter committer(GroupCommitBatch, GroupCommitWindowMicros);
+  std::vector<User> users = GenUsers(128);
+  mkdir(PmemBenchDir().c_str(), 0755);
+  std::string path = Util::DataFileName(PmemBenchDir(), "BENCH_LAYOUT" + std::to_string(layout), state.thread_index());
+  RemovePmemLog(path, max_segments);
+  Util::CreateIfNotExists(path + PmapBufferWriterFileNameSuffix);
+  std::unique_ptr<PmapBufferWriter> writer(
+    new PmapBufferWriter(path, PmemSegmentSize, max_segments, durability,
+                         durability == Durability::GroupCommit ? &committer : nullptr, nullptr, layout));
+  size_t i = 0;
+  for (auto _ : state) {
+    writer->Append(&users[i++ % BenchUserNum]);
+  }
+  const DurabilityStats stats = writer->Stats();
+  writer.reset();
+  RemovePmemLog(path, max_segments);
+
+  state.SetItemsProcessed(i);
+  state.SetBytesProcessed(i * RecordSize);
+  state.counters["xplines_per_record"] = benchmark::Counter(stats.xplines, benchmark::Counter::kAvgIterations);
+  state.counters["partial_per_record"] = benchmark::Counter(stats.partial_xplines, benchmark::Counter::kAvgIterations);
+  state.counters["write_amp"] = benchmark::Counter(double(stats.xplines) * XPLineSize / RecordSize,
+                                                   benchmark::Counter::kAvgIterations);
+  if (durability != Durability::Async) {
+    // group commit的drain只记在leader上，先合计再求倒数
+    state.counters["records_per_drain"] = benchmark::Counter(stats.drains,
+                                                             benchmark::Counter::kAvgIterations | benchmark::Counter::kInvert);
+    state.counters["avg_commit_us"] = benchmark::Counter(stats.commit_ns / 1000.0, benchmark::Counter::kAvgIterations);
+    // 各线程最大值的平均
+    state.counters["max_commit_us"] = benchmark::Counter(stats.max_commit_ns / 1000.0, benchmark::Counter::kAvgThreads);
+  }
+}
+
+static void LogFormatArgs(benchmark::internal::Benchmark* b) {
+  for (int format : {DiskLogFormat::RowLog, DiskLogFormat::ColumnLog, DiskLogFormat::CompressedLog}) {
+    for (int fill_len : {8, 32, 128}) {
+      b->Args({format, fill_len});
+    }
+  }
+  b->ArgNames({"format", "fill_len"});
+}
+
+BENCHMARK(BM_DiskLogAppend)->Apply(LogFormatArgs);
+BENCHMARK(BM_DiskLogReplay)->Apply(LogFormatArgs)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_DiskLogOpen)->Apply(LogFormatArgs)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_DiskBackendAppend)->Arg(DiskBackend::MmapBackend)->Arg(DiskBackend::DirectBackend)->ArgName("backend");
+BENCHMARK(BM_PmemAppend)->Arg(0)->Arg(1)->ArgName("background");
+BENCHMARK(BM_PmemLayout)->ArgsProduct({{PmemLayout::PmemRowLayout, PmemLayout::PmemXPLineLayout},
+                                       {Durability::Async, Durability::PerRecord, Durability::GroupCommit}})
+                        ->ArgNames({"layout", "durability"})
+                        ->Threads(1)->Threads(4)->Threads(GroupCommitBatch)->UseRealTime();
+
+BENCHMARK_MAIN();
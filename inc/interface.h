@@ -18,6 +18,13 @@ extern "C" {
  */
 void engine_write( void *ctx, const void *data, size_t len);
 
+/*
+ * Writes num records to the engine in one call.
+ * datas points to num contiguous records, each one is a full row of the table schema (272 bytes).
+ * A null datas with num > 0 is rejected and nothing is written.
+ */
+void engine_write_batch( void *ctx, const void *datas, size_t num);
+
 /*
  * Simulate queries to a relational database：
  * SELECT select_column FROM table_name WHERE where_column = column_key .
@@ -0,0 +1,226 @@
+#include "checkpoint.h"
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libpmem.h>
+
+#include "spdlog/spdlog.h"
+#include "crc32c.h"
+
+static uint64_t align64(uint64_t n) {
+  return (n + 63) & ~(uint64_t)63;
+}
+
+static uint32_t header_crc(const CheckpointHeader &header) {
+  CheckpointHeader h = header;
+  h.crc = 0;
+  return Crc32c(reinterpret_cast<const char *>(&h), sizeof(h));
+}
+
+// 从counts_offset到crcs_offset的块数
+static uint64_t crc_blocks(const CheckpointHeader &h) {
+  return (h.crcs_offset - h.counts_offset + CheckpointCrcBlockSize - 1) / CheckpointCrcBlockSize;
+}
+
+// 计算header之后每一块的crc，写入和打开时共用
+static void section_crcs(const char *base, const CheckpointHeader &h, uint32_t *crcs) {
+  const uint64_t len = h.crcs_offset - h.counts_offset;
+  const uint64_t full = len / CheckpointCrcBlockSize;
+  Crc32cBlocks(base + h.counts_offset, CheckpointCrcBlockSize, full, crcs);
+  if (len % CheckpointCrcBlockSize != 0) {
+    crcs[full] = Crc32c(base + h.counts_offset + full * CheckpointCrcBlockSize, len % CheckpointCrcBlockSize);
+  }
+}
+
+IndexCheckpoint *IndexCheckpoint::Open(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CheckpointHeader)) {
+    spdlog::warn("[IndexCheckpoint] {} is too small, ignore it", path);
+    close(fd);
+    return nullptr;
+  }
+  size_t size = st.st_size;
+  void *base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    spdlog::warn("[IndexCheckpoint] mmap {} failed, ignore it", path);
+    return nullptr;
+  }
+  // 校验header，以及每一段都在文件之内
+  const CheckpointHeader &h = *static_cast<const CheckpointHeader *>(base);
+  bool valid = h.magic == CheckpointMagic && h.version == CheckpointVersion && h.crc == header_crc(h)
+    && h.file_size == size && h.capacity >= 16 && (h.capacity & (h.capacity - 1)) == 0
+    && h.counts_offset + h.log_num * 2 * sizeof(uint64_t) <= h.records_offset
+    && h.records_offset + h.record_num * sizeof(User) <= h.links_offset
+    && h.links_offset + h.record_num * sizeof(uint64_t) <= h.tables_offset
+    && h.tables_offset + h.capacity * 3 * sizeof(CheckpointEntry) <= h.crcs_offset
+    && h.crcs_offset + crc_blocks(h) * sizeof(uint32_t) == size;
+  if (!valid) {
+    spdlog::warn("[IndexCheckpoint] invalid checkpoint {}, ignore it", path);
+    munmap(base, size);
+    return nullptr;
+  }
+  std::vector<uint32_t> crcs(crc_blocks(h));
+  section_crcs(static_cast<const char *>(base), h, crcs.data());
+  if (memcmp(crcs.data(), static_cast<const char *>(base) + h.crcs_offset, crcs.size() * sizeof(uint32_t)) != 0) {
+    spdlog::warn("[IndexCheckpoint] checksum mismatch in {}, ignore it", path);
+    munmap(base, size);
+    return nullptr;
+  }
+  return new IndexCheckpoint(static_cast<char *>(base), size);
+}
+
+IndexCheckpoint::IndexCheckpoint(char *base, size_t size)
+  : base_(base), size_(size), header_(reinterpret_cast<const CheckpointHeader *>(base))
+  , counts_(reinterpret_cast<const uint64_t *>(base + header_->counts_offset))
+  , records_(reinterpret_cast<const User *>(base + header_->records_offset))
+  , links_(reinterpret_cast<const uint64_t *>(base + header_->links_offset))
+  , tables_(reinterpret_cast<const CheckpointEntry *>(base + header_->tables_offset))
+  , mask_(header_->capacity - 1) {
+}
+
+IndexCheckpoint::~IndexCheckpoint() {
+  munmap(base_, size_);
+}
+
+void IndexCheckpoint::WarmUp() const {
+  madvise(base_, size_, MADV_WILLNEED);
+}
+
+CheckpointWriter::CheckpointWriter(const std::string &path, int log_num, uint64_t max_records)
+  : path_(path), tmp_path_(path + ".tmp"), base_(nullptr), size_(0), is_pmem_(0), header_(), failed_(false)
+  , finished_(false) {
+  // 表最多3/4满
+  uint64_t capacity = 16;
+  while (capacity * 3 < max_records * 4) {
+    capacity <<= 1;
+  }
+  header_.magic = CheckpointMagic;
+  header_.version = CheckpointVersion;
+  header_.log_num = log_num;
+  header_.record_num = 0;
+  header_.capacity = capacity;
+  header_.counts_offset = align64(sizeof(CheckpointHeader));
+  header_.records_offset = align64(header_.counts_offset + log_num * 2 * sizeof(uint64_t));
+  header_.links_offset = align64(header_.records_offset + max_records * sizeof(User));
+  header_.tables_offset = align64(header_.links_offset + max_records * sizeof(uint64_t));
+  header_.crcs_offset = align64(header_.tables_offset + capacity * 3 * sizeof(CheckpointEntry));
+  header_.file_size = header_.crcs_offset + crc_blocks(header_) * sizeof(uint32_t);
+  size_ = header_.file_size;
+
+  // 新建的文件全部是0: counts和三张表都不需要初始化。上一次没有写完的临时文件先删掉
+  unlink(tmp_path_.c_str());
+  size_t mapped_len = 0;
+  void *base = pmem_map_file(tmp_path_.c_str(), size_, PMEM_FILE_CREATE | PMEM_FILE_EXCL, 0644, &mapped_len, &is_pmem_);
+  if (base == nullptr || mapped_len != size_) {
+    spdlog::error("[CheckpointWriter] can't create {} with size {}", tmp_path_, size_);
+    if (base != nullptr) {
+      pmem_unmap(base, mapped_len);
+    }
+    failed_ = true;
+    return;
+  }
+  base_ = static_cast<char *>(base);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+  unmap();
+  if (!finished_) {
+    unlink(tmp_path_.c_str());
+  }
+}
+
+void CheckpointWriter::unmap() {
+  if (base_ != nullptr) {
+    pmem_unmap(base_, size_);
+    base_ = nullptr;
+  }
+}
+
+void CheckpointWriter::Add(int log, bool pmem, const User *user) {
+  if (unlikely(failed_)) {
+    return;
+  }
+  const uint64_t max_records = (header_.links_offset - header_.records_offset) / sizeof(User);
+  if (unlikely(log < 0 || log >= (int)header_.log_num || header_.record_num == max_records)) {
+    spdlog::error("[CheckpointWriter] record of log {} exceeds log num {} or max records {}",
+                  log, header_.log_num, max_records);
+    failed_ = true;
+    return;
+  }
+  User *records = reinterpret_cast<User *>(base_ + header_.records_offset);
+  uint64_t *counts = reinterpret_cast<uint64_t *>(base_ + header_.counts_offset);
+  memcpy(&records[header_.record_num++], user, sizeof(User));
+  counts[pmem ? header_.log_num + log : log]++;
+}
+
+void CheckpointWriter::build_tables() {
+  const User *records = reinterpret_cast<const User *>(base_ + header_.records_offset);
+  uint64_t *links = reinterpret_cast<uint64_t *>(base_ + header_.links_offset);
+  CheckpointEntry *tables = reinterpret_cast<CheckpointEntry *>(base_ + header_.tables_offset);
+  const size_t mask = header_.capacity - 1;
+  // 返回key所在或者应该插入的项
+  auto slot = [mask](CheckpointEntry *entries, int64_t key) {
+    size_t i = IndexHash(key) & mask;
+    while (entries[i].value != 0 && entries[i].key != key) {
+      i = (i + 1) & mask;
+    }
+    return &entries[i];
+  };
+  for (uint64_t i = 0; i < header_.record_num; i++) {
+    const User &user = records[i];
+    // id和user_id重复时保留先写入的记录
+    CheckpointEntry *e = slot(tables, user.id);
+    if (e->value == 0) {
+      *e = CheckpointEntry{user.id, i + 1};
+    }
+    int64_t user_id = BlizardHashWrapper(user.user_id, UseridLen).Hash();
+    e = slot(tables + header_.capacity, user_id);
+    if (e->value == 0) {
+      *e = CheckpointEntry{user_id, i + 1};
+    }
+    // 新记录成为链表头
+    e = slot(tables + header_.capacity * 2, user.salary);
+    links[i] = e->value;
+    *e = CheckpointEntry{user.salary, i + 1};
+  }
+}
+
+int CheckpointWriter::Finish() {
+  if (failed_) {
+    return -1;
+  }
+  build_tables();
+  section_crcs(base_, header_, reinterpret_cast<uint32_t *>(base_ + header_.crcs_offset));
+  header_.crc = header_crc(header_);
+  memcpy(base_, &header_, sizeof(header_));
+  // 先持久化整个文件再rename，crash时要么是完整的新checkpoint，要么是原来的
+  if (is_pmem_) {
+    pmem_persist(base_, size_);
+  } else if (pmem_msync(base_, size_) != 0) {
+    spdlog::error("[CheckpointWriter] msync {} failed", tmp_path_);
+    return -1;
+  }
+  unmap();
+  if (rename(tmp_path_.c_str(), path_.c_str()) != 0) {
+    spdlog::error("[CheckpointWriter] rename {} failed", tmp_path_);
+    return -1;
+  }
+  finished_ = true;
+  std::vector<char> dir(path_.begin(), path_.end());
+  dir.push_back('\0');
+  int dir_fd = open(dirname(dir.data()), O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  return 0;
+}
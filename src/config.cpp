@@ -0,0 +1,128 @@
+#include <fstream>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdint>
+
+#include "spdlog/spdlog.h"
+#include "config.h"
+
+// 解析[lo, hi]范围内的整数
+static bool parse_int(const std::string &value, int64_t lo, int64_t hi, int64_t *out) {
+  char *end = nullptr;
+  errno = 0;
+  long long v = strtoll(value.c_str(), &end, 10);
+  if (errno != 0 || end == value.c_str() || *end != '\0' || v < lo || v > hi) {
+    return false;
+  }
+  *out = v;
+  return true;
+}
+
+static std::string trim(const std::string &s) {
+  size_t begin = s.find_first_not_of(" \t\r\n");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  size_t end = s.find_last_not_of(" \t\r\n");
+  return s.substr(begin, end - begin + 1);
+}
+
+int EngineConfig::Parse(const std::string &raw) {
+  std::string line = trim(raw.substr(0, raw.find('#')));
+  if (line.empty()) {
+    return 0;
+  }
+  size_t eq = line.find('=');
+  if (eq == std::string::npos) {
+    return -1;
+  }
+  std::string key = trim(line.substr(0, eq));
+  std::string value = trim(line.substr(eq + 1));
+  int64_t v = 0;
+  if (key == "client_num" && parse_int(value, 1, INT32_MAX, &v)) {
+    client_num = v;
+  } else if (key == "write_per_client" && parse_int(value, 0, INT64_MAX, &v)) {
+    write_per_client = v;
+  } else if (key == "aep_share" && parse_int(value, RouteMinShare, RouteWindow - RouteMinShare, &v)) {
+    aep_share = v;
+  } else if (key == "max_writer_slots" && parse_int(value, 1, INT32_MAX, &v)) {
+    max_writer_slots = v;
+  } else if (key == "disk_log_format" && parse_int(value, DiskLogFormat::RowLog, DiskLogFormat::CompressedLog, &v)) {
+    disk_log_format = v;
+  } else if (key == "disk_backend" && parse_int(value, DiskBackend::MmapBackend, DiskBackend::DirectBackend, &v)) {
+    disk_backend = v;
+  } else if (key == "pmem_layout" && parse_int(value, PmemLayout::PmemRowLayout, PmemLayout::PmemXPLineLayout, &v)) {
+    pmem_layout = v;
+  } else if (key == "durability" && parse_int(value, Durability::Async, Durability::GroupCommit, &v)) {
+    durability = v;
+  } else if (key == "background_flush" && parse_int(value, 0, 1, &v)) {
+    background_flush = v != 0;
+  } else if (key == "disk_segment_records" && parse_int(value, 1, INT32_MAX / RecordSize, &v)) {
+    // 和DiskSegmentSize一样多留8字节给最后一条记录的commit标记
+    disk_segment_size = RecordSize * v + 8;
+  } else if (key == "max_disk_segments" && parse_int(value, 0, INT32_MAX, &v)) {
+    max_disk_segments = v;
+  } else if (key == "pmem_segment_buffers" && parse_int(value, 1, INT32_MAX, &v)) {
+    pmem_segment_size = static_cast<size_t>(PmapBufferWriterSize) * v;
+  } else if (key == "max_pmem_segments" && parse_int(value, 0, INT32_MAX, &v)) {
+    max_pmem_segments = v;
+  } else if (key == "replay_verify_threads" && parse_int(value, 1, 1024, &v)) {
+    replay_verify_threads = v;
+  } else if (key == "index_layout" && parse_int(value, IndexLayout::ShardedIndexLayout, IndexLayout::PmemPartitionedLayout, &v)) {
+    index_layout = v;
+  } else if (key == "index_threads" && parse_int(value, 0, 1024, &v)) {
+    index_threads = v;
+  } else if (key == "checkpoint" && parse_int(value, 0, 1, &v)) {
+    checkpoint = v != 0;
+  } else if (key == "checkpoint_interval" && parse_int(value, 0, INT32_MAX, &v)) {
+    checkpoint_interval = v;
+  } else if (key == "checkpoint_on_pmem" && parse_int(value, 0, 1, &v)) {
+    checkpoint_on_pmem = v != 0;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+EngineConfig EngineConfig::Load(const std::string &dir) {
+  EngineConfig config;
+  std::string path = dir + "/" + ConfigFileName;
+  std::ifstream in(path);
+  if (!in.is_open()) {
+    spdlog::info("[EngineConfig] {} not exist, use default config", path);
+    return config;
+  }
+  std::string line;
+  for (int line_no = 1; std::getline(in, line); line_no++) {
+    if (config.Parse(line) != 0) {
+      spdlog::warn("[EngineConfig] ignore invalid line {} in {}: {}", line_no, path, line);
+    }
+  }
+  if (config.max_writer_slots < config.client_num) {
+    spdlog::warn("[EngineConfig] max_writer_slots {} < client_num {}, use {}",
+                 config.max_writer_slots, config.client_num, config.client_num);
+    config.max_writer_slots = config.client_num;
+  }
+  if (config.disk_backend != DiskBackend::MmapBackend && config.disk_log_format != DiskLogFormat::RowLog) {
+    spdlog::warn("[EngineConfig] disk_backend {} only supports row log, use mmap", config.disk_backend);
+    config.disk_backend = DiskBackend::MmapBackend;
+  }
+  if (config.index_layout == IndexLayout::PmemPartitionedLayout && config.checkpoint) {
+    // pmem上的索引本身就是持久化的，不需要checkpoint
+    spdlog::warn("[EngineConfig] index_layout {} is persistent, disable checkpoint", config.index_layout);
+    config.checkpoint = false;
+  }
+  return config;
+}
+
+void EngineConfig::Print() const {
+  spdlog::info("[EngineConfig] client_num = {}, write_per_client = {}, aep_share = {}/{}, max_writer_slots = {}",
+               client_num, write_per_client, aep_share, RouteWindow, max_writer_slots);
+  spdlog::info("[EngineConfig] disk_log_format = {}, disk_backend = {}, pmem_layout = {}, durability = {}, "
+               "background_flush = {}, disk_segment_size = {} x {}, pmem_segment_size = {} x {}, "
+               "replay_verify_threads = {}, index_layout = {}, index_threads = {}, checkpoint = {}, checkpoint_interval = {}s, "
+               "checkpoint_on_pmem = {}",
+               disk_log_format, disk_backend, pmem_layout, durability, background_flush, disk_segment_size, max_disk_segments,
+               pmem_segment_size, max_pmem_segments, replay_verify_threads, index_layout, index_threads, checkpoint,
+               checkpoint_interval, checkpoint_on_pmem);
+}
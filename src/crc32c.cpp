@@ -0,0 +1,108 @@
+#include <string.h>
+#include <nmmintrin.h>
+
+#include "crc32c.h"
+
+//--------------------- software -----------------------------------
+static uint32_t crc_table[256];
+
+static void init_crc_table() {
+  const uint32_t poly = 0x82F63B78; // Castagnoli, reversed
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
+    }
+    crc_table[i] = crc;
+  }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const char *data, size_t len) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static void crc32c_blocks_sw(const char *data, size_t block_size, size_t n, uint32_t *crcs) {
+  for (size_t i = 0; i < n; i++) {
+    crcs[i] = crc32c_sw(0, data + i * block_size, block_size);
+  }
+}
+
+//--------------------- SSE4.2 -----------------------------------
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const char *data, size_t len) {
+  uint64_t c = ~crc;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, data + i, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  uint32_t c32 = static_cast<uint32_t>(c);
+  for (; i < len; i++) {
+    c32 = _mm_crc32_u8(c32, static_cast<uint8_t>(data[i]));
+  }
+  return ~c32;
+}
+
+__attribute__((target("sse4.2")))
+static void crc32c_blocks_hw(const char *data, size_t block_size, size_t n, uint32_t *crcs) {
+  size_t i = 0;
+  for (; i + 3 <= n; i += 3) {
+    const char *a = data + i * block_size;
+    const char *b = a + block_size;
+    const char *c = b + block_size;
+    uint64_t ca = 0xFFFFFFFF, cb = 0xFFFFFFFF, cc = 0xFFFFFFFF;
+    for (size_t j = 0; j < block_size; j += 8) {
+      uint64_t va, vb, vc;
+      memcpy(&va, a + j, 8);
+      memcpy(&vb, b + j, 8);
+      memcpy(&vc, c + j, 8);
+      ca = _mm_crc32_u64(ca, va);
+      cb = _mm_crc32_u64(cb, vb);
+      cc = _mm_crc32_u64(cc, vc);
+    }
+    crcs[i] = ~static_cast<uint32_t>(ca);
+    crcs[i + 1] = ~static_cast<uint32_t>(cb);
+    crcs[i + 2] = ~static_cast<uint32_t>(cc);
+  }
+  for (; i < n; i++) {
+    crcs[i] = crc32c_hw(0, data + i * block_size, block_size);
+  }
+}
+
+//--------------------- dispatch -----------------------------------
+typedef uint32_t (*Crc32cFn)(uint32_t crc, const char *data, size_t len);
+typedef void (*Crc32cBlocksFn)(const char *data, size_t block_size, size_t n, uint32_t *crcs);
+
+static Crc32cFn crc32c_fn = crc32c_sw;
+static Crc32cBlocksFn crc32c_blocks_fn = crc32c_blocks_sw;
+
+static bool init_crc32c() {
+  init_crc_table();
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_fn = crc32c_hw;
+    crc32c_blocks_fn = crc32c_blocks_hw;
+    return true;
+  }
+  return false;
+}
+
+static bool crc32c_hardware = init_crc32c();
+
+uint32_t Crc32cExtend(uint32_t crc, const char *data, size_t len) {
+  return crc32c_fn(crc, data, len);
+}
+
+void Crc32cBlocks(const char *data, size_t block_size, size_t n, uint32_t *crcs) {
+  crc32c_blocks_fn(data, block_size, n, crcs);
+}
+
+bool Crc32cHardware() {
+  return crc32c_hardware;
+}
@@ -6,6 +6,9 @@
 #include <fstream>
 #include <chrono>
 #include <thread>
+#include <algorithm>
+#include <memory>
+#include <condition_variable>
 #include <xmmintrin.h>
 
 #include "spdlog/spdlog.h"
@@ -14,6 +17,7 @@
 #include "def.h"
 
 thread_local int tid_ = -1;
+thread_local SlotLease slot_lease_;  // tid_就是租到的slot
 thread_local int write_cnt = 0;
 const std::string phase_name[3] = {"Hybrid", "WriteOnly", "ReadOnly"};
 
@@ -42,68 +46,223 @@ void add_res(const User &user, int32_t select_column, void **result) {
 }
 
 // ------Index Builder-------------
+// 并行回放时建hybrid阶段的索引，见HybridIndex::BeginLoad
 class Index_Helper {
   public:
-    Index_Helper(primary_key *idx_id,
-      unique_key *idx_user_id, normal_key  *idx_salary, std::vector<User> *users)
-      : count_(0), idx_id_(idx_id),
-        idx_user_id_(idx_user_id), idx_salary_(idx_salary), users_(users) { }
+    Index_Helper(HybridIndex *index, int threads)
+      : index_(index) { index_->BeginLoad(threads); }
 
-    // 当is_build为false时，仅仅记录count_，不build索引
-    void Scan(const User *user);
-
-    int Get_count() { return count_; }
+    // worker是扫描线程的编号，log是记录所在log的编号，也就是写入它的slot，pmem表示是否pmem log
+    void Scan(int worker, int log, bool pmem, const User *user);
+    // 所有扫描线程结束之后调用
+    void Finish() { index_->FinishLoad(); }
 
   private:
-    int  count_;
-    std::vector<User> *users_;
-    primary_key *idx_id_;
-    unique_key  *idx_user_id_;
-    normal_key  *idx_salary_;
+    HybridIndex *index_;
 };
 
-void Index_Helper::Scan(const User *user) {
+void Index_Helper::Scan(int worker, int log, bool pmem, const User *user) {
+  index_->Load(worker, log, pmem, user);
+}
 
-  users_->push_back(*user);
+// 读取disk log的下一条记录中columns(ColumnMask的组合)中的列: 行存直接返回mmap中的记录，
+// 列存/压缩格式只读取/解码需要的列到buf，其他列的内容不确定
+static bool read_disk_log(DiskLogReader *reader, int format, int columns, User *buf, const User **user) {
+  if (format == DiskLogFormat::RowLog) {
+    char *record;
+    if (!reader->ReadRecord(record, RecordSize)) {
+      return false;
+    }
+    *user = reinterpret_cast<const User *>(record);
+    return true;
+  }
+  if (!reader->ReadColumns(columns, buf)) {
+    return false;
+  }
+  *user = buf;
+  return true;
+}
 
-  size_t record_slot = users_->size() - 1;
-  // build pk index
-  idx_id_->insert({user->id, record_slot});
-  // build uk index
-  idx_user_id_->emplace(BlizardHashWrapper(user->user_id, UseridLen), record_slot);
-  // build nk index
-  auto &locations = (*idx_salary_)[user->salary];
-  locations.Push(record_slot);
-  count_++;
+// 流水线地校验并扫描所有log(先ssd再pmem，和写入无关的固定顺序):
+// config.replay_verify_threads个线程按顺序领取log并校验checksum(截断到第一个损坏的块之前)，
+// 调用线程按顺序等待每个log校验完成，然后对其中的每条记录调用scan(log的编号, 是否pmem log, 记录)，
+// 因此校验和建索引是重叠的。ssd log只保证读出columns中的列。
+// disk_counts/pmem_counts返回每个log校验之后的记录数
+template <typename Scan>
+static uint64_t scan_verified_logs(const EngineConfig &config, const std::vector<std::string> &disk_path,
+                                   const std::vector<std::string> &pmem_path, int columns,
+                                   std::vector<uint64_t> *disk_counts, std::vector<uint64_t> *pmem_counts, Scan scan) {
+  const size_t disk_num = disk_path.size();
+  const size_t total = disk_num + pmem_path.size();
+  disk_counts->assign(disk_num, 0);
+  pmem_counts->assign(pmem_path.size(), 0);
+  std::vector<std::unique_ptr<DiskLogReader>> disk_readers(disk_num);
+  std::vector<std::unique_ptr<PmapBufferReader>> pmem_readers(pmem_path.size());
+  std::vector<bool> verified(total, false); // 由mtx保护
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::atomic<size_t> next_log(0);
+
+  auto verify = [&]() {
+    for (size_t i = next_log.fetch_add(1); i < total; i = next_log.fetch_add(1)) {
+      if (i < disk_num) {
+        disk_readers[i].reset(new SegmentedLogReader(config.disk_log_format, disk_path[i], config.disk_segment_size));
+        (*disk_counts)[i] = disk_readers[i]->Verify();
+      } else {
+        pmem_readers[i - disk_num].reset(new PmapBufferReader(pmem_path[i - disk_num], config.pmem_segment_size, config.pmem_layout));
+        (*pmem_counts)[i - disk_num] = pmem_readers[i - disk_num]->Verify();
+      }
+      std::lock_guard<std::mutex> lock(mtx);
+      verified[i] = true;
+      cv.notify_all();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < std::min<size_t>(config.replay_verify_threads, total); t++) {
+    workers.emplace_back(verify);
+  }
+
+  uint64_t cnt = 0;
+  User buf;
+  for (size_t i = 0; i < total; i++) {
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [&verified, i]{ return verified[i]; });
+    }
+    char *record;
+    if (i < disk_num) {
+      const User *user;
+      while (read_disk_log(disk_readers[i].get(), config.disk_log_format, columns, &buf, &user)) {
+        scan(static_cast<int>(i), false, user);
+        cnt++;
+      }
+      disk_readers[i].reset();
+    } else {
+      while (pmem_readers[i - disk_num]->ReadRecord(record, RecordSize)) {
+        scan(static_cast<int>(i - disk_num), true, reinterpret_cast<const User *>(record));
+        cnt++;
+      }
+      pmem_readers[i - disk_num].reset();
+    }
+  }
+  for (auto &worker: workers) {
+    worker.join();
+  }
+  return cnt;
 }
 
-void record_scan(const char *record, void *context) {
-  const User *user = reinterpret_cast<const User *>(record);
-  Index_Helper *helper = reinterpret_cast<Index_Helper *>(context);
-  helper->Scan(user);
+// 并行地校验并扫描所有log: threads个线程按slot领取，slot i的ssd log和pmem log由同一个线程
+// 先校验checksum再扫描(ssd在前)，对其中的每条记录调用scan(线程编号, slot, 是否pmem log, 记录)。
+// 同一个slot的记录只会在一个线程中按固定的顺序出现，不同线程之间scan是并发的。
+// 两个log都校验完之后调用prefix(slot, ssd log的记录数, pmem log的记录数, &ssd跳过数, &pmem跳过数)，
+// 跳过每个log中已经在索引(或checkpoint)中的前缀(ssd log跳过时不读取任何列)，prefix也由这个线程调用。
+// 返回扫描的记录数。ssd log只保证读出columns中的列，disk_counts/pmem_counts返回每个log校验之后的记录数
+template <typename Prefix, typename Scan>
+static uint64_t scan_logs_parallel(const EngineConfig &config, const std::vector<std::string> &disk_path,
+                                   const std::vector<std::string> &pmem_path, Prefix prefix,
+                                   int columns, int threads, std::vector<uint64_t> *disk_counts,
+                                   std::vector<uint64_t> *pmem_counts, Scan scan) {
+  const size_t slots = std::max(disk_path.size(), pmem_path.size());
+  disk_counts->assign(disk_path.size(), 0);
+  pmem_counts->assign(pmem_path.size(), 0);
+  std::atomic<size_t> next_slot(0);
+  std::atomic<uint64_t> total(0);
+  auto worker = [&](int id) {
+    uint64_t cnt = 0;
+    char *record;
+    User buf;
+    const User *user;
+    for (size_t i = next_slot.fetch_add(1); i < slots; i = next_slot.fetch_add(1)) {
+      std::unique_ptr<DiskLogReader> disk_reader;
+      std::unique_ptr<PmapBufferReader> pmem_reader;
+      if (i < disk_path.size()) {
+        disk_reader.reset(new SegmentedLogReader(config.disk_log_format, disk_path[i], config.disk_segment_size));
+        (*disk_counts)[i] = disk_reader->Verify();
+      }
+      if (i < pmem_path.size()) {
+        pmem_reader.reset(new PmapBufferReader(pmem_path[i], config.pmem_segment_size, config.pmem_layout));
+        (*pmem_counts)[i] = pmem_reader->Verify();
+      }
+      uint64_t disk_skip = 0, pmem_skip = 0;
+      prefix(static_cast<int>(i), i < disk_path.size() ? (*disk_counts)[i] : 0,
+             i < pmem_path.size() ? (*pmem_counts)[i] : 0, &disk_skip, &pmem_skip);
+      if (disk_reader) {
+        for (; disk_skip > 0 && disk_reader->ReadColumns(0, &buf); disk_skip--) {
+        }
+        while (read_disk_log(disk_reader.get(), config.disk_log_format, columns, &buf, &user)) {
+          scan(id, static_cast<int>(i), false, user);
+          cnt++;
+        }
+      }
+      if (pmem_reader) {
+        for (; pmem_skip > 0 && pmem_reader->ReadRecord(record, RecordSize); pmem_skip--) {
+        }
+        while (pmem_reader->ReadRecord(record, RecordSize)) {
+          scan(id, static_cast<int>(i), true, reinterpret_cast<const User *>(record));
+          cnt++;
+        }
+      }
+    }
+    total.fetch_add(cnt);
+  };
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back(worker, t);
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  return total.load();
 }
 
 // --------------------Engine-----------------------------
 Engine::Engine(const char* aep_dir, const char* disk_dir)
-  : is_changing_(false), phase_(Phase::Hybrid), next_tid_(0)
-  , mtx_(), aep_dir_(aep_dir), dir_(disk_dir), disk_logs_()
-  , pmem_logs_(), idx_id_(), idx_user_id_(), idx_salary_() {
+  : config_(EngineConfig::Load(disk_dir)), reserve_records_(config_.ExpectedRecords())
+  , gate_(QuiescenceSlots), phase_(Phase::Hybrid)
+  , slots_(new SlotRegistry(config_.max_writer_slots)), log_num_(config_.client_num)
+  , aep_dir_(aep_dir), dir_(disk_dir), disk_logs_(config_.max_writer_slots, nullptr)
+  , pmem_logs_(config_.max_writer_slots, nullptr), group_committer_(nullptr), buffer_flusher_(nullptr), indexer_(nullptr), router_(), pmem_stats_()
+  , index_(config_.index_layout, config_.max_writer_slots, aep_dir), checkpoint_(), checkpoint_records_(UINT64_MAX)
+  , checkpointer_(), checkpoint_mtx_(), checkpoint_cv_(), stop_checkpoint_(false) {
+  if (config_.durability == Durability::GroupCommit) {
+    group_committer_ = new GroupCommitter(GroupCommitBatch, GroupCommitWindowMicros);
+  }
+  if (config_.durability == Durability::Async && config_.background_flush) {
+    buffer_flusher_ = new BufferFlusher();
+  }
 }
 
 Engine::~Engine() {
   auto end = std::chrono::system_clock::now();
   std::chrono::duration<double> elapsed_seconds = end-start_;
   spdlog::info("since init done, elapsed time: {}s", elapsed_seconds.count());
-
-  int record_num = build_3_cluster_index(disk_file_paths_, pmem_file_paths_);
-  spdlog::info("there are {} records in db", record_num);
-
-  for (size_t i = 0; i < disk_logs_.size(); i++) {
-    delete disk_logs_[i];
+  if (checkpointer_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(checkpoint_mtx_);
+      stop_checkpoint_ = true;
+    }
+    checkpoint_cv_.notify_all();
+    checkpointer_.join();
   }
-  for (size_t i = 0; i < pmem_logs_.size(); i++) {
-    delete pmem_logs_[i];
+  // WriteOnly阶段的后台线程一直运行到这里，之后会重新扫描log
+  delete indexer_;
+  indexer_ = nullptr;
+
+  // 记录数来自writer，不需要扫描log
+  std::vector<uint64_t> disk_counts, pmem_counts;
+  uint64_t record_num = writer_counts(&disk_counts, &pmem_counts);
+  if (config_.checkpoint) {
+    write_checkpoint();
   }
+  spdlog::info("there are {} records in db", record_num);
+
+  close_all_writers();
+  pmem_stats_.Report(config_.durability);
+  router_.Save();
+  // 最后写，之前crash时下一次启动重新统计
+  save_manifest(true, disk_counts, pmem_counts);
+  delete group_committer_;
+  delete buffer_flusher_;
 }
 
 int Engine::Init() {
@@ -120,20 +279,85 @@ int Engine::Init() {
     }
   }
 
+  config_.Print();
+  EngineManifest manifest;
+  const bool has_manifest = EngineManifest::Load(dir_ + "/" + ManifestFileName, &manifest);
+  // ROUTE文件不存在时沿用MANIFEST中的比例
+  router_.Load(dir_ + "/" + RouteFileName, has_manifest ? manifest.aep_share : config_.aep_share);
+
   // build index
-  Util::gen_sorted_paths(dir_, WALFileNamePrefix, disk_file_paths_, ClientNum);
-  Util::gen_sorted_paths(aep_dir_, WALFileNamePrefix, pmem_file_paths_, ClientNum);
+  // 写线程超过client_num时按需创建了更多的log，重启时全部回放
+  int log_num = config_.client_num;
+  while (Util::FileExists(Util::DataFileName(dir_, WALFileNamePrefix, log_num)) ||
+         Util::FileExists(Util::DataFileName(aep_dir_, WALFileNamePrefix, log_num))) {
+    log_num++;
+  }
+  log_num_.store(log_num);
   
-  int record_num = replay_index(disk_file_paths_, pmem_file_paths_);
-  if (record_num == ClientNum * WritePerClient) {
+  // 上一次正常关闭时MANIFEST中有每个log的记录数，否则只统计记录数(列存只需要读id列)。
+  // 数据写满时直接建cluster索引，不再先建一遍普通索引
+  std::vector<uint64_t> disk_counts, pmem_counts;
+  uint64_t record_num;
+  const bool clean = has_manifest && manifest.Usable(config_) && (int)manifest.disk_counts.size() == log_num;
+  if (clean) {
+    disk_counts = manifest.disk_counts;
+    pmem_counts = manifest.pmem_counts;
+    record_num = manifest.RecordNum();
+    open_all_writers();
+    spdlog::info("[Engine] load manifest with {} records of {} logs, last phase: {}",
+                 record_num, log_num, phase_name[manifest.last_phase]);
+  } else {
+    record_num = count_records(log_paths(dir_), log_paths(aep_dir_), &disk_counts, &pmem_counts);
+  }
+  // 之后会有新的写入，在正常关闭之前MANIFEST中的计数都不能使用
+  save_manifest(false, disk_counts, pmem_counts);
+  reserve_records_ = std::max(config_.ExpectedRecords(), record_num);
+  if (config_.checkpoint && record_num > 0) {
+    load_checkpoint(disk_counts, pmem_counts);
+  }
+  if (index_.Persistent()) {
+    // pmem上的索引打开之后就可以查询: 上一次正常关闭并且每个分区都包含了对应log的全部记录时不需要回放，
+    // 否则校验log之后只回放每个分区之后的记录
+    index_.Recover();
+    bool covered = clean;
+    for (int log = 0; covered && log < log_num; log++) {
+      covered = index_.DiskCount(log) == disk_counts[log] && index_.PmemCount(log) == pmem_counts[log];
+    }
+    if (covered) {
+      spdlog::info("pmem index covers all {} records, skip replay", record_num);
+    } else {
+      replay_index(log_paths(dir_), log_paths(aep_dir_));
+    }
+  } else if (checkpoint_ && checkpoint_records_ == record_num && record_num == config_.ExpectedRecords()) {
+    // checkpoint包含了所有的记录，直接在mmap的checkpoint上查询，在pmem上时不需要预读
+    is_read_perf_ = true;
+    if (!config_.checkpoint_on_pmem) {
+      checkpoint_->WarmUp();
+    }
+  } else if (!checkpoint_ && record_num > 0 && record_num == config_.ExpectedRecords()) {
     is_read_perf_ = true;
-    build_3_cluster_index(disk_file_paths_, pmem_file_paths_);
+    build_3_cluster_index(log_paths(dir_), log_paths(aep_dir_));
+  } else {
+    // 有checkpoint时只回放之后的记录
+    replay_index(log_paths(dir_), log_paths(aep_dir_));
   }
   spdlog::info("init replay build index done, record num = {}", record_num);
-  phase_.store(record_num == 0? Phase::WriteOnly: Phase::ReadOnly);
+  // pmem上的索引在写入时直接插入，没有只写log的WriteOnly阶段
+  if (index_.Persistent()) {
+    phase_.store(record_num == 0? Phase::Hybrid: Phase::ReadOnly);
+  } else {
+    phase_.store(record_num == 0? Phase::WriteOnly: Phase::ReadOnly);
+  }
+  if (phase_.load() == Phase::WriteOnly && config_.index_threads > 0) {
+    // 从空的索引开始，后台跟着写入建索引
+    indexer_ = new BackgroundIndexer(&index_, config_.max_writer_slots, config_.index_threads);
+  }
 
   warmUp();  
   spdlog::info("warmup ssd & pmam done!");
+  if (config_.checkpoint && config_.checkpoint_interval > 0) {
+    checkpointer_ = std::thread(&Engine::checkpoint_loop, this);
+  }
 
   Util::print_resident_set_size();
   spdlog::info("engine init done, phase_:{}", phase_name[phase_.load()]);
@@ -143,121 +367,188 @@ int Engine::Init() {
 
 int Engine::Append(const void *datas) {
   _mm_prefetch(datas, _MM_HINT_T0);
-  if (unlikely(phase_.load() == Phase::ReadOnly)) {
-    bool current = is_changing_.exchange(true);
-    if (current == false) {
-      // current可能和一个刚刚建完索引的线程冲突，因此做一次double check
-      if (phase_.load() == Phase::ReadOnly) {
-        // 1. 睡眠一段时间，保证其他线程探测到is_changing_ = true 并且阻塞住，
-        // 使得建立索引的过程中没有正在进行中的R/W（只能说无锁，尽量多睡眠一段时间）
-        sleep(FenceSecond);
-        // 2. 先修改phase_
-        phase_.store(Phase::Hybrid);
-        // 3. 再修改is_changing_
-        is_changing_.store(false);
-        spdlog::info("phase change: ReadOnly -> Hybrid");
-      }
-    }
-  }
-  while (unlikely(is_changing_.load() == true)) {
-    sleep(WaitChangeFinishSecond);
-  }
+  wait_write_phase();
   must_set_tid();
   int cur_phase = phase_.load();
-  if (cur_phase == Phase::Hybrid) {
-    mtx_.lock();
-  }
   const User *user = reinterpret_cast<const User *>(datas);
 
-  if (IsWriteAEP(write_cnt)) {
-    pmem_logs_[tid_]->Append(datas);
-  } else {
-    disk_logs_[tid_]->Append(datas);
+  size_t run;
+  bool to_aep = route_write(1, &run);
+  // 选中的设备写满时记录写到了另一个设备
+  if (append_run(to_aep, datas, 1) == 0) {
+    to_aep = !to_aep;
   }
 
-  if (cur_phase == Phase::Hybrid) {
-    users_.push_back(*user);
-    size_t record_slot = users_.size() - 1;
-    idx_id_.insert({user->id, record_slot});
-    // build uk index
-    idx_user_id_.emplace(BlizardHashWrapper(user->user_id, UseridLen), record_slot); // avoid unneccessary copy constructer
+  insert_index(cur_phase, to_aep, user);
+  gate_.Exit();
+  write_cnt++;
+  if (write_cnt == config_.write_per_client) {
+    auto end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start_;
+    spdlog::info("tid[{}] finish write {} records, elapsed time: {}s", tid_, config_.write_per_client, elapsed_seconds.count());
+  }
+  return 0;
+}
 
-    // build nk index
-    
-    LocationsWrapper &locations = idx_salary_[user->salary];
-    locations.Push(record_slot);
+int Engine::AppendBatch(const void *datas, size_t num) {
+  if (num == 0) {
+    return 0;
   }
-  
-  if (cur_phase == Phase::Hybrid) {
-    mtx_.unlock();
+  _mm_prefetch(datas, _MM_HINT_T0);
+  // 整个batch只检查一次phase
+  wait_write_phase();
+  must_set_tid();
+  int cur_phase = phase_.load();
+  const char *data = reinterpret_cast<const char *>(datas);
+  const int prev_write_cnt = write_cnt;
+  size_t left = num;
+  while (left > 0) {
+    // 路由到同一个设备的连续记录作为一段整体写入
+    size_t run;
+    bool to_aep = route_write(left, &run);
+    size_t done = append_run(to_aep, data, run);
+    for (size_t i = 0; i < run; i++) {
+      insert_index(cur_phase, i < done ? to_aep : !to_aep, reinterpret_cast<const User *>(data + i * RecordSize));
+    }
+    data += run * RecordSize;
+    left -= run;
+    write_cnt += run;
   }
-  write_cnt++;
-  if (write_cnt == WritePerClient) {
+  gate_.Exit();
+  if (prev_write_cnt < config_.write_per_client && write_cnt >= config_.write_per_client) {
     auto end = std::chrono::system_clock::now();
     std::chrono::duration<double> elapsed_seconds = end-start_;
-    spdlog::info("tid[{}] finish write {} records, elapsed time: {}s", tid_, WritePerClient, elapsed_seconds.count());
+    spdlog::info("tid[{}] finish write {} records, elapsed time: {}s", tid_, config_.write_per_client, elapsed_seconds.count());
   }
   return 0;
 }
 
-size_t Engine::Read(void *ctx, int32_t select_column,
-    int32_t where_column, const void *column_key, 
-    size_t column_key_len, void *res) {
-  if (likely(is_read_perf_)) {
-    return perf_Read(ctx, select_column, where_column, column_key, column_key_len, res);
-  }
-  if (phase_.load() == Phase::WriteOnly) {
-    bool current = is_changing_.exchange(true);
-    if (current == false) {
-      // current可能和一个刚刚建完索引的线程冲突，因此做一次double check
-      if (phase_.load() == Phase::WriteOnly) {
-        // 由本线程负责建索引
-        // 1. 睡眠一段时间，保证其他线程探测到is_changing_ = true 并且阻塞住，
-        // 使得建立索引的过程中没有正在进行中的R/W（只能说无锁，尽量多睡眠一段时间）
-        sleep(FenceSecond);
-        // 2. 开始建立索引
-        replay_index(disk_file_paths_, pmem_file_paths_);
-        // 3. 先修改phase_
+// 返回时已经进入gate_，调用者写完之后需要gate_.Exit()
+void Engine::wait_write_phase() {
+  if (unlikely(phase_.load() == Phase::ReadOnly)) {
+    if (gate_.TryClose()) {
+      // 关闭之前可能有别的线程刚刚切换完，因此做一次double check
+      if (phase_.load() == Phase::ReadOnly) {
+        // 等到进行中的读都结束，之后才开始有hybrid的写
+        gate_.Drain();
         phase_.store(Phase::Hybrid);
-        // 4. 再修改is_changing_
-        is_changing_.store(false);
-        spdlog::info("phase change: WriteOnly -> Hybrid");
-      }
-    } else {
-      // 等到状态变更完成
-      while (is_changing_.load() == true) {
-        sleep(WaitChangeFinishSecond);
+        spdlog::info("phase change: ReadOnly -> Hybrid");
       }
+      gate_.Open();
+    }
+  }
+  // 正在切换时阻塞到切换完成
+  gate_.Enter();
+}
+
+// 选择本线程接下来写入的设备，run返回连续写入该设备的记录数(不超过left)
+// 选中的设备写满时改写另一个设备
+inline bool Engine::route_write(size_t left, size_t *run) {
+  bool to_aep = router_.IsWriteAEP(write_cnt);
+  size_t free = to_aep ? pmem_logs_[tid_]->FreeSlot() : disk_logs_[tid_]->FreeSlot();
+  *run = std::min(left, router_.RunLength(write_cnt));
+  if (unlikely(free == 0)) {
+    to_aep = !to_aep;
+    free = to_aep ? pmem_logs_[tid_]->FreeSlot() : disk_logs_[tid_]->FreeSlot();
+    *run = left;
+    if (free == 0) {
+      spdlog::error("tid[{}] both ssd and aep log are full", tid_);
+      exit(1);
     }
   }
-  while (is_changing_.load() == true) {
-    sleep(WaitChangeFinishSecond);
+  *run = std::min(*run, free);
+  return to_aep;
+}
+
+// 抽样的写入会记录耗时，用于调整ssd/aep的写入比例。
+// FreeSlot只是按剩余空间的估计，设备实际写满时剩下的记录写入另一个设备，返回写入选中的设备的记录数
+inline size_t Engine::append_run(bool to_aep, const void *datas, size_t run) {
+  bool sample = router_.ShouldSample();
+  auto start = sample ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+  // 返回实际写入的记录数
+  auto append = [this](bool aep, const void *data, size_t n) -> size_t {
+    if (aep) {
+      uint64_t before = pmem_logs_[tid_]->Count();
+      int ret = n == 1 ? pmem_logs_[tid_]->Append(data) : pmem_logs_[tid_]->AppendBatch(data, n);
+      return ret == 0 ? n : pmem_logs_[tid_]->Count() - before;
+    }
+    uint64_t before = disk_logs_[tid_]->Count();
+    int ret = n == 1 ? disk_logs_[tid_]->Append(data) : disk_logs_[tid_]->AppendBatch(data, n);
+    return ret == 0 ? n : disk_logs_[tid_]->Count() - before;
+  };
+  size_t done = append(to_aep, datas, run);
+  if (unlikely(done < run)) {
+    spdlog::warn("tid[{}] {} log is full, write {} records to {}", tid_, to_aep ? "aep" : "ssd",
+                 run - done, to_aep ? "ssd" : "aep");
+    const char *rest = reinterpret_cast<const char *>(datas) + done * RecordSize;
+    if (append(!to_aep, rest, run - done) < run - done) {
+      spdlog::error("tid[{}] both ssd and aep log are full", tid_);
+      exit(1);
+    }
   }
-  must_set_tid();
-  int cur_phase = phase_.load();
+  if (unlikely(sample)) {
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+    const PmapBufferWriter *pmem_log = pmem_logs_[tid_];
+    const DiskLogWriter *disk_log = disk_logs_[tid_];
+    router_.Sample(to_aep, ns, run, pmem_log->FreeSlot(), pmem_log->MaxSlot(),
+                   disk_log->FreeSlot(), disk_log->MaxSlot());
+  }
+  return done;
+}
+
+// 可以被多个写线程并发调用，只锁key所在的shard。
+// WriteOnly阶段追加到本线程的delta表，没有后台线程时不建索引(第一次读时回放)。pmem表示记录写入了pmem log
+inline void Engine::insert_index(int cur_phase, bool pmem, const User *user) {
   if (cur_phase == Phase::Hybrid) {
-    mtx_.lock();
+    index_.Insert(tid_, pmem, user);
+  } else if (indexer_ != nullptr) {
+    indexer_->Add(tid_, user);
   }
-  spdlog::debug("[engine_read] [select_column:{0:d}] [where_column:{1:d}] [column_key_len:{2:d}]", select_column, where_column, column_key_len); 
-  User user;
+}
+
+// checkpoint中的记录(更早写入)和之后回放、写入的记录(在index中)合起来查询，
+// id/user_id重复时和索引一样保留先写入的
+template <typename Index>
+class CheckpointLayer {
+  public:
+    CheckpointLayer(const IndexCheckpoint &checkpoint, const Index &index) : checkpoint_(checkpoint), index_(index) {}
+
+    template <typename F>
+    size_t FindId(int64_t id, F f) const {
+      size_t n = checkpoint_.FindId(id, f);
+      return n > 0 ? n : index_.FindId(id, f);
+    }
+    template <typename F>
+    size_t FindUserId(const char *user_id, F f) const {
+      size_t n = checkpoint_.FindUserId(user_id, f);
+      return n > 0 ? n : index_.FindUserId(user_id, f);
+    }
+    template <typename F>
+    size_t FindSalary(int64_t salary, F f) const {
+      return checkpoint_.FindSalary(salary, f) + index_.FindSalary(salary, f);
+    }
+
+  private:
+    const IndexCheckpoint &checkpoint_;
+    const Index &index_;
+};
+
+// 按where_column查询index(HybridIndex、BackgroundIndexer、IndexCheckpoint或CheckpointLayer)，把select_column写入res
+template <typename Index>
+static size_t query_index(const Index &index, int32_t select_column, int32_t where_column,
+                          const void *column_key, void *res) {
   size_t res_num = 0;
   switch(where_column) {
       case Id: {
         int64_t id = *((int64_t *)column_key);
-        auto iter = idx_id_.find(id);
-        if (iter != idx_id_.end()) {
-          res_num = 1;
-          add_res(users_[iter->second], select_column, &res);
-        }
+        res_num = index.FindId(id, [&](const User &u) { add_res(u, select_column, &res); });
       }
       break;
 
       case Userid: {
-        auto iter = idx_user_id_.find(BlizardHashWrapper(reinterpret_cast<const char*>(column_key), UseridLen));
-        if (iter != idx_user_id_.end()) {
-          res_num = 1;
-          add_res(users_[iter->second], select_column, &res);
-        }
+        res_num = index.FindUserId(reinterpret_cast<const char*>(column_key),
+                                   [&](const User &u) { add_res(u, select_column, &res); });
       } 
       break;
 
@@ -268,13 +559,7 @@ size_t Engine::Read(void *ctx, int32_t select_column,
 
       case Salary: {
         int64_t salary = *((int64_t *)column_key);
-        auto iter = idx_salary_.find(salary);
-        if (iter != idx_salary_.end()) {
-          for (size_t i = 0; i < iter->second.Size(); i++) {
-            res_num += 1;
-            add_res(users_[iter->second[i]], select_column, &res);
-          }
-        }
+        res_num = index.FindSalary(salary, [&](const User &u) { add_res(u, select_column, &res); });
       }
       break;
 
@@ -282,78 +567,313 @@ size_t Engine::Read(void *ctx, int32_t select_column,
         spdlog::error("unexpected where_column: {}", where_column);
       break;
   }
-  if (cur_phase == Phase::Hybrid) {
-    mtx_.unlock();
+  return res_num;
+}
+
+size_t Engine::Read(void *ctx, int32_t select_column,
+    int32_t where_column, const void *column_key, 
+    size_t column_key_len, void *res) {
+  if (likely(is_read_perf_)) {
+    if (checkpoint_) {
+      return query_index(*checkpoint_, select_column, where_column, column_key, res);
+    }
+    return perf_Read(ctx, select_column, where_column, column_key, column_key_len, res);
   }
+  // 有后台建索引时WriteOnly阶段的读直接查delta表和索引，不切换phase
+  if (phase_.load() == Phase::WriteOnly && indexer_ == nullptr) {
+    if (gate_.TryClose()) {
+      // 关闭之前可能有别的线程刚刚建完索引，因此做一次double check
+      if (phase_.load() == Phase::WriteOnly) {
+        // 由本线程负责建索引
+        // 1. 等到进行中的写都结束，之后直到打开gate_都没有进行中的R/W
+        gate_.Drain();
+        // 2. 回放所有log建立索引
+        replay_index(log_paths(dir_), log_paths(aep_dir_));
+        // 3. 修改phase_之后才放行其他线程
+        phase_.store(Phase::Hybrid);
+        spdlog::info("phase change: WriteOnly -> Hybrid");
+      }
+      gate_.Open();
+    }
+  }
+  // 正在切换时阻塞到切换完成
+  gate_.Enter();
+  spdlog::debug("[engine_read] [select_column:{0:d}] [where_column:{1:d}] [column_key_len:{2:d}]", select_column, where_column, column_key_len); 
+  size_t res_num;
+  if (indexer_ != nullptr) {
+    res_num = query_index(*indexer_, select_column, where_column, column_key, res);
+  } else if (checkpoint_) {
+    res_num = query_index(CheckpointLayer<HybridIndex>(*checkpoint_, index_), select_column, where_column, column_key, res);
+  } else {
+    res_num = query_index(index_, select_column, where_column, column_key, res);
+  }
+  gate_.Exit();
   return res_num;
 }
 
 int Engine::replay_index(const std::vector<std::string> disk_path, const std::vector<std::string> pmem_path) {
   // 我不确定对于同一个文件或pmem同时读写打开会不会有问题，因此在这里重新关闭之后再次打开了writers。
   close_all_writers();
-  idx_id_.clear();
-  idx_user_id_.clear();
-  idx_salary_.clear();
-  users_.clear();
-  idx_id_.reserve(WritePerClient * ClientNum);
-  idx_user_id_.reserve(WritePerClient * ClientNum);
-  idx_salary_.reserve(WritePerClient * ClientNum);
-  users_.reserve(WritePerClient * ClientNum);
-  Index_Helper index_builder(&idx_id_, &idx_user_id_, &idx_salary_, &users_);
+  // pmem上的索引保留，只回放每个分区之后的记录
+  if (!index_.Persistent()) {
+    index_.Clear();
+  }
+  // checkpoint中的记录不在index_中
+  const uint64_t checkpointed = checkpoint_ ? checkpoint_->RecordNum() : 0;
+  index_.Reserve(reserve_records_ - std::min(reserve_records_, checkpointed), config_.client_num);
+  // 每个线程至少负责一个slot
+  const int threads = std::max<int>(1, std::min<size_t>(config_.replay_verify_threads, std::max(disk_path.size(), pmem_path.size())));
+  auto start = std::chrono::steady_clock::now();
+  Index_Helper index_builder(&index_, threads);
+  std::vector<uint64_t> disk_counts, pmem_counts;
+  // 跳过checkpoint或者pmem索引分区中已有的前缀
+  auto prefix = [this](int log, uint64_t disk_cnt, uint64_t pmem_cnt, uint64_t *disk_skip, uint64_t *pmem_skip) {
+    if (checkpoint_) {
+      *disk_skip = checkpoint_->DiskCount(log);
+      *pmem_skip = checkpoint_->PmemCount(log);
+    } else if (index_.Persistent()) {
+      // Async模式下crash时分区可能比校验之后的log更长，这时分区不再是log的前缀，从头重建
+      if (index_.DiskCount(log) > disk_cnt || index_.PmemCount(log) > pmem_cnt) {
+        spdlog::warn("pmem index partition {} has {}/{} records but log has {}/{}, rebuild it",
+                     log, index_.DiskCount(log), index_.PmemCount(log), disk_cnt, pmem_cnt);
+        index_.Drop(log);
+      }
+      *disk_skip = index_.DiskCount(log);
+      *pmem_skip = index_.PmemCount(log);
+    }
+  };
+  // 索引中保存完整的记录
+  uint64_t record_num = scan_logs_parallel(config_, disk_path, pmem_path, prefix, AllColumns, threads,
+                                           &disk_counts, &pmem_counts,
+                                           [&index_builder](int worker, int log, bool pmem, const User *user) {
+    index_builder.Scan(worker, log, pmem, user);
+  });
+  index_builder.Finish();
+  open_all_writers(&disk_counts, &pmem_counts);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  spdlog::info("replay index done, record num = {} (and {} in checkpoint), {} threads, elapsed time: {}s",
+               record_num, checkpointed, threads, elapsed.count());
+  return record_num;
+}
+
+// 只读取每个log的元数据
+static uint64_t count_logs(const EngineConfig &config, const std::vector<std::string> &disk_path,
+                           const std::vector<std::string> &pmem_path, std::vector<uint64_t> *disk_counts,
+                           std::vector<uint64_t> *pmem_counts) {
+  uint64_t record_num = 0;
   for (size_t log_id = 0; log_id < disk_path.size(); log_id++) {
-    // 如果ret != 0,没有给file分配内存,因此可以让reader管理file指针的内存,reader离开作用域时，会调用reader的析构函数释放file指针的空间
-    MmapReader reader(disk_path[log_id], MmapSize);
-    char *record;
-    while (reader.ReadRecord(record, RecordSize)) {
-      const User *user = (const User *)record;
-      index_builder.Scan(user);
+    std::unique_ptr<DiskLogReader> reader(new SegmentedLogReader(config.disk_log_format, disk_path[log_id], config.disk_segment_size));
+    uint64_t cnt = reader->Count();
+    record_num += cnt;
+    if (disk_counts != nullptr) {
+      disk_counts->push_back(cnt);
     }
   }
   for (size_t log_id = 0; log_id < pmem_path.size(); log_id++) {
-    PmapBufferReader reader(pmem_path[log_id], PoolSize);
-    char *record;
-    while (reader.ReadRecord(record, RecordSize)) {
-      const User *user = (const User *)record;
-      index_builder.Scan(user);
+    PmapBufferReader reader(pmem_path[log_id], config.pmem_segment_size, config.pmem_layout);
+    uint64_t cnt = reader.Count();
+    record_num += cnt;
+    if (pmem_counts != nullptr) {
+      pmem_counts->push_back(cnt);
     }
   }
+  return record_num;
+}
+
+uint64_t Engine::count_records(const std::vector<std::string> disk_path, const std::vector<std::string> pmem_path,
+                               std::vector<uint64_t> *disk_counts, std::vector<uint64_t> *pmem_counts) {
+  close_all_writers();
+  uint64_t record_num = count_logs(config_, disk_path, pmem_path, disk_counts, pmem_counts);
   open_all_writers();
-  spdlog::info("replay index done, record num = {}", index_builder.Get_count());
-  return index_builder.Get_count();
+  return record_num;
 }
 
-inline int Engine::must_set_tid() {
-  if (unlikely(tid_ == -1)) {
-    tid_ = next_tid_.fetch_add(1);
-    if (tid_ >= ClientNum) {
-      spdlog::warn("w/r thread excceed 50!!");
-      tid_ %= ClientNum;
+uint64_t Engine::writer_counts(std::vector<uint64_t> *disk_counts, std::vector<uint64_t> *pmem_counts) const {
+  uint64_t record_num = 0;
+  // slot < log_num_的writer都已经打开
+  for (int slot = 0; slot < log_num_.load(); slot++) {
+    uint64_t disk_cnt = disk_logs_[slot]->Count();
+    uint64_t pmem_cnt = pmem_logs_[slot]->Count();
+    record_num += disk_cnt + pmem_cnt;
+    if (disk_counts != nullptr) {
+      disk_counts->push_back(disk_cnt);
+    }
+    if (pmem_counts != nullptr) {
+      pmem_counts->push_back(pmem_cnt);
     }
   }
+  return record_num;
+}
+
+void Engine::save_manifest(bool clean, const std::vector<uint64_t> &disk_counts, const std::vector<uint64_t> &pmem_counts) {
+  EngineManifest manifest;
+  manifest.disk_log_format = config_.disk_log_format;
+  manifest.pmem_layout = config_.pmem_layout;
+  manifest.disk_segment_size = config_.disk_segment_size;
+  manifest.pmem_segment_size = config_.pmem_segment_size;
+  manifest.aep_share = router_.AEPShare();
+  manifest.last_phase = phase_.load();
+  manifest.clean = clean;
+  manifest.disk_counts = disk_counts;
+  manifest.pmem_counts = pmem_counts;
+  if (manifest.Save(dir_ + "/" + ManifestFileName) != 0) {
+    spdlog::error("[Engine] save manifest failed");
+  }
+}
+
+std::string Engine::checkpoint_path() const {
+  return (config_.checkpoint_on_pmem ? aep_dir_ : dir_) + "/" + CheckpointFileName;
+}
+
+void Engine::load_checkpoint(const std::vector<uint64_t> &disk_counts, const std::vector<uint64_t> &pmem_counts) {
+  const std::string path = checkpoint_path();
+  std::unique_ptr<IndexCheckpoint> checkpoint(IndexCheckpoint::Open(path));
+  if (!checkpoint) {
+    return;
+  }
+  // checkpoint中的每个log必须是现在的log的前缀
+  bool valid = checkpoint->LogNum() <= (int)disk_counts.size() && checkpoint->LogNum() <= (int)pmem_counts.size();
+  uint64_t total = 0;
+  for (int log = 0; valid && log < checkpoint->LogNum(); log++) {
+    valid = checkpoint->DiskCount(log) <= disk_counts[log] && checkpoint->PmemCount(log) <= pmem_counts[log];
+    total += checkpoint->DiskCount(log) + checkpoint->PmemCount(log);
+  }
+  if (!valid || total != checkpoint->RecordNum()) {
+    spdlog::warn("[Engine] checkpoint {} doesn't match the logs, replay all logs", path);
+    return;
+  }
+  checkpoint_ = std::move(checkpoint);
+  checkpoint_records_ = total;
+  spdlog::info("[Engine] load checkpoint {} with {} records of {} logs", path, total, checkpoint_->LogNum());
+}
+
+uint64_t Engine::write_checkpoint() {
+  // 关闭writer之后log文件才是完整的: 后台刷入的pmem buffer和direct io的写入都在关闭时等待完成。
+  // 扫描时校验得到的记录数在重新打开writer时用来截断损坏的log
+  uint64_t record_num = writer_counts(nullptr, nullptr);
+  close_all_writers();
+  const std::vector<std::string> disk_path = log_paths(dir_), pmem_path = log_paths(aep_dir_);
+  std::vector<uint64_t> disk_counts, pmem_counts;
+  if (record_num > 0 && record_num != checkpoint_records_) {
+    auto start = std::chrono::steady_clock::now();
+    CheckpointWriter writer(checkpoint_path(), log_num_.load(), record_num);
+    record_num = scan_verified_logs(config_, disk_path, pmem_path, AllColumns, &disk_counts, &pmem_counts,
+                                    [&writer](int log, bool pmem, const User *user) {
+      writer.Add(log, pmem, user);
+    });
+    if (writer.Finish() == 0) {
+      checkpoint_records_ = record_num;
+      // 修改过checkpoint_on_pmem时，另一个目录下的checkpoint已经过时
+      unlink(((config_.checkpoint_on_pmem ? dir_ : aep_dir_) + "/" + CheckpointFileName).c_str());
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      spdlog::info("write checkpoint done, record num = {}, elapsed time: {}s", record_num, elapsed.count());
+    }
+  }
+  open_all_writers(&disk_counts, &pmem_counts);
+  return record_num;
+}
+
+void Engine::checkpoint_loop() {
+  std::unique_lock<std::mutex> lock(checkpoint_mtx_);
+  while (!checkpoint_cv_.wait_for(lock, std::chrono::seconds(config_.checkpoint_interval),
+                                  [this] { return stop_checkpoint_; })) {
+    // 别的线程正在切换phase时等下一次
+    if (!gate_.TryClose()) {
+      continue;
+    }
+    // 等进行中的读写结束，写完之前新的读写阻塞在gate_
+    gate_.Drain();
+    write_checkpoint();
+    gate_.Open();
+  }
+}
+
+inline int Engine::must_set_tid() {
+  // 线程还没有租用本engine的slot(第一次写入，或者租约属于已经销毁的engine)
+  if (unlikely(!slot_lease_.HeldBy(slots_.get()))) {
+    lease_slot();
+  }
   return 0;
 } 
 
+// 为当前线程租用一个slot，线程退出时自动归还。
+// 超过已有log数的slot第一次被租用时由租用的线程创建新的log，只有持有租约的线程访问这个slot的writer
+void Engine::lease_slot() {
+  tid_ = slot_lease_.Acquire(slots_);
+  if (tid_ < 0) {
+    spdlog::error("w/r thread exceed {}!!", config_.max_writer_slots);
+    exit(1);
+  }
+  if (unlikely(disk_logs_[tid_] == nullptr)) {
+    open_writers(tid_);
+    int num = log_num_.load();
+    while (num < tid_ + 1 && !log_num_.compare_exchange_weak(num, tid_ + 1)) {
+    }
+    spdlog::info("open writers for new slot {}", tid_);
+  }
+}
+
+std::vector<std::string> Engine::log_paths(const std::string &dir) const {
+  std::vector<std::string> paths;
+  Util::gen_sorted_paths(dir, WALFileNamePrefix, paths, log_num_.load());
+  return paths;
+}
+
 void Engine::close_all_writers() {
-for (size_t i = 0; i < disk_logs_.size(); i++) {
+  for (size_t i = 0; i < disk_logs_.size(); i++) {
     delete disk_logs_[i];
+    disk_logs_[i] = nullptr;
   }
   for (size_t i = 0; i < pmem_logs_.size(); i++) {
-    delete pmem_logs_[i];
+    if (pmem_logs_[i] != nullptr) {
+      pmem_stats_.Merge(pmem_logs_[i]->Stats());
+      delete pmem_logs_[i];
+      pmem_logs_[i] = nullptr;
+    }
   }
-  disk_logs_.clear();
-  pmem_logs_.clear();
 }
 
-int Engine::open_all_writers() {
-  for (const auto &fname: disk_file_paths_) {
-    disk_logs_.push_back(new MmapWriter(fname, MmapSize));
+int Engine::open_all_writers(const std::vector<uint64_t> *disk_counts, const std::vector<uint64_t> *pmem_counts) {
+  bool truncated = false;
+  for (int slot = 0; slot < log_num_.load(); slot++) {
+    open_writers(slot);
+    if (disk_counts != nullptr && slot < (int)disk_counts->size() && (*disk_counts)[slot] < disk_logs_[slot]->Count()) {
+      spdlog::warn("[Engine] truncate ssd log {} from {} to {} verified records", slot, disk_logs_[slot]->Count(), (*disk_counts)[slot]);
+      disk_logs_[slot]->Truncate((*disk_counts)[slot]);
+      truncated = true;
+    }
+    if (pmem_counts != nullptr && slot < (int)pmem_counts->size() && (*pmem_counts)[slot] < pmem_logs_[slot]->Count()) {
+      spdlog::warn("[Engine] truncate pmem log {} from {} to {} verified records", slot, pmem_logs_[slot]->Count(), (*pmem_counts)[slot]);
+      pmem_logs_[slot]->Truncate((*pmem_counts)[slot]);
+      truncated = true;
+    }
   }
-  for (const auto &fname: pmem_file_paths_) {
-    pmem_logs_.push_back(new PmapBufferWriter(fname, PoolSize));
+  // 截断到加载的checkpoint中的记录之前时，之后的写入会接在截断的位置，checkpoint不再是log的前缀。
+  // 已经打开的checkpoint仍然可以查询(unlink不影响映射)，下一次写checkpoint时重新生成
+  if (truncated && checkpoint_) {
+    bool prefix = true;
+    for (int log = 0; prefix && log < checkpoint_->LogNum(); log++) {
+      prefix = (log >= (int)disk_counts->size() || checkpoint_->DiskCount(log) <= (*disk_counts)[log])
+            && (log >= (int)pmem_counts->size() || checkpoint_->PmemCount(log) <= (*pmem_counts)[log]);
+    }
+    if (!prefix) {
+      spdlog::warn("[Engine] checkpoint {} is beyond the truncated logs, drop it", checkpoint_path());
+      unlink(checkpoint_path().c_str());
+      checkpoint_records_ = UINT64_MAX;
+    }
   }
   return 0;
 }
 
+void Engine::open_writers(int slot) {
+  disk_logs_[slot] = new SegmentedLogWriter(config_.disk_log_format, Util::DataFileName(dir_, WALFileNamePrefix, slot),
+                                            config_.disk_segment_size, config_.max_disk_segments,
+                                            config_.disk_backend);
+  pmem_logs_[slot] = new PmapBufferWriter(Util::DataFileName(aep_dir_, WALFileNamePrefix, slot), config_.pmem_segment_size,
+                                          config_.max_pmem_segments, config_.durability, group_committer_, buffer_flusher_,
+                                          config_.pmem_layout);
+}
+
 // read formance
 // ------Index Builder-------------
 class Cluster_Index_Helper {
@@ -368,6 +888,9 @@ class Cluster_Index_Helper {
     // 当is_build为false时，仅仅记录count_，不build索引
     void Scan(const User *user);
 
+    // Scan用到的列: id -> user_id, user_id -> name, salary -> id
+    static const int Columns = ColumnMask(Id) | ColumnMask(Userid) | ColumnMask(Name) | ColumnMask(Salary);
+
     int Get_count() { return count_; }
 
   private:
@@ -391,35 +914,20 @@ int Engine::build_3_cluster_index(const std::vector<std::string> disk_path, cons
   // 我不确定对于同一个文件或pmem同时读写打开会不会有问题，因此在这里重新关闭之后再次打开了writers。
   close_all_writers();
   // clear() is not work here for release memory in c++
-  idx_id_ = primary_key();
-  idx_user_id_ = unique_key();
-  idx_salary_ = normal_key();
-  users_ = std::vector<User>();
+  index_.Clear();
   cluster_idx_id_ = cluster_primary_key();
   cluster_idx_user_id_ = cluster_unique_key();
   cluster_idx_salary_ = cluster_normal_key();
-  cluster_idx_id_.reserve(WritePerClient * ClientNum);
-  cluster_idx_user_id_.reserve(WritePerClient * ClientNum);
-  cluster_idx_salary_.reserve(WritePerClient * ClientNum);
+  cluster_idx_id_.reserve(reserve_records_);
+  cluster_idx_user_id_.reserve(reserve_records_);
+  cluster_idx_salary_.reserve(reserve_records_);
   Cluster_Index_Helper index_builder(&cluster_idx_id_, &cluster_idx_user_id_, &cluster_idx_salary_);
-  for (size_t log_id = 0; log_id < disk_path.size(); log_id++) {
-    // 如果ret != 0,没有给file分配内存,因此可以让reader管理file指针的内存,reader离开作用域时，会调用reader的析构函数释放file指针的空间
-    MmapReader reader(disk_path[log_id], MmapSize);
-    char *record;
-    while (reader.ReadRecord(record, RecordSize)) {
-      const User *user = (const User *)record;
-      index_builder.Scan(user);
-    }
-  }
-  for (size_t log_id = 0; log_id < pmem_path.size(); log_id++) {
-    PmapBufferReader reader(pmem_path[log_id], PoolSize);
-    char *record;
-    while (reader.ReadRecord(record, RecordSize)) {
-      const User *user = (const User *)record;
-      index_builder.Scan(user);
-    }
-  }
-  open_all_writers();
+  std::vector<uint64_t> disk_counts, pmem_counts;
+  scan_verified_logs(config_, disk_path, pmem_path, Cluster_Index_Helper::Columns, &disk_counts, &pmem_counts,
+                     [&index_builder](int, bool, const User *user) {
+    index_builder.Scan(user);
+  });
+  open_all_writers(&disk_counts, &pmem_counts);
   spdlog::info("build_3_cluster_index done, record num = {}", index_builder.Get_count());
   return index_builder.Get_count();
 }
@@ -481,19 +989,21 @@ inline size_t Engine::perf_Read(void *ctx, int32_t select_column,
 // writer3: slot(nw) slot(nw) slot(nw) slot(nw)
 // 在这里我采用方案1
 void Engine::warmUp() {
-  if (disk_logs_.size() > 0) {
-    // 注意：假设每个mmapwriter的大小是一样的
-    size_t max_slot = disk_logs_[0]->MaxSlot();
+  // 只warmup已经打开的writer，之后按需创建的writer不warmup
+  const int log_num = log_num_.load();
+  if (log_num > 0) {
+    // 只warmup每个writer当前的segment，注意：假设每个segment的大小是一样的
+    size_t max_slot = disk_logs_[0]->SegmentSlot();
     // 从后往前warmup，那么理论上来说先被置换出去的页应该就是尾页
     // 这样当发生驱逐时，会先驱逐出mmap的地址空间后面一部分pagecache，应该会好一点
     for (size_t i = max_slot; i != 0; i--) {
-      for (const auto &mmapWriter: disk_logs_) {
-        mmapWriter->WarmUp(i - 1);
+      for (int slot = 0; slot < log_num; slot++) {
+        disk_logs_[slot]->WarmUp(i - 1);
       }
     }
   }
-  for (const auto &pmemWriter: pmem_logs_) {
+  for (int slot = 0; slot < log_num; slot++) {
     // pmemwriter的buffer很小，直接warmup整个buffer
-    pmemWriter->WarmUp();
+    pmem_logs_[slot]->WarmUp();
   }
 }
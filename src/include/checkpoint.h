@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "sharded_index.h"
+
+// 索引的checkpoint文件。文件中只有相对文件头的偏移，没有指针，mmap之后直接查询，不需要反序列化。
+// 布局(每一段64字节对齐):
+// | header | disk_counts[log_num] | pmem_counts[log_num] | records[max_records] | links[max_records] |
+// | id表[capacity] | user_id表[capacity] | salary表[capacity] | crcs[] |
+// header有自己的crc，从disk_counts到三张表结束每CheckpointCrcBlockSize字节一个crc32c(最后一块可能不满)，
+// 任何一块校验失败都不使用这个checkpoint
+// 三张表都是线性探测的hash表，项为(key, 记录位置 + 1)，value为0表示空，位置和hybrid阶段的索引一样
+// 由IndexHash(key)决定; user_id表的key是user_id的前8字节。salary表中是链表头，links中是salary相同的
+// 下一条记录的位置 + 1。disk_counts/pmem_counts是每个log包含在checkpoint中的记录数(log的前缀)，
+// 重启时只需要回放每个log在这之后的记录
+struct CheckpointHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t crc;            // header的crc32c，计算时这个字段为0
+  uint64_t file_size;
+  uint64_t log_num;
+  uint64_t record_num;
+  uint64_t capacity;       // 每张表的项数，2的幂
+  uint64_t counts_offset;  // disk_counts，后面紧跟pmem_counts
+  uint64_t records_offset;
+  uint64_t links_offset;
+  uint64_t tables_offset;  // id、user_id、salary三张表依次存放
+  uint64_t crcs_offset;
+};
+
+struct CheckpointEntry {
+  int64_t key;
+  uint64_t value;
+};
+
+// 只读地mmap一个checkpoint，可以被任意多个线程并发查询
+class IndexCheckpoint {
+  public:
+    // 文件不存在或者校验失败时返回nullptr。会读一遍整个文件校验crc
+    static IndexCheckpoint *Open(const std::string &path);
+    ~IndexCheckpoint();
+    IndexCheckpoint(const IndexCheckpoint&) = delete;
+    IndexCheckpoint& operator=(const IndexCheckpoint&) = delete;
+
+    uint64_t RecordNum() const { return header_->record_num; }
+    int LogNum() const { return static_cast<int>(header_->log_num); }
+    // 第log个ssd/pmem log包含在checkpoint中的记录数，超过LogNum的log为0
+    uint64_t DiskCount(int log) const { return log < LogNum() ? counts_[log] : 0; }
+    uint64_t PmemCount(int log) const { return log < LogNum() ? counts_[LogNum() + log] : 0; }
+    // 让内核在后台预读整个文件，不等待读完
+    void WarmUp() const;
+
+    // 和HybridIndex相同的查询接口
+    template <typename F>
+    size_t FindId(int64_t id, F f) const {
+      uint64_t value = find(0, id);
+      if (value == 0) {
+        return 0;
+      }
+      f(records_[value - 1]);
+      return 1;
+    }
+    template <typename F>
+    size_t FindUserId(const char *user_id, F f) const {
+      uint64_t value = find(1, BlizardHashWrapper(user_id, UseridLen).Hash());
+      if (value == 0) {
+        return 0;
+      }
+      f(records_[value - 1]);
+      return 1;
+    }
+    template <typename F>
+    size_t FindSalary(int64_t salary, F f) const {
+      size_t n = 0;
+      for (uint64_t value = find(2, salary); value != 0; value = links_[value - 1]) {
+        f(records_[value - 1]);
+        n++;
+      }
+      return n;
+    }
+
+  private:
+    IndexCheckpoint(char *base, size_t size);
+
+    uint64_t find(int table, int64_t key) const {
+      const CheckpointEntry *entries = tables_ + table * (mask_ + 1);
+      size_t i = IndexHash(key) & mask_;
+      for (size_t probe = 0; probe <= mask_; probe++, i = (i + 1) & mask_) {
+        if (entries[i].value == 0) {
+          return 0;
+        }
+        if (entries[i].key == key) {
+          return entries[i].value;
+        }
+      }
+      return 0;
+    }
+
+    char *base_;
+    const size_t size_;
+    const CheckpointHeader *header_;
+    const uint64_t *counts_;
+    const User *records_;
+    const uint64_t *links_;
+    const CheckpointEntry *tables_;
+    const size_t mask_;
+};
+
+// 写一个新的checkpoint: 先写到path.tmp，Finish时建三张表、持久化之后rename成path，
+// 中途失败或者没有调用Finish都不影响原来的checkpoint。只能由一个线程使用。
+// 文件由libpmem映射，在pmem上时用pmem_persist持久化，否则用msync
+class CheckpointWriter {
+  public:
+    // log_num是log的个数，max_records是记录数的上限(各个log的Count()之和)
+    CheckpointWriter(const std::string &path, int log_num, uint64_t max_records);
+    ~CheckpointWriter();
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    // 按log中的顺序添加第log个ssd(pmem为false)或pmem log中的记录
+    void Add(int log, bool pmem, const User *user);
+    // 成功返回0
+    int Finish();
+
+  private:
+    void build_tables();
+    void unmap();
+
+    const std::string path_;
+    const std::string tmp_path_;
+    char *base_;
+    size_t size_;
+    int is_pmem_;
+    CheckpointHeader header_;
+    bool failed_;
+    bool finished_;
+};
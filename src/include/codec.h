@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <emmintrin.h>
+#include "user.h"
+
+// user_id/name 是定长128字节，实际数据大多在前几个字节，后面都是0。
+// 编码格式(zero suppression): | id(8) | salary(8) | user_id_len(1) | name_len(1) | user_id | name |
+// 其中user_id_len/name_len是去掉末尾0之后的长度，解码时补0。
+const int EncodedHeaderSize = 8 + 8 + 1 + 1;
+const int MaxEncodedRecordSize = EncodedHeaderSize + UseridLen + NameLen;
+
+// 去掉末尾0之后的长度，len必须是16的倍数
+inline int TrimmedLen(const char *s, int len) {
+  const __m128i zero = _mm_setzero_si128();
+  for (int i = len - 16; i >= 0; i -= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+    unsigned nonzero = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xFFFF;
+    if (nonzero != 0) {
+      return i + 32 - __builtin_clz(nonzero);
+    }
+  }
+  return 0;
+}
+
+// 返回编码之后的字节数，dst至少有MaxEncodedRecordSize字节
+inline size_t EncodeRecord(const User *user, char *dst) {
+  uint8_t user_id_len = TrimmedLen(user->user_id, UseridLen);
+  uint8_t name_len = TrimmedLen(user->name, NameLen);
+  memcpy(dst, &user->id, 8);
+  memcpy(dst + 8, &user->salary, 8);
+  dst[16] = user_id_len;
+  dst[17] = name_len;
+  memcpy(dst + EncodedHeaderSize, user->user_id, user_id_len);
+  memcpy(dst + EncodedHeaderSize + user_id_len, user->name, name_len);
+  return EncodedHeaderSize + user_id_len + name_len;
+}
+
+inline size_t EncodedSize(const User *user) {
+  return EncodedHeaderSize + TrimmedLen(user->user_id, UseridLen) + TrimmedLen(user->name, NameLen);
+}
+
+// 返回src中这条记录编码之后的字节数
+inline size_t DecodeRecord(const char *src, User *user) {
+  uint8_t user_id_len = src[16];
+  uint8_t name_len = src[17];
+  memcpy(&user->id, src, 8);
+  memcpy(&user->salary, src + 8, 8);
+  memcpy(user->user_id, src + EncodedHeaderSize, user_id_len);
+  memset(user->user_id + user_id_len, 0, UseridLen - user_id_len);
+  memcpy(user->name, src + EncodedHeaderSize + user_id_len, name_len);
+  memset(user->name + name_len, 0, NameLen - name_len);
+  return EncodedHeaderSize + user_id_len + name_len;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include "def.h"
+
+// engine的运行时配置，默认值就是def.h中的常量。
+// disk_dir下的CONFIG文件可以覆盖其中任意几项，每行一个"key = value"，#之后是注释，例如:
+//   client_num = 8
+//   write_per_client = 100000
+// 注意: disk_log_format、pmem_layout、disk_segment_records和pmem_segment_buffers决定了log的格式，写入数据之后不能再修改
+struct EngineConfig {
+  int client_num = ClientNum;                 // 启动时打开的log数(写线程更多时按需增加)
+  int64_t write_per_client = WritePerClient;  // 每个client预计写入的记录数，用来预留索引的空间
+  int aep_share = AEPNum;                     // 没有ROUTE文件时，每RouteWindow次写入中写aep的次数
+  int max_writer_slots = MaxWriterSlots;      // 同时写入的线程数上限
+  int disk_log_format = DefaultDiskLogFormat;
+  int disk_backend = DefaultDiskBackend;      // 只对RowLog有效，可以随时修改(两种方式写出的文件相同)
+  int pmem_layout = DefaultPmemLayout;
+  int durability = DefaultDurability;
+  bool background_flush = DefaultBackgroundFlush;  // 只对Async模式有效
+  size_t disk_segment_size = DiskSegmentSize;
+  size_t max_disk_segments = MaxDiskSegments;
+  size_t pmem_segment_size = PmemSegmentSize;
+  size_t max_pmem_segments = MaxPmemSegments;
+  int replay_verify_threads = ReplayVerifyThreads;
+  int index_layout = DefaultIndexLayout;
+  int index_threads = IndexerThreads;         // WriteOnly阶段在后台建索引的线程数，0表示第一次读时全部回放
+  bool checkpoint = DefaultCheckpoint;        // 是否写和加载索引的checkpoint
+  int checkpoint_interval = CheckpointIntervalSeconds;  // 运行期间写checkpoint的间隔(秒)，0表示只在deinit时写
+  bool checkpoint_on_pmem = DefaultCheckpointOnPmem;    // checkpoint放在aep_dir(true)还是disk_dir
+
+  // 预计的总记录数，数据正好这么多时按只读的性能测试处理
+  uint64_t ExpectedRecords() const { return static_cast<uint64_t>(client_num) * write_per_client; }
+
+  // 读取dir下的CONFIG文件，文件不存在时全部使用默认值；无效的配置项报warning并忽略
+  static EngineConfig Load(const std::string &dir);
+  // 解析一行配置，成功返回0
+  int Parse(const std::string &line);
+  void Print() const;
+};
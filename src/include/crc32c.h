@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C(Castagnoli)，CPU支持SSE4.2时用crc32指令，否则查表，进程启动时根据CPUID选择
+
+// 在crc(之前数据的结果，第一段为0)的基础上继续计算data，
+// 因此Crc32cExtend(Crc32cExtend(0, a), b)等于a和b拼起来的crc
+uint32_t Crc32cExtend(uint32_t crc, const char *data, size_t len);
+
+inline uint32_t Crc32c(const char *data, size_t len) {
+  return Crc32cExtend(0, data, len);
+}
+
+// 分别计算n个连续的、block_size字节的块的crc，结果写入crcs[0, n)。
+// 不同的块之间没有依赖，每次交错计算三个块，隐藏crc32指令3个周期的延迟。block_size必须是8的倍数
+void Crc32cBlocks(const char *data, size_t block_size, size_t n, uint32_t *crcs);
+
+// 当前是否使用了SSE4.2
+bool Crc32cHardware();
@@ -9,26 +9,133 @@ constexpr const int RecordSize = 8 + 128 + 128 + 8;
 const unsigned long CommitFlag = 0xFFFFFFFFFFFFFFFF;
 const int CommitField = 8;
 const char WALFileNamePrefix[] = "WAL";
-const int PoolSize = 1 << 29; // 512MB can't exceed 1GB
-// 272 * 5e7 * (24 / 50) / 50 = 130560000
-// 130560000 + 8
-const int MmapSize = 130560000 + 8; // 281018368 data: 272000000
+const int MmapHeaderSize = 64; // 行存文件头: tail(8) + 保留，一个cache line保证后面的记录64字节对齐
+const int CrcBlockRecords = 16; // 行存每16条记录(4352字节，和pmem buffer一样)一个crc32c
+
+// log按segment切分: 第0个segment的文件名就是log的文件名，第i(i>0)个segment为 filename + ".seg" + i。
+// 当前segment写满时才创建下一个，磁盘/pmem空间随写入增长，而不是一开始就分配好整个log。
+// 新的segment创建时一次分配全部空间，空间不足时log写满，之后的记录写入另一个设备
+const char SegmentFileSuffix[] = ".seg";
+const int DiskSegmentSize = RecordSize * 65536 + 8; // 17MB, 最后8字节留给commit标记
+const int MaxDiskSegments = 0; // 每个log的segment数上限，0表示不限制: 容量由ssd的剩余空间决定(statvfs)
+
+// 拷贝272字节记录的kernel，启动时按CPUID选择CPU支持的最宽的一个(record_copy.h)
+enum RecordCopyKernel{CopySSE2=0, CopyAVX2, CopyAVX512};
+// 一次写入至少这么多条记录时才用non-temporal store: 每次的sfence很贵，小batch用普通store更快(bench/copy_bench)
+const int StreamCopyMinRecords = 64;
+
+// RowLog: 每条记录272字节连续存放
+// ColumnLog: id/user_id/name/salary分别存放在4个文件中，重建索引时只需要读取用到的列
+// CompressedLog: 记录去掉user_id/name末尾的0之后，紧凑地存放在CompressBlockSize大小的块中
+enum DiskLogFormat{RowLog=0, ColumnLog, CompressedLog};
+const int DefaultDiskLogFormat = DiskLogFormat::RowLog;
+const char* const ColumnFileSuffix[4] = {".id", ".uid", ".name", ".salary"};
+const int ColumnWidth[4] = {8, 128, 128, 8};
+const int CompressBlockSize = 4096; // 块头8字节: 高32位是块内已用字节数(含块头)，低32位是记录数
+
+// 行存log的写入方式，两种方式写出的文件完全相同，都由MmapReader读取
+// MmapBackend: MAP_SHARED mmap文件直接写入，由内核回写，写入延迟受缺页和回写影响
+// DirectBackend: 记录写入4KB对齐的staging页，通过io_uring以O_DIRECT写入文件，不经过page cache
+enum DiskBackend{MmapBackend=0, DirectBackend};
+const int DefaultDiskBackend = DiskBackend::MmapBackend;
+const int DirectPageSize = 4096;
+const int DirectStagingPages = 64; // 每个writer的staging页(环)，写满的页提交之后要等写入完成才能重用
+const int DirectSnapshots = 4;     // 没写满的页提交时先拷贝一份快照，写入过程中staging页可以继续写
 
 const char PmapBufferWriterFileNameSuffix[] = "BUF";
 const int PmapBufferWriterSize = 4352; // LCM(256, 272) write 256 per write pmem
-const int PmapBufferWriterFileSize = PmapBufferWriterSize + 8; // 8 bytes is for commit_cnt
+const int PmapBufferWriterMetaSize = 16; // 8 bytes is for flush_cnt, 8 bytes is for commit_cnt
+const int PmapBufferRecords = PmapBufferWriterSize / RecordSize;
+// buffer文件中有PmapBufferCount个buffer组成一个环，第i条记录写在环的第i % (PmapBufferCount * 16)个位置:
+// 一个buffer写满之后交给后台线程刷入pmem，writer接着写下一个buffer
+const int PmapBufferCount = 2;
+const int PmapBufferWriterFileSize = PmapBufferWriterSize * PmapBufferCount + PmapBufferWriterMetaSize;
+const bool DefaultBackgroundFlush = false; // Async模式下由后台线程(每个socket一个)把写满的buffer刷入pmem，默认关闭，CONFIG中background_flush = 1打开
+// pmem(和buffer文件)中一个块(PmapBufferWriterSize字节，16条记录)内记录的布局:
+// PmemRowLayout: 16条272字节的记录连续存放，记录跨越XPLine(pmem内部256字节的写入单位)的边界
+// PmemXPLineLayout: 第i条记录的user_id+name(256字节)正好占块中第i个XPLine，
+//   id和salary放在块最后一个XPLine(side line)的第i个16字节，单条记录的主体总是一次对齐的整XPLine写入
+enum PmemLayout{PmemRowLayout=0, PmemXPLineLayout};
+const int DefaultPmemLayout = PmemLayout::PmemRowLayout;
+const int XPLineSize = 256;
+const int XPLineSideWidth = 16; // side line中每条记录的id(8) + salary(8)
+// pmem segment必须是buffer的整数倍，这样每次刷buffer都落在同一个segment中
+const size_t PmemSegmentSize = (size_t)PmapBufferWriterSize * (1 << 14); // 68MB
+const int MaxPmemSegments = 0; // 每个log的segment数上限，0表示不限制: 容量由pmem的剩余空间决定(statvfs)
+
+// Async: 只在刷buffer时不带drain地写pmem, 关闭时才drain, 写入返回时不保证持久化
+// PerRecord: 每条记录返回之前都已经持久化
+// GroupCommit: 多个线程的记录攒成一组(数量或时间窗口), 由leader统一持久化, 返回时已持久化
+enum Durability{Async=0, PerRecord, GroupCommit};
+const int DefaultDurability = Durability::Async;
+const int GroupCommitBatch = 16;         // 一组最多攒多少个writer
+const int GroupCommitWindowMicros = 50;  // leader最多等待多久就开始持久化
 
 // ------ engine.h -------
 const int WritePerClient = 1000000; 
 const int ClientNum = 50;
 const int SSDNum = 24;  // 在lockfree情况下，必须ClientNum = SSDNum + AEPNum
 const int AEPNum = 26;  // 在lockfree情况下，必须ClientNum = SSDNum + AEPNum
-#define IsWriteAEP(write_cnt) ((write_cnt) % 50 < AEPNum)
+const int MaxWriterSlots = 1024;  // 同时写入的线程数上限，超过ClientNum的线程按需创建新的log
 
-const int WaitChangeFinishSecond = 3;
-const int FenceSecond = 10;
+const int QuiescenceSlots = 4096;  // 切换phase时单独登记进行中操作的线程数，更多的线程共用一个计数
+const int ReplayVerifyThreads = 8;  // replay时并行校验log checksum并扫描log建索引的线程数
+const char ConfigFileName[] = "CONFIG";  // disk_dir下的运行时配置，见config.h
 
 enum Phase{Hybrid=0, WriteOnly, ReadOnly};
 
+// ------ sharded_index.h -------
+const int IndexShardBits = 8;        // hybrid阶段每个索引分成(1 << IndexShardBits)个shard，每个shard一把读写锁
+const int RecordChunkBits = 16;      // 记录按(1 << RecordChunkBits)条一块分配(~17MB)，块的地址不再变化
+const int MaxRecordChunks = 1 << 16; // 最多(1 << 32)条记录
+const int LoaderBatch = 256;         // 并行回放时每个线程攒够这么多条记录才追加到RecordStore
+
+// ------ partitioned_index.h -------
+// ShardedIndexLayout: 所有写线程共用一个按key分shard的索引，点查只查一个shard
+// WriterPartitionedLayout: 每个写线程(slot)独占一个索引分区，写入之间完全没有竞争，
+//   点查先用每个分区的filter排除，salary查询汇总所有分区。适合写多读少的场景
+// PmemPartitionedLayout: 和WriterPartitionedLayout一样按写线程分区，但每个分区是aep_dir下的一个pmem文件
+//   (pmem_index.h)，每条记录插入时就持久化，重启之后直接查询，只回放索引之后写入的记录
+enum IndexLayout{ShardedIndexLayout=0, WriterPartitionedLayout, PmemPartitionedLayout};
+const int DefaultIndexLayout = IndexLayout::ShardedIndexLayout;
+const int PartitionFilterBitsPerKey = 10;   // 分区filter每个key占的bit数
+const int PartitionFilterHashes = 6;        // 每个key在filter的一个cache line中置位的bit数
+const size_t MinPartitionRecords = 1 << 16; // 每个分区的filter至少按这么多记录分配
+
+// ------ pmem_index.h -------
+const char PmemIndexFileNamePrefix[] = "INDEX";     // aep_dir下第i个分区的文件为INDEX_0000000i
+const uint64_t PmemIndexMagic = 0x58444E494D454D50; // "PMEMINDX"
+const uint32_t PmemIndexVersion = 2;
+
+// ------ indexer.h -------
+const int IndexerThreads = 2;       // WriteOnly阶段在后台建索引的线程数，0表示不在后台建(第一次读时全部回放)
+const int DeltaTableRecords = 1024; // 每个写线程的delta表(最近写入的记录和它们的小索引)能放的记录数
+const int DeltaTables = 4;          // 每个写线程轮流写入的delta表个数，都没有合并完时写线程等待
+const int IndexerBatch = 256;       // 后台线程每次从一个写线程的delta表合并到索引的最多记录数
+const int IndexerIdleMicros = 100;  // 所有delta表都合并完时后台线程的休眠时间
+
+// ------ checkpoint.h -------
+const char CheckpointFileName[] = "CHECKPOINT";     // disk_dir下的索引checkpoint，见checkpoint.h
+const uint64_t CheckpointMagic = 0x54504B4348445050; // "PPDHCKPT"
+const uint32_t CheckpointVersion = 2;
+const uint64_t CheckpointCrcBlockSize = 1 << 20; // header之后的内容每1MB一个crc32c，打开时全部校验
+const bool DefaultCheckpoint = true;      // engine_deinit时写checkpoint，重启时只回放checkpoint之后的记录
+const int CheckpointIntervalSeconds = 0;  // 运行期间每隔多少秒写一次checkpoint(期间暂停读写)，0表示只在deinit时写
+const bool DefaultCheckpointOnPmem = false; // checkpoint放在aep_dir，查询直接访问pmem，不占用DRAM的page cache
+
+// ------ manifest.h -------
+const char ManifestFileName[] = "MANIFEST";      // disk_dir下engine的元数据，见manifest.h
+const uint64_t ManifestMagic = 0x54534E4D48445050; // "PPDHMNST"
+const uint32_t ManifestVersion = 1;              // MANIFEST文件本身的格式
+const uint32_t ManifestLayoutVersion = 2;        // log的格式，修改log格式时加1，旧的计数不再使用
+
+// ------ router.h -------
+const char RouteFileName[] = "ROUTE";
+const int RouteWindow = SSDNum + AEPNum;  // 每RouteWindow次写入中有aep_share次写aep, 初始为AEPNum
+const int RouteSampleInterval = 1024;     // 每个线程平均多少次写入抽样一次耗时
+const int RouteRebalanceSamples = 1024;   // 每个设备累计多少条抽样之后重新计算比例
+const int RouteMinShare = 2;              // 每个设备至少分到的份数，保证一直有抽样
+const int RouteMaxStep = 2;               // 每次调整最多变化的份数
+
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
\ No newline at end of file
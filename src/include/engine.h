@@ -2,6 +2,8 @@
 #include <unordered_map>
 #include <map>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <vector>
 
 #include "hash_table8.hpp"
@@ -10,16 +12,20 @@
 #include "hash_table5.hpp"
 #include "user.h"
 #include "log.h"
+#include "router.h"
+#include "slot_registry.h"
+#include "config.h"
+#include "partitioned_index.h"
+#include "quiescence.h"
+#include "indexer.h"
+#include "checkpoint.h"
+#include "manifest.h"
 
 // id int64, user_id char(128), name char(128), salary int64
 // pk : id 			    //主键索引
 // uk : user_id 		//唯一索引
 // sk : salary			//普通索引
 
-using primary_key = emhash8::HashMap<int64_t, size_t>;
-using unique_key  = emhash8::HashMap<BlizardHashWrapper, size_t>;
-using normal_key  = emhash8::HashMap<int64_t, LocationsWrapper>;
-
 using cluster_primary_key = emhash8::HashMap<int64_t, UserIdWrapper>; // Id->Userid
 using cluster_unique_key  = emhash8::HashMap<BlizardHashWrapper, NameWrapper>; // Userid->Name
 using cluster_normal_key  = emhash5::HashMap<int64_t, int64_t>; // Salary->Id
@@ -33,17 +39,47 @@ class Engine {
 
     int Append(const void *datas);
 
+    // datas是连续的num条记录
+    int AppendBatch(const void *datas, size_t num);
+
     size_t Read(void *ctx, int32_t select_column,
       int32_t where_column, const void *column_key, 
       size_t column_key_len, void *res);
     
   private:
     void warmUp();
+    void wait_write_phase();
+    void insert_index(int cur_phase, bool pmem, const User *user);
+    bool route_write(size_t left, size_t *run);
+    size_t append_run(bool to_aep, const void *datas, size_t run);
     int replay_index(const std::vector<std::string> disk_path, const std::vector<std::string> pmem_path);
+    // 只统计记录数，不建索引。disk_counts/pmem_counts不为nullptr时返回每个log的记录数
+    uint64_t count_records(const std::vector<std::string> disk_path, const std::vector<std::string> pmem_path,
+                           std::vector<uint64_t> *disk_counts = nullptr, std::vector<uint64_t> *pmem_counts = nullptr);
+    // 从打开的writer得到每个log的记录数，不读log。调用者保证没有进行中的写入
+    uint64_t writer_counts(std::vector<uint64_t> *disk_counts, std::vector<uint64_t> *pmem_counts) const;
+    // 把每个log的记录数和当前的状态写到disk_dir下的MANIFEST，clean表示所有writer都已经关闭
+    void save_manifest(bool clean, const std::vector<uint64_t> &disk_counts, const std::vector<uint64_t> &pmem_counts);
+    // checkpoint_on_pmem时在aep_dir下，否则在disk_dir下
+    std::string checkpoint_path() const;
+    // 加载checkpoint，每个log的记录数都不少于checkpoint中的才使用
+    void load_checkpoint(const std::vector<uint64_t> &disk_counts, const std::vector<uint64_t> &pmem_counts);
+    // 扫描所有log写一个新的checkpoint(和上一次相比没有新记录时不写)，返回log中的记录数。
+    // 调用者保证没有进行中的读写
+    uint64_t write_checkpoint();
+    // 每隔config_.checkpoint_interval秒关闭gate_写一次checkpoint
+    void checkpoint_loop();
     int must_set_tid();
+    void lease_slot();
+    // 当前所有log(包括按需创建的)的路径
+    std::vector<std::string> log_paths(const std::string &dir) const;
 
     void close_all_writers();
-    int open_all_writers();
+    // disk_counts/pmem_counts不为nullptr时是每个log校验之后的记录数，writer截断到校验通过的记录，
+    // 新的记录接在后面，之后的回放不会在损坏的块处丢掉它们
+    int open_all_writers(const std::vector<uint64_t> *disk_counts = nullptr,
+                         const std::vector<uint64_t> *pmem_counts = nullptr);
+    void open_writers(int slot);
 
   private:
     int build_3_cluster_index(const std::vector<std::string> disk_path, const std::vector<std::string> pmem_path);
@@ -52,23 +88,40 @@ class Engine {
       size_t column_key_len, void *res);
     
 
-    std::atomic<bool> is_changing_;
+    // 必须最先初始化，其他成员的大小都来自配置
+    const EngineConfig config_;
+    // 建索引时预留的记录数: 预计的记录数和已有的记录数中较大的一个
+    uint64_t reserve_records_;
+    // Read/Append进出时登记，phase切换时关闭并等待进行中的操作结束
+    QuiescenceGate gate_;
     std::atomic<int> phase_;
-    std::atomic<int> next_tid_;
-    std::mutex mtx_;
-    std::vector<std::string> disk_file_paths_;
-    std::vector<std::string> pmem_file_paths_;
+    // 写线程租用的slot，slot i独占disk_logs_[i]和pmem_logs_[i]
+    std::shared_ptr<SlotRegistry> slots_;
+    // log的数量: 至少config_.client_num个，写线程更多时按需增加
+    std::atomic<int> log_num_;
     const std::string aep_dir_;
     const std::string dir_;
-    std::vector<MmapWriter *> disk_logs_;
+    // 长度为config_.max_writer_slots，还没有创建的writer为nullptr
+    std::vector<SegmentedLogWriter *> disk_logs_;
     std::vector<PmapBufferWriter *> pmem_logs_;
+    GroupCommitter *group_committer_;
+    BufferFlusher *buffer_flusher_;  // Async模式下后台刷pmem buffer，可以为nullptr
+    BackgroundIndexer *indexer_;     // 从空库开始的WriteOnly阶段在后台建索引，读写都经过它，一直保留到析构
+    WriteRouter router_;
+    // 关闭pmem writer时汇总的持久化开销
+    DurabilityStats pmem_stats_;
 
-    std::vector<User> users_;
-    primary_key idx_id_;
-
-    unique_key idx_user_id_;
-
-    normal_key idx_salary_;
+    // hybrid阶段的索引，并发读写不需要全局锁
+    HybridIndex index_;
+    // 重启时加载的checkpoint(只读)，checkpoint之后回放和写入的记录在index_中。
+    // 在pmem上时查询直接访问pmem，重启不需要重建也不占用DRAM
+    std::unique_ptr<IndexCheckpoint> checkpoint_;
+    // 最近一次加载或者写出的checkpoint包含的记录数，没有时为UINT64_MAX
+    uint64_t checkpoint_records_;
+    std::thread checkpointer_;  // checkpoint_interval > 0时定期写checkpoint
+    std::mutex checkpoint_mtx_;
+    std::condition_variable checkpoint_cv_;
+    bool stop_checkpoint_;
 
     // only use for performance read phase
     bool is_read_perf_ = false;
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "partitioned_index.h"
+
+// 一个写线程最近写入的记录和它们的小索引(delta memtable)，最多DeltaTableRecords条。
+// 写者是租用这个slot的写线程(同一时刻只有一个)，它只追加; 负责这个slot的后台线程按写入顺序
+// 把记录合并到索引(merged之前的记录一定已经在索引中)，写满并且全部合并之后原地清空给写线程重用。
+// 读者不加锁: 清空时gen为奇数，读者读完之后检查gen没有变化，否则丢弃读到的结果
+class DeltaTable {
+  public:
+    DeltaTable();
+    DeltaTable(const DeltaTable&) = delete;
+    DeltaTable& operator=(const DeltaTable&) = delete;
+
+    // 以下只由写线程调用，写满时返回false
+    bool Append(const User *user);
+
+    // 以下只由后台线程调用
+    // 把[merged, size)中最多max条记录按写入顺序交给f(const User *)，f返回之后才推进merged
+    template <typename F>
+    size_t Merge(size_t max, F f) {
+      uint32_t merged = merged_.load(std::memory_order_relaxed);
+      uint32_t n = std::min<uint64_t>(max, size_.load(std::memory_order_acquire) - merged);
+      for (uint32_t i = 0; i < n; i++) {
+        f(&records_[merged + i]);
+      }
+      merged_.store(merged + n, std::memory_order_release);
+      return n;
+    }
+    // 写满并且全部合并
+    bool Drained() const { return merged_.load(std::memory_order_relaxed) == DeltaTableRecords; }
+    // 调用者保证写线程已经换到别的表
+    void Reset();
+
+    // 以下读者调用
+    uint32_t Size() const { return size_.load(std::memory_order_acquire); }
+    uint32_t Merged() const { return merged_.load(std::memory_order_acquire); }
+    // 查到时把记录复制到out，返回false表示没有查到或者表正在被清空
+    bool FindId(uint64_t hash, int64_t id, User *out) const { return find_unique(idx_id_, hash, id, out); }
+    bool FindUserId(uint64_t hash, int64_t user_id, User *out) const { return find_unique(idx_user_id_, hash, user_id, out); }
+    // 对位置不小于from的salary匹配的记录调用f(const User &)。不检查gen，由调用者保证没有并发的清空
+    template <typename F>
+    void FindSalary(uint64_t hash, int64_t salary, uint32_t from, F f) const {
+      // 链表中的位置严格递减
+      for (uint64_t value = idx_salary_.Find(hash, salary); value > from;
+           value = link_[value - 1].load(std::memory_order_relaxed)) {
+        f(records_[value - 1]);
+      }
+    }
+
+  private:
+    bool find_unique(const SlotTable &table, uint64_t hash, int64_t key, User *out) const;
+
+    std::atomic<uint64_t> gen_;     // 清空时为奇数
+    std::atomic<uint32_t> size_;    // 写线程
+    std::atomic<uint32_t> merged_;  // 后台线程
+    std::unique_ptr<User[]> records_;
+    std::unique_ptr<std::atomic<uint32_t>[]> link_;  // salary相同的上一条记录的位置 + 1
+    SlotTable idx_id_;
+    SlotTable idx_user_id_;
+    SlotTable idx_salary_;
+};
+
+// 一个slot的delta表。写线程写满一张表之后换到下一张已经清空的表，后台线程从最老的表开始合并
+struct SlotDelta {
+  // 后台线程合并一批记录或者清空一张表时为奇数，salary查询用它检测和合并的并发
+  alignas(64) std::atomic<uint64_t> seq{0};
+  std::atomic<int> active{0};  // 写线程正在写入的表
+  uint64_t overflow = 0;       // 写线程遇到所有表都没有合并完的次数，只由写线程修改
+  DeltaTable tables[DeltaTables];
+};
+
+// WriteOnly阶段的后台建索引: 写线程写完log之后把记录追加到自己slot的delta表，
+// 后台线程按slot分工(每个slot只由一个线程负责)把delta表合并到索引。读者同时查delta表和索引，
+// 因此WriteOnly阶段的读不用等索引建完，也不用切换phase，读写一直都不加锁。
+// delta表中不记录记录来自哪个log，不能用于PmemPartitionedLayout(engine在这种布局下直接插入索引)
+class BackgroundIndexer {
+  public:
+    BackgroundIndexer(HybridIndex *index, int max_slots, int threads);
+    ~BackgroundIndexer();
+    BackgroundIndexer(const BackgroundIndexer&) = delete;
+    BackgroundIndexer& operator=(const BackgroundIndexer&) = delete;
+
+    // 由持有slot的写线程调用，所有delta表都没有合并完时等待后台线程清空一张表，
+    // 保证同一个slot的记录按写入顺序进入索引
+    void Add(int slot, const User *user);
+    // 停止后台线程，把所有delta表中剩下的记录合并到索引，返回这一步合并的记录数。
+    // 调用者保证没有并发的Add，可以重复调用
+    uint64_t Finish();
+
+    // 和HybridIndex相同的查询接口，可以和Add并发。写线程能查到自己已经Add的记录
+    template <typename F>
+    size_t FindId(int64_t id, F f) const {
+      return find_unique(IndexHash(id), id, &DeltaTable::FindId, [&]() { return index_->FindId(id, f); }, f);
+    }
+    template <typename F>
+    size_t FindUserId(const char *user_id, F f) const {
+      int64_t key = BlizardHashWrapper(user_id, UseridLen).Hash();
+      return find_unique(IndexHash(key), key, &DeltaTable::FindUserId,
+                         [&]() { return index_->FindUserId(user_id, f); }, f);
+    }
+    template <typename F>
+    size_t FindSalary(int64_t salary, F f) const {
+      const std::vector<User> &found = collect_salary(salary);
+      for (const User &user : found) {
+        f(user);
+      }
+      return found.size();
+    }
+
+  private:
+    using DeltaFind = bool (DeltaTable::*)(uint64_t, int64_t, User *) const;
+
+    // 先查delta表再查索引: 合并完的表被跳过或清空时，其中的记录已经在索引中。
+    // 两边都查到时以索引为准，和索引一样保留先写入的记录
+    template <typename IndexFind, typename F>
+    size_t find_unique(uint64_t hash, int64_t key, DeltaFind find, IndexFind index_find, F f) const {
+      User delta;
+      bool in_delta = find_delta(hash, key, find, &delta);
+      size_t n = index_find();
+      if (n == 0 && in_delta) {
+        f(delta);
+        n = 1;
+      }
+      return n;
+    }
+    bool find_delta(uint64_t hash, int64_t key, DeltaFind find, User *out) const;
+    // 索引和所有delta表中还没有合并的记录，返回本线程的缓冲区
+    const std::vector<User> &collect_salary(int64_t salary) const;
+
+    void run(int id);
+    SlotDelta *delta(int slot);
+    // 合并slot最多max条记录，并清空已经合并完的表，返回合并的记录数
+    size_t merge_slot(int slot, SlotDelta *d, size_t max);
+
+    HybridIndex *index_;
+    const int max_slots_;
+    const int threads_;
+    // 长度为max_slots_，由写线程第一次Add时创建
+    std::unique_ptr<std::atomic<SlotDelta *>[]> deltas_;
+    std::atomic<int> slot_num_;  // 创建过delta的最大slot + 1
+    std::vector<std::thread> workers_;
+    std::atomic<bool> stop_;
+    std::atomic<uint64_t> indexed_;  // 后台线程合并的记录数
+};
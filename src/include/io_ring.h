@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <deque>
+#include <utility>
+
+// 只支持写的最小io_uring封装，直接用系统调用(不依赖liburing)，只由一个线程使用。
+// 内核不支持或者不允许io_uring时退化为同步的pwrite，完成的请求同样由Reap返回，调用者不需要区分
+class IoRing {
+ public:
+  explicit IoRing(unsigned entries);
+  ~IoRing();
+  IoRing(const IoRing&) = delete;
+  IoRing& operator=(const IoRing&) = delete;
+
+  bool Async() const { return ring_fd_ >= 0; }
+  // 提交一个写请求，完成时Reap返回user_data和结果(写入的字节数或者-errno)。
+  // 提交队列满时先等待一个请求完成
+  void Write(int fd, const void *buf, size_t len, off_t offset, uint64_t user_data);
+  // 处理已经完成的请求; wait时如果没有已完成的请求，至少等到一个完成。返回处理的请求数
+  template <typename OnComplete>
+  size_t Reap(bool wait, OnComplete on_complete) {
+    collect(wait && done_.empty() && in_flight_ > 0);
+    size_t n = 0;
+    while (!done_.empty()) {
+      std::pair<uint64_t, int> c = done_.front();
+      done_.pop_front();
+      on_complete(c.first, c.second);
+      n++;
+    }
+    return n;
+  }
+  // 已提交还没有被Reap处理的请求数
+  size_t Pending() const { return in_flight_ + done_.size(); }
+
+ private:
+  // 把完成队列中的请求移到done_，wait时至少等到一个
+  void collect(bool wait);
+
+  int ring_fd_;
+  unsigned entries_;
+  size_t in_flight_;  // 已提交还没有完成的请求数
+  std::deque<std::pair<uint64_t, int>> done_;
+
+  void *sq_ptr_;
+  size_t sq_size_;
+  void *cq_ptr_;
+  size_t cq_size_;
+  void *sqes_ptr_;
+  size_t sqes_size_;
+  unsigned *sq_tail_;
+  unsigned *sq_mask_;
+  unsigned *sq_array_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned *cq_mask_;
+  void *cqes_;
+};
@@ -1,11 +1,75 @@
+#pragma once
+
 #include <xmmintrin.h>
 #include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <chrono>
+#include <condition_variable>
 #include <libpmem.h>
-#include "rte_memcpy.h"
+#include "record_copy.h"
+#include "crc32c.h"
 #include "def.h"
+#include "user.h"
+#include "codec.h"
+#include "io_ring.h"
+
+//--------------------- disk log-----------------------------------
+// ssd上的log，根据DiskLogFormat选择不同的实现
+class DiskLogWriter {
+ public:
+  virtual ~DiskLogWriter() {}
+
+  virtual int Append(const void* data) = 0;
+  // datas是连续的num条记录
+  virtual int AppendBatch(const void* datas, size_t num) = 0;
+
+  virtual size_t MaxSlot() const = 0;
+  virtual size_t FreeSlot() const = 0;
+  // 已提交的记录数(精确值，和reader读出的记录数相同)
+  virtual uint64_t Count() const = 0;
+  // 已经写入的数据占用的字节数
+  virtual size_t UsedBytes() const = 0;
+  virtual void WarmUp(const size_t slot) = 0;
+};
+
+#define ColumnMask(column) (1 << (column))
+const int AllColumns = ColumnMask(Id) | ColumnMask(Userid) | ColumnMask(Name) | ColumnMask(Salary);
+
+class DiskLogReader {
+ public:
+  virtual ~DiskLogReader() {}
+
+  // 已提交的记录数
+  virtual uint64_t Count() const = 0;
+  // record指向一条完整的记录
+  virtual bool ReadRecord(char *&record, int len) = 0;
+  // 只把columns(ColumnMask的组合)中的列拷贝到user中，列存格式只会读取这些列
+  virtual bool ReadColumns(int columns, User *user) = 0;
+  // 校验checksum，把记录数截断到第一个损坏的块之前，返回截断后的记录数。
+  // 没有checksum的格式直接返回Count()。必须在读取之前调用
+  virtual uint64_t Verify() { return Count(); }
+  // 最多只读取前cnt条记录
+  virtual void Truncate(uint64_t cnt) = 0;
+};
+
+// backend(DiskBackend)只对RowLog有效
+DiskLogWriter *NewDiskLogWriter(int format, const std::string &filename, int mmap_size,
+                                int backend = DefaultDiskBackend);
+DiskLogReader *NewDiskLogReader(int format, const std::string &filename, int mmap_size);
 
 //--------------------- mmap file-----------------------------------
-class MmapWriter {
+// 文件布局: | header(MmapHeaderSize) | record | record | ... | commit(8) | crc | crc | ... |
+// header的前8字节是已提交的记录数(tail)，每次写入时顺便更新(文件头所在的cache line一直是热的)，
+// 打开时不需要扫描整个文件。第slot条记录的commit标记是第slot+1条记录的第一个word。
+// 每CrcBlockRecords条记录一个crc32c，在块的最后一条记录提交之前写入，因此提交了的完整块都有crc，
+// 最后一个不完整的块仍然只靠commit标记
+class MmapWriter : public DiskLogWriter {
  public:
   MmapWriter() = delete;
   MmapWriter(const std::string &filename, int mmap_size);
@@ -13,71 +77,530 @@ class MmapWriter {
   MmapWriter(const MmapWriter&) = delete;
   MmapWriter& operator=(const MmapWriter&) = delete;
 
-  int Append(const void* data) {
-    memcpy(data_curr_, data, 256);
-    memcpy(data_curr_ + 256, (const char *)data + 256, 16);
-    memcpy(data_curr_ + 272, (const char *)data + 272, 8);
-    *(uint64_t *)(data_curr_ + 272) = CommitFlag;
+  // 不检查边界，由调用者保证FreeSlot() > 0 (SegmentedLogWriter在写满时切换segment)
+  int Append(const void* data) override {
+    CopyRecords(data_curr_, reinterpret_cast<const char *>(data), 1);
+    update_crc(reinterpret_cast<const char *>(data), 1);
+    *(uint64_t *)(data_curr_ + RecordSize) = CommitFlag;
     data_curr_ += RecordSize;
+    *tail_ += 1;
+    return 0;
+  }
+
+  // 连续写入num条记录之后再写commit标记，大batch用non-temporal store(结束时sfence)
+  int AppendBatch(const void* datas, size_t num) override {
+    if (num >= StreamCopyMinRecords) {
+      StreamRecords(data_curr_, reinterpret_cast<const char *>(datas), num);
+    } else {
+      CopyRecords(data_curr_, reinterpret_cast<const char *>(datas), num);
+    }
+    update_crc(reinterpret_cast<const char *>(datas), num);
+    data_curr_ += num * RecordSize;
+    *(uint64_t *)data_curr_ = CommitFlag;
+    *tail_ += num;
     return 0;
   }
   
-  size_t MaxSlot() const { return (mmap_size_ - 8) / RecordSize; }
+  size_t MaxSlot() const override { return (mmap_size_ - 8) / RecordSize; }
+  // 还能写入的记录数(最后8字节留给commit标记)
+  size_t FreeSlot() const override { return (data_start_ + mmap_size_ - 8 - data_curr_) / RecordSize; }
+  uint64_t Count() const override { return *tail_; }
+  size_t UsedBytes() const override { return data_curr_ - data_start_; }
   // 预取第slot个记录的头指针，每次顺便预取一下commit_cnt_指针
-  void WarmUp(const size_t slot) { 
+  void WarmUp(const size_t slot) override { 
     _mm_prefetch((const void *)(data_start_ + (slot * RecordSize)), _MM_HINT_T0);
   }
+  // 丢弃第cnt条之后的记录(从后往前清除commit标记)，之后从第cnt条开始写入
+  void Truncate(uint64_t cnt);
 
  private:
+  // 用源数据(还在cache中)更新当前块的crc，块写满时写入文件，调用者在这之后才写commit标记
+  void update_crc(const char *src, size_t num) {
+    uint64_t slot = *tail_;
+    while (num > 0) {
+      size_t n = std::min<size_t>(num, CrcBlockRecords - slot % CrcBlockRecords);
+      block_crc_ = Crc32cExtend(block_crc_, src, n * RecordSize);
+      src += n * RecordSize;
+      num -= n;
+      slot += n;
+      if (slot % CrcBlockRecords == 0) {
+        crcs_[slot / CrcBlockRecords - 1] = block_crc_;
+        block_crc_ = 0;
+      }
+    }
+  }
+
   const std::string filename_;
   int mmap_size_;
   int fd_;
-  char *data_start_; // data_start_ = (char *)mmap_start_ptr + 8
+  uint64_t *tail_;   // 文件头中的记录数，tail_ = (uint64_t *)mmap_start_ptr
+  char *data_start_; // data_start_ = (char *)mmap_start_ptr + MmapHeaderSize
   char *data_curr_;
+  uint32_t *crcs_;   // crcs_ = (uint32_t *)(data_start_ + mmap_size_)
+  uint32_t block_crc_; // 当前还没写满的块的crc
 };
 
-class MmapReader {
+class MmapReader : public DiskLogReader {
  public:
   MmapReader(const std::string &filename, int mmap_size);
   ~MmapReader();
 
-  bool ReadRecord(char *&record, int len);
+  uint64_t Count() const override { return cnt_; }
+  bool ReadRecord(char *&record, int len) override;
+  bool ReadColumns(int columns, User *user) override;
+  uint64_t Verify() override;
+  void Truncate(uint64_t cnt) override { cnt_ = std::min(cnt_, cnt); }
 
  private:
   const std::string filename_;
   int mmap_size_;
   int fd_;
   uint64_t cnt_;
-  char *data_start_; // data_start_ = (char *)mmap_start_ptr + 8
+  char *data_start_; // data_start_ = (char *)mmap_start_ptr + MmapHeaderSize
   char *data_curr_;
+  const uint32_t *crcs_;
+};
+
+//--------------------- direct io file-----------------------------------
+// 和MmapWriter写出相同的文件(行存格式)，但不mmap文件: 记录写入4KB对齐的staging页，
+// 通过io_uring以O_DIRECT写入，写入延迟不受缺页和内核回写影响，也不需要WarmUp。
+// 写满的页直接提交; 没写满的页(当前记录和commit标记所在的页、crc所在的页)提交一份快照。
+// 同一页同时最多只有一个写入，写入过程中再修改的页标记为dirty，完成之后再提交，所以后写的内容一定后落盘。
+// AppendBatch返回时所有修改过的页都已经提交(必要时等待前一次写入完成)，不会有dirty页留到下一次写入。
+// 一条记录在它所在的页和crc所在的页的写入完成之后才持久化，进程crash时只丢失还没有完成的写入。
+// 文件头中的tail只是提示，只在关闭时写入
+class DirectWriter : public DiskLogWriter {
+ public:
+  DirectWriter() = delete;
+  DirectWriter(const std::string &filename, int mmap_size);
+  ~DirectWriter();
+  DirectWriter(const DirectWriter&) = delete;
+  DirectWriter& operator=(const DirectWriter&) = delete;
+
+  // 和MmapWriter一样不检查边界
+  int Append(const void* data) override { return AppendBatch(data, 1); }
+  int AppendBatch(const void* datas, size_t num) override;
+
+  size_t MaxSlot() const override { return (mmap_size_ - 8) / RecordSize; }
+  size_t FreeSlot() const override { return MaxSlot() - tail_; }
+  uint64_t Count() const override { return tail_; }
+  size_t UsedBytes() const override { return tail_ * RecordSize; }
+  void WarmUp(const size_t) override {}
+
+ private:
+  struct Page {
+    int64_t page = -1; // 文件中的第几页，-1表示空闲
+    char *buf = nullptr;
+    bool in_flight = false;
+    bool dirty = false;
+  };
+  // 文件中第page页所在的staging页，不在staging中时返回nullptr
+  Page *lookup(int64_t page);
+  // 把第page页放进staging: data页用环中的page % DirectStagingPages，等这个位置上原来的页写完。
+  // load时从文件读取原来的内容，否则清零(新写入的页在文件中还是0)
+  Page *load_data_page(int64_t page, bool load);
+  void load_crc_page(int64_t page);
+  void read_page(int64_t page, char *buf);
+  // 从off开始写入len字节。写入的是记录时data_off_随之前进，写满的页马上提交
+  void write(uint64_t off, const char *src, size_t len, bool record);
+  // 用源数据更新当前块的crc，块写满时写入crc页
+  void update_crc(const char *src, size_t num);
+  // 提交page的当前内容: 不会再修改的页直接提交staging页，否则提交一份快照; 写入中的页只标记为dirty
+  void submit(Page *page);
+  // 第page页不会再被写入: data和crc的写入位置都已经越过了这一页
+  bool sealed(int64_t page) const;
+  // 有修改过但还没有提交的页(提交之后dirty才清除)
+  bool has_unsubmitted() const;
+  // 处理已经完成的写入，wait时至少等到一个
+  void reap(bool wait);
+
+  const std::string filename_;
+  int mmap_size_;
+  int fd_;
+  uint64_t tail_;       // 已经写入的记录数
+  uint64_t data_off_;   // 下一条记录(当前的commit标记)在文件中的偏移
+  uint64_t crc_start_;  // 文件中crc数组的偏移
+  uint64_t crc_off_;    // 下一个crc在文件中的偏移
+  uint32_t block_crc_;  // 当前还没写满的块的crc
+  IoRing ring_;
+  char *bufs_;          // DirectStagingPages个staging页 + crc页 + DirectSnapshots个快照
+  Page pages_[DirectStagingPages];
+  Page crc_page_;       // 当前crc所在的页
+  char *snapshots_[DirectSnapshots];
+  std::vector<int> free_snapshots_;
+};
+
+//--------------------- column mmap file-----------------------------------
+// 每一列一个mmap文件: filename + ColumnFileSuffix[column]，第slot条记录的列在column_offset(column, slot)处。
+// id列文件开头的8字节是已提交的记录数，写完一条(一批)记录的所有列之后再更新，这是提交点。
+// 提交标记不和任何列共用位置，任意的id(包括0)都不会影响记录数，统计记录数只需要读这8字节。
+static inline size_t column_offset(int column, uint64_t slot) {
+  return (column == Id ? 8 : 0) + slot * ColumnWidth[column];
+}
+
+class ColumnMmapWriter : public DiskLogWriter {
+ public:
+  ColumnMmapWriter() = delete;
+  // mmap_size是对应行存文件的大小，列存和行存能够容纳的记录数相同
+  ColumnMmapWriter(const std::string &filename, int mmap_size);
+  ~ColumnMmapWriter();
+  ColumnMmapWriter(const ColumnMmapWriter&) = delete;
+  ColumnMmapWriter& operator=(const ColumnMmapWriter&) = delete;
+
+  int Append(const void* data) override {
+    write_columns(reinterpret_cast<const User *>(data));
+    slot_++;
+    count_->store(slot_, std::memory_order_release);
+    return 0;
+  }
+
+  int AppendBatch(const void* datas, size_t num) override {
+    const User *users = reinterpret_cast<const User *>(datas);
+    for (size_t i = 0; i < num; i++) {
+      write_columns(users + i);
+      slot_++;
+    }
+    count_->store(slot_, std::memory_order_release);
+    return 0;
+  }
+
+  size_t MaxSlot() const override { return max_slot_; }
+  size_t FreeSlot() const override { return max_slot_ - slot_; }
+  uint64_t Count() const override { return slot_; }
+  size_t UsedBytes() const override { return slot_ * RecordSize; }
+  void WarmUp(const size_t slot) override {
+    for (int c = 0; c < 4; c++) {
+      _mm_prefetch((const void *)(columns_[c] + column_offset(c, slot)), _MM_HINT_T0);
+    }
+  }
+  // 丢弃第cnt条之后的记录(改小已提交的记录数)，之后从第cnt条开始写入
+  void Truncate(uint64_t cnt);
+
+ private:
+  void write_columns(const User *user) {
+    memcpy(columns_[Userid] + column_offset(Userid, slot_), user->user_id, UseridLen);
+    memcpy(columns_[Name] + column_offset(Name, slot_), user->name, NameLen);
+    *(int64_t *)(columns_[Salary] + column_offset(Salary, slot_)) = user->salary;
+    *(int64_t *)(columns_[Id] + column_offset(Id, slot_)) = user->id;
+  }
+
+  const std::string filename_;
+  size_t max_slot_;
+  size_t slot_;
+  int fds_[4];
+  size_t sizes_[4];
+  char *columns_[4];
+  std::atomic<uint64_t> *count_;  // id列文件开头的已提交记录数
+};
+
+class ColumnMmapReader : public DiskLogReader {
+ public:
+  ColumnMmapReader(const std::string &filename, int mmap_size);
+  ~ColumnMmapReader();
+
+  uint64_t Count() const override { return cnt_; }
+  // 把各列拼成一条完整的记录，record指向reader内部的buffer，下一次读取之前有效
+  bool ReadRecord(char *&record, int len) override;
+  bool ReadColumns(int columns, User *user) override;
+  void Truncate(uint64_t cnt) override { cnt_ = std::min(cnt_, cnt); }
+
+ private:
+  // 只打开用到的列，没有打开的列为nullptr
+  void open_column(int column);
+
+  const std::string filename_;
+  size_t max_slot_;
+  uint64_t cnt_;
+  uint64_t slot_;
+  int fds_[4];
+  size_t sizes_[4];
+  char *columns_[4];
+  User record_;
+};
+
+//--------------------- compressed mmap file-----------------------------------
+// 文件被切分为CompressBlockSize大小的块，每块: | header(8) | encoded record | encoded record | ... |
+// 记录用codec.h中的格式编码，不跨块。写完一条记录之后用一次8字节的store更新块头来提交，
+// 读取时遇到记录数为0的块结束。
+class CompressedMmapWriter : public DiskLogWriter {
+ public:
+  CompressedMmapWriter() = delete;
+  CompressedMmapWriter(const std::string &filename, int mmap_size);
+  ~CompressedMmapWriter();
+  CompressedMmapWriter(const CompressedMmapWriter&) = delete;
+  CompressedMmapWriter& operator=(const CompressedMmapWriter&) = delete;
+
+  int Append(const void* data) override {
+    const User *user = reinterpret_cast<const User *>(data);
+    // 剩余空间足够放下最长的记录时不需要先计算编码长度
+    if (unlikely(block_used_ + MaxEncodedRecordSize > CompressBlockSize)
+        && block_used_ + EncodedSize(user) > CompressBlockSize) {
+      next_block();
+    }
+    block_used_ += EncodeRecord(user, block_ + block_used_);
+    block_cnt_++;
+    *(uint64_t *)block_ = (uint64_t)block_used_ << 32 | block_cnt_;
+    cnt_++;
+    return 0;
+  }
+
+  int AppendBatch(const void* datas, size_t num) override {
+    for (size_t i = 0; i < num; i++) {
+      Append((const char *)datas + i * RecordSize);
+    }
+    return 0;
+  }
+
+  // 按最坏情况(不能压缩)估计容量
+  size_t MaxSlot() const override { return block_num_ * RecordsPerBlock; }
+  size_t FreeSlot() const override {
+    size_t rest_blocks = block_num_ - (block_ - data_start_) / CompressBlockSize - 1;
+    return rest_blocks * RecordsPerBlock + (CompressBlockSize - block_used_) / MaxEncodedRecordSize;
+  }
+  uint64_t Count() const override { return cnt_; }
+  size_t UsedBytes() const override { return block_ - data_start_ + block_used_; }
+  void WarmUp(const size_t slot) override {
+    _mm_prefetch((const void *)(data_start_ + slot * MaxEncodedRecordSize), _MM_HINT_T0);
+  }
+  // 丢弃第cnt条之后的记录(从后往前清除块头)，之后从第cnt条开始写入
+  void Truncate(uint64_t cnt);
+
+  static const size_t RecordsPerBlock = (CompressBlockSize - 8) / MaxEncodedRecordSize;
+
+ private:
+  void next_block();
+
+  const std::string filename_;
+  size_t mmap_size_;
+  size_t block_num_;
+  int fd_;
+  char *data_start_;
+  char *block_;        // 当前写入的块
+  uint32_t block_used_;
+  uint32_t block_cnt_;
+  uint64_t cnt_;       // 所有块中的记录数
+};
+
+class CompressedMmapReader : public DiskLogReader {
+ public:
+  CompressedMmapReader(const std::string &filename, int mmap_size);
+  ~CompressedMmapReader();
+
+  uint64_t Count() const override { return cnt_; }
+  // 解码到reader内部的buffer，下一次读取之前有效
+  bool ReadRecord(char *&record, int len) override;
+  bool ReadColumns(int columns, User *user) override;
+  void Truncate(uint64_t cnt) override { cnt_ = std::min(cnt_, cnt); }
+
+ private:
+  const std::string filename_;
+  size_t mmap_size_;
+  size_t block_num_;
+  int fd_;
+  uint64_t cnt_;
+  uint64_t read_cnt_;
+  char *data_start_;
+  char *block_;
+  uint32_t block_read_;  // 当前块已经读取的记录数
+  uint32_t block_off_;   // 当前块下一条记录的偏移
+  User record_;
+};
+
+//--------------------- segmented disk log-----------------------------------
+// 第segment个segment的文件名，第0个segment就是filename本身
+std::string SegmentFileName(const std::string &filename, size_t segment);
+
+// 由多个固定大小(segment_size)的segment组成的log，每个segment是一个format格式的DiskLogWriter。
+// 只有最后一个segment是打开的，当前segment写满时才创建下一个，前面的segment都已经写满。
+class SegmentedLogWriter : public DiskLogWriter {
+ public:
+  SegmentedLogWriter() = delete;
+  // max_segments为0时segment数只受设备剩余空间的限制
+  SegmentedLogWriter(int format, const std::string &filename, int segment_size, size_t max_segments,
+                     int backend = DefaultDiskBackend);
+  ~SegmentedLogWriter();
+  SegmentedLogWriter(const SegmentedLogWriter&) = delete;
+  SegmentedLogWriter& operator=(const SegmentedLogWriter&) = delete;
+
+  // 设备空间不足(或者达到max_segments)、无法创建下一个segment时返回-1，记录没有写入
+  int Append(const void* data) override {
+    if (unlikely(writer_->FreeSlot() == 0) && !next_segment()) {
+      return -1;
+    }
+    return writer_->Append(data);
+  }
+
+  // batch可能跨越多个segment。无法创建下一个segment时返回-1，
+  // 此时只写入了前面的一部分记录，调用者通过Count()得到写入了多少条
+  int AppendBatch(const void* datas, size_t num) override {
+    const char *data = reinterpret_cast<const char *>(datas);
+    while (num > 0) {
+      size_t n = std::min(num, writer_->FreeSlot());
+      if (unlikely(n == 0)) {
+        if (!next_segment()) {
+          return -1;
+        }
+        continue;
+      }
+      writer_->AppendBatch(data, n);
+      data += n * RecordSize;
+      num -= n;
+    }
+    return 0;
+  }
+
+  // 容量由设备的剩余空间估计: 已经创建的segment + 剩余空间还能创建的segment(打开segment时statvfs)。
+  // 同一个设备上的其它文件也在使用这些空间，所以FreeSlot只是估计，写入时仍然可能失败
+  size_t MaxSlot() const override { return (segment_ + 1 + spare_segments_) * segment_slots_; }
+  size_t FreeSlot() const override {
+    return spare_segments_ * segment_slots_ + writer_->FreeSlot();
+  }
+  uint64_t Count() const override { return base_cnt_ + writer_->Count(); }
+  // 写满的segment按整个segment的大小计算
+  size_t UsedBytes() const override { return segment_ * segment_size_ + writer_->UsedBytes(); }
+  // 只预取当前segment中的第slot个记录
+  void WarmUp(const size_t slot) override { writer_->WarmUp(slot); }
+  // 每个segment能容纳的记录数
+  size_t SegmentSlot() const { return segment_slots_; }
+  // 丢弃第cnt条之后的记录，之后从第cnt条开始写入(Verify截断了log时，新的记录接在校验通过的记录之后)。
+  // 先从后往前删除后面的segment，再截断cnt所在的segment，中途crash时仍然是一个前缀
+  void Truncate(uint64_t cnt);
+
+ private:
+  void open_segment(size_t segment);
+  // 预先分配下一个segment的全部空间之后再切换过去，空间不足时不切换并返回false
+  bool next_segment();
+  // 按设备的剩余空间(和max_segments_)重新估计还能创建的segment数
+  void update_spare_segments();
+
+  const int format_;
+  const int backend_;
+  const std::string filename_;
+  const int segment_size_;
+  const size_t max_segments_;  // 0表示不限制
+  size_t segment_slots_;
+  size_t segment_;
+  size_t spare_segments_;  // 估计还能创建的segment数
+  uint64_t base_cnt_;  // 前面所有segment中的记录数
+  std::unique_ptr<DiskLogWriter> writer_;
+};
+
+// 按顺序读取所有segment
+class SegmentedLogReader : public DiskLogReader {
+ public:
+  SegmentedLogReader(int format, const std::string &filename, int segment_size);
+  ~SegmentedLogReader();
+
+  // 第一次调用时打开每个segment统计
+  uint64_t Count() const override;
+  bool ReadRecord(char *&record, int len) override;
+  bool ReadColumns(int columns, User *user) override;
+  // 按顺序校验每个segment，遇到损坏的块之后的segment都丢弃
+  uint64_t Verify() override;
+  void Truncate(uint64_t cnt) override { limit_ = std::min(limit_, cnt); }
+
+ private:
+  // 当前segment读完时打开下一个，没有下一个segment时返回false
+  bool next_segment();
+
+  const int format_;
+  const std::string filename_;
+  const int segment_size_;
+  size_t segments_;
+  size_t segment_;
+  mutable int64_t cnt_;
+  std::vector<uint64_t> verified_; // Verify之后每个segment中有效的记录数
+  uint64_t limit_;
+  uint64_t read_cnt_;
+  std::unique_ptr<DiskLogReader> reader_;
 };
 
 //--------------------- pmem Buffer Writer-----------------------------------
+// 一个块(PmapBufferWriterSize)中第slot条记录在两种布局(PmemLayout)下的写入/读出。
+// XPLine布局: user_id+name在第slot个XPLine，id和salary在最后一个XPLine的第slot个16字节
+static_assert(PmapBufferRecords * (XPLineSize + XPLineSideWidth) == PmapBufferWriterSize,
+              "xpline layout must fill the block exactly");
+void ScatterXPLineRecords(char *block, size_t slot, const char *src, size_t num);
+void GatherXPLineRecord(const char *block, size_t slot, char *dst);
+inline char *XPLineSide(char *block, size_t slot) {
+  return block + PmapBufferRecords * XPLineSize + slot * XPLineSideWidth;
+}
+
+// 文件布局: | data(PmapBufferWriterSize * PmapBufferCount) | flush_cnt(8) | commit_cnt(8) |
+// commit_cnt: 已提交的记录总数, flush_cnt: 已经刷入pmem的记录总数
+// 因此buffer中保存的是第[flush_cnt, commit_cnt)条记录，块内按layout存放。
+// 截断时先改commit_cnt再改flush_cnt，flush_cnt > commit_cnt(中途crash)时按flush_cnt = commit_cnt处理
 class MmapBufferWriter {
  public:
   MmapBufferWriter() = delete;
-  MmapBufferWriter(const std::string &filename, int mmap_size);
+  MmapBufferWriter(const std::string &filename, int mmap_size, int layout = DefaultPmemLayout);
   ~MmapBufferWriter();
   MmapBufferWriter(const MmapBufferWriter&) = delete;
   MmapBufferWriter& operator=(const MmapBufferWriter&) = delete;
 
   int Append(const void* data) {
-    if (data_curr_ + RecordSize > data_start_ + mmap_size_ - 8) {
+    if (Write(data) != 0) {
       return -1;
     }
-    memcpy(data_curr_, data, 256);
-    memcpy(data_curr_ + 256, (const char *)data + 256, 16);
     *commit_cnt_ = *commit_cnt_ + 1;
-    data_curr_ += RecordSize;
     return 0;
   }
 
-  int GetCommitCnt() { return *commit_cnt_; }
-  int Bytes() { return data_curr_ - data_start_; }
-  char* Data() { return data_start_; }
-  void Reset() { data_curr_ = data_start_; }
+  // 只写入数据而不提交，由调用者在数据持久化之后调用Commit
+  int Write(const void* data) {
+    if (Full()) {
+      return -1;
+    }
+    write_records(reinterpret_cast<const char *>(data), 1);
+    return 0;
+  }
+  // 写入最多num条记录(直到当前buffer写满)而不提交，返回写入的条数
+  size_t WriteBatch(const void* datas, size_t num) {
+    size_t n = std::min(num, FreeSlot());
+    write_records(reinterpret_cast<const char *>(datas), n);
+    return n;
+  }
+  size_t AppendBatch(const void* datas, size_t num) {
+    size_t n = WriteBatch(datas, num);
+    *commit_cnt_ = *commit_cnt_ + n;
+    return n;
+  }
+  void Commit(uint64_t n) { *commit_cnt_ = *commit_cnt_ + n; }
+  void SetCommitCnt(uint64_t cnt) { *commit_cnt_ = cnt; }
+  // 当前buffer的剩余空间
+  size_t FreeSlot() const { return PmapBufferRecords - used_; }
+  bool Full() const { return used_ == PmapBufferRecords; }
+
+  // 刷出[addr, addr + len)的cache line, 不drain (非pmem时退化为msync)
+  void Flush(const char *addr, size_t len) {
+    if (is_pmem_) {
+      pmem_flush(addr, len);
+    } else {
+      pmem_msync(addr, len);
+    }
+  }
+  const char *Meta() const { return reinterpret_cast<const char *>(flush_cnt_); }
+
+  uint64_t GetCommitCnt() const { return *commit_cnt_; }
+  uint64_t GetFlushCnt() const { return *flush_cnt_; }
+  void SetFlushCnt(uint64_t cnt) { *flush_cnt_ = cnt; }
+  // 当前buffer，以及其中已经写入的记录数
+  char* Data() { return block_start_; }
+  size_t Used() const { return used_; }
+  int Layout() const { return layout_; }
+  // 换到环中的下一个buffer，调用者保证这个buffer中的记录已经刷入pmem
+  void Reset() {
+    block_start_ += PmapBufferWriterSize;
+    if (block_start_ == data_start_ + mmap_size_ - PmapBufferWriterMetaSize) {
+      block_start_ = data_start_;
+    }
+    used_ = 0;
+  }
+  // 按flush_cnt和commit_cnt定位: 当前buffer是第一个没有刷入pmem的记录所在的buffer
+  void Restore();
   
-  size_t MaxSlot() const { return (mmap_size_ - 8) / RecordSize; }
+  // 环中所有buffer的记录数
+  size_t MaxSlot() const { return (mmap_size_ - PmapBufferWriterMetaSize) / RecordSize; }
   // 预取第slot个记录的头指针，每次顺便预取一下commit_cnt_指针
   void WarmUp(const size_t slot) { 
     _mm_prefetch((const void *)(data_start_ + (slot * RecordSize)), _MM_HINT_T0);
@@ -85,31 +608,133 @@ class MmapBufferWriter {
   }
 
  private:
+  void write_records(const char *src, size_t n) {
+    if (layout_ == PmemLayout::PmemRowLayout) {
+      CopyRecords(block_start_ + used_ * RecordSize, src, n);
+    } else {
+      ScatterXPLineRecords(block_start_, used_, src, n);
+    }
+    used_ += n;
+  }
+
   const std::string filename_;
   int mmap_size_;
+  const int layout_;
   int fd_;
-  uint64_t *commit_cnt_; // commit_cnt_ = (uint64_t *)mmap_start_ptr
-  char *data_start_; // data_start_ = (char *)mmap_start_ptr + 8
-  char *data_curr_;
+  bool is_pmem_;
+  uint64_t *flush_cnt_;  // flush_cnt_ = (uint64_t *)(mmap_start_ptr + mmap_size - 16)
+  uint64_t *commit_cnt_; // commit_cnt_ = (uint64_t *)(mmap_start_ptr + mmap_size - 8)
+  char *data_start_; // data_start_ = (char *)mmap_start_ptr
+  char *block_start_; // 当前buffer
+  size_t used_;       // 当前buffer中已经写入的记录数
 };
 
 class MmapBufferReader {
  public:
-  MmapBufferReader(const std::string &filename, int mmap_size);
+  MmapBufferReader(const std::string &filename, int mmap_size, int layout = DefaultPmemLayout);
   ~MmapBufferReader();
 
-  bool ReadRecord(char *&record, int len);
+  // 第cnt条记录，只对[FlushCnt(), CommitCnt())中的记录有效。
+  // 行存时直接返回在buffer环中的位置，XPLine布局时拼成一条记录写入scratch
+  char *Record(uint64_t cnt, char *scratch);
 
   uint64_t CommitCnt() { return *commit_cnt_; }
-  char* Data() { return data_start_; }
+  uint64_t FlushCnt() { return std::min(*flush_cnt_, *commit_cnt_); }
   
  private:
   const std::string filename_;
   int mmap_size_;
+  const int layout_;
   int fd_;
-  uint64_t *commit_cnt_; // commit_cnt_ = (uint64_t *)mmap_start_ptr
-  char *data_start_; // data_start_ = (char *)mmap_start_ptr + 8
-  char *data_curr_;
+  uint64_t ring_slots_;
+  uint64_t *flush_cnt_;
+  uint64_t *commit_cnt_;
+  char *data_start_;
+};
+
+// 持久化开销统计，只由writer所在的线程更新，关闭writer时汇总到engine
+struct DurabilityStats {
+  uint64_t records = 0;
+  uint64_t flushes = 0;       // buffer刷入pmem的次数
+  uint64_t flush_ns = 0;
+  uint64_t drains = 0;        // drain(或msync)的次数
+  uint64_t commit_ns = 0;     // Append为了持久化而额外等待的总时间
+  uint64_t max_commit_ns = 0;
+  uint64_t flush_wait_ns = 0; // 后台刷入时，writer等待上一个buffer刷完的总时间
+  // 显式刷出(flush/non-temporal写入)的范围涉及的XPLine数，以及其中没有整条写满的XPLine数。
+  // pmem以XPLine为单位写介质，partial的XPLine需要读-改-写，用来估计写放大(不含cache自然换出的写入)
+  uint64_t xplines = 0;
+  uint64_t partial_xplines = 0;
+
+  void CountXPLines(const void *addr, size_t len) {
+    uintptr_t begin = reinterpret_cast<uintptr_t>(addr);
+    uintptr_t end = begin + len;
+    uint64_t lines = (end + XPLineSize - 1) / XPLineSize - begin / XPLineSize;
+    uint64_t full = end / XPLineSize > (begin + XPLineSize - 1) / XPLineSize ?
+                    end / XPLineSize - (begin + XPLineSize - 1) / XPLineSize : 0;
+    xplines += lines;
+    partial_xplines += lines - full;
+  }
+
+  void Merge(const DurabilityStats &other);
+  void Report(int durability) const;
+};
+
+class PmapBufferWriter;
+
+// leader/follower式的group commit：第一个到达的writer成为leader，
+// 等待GroupCommitWindowMicros或者攒够GroupCommitBatch个writer之后，
+// 统一flush所有writer的buffer，只drain两次(数据一次，commit_cnt一次)，然后唤醒follower。
+// 注意drain(sfence)只对本核有效，因此只有buffer中普通store写入的数据可以由leader代为持久化，
+// 刷入pmem的non-temporal store仍然由writer自己drain。
+class GroupCommitter {
+ public:
+  GroupCommitter(size_t max_batch, int window_us);
+  GroupCommitter(const GroupCommitter&) = delete;
+  GroupCommitter& operator=(const GroupCommitter&) = delete;
+
+  // 阻塞直到writer中所有已写入的记录持久化
+  void Commit(PmapBufferWriter *writer);
+
+ private:
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::vector<PmapBufferWriter *> pending_;
+  bool leader_active_;
+  const size_t max_batch_;
+  const std::chrono::microseconds window_;
+};
+
+// 后台把写满的buffer刷入pmem的线程，每个socket一个，并绑定到这个socket的cpu上。
+// writer提交到自己当前所在socket的线程，刷入时读的buffer还在本socket的cache中。
+// 每个writer同时最多只有一个buffer在刷入，所以同一个writer的buffer按顺序刷入
+class BufferFlusher {
+ public:
+  BufferFlusher();
+  ~BufferFlusher();
+  BufferFlusher(const BufferFlusher&) = delete;
+  BufferFlusher& operator=(const BufferFlusher&) = delete;
+
+  void Submit(PmapBufferWriter *writer);
+  size_t Threads() const { return workers_.size(); }
+  // 单核机器上忙等只会和writer抢cpu，flusher和等待的writer都直接让出cpu
+  bool Spin() const { return spin_; }
+
+ private:
+  struct Worker {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<PmapBufferWriter *> queue;
+    std::atomic<int> pending{0};  // queue的长度，空闲时不加锁地轮询
+    bool sleeping = false;
+    bool stop = false;
+    std::thread thread;
+  };
+  void run(Worker *worker);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<int> cpu_worker_;  // cpu -> 所在socket的worker
+  const bool spin_;
 };
 
 class PmapBufferWriter {
@@ -118,23 +743,76 @@ class PmapBufferWriter {
   PmapBufferWriter(const PmapBufferWriter&) = delete;
   PmapBufferWriter& operator=(const PmapBufferWriter&) = delete;
   
-  PmapBufferWriter(const std::string &filename, size_t pool_size);
+  // pmem按segment_size切分为多个segment(filename, filename.seg1, ...)，共用一个buffer文件，
+  // segment_size必须是PmapBufferWriterSize的整数倍。每个segment文件的最后是每个块(一次刷入的buffer)的crc。
+  // max_segments为0时segment数只受pmem剩余空间的限制。
+  // Async模式下给了flusher时，写满的buffer由flusher在后台刷入，writer接着写环中的下一个buffer。
+  // layout(PmemLayout)决定buffer和pmem中块内记录的布局，写入数据之后不能修改
+  PmapBufferWriter(const std::string &filename, size_t segment_size, size_t max_segments,
+                   int durability = DefaultDurability, GroupCommitter *committer = nullptr,
+                   BufferFlusher *flusher = nullptr, int layout = DefaultPmemLayout);
   ~PmapBufferWriter();
 
+  // 记录所在的segment在写入之前就已经分配好空间(后台刷入时不会因为空间不足失败)，
+  // 无法再分配segment时返回-1，记录没有写入
   int Append(const void* data) {
+    if (unlikely(Count() >= reserved_slots()) && !reserve_segments(1)) {
+      return -1;
+    }
+    if (durability_ != Durability::Async) {
+      return durable_append(data, 1);
+    }
+    stats_.records++;
     if (mmap_writer_->Append(data) == 0) {
       return 0;
     }
-    // flush buffer
-    pmem_memcpy(curr_, mmap_writer_->Data(), mmap_writer_->Bytes(), PMEM_F_MEM_NODRAIN|PMEM_F_MEM_NONTEMPORAL|PMEM_F_MEM_WC);
-    curr_ += mmap_writer_->Bytes();
-    mmap_writer_->Reset();
+    flush_buffer();
 
     // must success!! (ret == 0)
     mmap_writer_->Append(data);
     return 0;
   }
 
+  // 无法分配足够的segment时只写入已经分配的segment能容纳的部分，返回-1
+  int AppendBatch(const void* datas, size_t num) {
+    if (unlikely(Count() + num > reserved_slots()) && !reserve_segments(num)) {
+      size_t n = reserved_slots() - Count();
+      if (n > 0) {
+        AppendBatch(datas, n);
+      }
+      return -1;
+    }
+    if (durability_ != Durability::Async) {
+      return durable_append(datas, num);
+    }
+    stats_.records += num;
+    const char *data = reinterpret_cast<const char *>(datas);
+    while (true) {
+      size_t n = mmap_writer_->AppendBatch(data, num);
+      data += n * RecordSize;
+      num -= n;
+      if (num == 0) {
+        return 0;
+      }
+      flush_buffer();
+    }
+  }
+
+  // 等后台的刷入完成之后才返回，统计才是完整的
+  const DurabilityStats &Stats() {
+    wait_flush();
+    return stats_;
+  }
+
+  // 容量由pmem的剩余空间估计: 已经分配的segment + 剩余空间还能分配的segment
+  size_t MaxSlot() const { return (reserved_segments_ + spare_segments_) * segment_slots_; }
+  size_t FreeSlot() const { return MaxSlot() - mmap_writer_->GetCommitCnt() - uncommitted_; }
+  // 已提交的记录数(包括还在buffer中的)
+  uint64_t Count() const { return mmap_writer_->GetCommitCnt(); }
+  // 丢弃第cnt条之后的记录，之后从第cnt条开始写入。cnt小于已经刷入pmem的记录数时必须是
+  // PmapBufferRecords的整数倍(Verify总是截断到块的边界)。调用者保证没有进行中的写入
+  void Truncate(uint64_t cnt);
+
   // 对于pmem要warm整个mmap_writer_(buffer)
   void WarmUp() {
     for (size_t i = 0; i < mmap_writer_->MaxSlot(); i++) {
@@ -142,32 +820,84 @@ class PmapBufferWriter {
     }
   }
  private:
+  friend class GroupCommitter;
+  friend class BufferFlusher;
+
+  int durable_append(const void* datas, size_t num);
+  // 当前buffer写满: 交给后台刷入，或者直接刷入，然后换到下一个buffer
+  void flush_buffer();
+  // 把一个写满的buffer写入pmem并更新flush_cnt，非Async模式下写完会drain，并持久化flush_cnt
+  void flush_block(const char *block);
+  // 等待后台刷入的buffer完成
+  void wait_flush();
+  // 当前segment写满，drain之后换到下一个segment
+  void next_segment();
+  // 按flush_cnt映射下一次刷入的segment和位置
+  void open_flushed_segment();
+  size_t reserved_slots() const { return reserved_segments_ * segment_slots_; }
+  // 分配segment直到能再容纳num条记录，空间不足(或者达到max_segments_)时返回false
+  bool reserve_segments(size_t num);
+  void update_spare_segments();
+  // 刷出buffer文件中的一段/flush_cnt和commit_cnt，不drain
+  void flush_range(const char *addr, size_t len);
+  void flush_meta();
+  // group commit: 由leader调用，flush已写入未提交的记录 / 提交这些记录
+  void flush_uncommitted();
+  void commit_uncommitted();
+
   std::string buff_filename_;
   std::string pmem_filename_;
 
   MmapBufferWriter *mmap_writer_; // buffer writer
-  size_t pool_size_;
-  char *start_;
+  size_t segment_size_;
+  size_t max_segments_;  // 0表示不限制
+  size_t segment_slots_;
+  size_t segment_;  // 当前segment的编号
+  size_t reserved_segments_;  // 已经创建并分配好空间的segment数，只由写线程修改
+  size_t spare_segments_;     // 估计还能分配的segment数
+  bool is_pmem_;
+  char *start_;     // 当前segment的起始地址
   char *curr_;
+  uint32_t *crcs_;  // 当前segment中每个块(一次刷入的buffer)的crc，crcs_ = start_ + segment_size_
+
+  const int durability_;
+  GroupCommitter *committer_;
+  uint64_t uncommitted_;  // 已写入buffer但还未提交的记录数
+  bool group_done_;       // 由GroupCommitter::mtx_保护
+  BufferFlusher *flusher_;
+  // 后台刷入时，flush_src_是正在刷入的buffer，刷完之前pmem segment相关的成员只由flusher访问
+  const char *flush_src_;
+  std::atomic<bool> flushing_;
+  DurabilityStats stats_;
 };
 
 class PmapBufferReader {
  public:
-  PmapBufferReader(const std::string &filename, size_t pool_size);
+  PmapBufferReader(const std::string &filename, size_t segment_size, int layout = DefaultPmemLayout);
   ~PmapBufferReader();
 
+  uint64_t Count() { return std::min(mmap_reader_->CommitCnt(), limit_); }
+  // 校验已经刷入pmem的每个块的crc，从第一个损坏的块开始的记录(包括buffer中的)都丢弃，
+  // 返回截断后的记录数。必须在读取之前调用
+  uint64_t Verify();
+
+  // XPLine布局时record指向内部拼好的一条记录，下一次ReadRecord之前有效
   bool ReadRecord(char *&record, int len);
  private:
   std::string buff_filename_;
   std::string pmem_filename_;
 
   MmapBufferReader *mmap_reader_;
-  size_t pool_size_;
+  size_t segment_size_;
+  size_t segment_slots_;
+  const int layout_;
+  size_t segment_;
   char *start_;
-  char *curr_;
+  char scratch_[RecordSize];
 
   // when read, if have read cnt < must_have_flush_cnt_, read from pmem
   // else read from buffer (mmap_reader_)
   uint64_t must_have_flush_cnt_; 
   uint64_t read_cnt_;
+  uint64_t limit_;  // Verify之后最多读取的记录数
 };
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+// disk_dir下的MANIFEST: engine的元数据，Init和deinit根据它决定怎么恢复，不需要扫描log。
+// 格式是定长的header加上disk_counts[log_num]、pmem_counts[log_num]，整个文件由crc32c校验，
+// 先写临时文件再rename，crash时要么是完整的新文件，要么是原来的文件。
+// clean只在deinit关闭所有writer之后写入时为true，Init会立即把它改成false:
+// 运行期间crash之后log可能比记录的更长，这时的计数不能使用
+struct EngineManifest {
+  uint32_t layout_version = ManifestLayoutVersion;
+  // 决定log格式的配置，和当前的配置不同时计数无效
+  int disk_log_format = DefaultDiskLogFormat;
+  int pmem_layout = DefaultPmemLayout;
+  uint64_t disk_segment_size = DiskSegmentSize;
+  uint64_t pmem_segment_size = PmemSegmentSize;
+  int aep_share = AEPNum;        // 写aep的比例，见router.h
+  int last_phase = Phase::Hybrid;
+  bool clean = false;
+  std::vector<uint64_t> disk_counts;  // 每个ssd log的记录数
+  std::vector<uint64_t> pmem_counts;  // 每个pmem log的记录数
+
+  uint64_t RecordNum() const;
+  // clean并且log格式和config相同时，计数可以代替扫描log
+  bool Usable(const EngineConfig &config) const;
+
+  // 文件不存在或者校验失败时返回false
+  static bool Load(const std::string &path, EngineManifest *manifest);
+  // 成功返回0
+  int Save(const std::string &path) const;
+};
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "sharded_index.h"
+#include "pmem_index.h"
+
+// 按cache line分块的bloom filter: 每个key只落在一个64字节的块中，查询最多一次cache miss，
+// 可以先预取再判断。只有一个写者，读者不加锁(可能暂时看不到正在写入的key)
+class PartitionFilter {
+  public:
+    explicit PartitionFilter(size_t keys);
+    PartitionFilter(const PartitionFilter&) = delete;
+    PartitionFilter& operator=(const PartitionFilter&) = delete;
+
+    void Add(uint64_t hash);
+    bool MayContain(uint64_t hash) const {
+      const Block &block = blocks_[block_index(hash)];
+      uint64_t h = hash;
+      for (int i = 0; i < PartitionFilterHashes; i++) {
+        h = h * 0x9E3779B97F4A7C15ull + i;
+        uint32_t bit = h >> 55; // 0~511
+        if ((block.words[bit >> 6].load(std::memory_order_relaxed) & (1ull << (bit & 63))) == 0) {
+          return false;
+        }
+      }
+      return true;
+    }
+    void Prefetch(uint64_t hash) const {
+      __builtin_prefetch(&blocks_[block_index(hash)]);
+    }
+
+  private:
+    struct alignas(64) Block {
+      std::atomic<uint64_t> words[8];
+    };
+
+    size_t block_index(uint64_t hash) const { return (hash >> 32) & block_mask_; }
+
+    size_t block_mask_;
+    std::unique_ptr<Block[]> blocks_;
+};
+
+// 一个写线程独占的索引分区: 自己的记录数组、三张表和id/user_id的filter。
+// 只有一个写者(持有这个slot的写线程，或者回放/后台建索引时负责这个slot的线程)，读者不加锁
+class IndexPartition {
+  public:
+    explicit IndexPartition(size_t records);
+    IndexPartition(const IndexPartition&) = delete;
+    IndexPartition& operator=(const IndexPartition&) = delete;
+
+    void Insert(const User *user);
+
+    const RecordStore &Users() const { return users_; }
+    const PartitionFilter &IdFilter() const { return id_filter_; }
+    const PartitionFilter &UserIdFilter() const { return user_id_filter_; }
+    uint64_t FindId(uint64_t hash, int64_t id) const { return idx_id_.Find(hash, id); }
+    uint64_t FindUserId(uint64_t hash, int64_t user_id) const { return idx_user_id_.Find(hash, user_id); }
+    uint64_t FindSalary(uint64_t hash, int64_t salary) const { return idx_salary_.Find(hash, salary); }
+
+  private:
+    RecordStore users_;
+    GrowableTable idx_id_;
+    GrowableTable idx_user_id_;
+    GrowableTable idx_salary_;  // value是分区内salary链表的头
+    PartitionFilter id_filter_;
+    PartitionFilter user_id_filter_;
+};
+
+// 按写线程分区的索引。写入只修改自己的分区; 点查分两步: 先预取所有分区filter中key所在的块
+// (scatter)，再依次判断并只查可能包含key的分区(gather)，多个分区的cache miss是重叠的;
+// salary查询汇总所有分区的结果
+class PartitionedIndex {
+  public:
+    explicit PartitionedIndex(int max_partitions);
+    ~PartitionedIndex();
+    PartitionedIndex(const PartitionedIndex&) = delete;
+    PartitionedIndex& operator=(const PartitionedIndex&) = delete;
+
+    // 同一个partition同一时刻只能有一个线程写入
+    void Insert(int partition, const User *user);
+
+    template <typename F>
+    size_t FindId(int64_t id, F f) const {
+      return find_unique(id, &IndexPartition::IdFilter, &IndexPartition::FindId, f);
+    }
+
+    template <typename F>
+    size_t FindUserId(const char *user_id, F f) const {
+      return find_unique(BlizardHashWrapper(user_id, UseridLen).Hash(), &IndexPartition::UserIdFilter,
+                         &IndexPartition::FindUserId, f);
+    }
+
+    template <typename F>
+    size_t FindSalary(int64_t salary, F f) const {
+      const uint64_t hash = IndexHash(salary);
+      const int n = partition_num_.load(std::memory_order_acquire);
+      size_t cnt = 0;
+      for (int p = 0; p < n; p++) {
+        const IndexPartition *part = partitions_[p].load(std::memory_order_acquire);
+        if (part == nullptr) {
+          continue;
+        }
+        const RecordStore &users = part->Users();
+        for (uint64_t value = part->FindSalary(hash, salary); value != 0; value = users.Link(value - 1)) {
+          f(users[value - 1]);
+          cnt++;
+        }
+      }
+      return cnt;
+    }
+
+    size_t Size() const;
+
+    // 以下调用者保证没有并发的读写
+    // 每个分区预计的记录数，用于之后创建的分区
+    void Reserve(size_t records_per_partition) { records_per_partition_ = records_per_partition; }
+    void Clear();
+
+  private:
+    template <typename Filter, typename Find, typename F>
+    size_t find_unique(int64_t key, Filter filter, Find find, F f) const {
+      const uint64_t hash = IndexHash(key);
+      const int n = partition_num_.load(std::memory_order_acquire);
+      for (int p = 0; p < n; p++) {
+        const IndexPartition *part = partitions_[p].load(std::memory_order_acquire);
+        if (part != nullptr) {
+          (part->*filter)().Prefetch(hash);
+        }
+      }
+      for (int p = 0; p < n; p++) {
+        const IndexPartition *part = partitions_[p].load(std::memory_order_acquire);
+        if (part == nullptr || !(part->*filter)().MayContain(hash)) {
+          continue;
+        }
+        uint64_t value = (part->*find)(hash, key);
+        if (value != 0) {
+          f(part->Users()[value - 1]);
+          return 1;
+        }
+      }
+      return 0;
+    }
+
+    const int max_partitions_;
+    std::unique_ptr<std::atomic<IndexPartition *>[]> partitions_;  // 由这个分区的写者第一次写入时创建
+    std::atomic<int> partition_num_;  // 创建过的最大分区 + 1
+    size_t records_per_partition_;
+};
+
+// engine使用的hybrid阶段索引，按config选择ShardedIndex、PartitionedIndex或PmemIndex
+class HybridIndex {
+  public:
+    // pmem_dir是PmemPartitionedLayout的分区文件所在的目录(aep_dir)，其他布局忽略
+    HybridIndex(int layout, int max_partitions, const std::string &pmem_dir = "")
+      : sharded_(), partitioned_(), pmem_(), loader_() {
+      if (layout == IndexLayout::PmemPartitionedLayout) {
+        pmem_.reset(new PmemIndex(pmem_dir, max_partitions));
+      } else if (layout == IndexLayout::WriterPartitionedLayout) {
+        partitioned_.reset(new PartitionedIndex(max_partitions));
+      } else {
+        sharded_.reset(new ShardedIndex());
+      }
+    }
+
+    // partition是写入这条记录的slot(回放时是记录所在log的编号)，ShardedIndex忽略。
+    // pmem表示记录在这个slot的pmem log(否则是ssd log)中，只有PmemIndex用它记录每个log有多少条记录在索引中
+    void Insert(int partition, bool pmem, const User *user) {
+      if (pmem_) {
+        pmem_->Insert(partition, pmem, user);
+      } else if (partitioned_) {
+        partitioned_->Insert(partition, user);
+      } else {
+        sharded_->Insert(user);
+      }
+    }
+    // 每个partition是否只能有一个写者
+    bool SingleWriter() const { return partitioned_ != nullptr || pmem_ != nullptr; }
+    // 索引在pmem上，重启之后不需要重建
+    bool Persistent() const { return pmem_ != nullptr; }
+
+    // 回放时threads个线程并行建索引: BeginLoad之后每个线程用自己的worker(0 ~ threads-1)调用Load，
+    // 同一个partition只能由一个线程Load，全部Load完之后调用FinishLoad。期间没有读者
+    void BeginLoad(int threads) {
+      if (sharded_) {
+        loader_.reset(new ShardedIndexLoader(sharded_.get(), threads));
+      }
+    }
+    void Load(int worker, int partition, bool pmem, const User *user) {
+      if (loader_) {
+        loader_->Add(worker, user);
+      } else {
+        Insert(partition, pmem, user);
+      }
+    }
+    void FinishLoad() {
+      if (loader_) {
+        loader_->Build();
+        loader_.reset();
+      }
+    }
+
+    template <typename F>
+    size_t FindId(int64_t id, F f) const {
+      if (pmem_) {
+        return pmem_->FindId(id, f);
+      }
+      return partitioned_ ? partitioned_->FindId(id, f) : sharded_->FindId(id, f);
+    }
+    template <typename F>
+    size_t FindUserId(const char *user_id, F f) const {
+      if (pmem_) {
+        return pmem_->FindUserId(user_id, f);
+      }
+      return partitioned_ ? partitioned_->FindUserId(user_id, f) : sharded_->FindUserId(user_id, f);
+    }
+    template <typename F>
+    size_t FindSalary(int64_t salary, F f) const {
+      if (pmem_) {
+        return pmem_->FindSalary(salary, f);
+      }
+      return partitioned_ ? partitioned_->FindSalary(salary, f) : sharded_->FindSalary(salary, f);
+    }
+    size_t Size() const {
+      if (pmem_) {
+        return pmem_->Size();
+      }
+      return partitioned_ ? partitioned_->Size() : sharded_->Size();
+    }
+    // Persistent时第partition个分区包含的ssd/pmem log的记录数(log的前缀)，否则为0
+    uint64_t DiskCount(int partition) const { return pmem_ ? pmem_->DiskCount(partition) : 0; }
+    uint64_t PmemCount(int partition) const { return pmem_ ? pmem_->PmemCount(partition) : 0; }
+
+    // 以下调用者保证没有并发的读写
+    // records是预计的总记录数，partitions是预计的写线程数
+    void Reserve(size_t records, int partitions) {
+      if (pmem_) {
+        pmem_->Reserve(records / std::max(partitions, 1));
+      } else if (partitioned_) {
+        partitioned_->Reserve(records / std::max(partitions, 1));
+      } else {
+        sharded_->Reserve(records);
+      }
+    }
+    // Persistent时打开上一次留下的分区
+    void Recover() {
+      if (pmem_) {
+        pmem_->Recover();
+      }
+    }
+    // Persistent时删除一个分区(它不再是log的前缀)
+    void Drop(int partition) {
+      if (pmem_) {
+        pmem_->Drop(partition);
+      }
+    }
+    // Persistent时同时删除pmem上的分区文件
+    void Clear() {
+      if (pmem_) {
+        pmem_->Clear();
+      } else if (partitioned_) {
+        partitioned_->Clear();
+      } else {
+        sharded_->Clear();
+      }
+    }
+
+  private:
+    std::unique_ptr<ShardedIndex> sharded_;
+    std::unique_ptr<PartitionedIndex> partitioned_;
+    std::unique_ptr<PmemIndex> pmem_;
+    std::unique_ptr<ShardedIndexLoader> loader_;  // 只在ShardedIndex的并行回放期间存在
+};
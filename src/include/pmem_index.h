@@ -0,0 +1,203 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sharded_index.h"
+
+// 放在pmem上的一个索引分区(一个写线程的记录)，整个分区是一个文件，只有相对文件头的偏移，没有指针，
+// 重启之后mmap就可以直接查询。布局(每一段64字节对齐):
+// | header | records[capacity] | links[capacity] | id表[table_capacity] | user_id表[table_capacity] | salary表[table_capacity] |
+// 三张表和checkpoint一样是线性探测的hash表，项为(key, 记录位置 + 1)，value为0表示空; user_id表的key是user_id的前8字节，
+// salary表中是链表头，links中是salary相同的下一条记录的位置 + 1。
+// header中的counts是分区中来自这个slot的ssd log和pmem log的记录数(两个log的前缀)，重启时只回放之后的记录。
+// counts有两组，commit & 1是当前的一组，另一组在提交之前可以随意写。
+// 只有一个写者，读者不加锁。插入第n条记录分三步，每一步持久化之后才开始下一步:
+// 1. 写records[n]和links[n]; 2. 写三张表的项(先key，再release地写value)和另一组counts;
+// 3. 8字节原子地把commit加1，这是提交点。
+// 在2和3之间crash时，打开时撤销第n条记录在表中的项: 它是最后插入的，其他项的探测都不依赖它占的位置
+struct PmemIndexHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t crc;             // 创建之后不再修改的字段的crc32c，计算时crc、commit和counts为0
+  uint64_t file_size;
+  uint64_t capacity;        // 能放的记录数
+  uint64_t table_capacity;  // 每张表的项数，2的幂
+  uint64_t records_offset;
+  uint64_t links_offset;
+  uint64_t tables_offset;   // id、user_id、salary三张表依次存放
+  uint64_t commit;          // 提交的插入次数(扩容之后从0开始)
+  uint64_t counts[2][2];    // 两组(ssd log的记录数, pmem log的记录数)
+};
+
+class PmemIndexPartition {
+  public:
+    // 打开path，不存在时按capacity条记录创建，失败时返回nullptr。打开时撤销没有提交的插入
+    static PmemIndexPartition *Open(const std::string &path, uint64_t capacity);
+    // 扩容: 把part中的记录按顺序插入新建的path.tmp(能放capacity条记录)，持久化之后rename成path。
+    // 失败时返回nullptr，path不变
+    static PmemIndexPartition *Grow(const std::string &path, const PmemIndexPartition &part, uint64_t capacity);
+    ~PmemIndexPartition();
+    PmemIndexPartition(const PmemIndexPartition&) = delete;
+    PmemIndexPartition& operator=(const PmemIndexPartition&) = delete;
+
+    // 插入并提交一条来自ssd(pmem为false)或pmem log的记录，写满时返回false
+    bool Insert(bool pmem, const User *user);
+
+    uint64_t DiskCount() const { return count(commit() & 1, 0); }
+    uint64_t PmemCount() const { return count(commit() & 1, 1); }
+    uint64_t Size() const {
+      const uint64_t group = commit() & 1;
+      return count(group, 0) + count(group, 1);
+    }
+    uint64_t Capacity() const { return header_->capacity; }
+
+    const User &Record(uint64_t slot) const { return records_[slot]; }
+    uint64_t Link(uint64_t slot) const { return links_[slot].load(std::memory_order_relaxed); }
+    // table: 0为id，1为user_id，2为salary
+    uint64_t Find(int table, uint64_t hash, int64_t key) const {
+      const Entry *entries = tables_ + table * (mask_ + 1);
+      for (size_t i = hash & mask_;; i = (i + 1) & mask_) {
+        uint64_t value = entries[i].value.load(std::memory_order_acquire);
+        if (value == 0) {
+          return 0;
+        }
+        if (entries[i].key.load(std::memory_order_relaxed) == key) {
+          return value;
+        }
+      }
+    }
+    void Prefetch(int table, uint64_t hash) const {
+      __builtin_prefetch(&tables_[table * (mask_ + 1) + (hash & mask_)]);
+    }
+
+  private:
+    struct Entry {
+      std::atomic<int64_t> key;
+      std::atomic<uint64_t> value;
+    };
+
+    PmemIndexPartition(const std::string &path, char *base, size_t size, int is_pmem);
+
+    uint64_t commit() const { return reinterpret_cast<const std::atomic<uint64_t> *>(&header_->commit)->load(std::memory_order_acquire); }
+    // 第group组中ssd(log为0)或pmem(log为1)的记录数。写者提交两次之后读者读到的可能是写到一半的值，只用于统计
+    uint64_t count(uint64_t group, int log) const {
+      return reinterpret_cast<const std::atomic<uint64_t> *>(&header_->counts[group][log])->load(std::memory_order_relaxed);
+    }
+    // key所在或者应该插入的项
+    Entry *slot(int table, int64_t key) const;
+    // 写入第n条记录和它的salary链表
+    void write_record(uint64_t n, const User *user);
+    // 写入第n条记录在三张表中的项，flush为true时刷出写过的项(不drain)
+    void insert_entries(uint64_t n, bool flush);
+    // 撤销第Size()条记录(没有提交的插入)在表中的项
+    void rollback();
+    // 在pmem上时只flush cache line，drain时才保证持久化; 否则直接msync
+    void flush(const void *addr, size_t len) const;
+    void drain() const;
+
+    const std::string path_;
+    char *base_;
+    const size_t size_;
+    const int is_pmem_;
+    PmemIndexHeader *header_;
+    User *records_;
+    std::atomic<uint64_t> *links_;
+    Entry *tables_;
+    const size_t mask_;
+};
+
+// 按写线程分区的pmem索引，查询方式和PartitionedIndex一样(没有DRAM中的filter，重启之后不需要重建任何东西)。
+// 分区由它的写者第一次写入时创建，写满时扩容到两倍，替换下来的分区保留到Clear(读者可能还在用)
+class PmemIndex {
+  public:
+    PmemIndex(const std::string &dir, int max_partitions);
+    ~PmemIndex();
+    PmemIndex(const PmemIndex&) = delete;
+    PmemIndex& operator=(const PmemIndex&) = delete;
+
+    // 同一个partition同一时刻只能有一个线程写入
+    void Insert(int partition, bool pmem, const User *user);
+
+    template <typename F>
+    size_t FindId(int64_t id, F f) const {
+      return find_unique(0, id, f);
+    }
+    template <typename F>
+    size_t FindUserId(const char *user_id, F f) const {
+      return find_unique(1, BlizardHashWrapper(user_id, UseridLen).Hash(), f);
+    }
+    template <typename F>
+    size_t FindSalary(int64_t salary, F f) const {
+      const uint64_t hash = IndexHash(salary);
+      const int n = partition_num_.load(std::memory_order_acquire);
+      size_t cnt = 0;
+      for (int p = 0; p < n; p++) {
+        const PmemIndexPartition *part = partitions_[p].load(std::memory_order_acquire);
+        if (part == nullptr) {
+          continue;
+        }
+        for (uint64_t value = part->Find(2, hash, salary); value != 0; value = part->Link(value - 1)) {
+          f(part->Record(value - 1));
+          cnt++;
+        }
+      }
+      return cnt;
+    }
+
+    size_t Size() const;
+    // 第partition个分区包含的ssd/pmem log的记录数
+    uint64_t DiskCount(int partition) const;
+    uint64_t PmemCount(int partition) const;
+
+    // 以下调用者保证没有并发的读写
+    // 打开dir下已有的分区
+    void Recover();
+    // 删除一个分区(分区中的记录不再是log的前缀时)，之后从空的分区开始
+    void Drop(int partition);
+    // 每个分区预计的记录数，用于之后创建的分区
+    void Reserve(size_t records_per_partition) { records_per_partition_ = records_per_partition; }
+    // 删除所有分区
+    void Clear();
+
+  private:
+    template <typename F>
+    size_t find_unique(int table, int64_t key, F f) const {
+      const uint64_t hash = IndexHash(key);
+      const int n = partition_num_.load(std::memory_order_acquire);
+      // 先预取所有分区中key所在的项，多个分区的cache miss是重叠的
+      for (int p = 0; p < n; p++) {
+        const PmemIndexPartition *part = partitions_[p].load(std::memory_order_acquire);
+        if (part != nullptr) {
+          part->Prefetch(table, hash);
+        }
+      }
+      for (int p = 0; p < n; p++) {
+        const PmemIndexPartition *part = partitions_[p].load(std::memory_order_acquire);
+        if (part == nullptr) {
+          continue;
+        }
+        uint64_t value = part->Find(table, hash, key);
+        if (value != 0) {
+          f(part->Record(value - 1));
+          return 1;
+        }
+      }
+      return 0;
+    }
+
+    std::string path(int partition) const;
+    void publish(int partition, PmemIndexPartition *part);
+
+    const std::string dir_;
+    const int max_partitions_;
+    std::unique_ptr<std::atomic<PmemIndexPartition *>[]> partitions_;
+    std::atomic<int> partition_num_;  // 创建过的最大分区 + 1
+    size_t records_per_partition_;
+    std::mutex retired_mtx_;
+    std::vector<PmemIndexPartition *> retired_;  // 扩容替换下来的分区
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include "slot_registry.h"
+
+// phase切换时的静默点。每个线程的读写操作用Enter/Exit包住，计数在线程自己的cache line上:
+// 切换的线程先关闭入口，再等到所有已经进入的操作都离开(通常是微秒级)，此后直到打开入口
+// 都没有进行中的读写; 入口关闭期间新来的操作阻塞在Enter中，打开时被唤醒。
+// Enter先增加计数再检查入口，Close先关闭入口再检查计数(都是seq_cst)，
+// 所以两者同时发生时要么Enter看到入口关闭，要么Drain看到计数，不会漏掉进行中的操作
+class QuiescenceGate {
+  public:
+    explicit QuiescenceGate(int capacity);
+    QuiescenceGate(const QuiescenceGate&) = delete;
+    QuiescenceGate& operator=(const QuiescenceGate&) = delete;
+
+    // 入口关闭时阻塞到重新打开。不能嵌套: 已经进入的线程再次Enter时只退还内层的计数，
+    // 外层的计数让Drain永远等不到静默，而阻塞在Enter中的自己又等着Drain之后的Open
+    void Enter();
+    void Exit();
+
+    // 关闭入口，只有一个线程能成功; 返回false表示别的线程正在切换
+    bool TryClose();
+    // 等待所有已经进入的操作离开，调用者自己不能在Enter和Exit之间
+    void Drain();
+    // 打开入口并唤醒阻塞的线程
+    void Open();
+
+  private:
+    struct alignas(64) Slot {
+      std::atomic<int64_t> active;
+    };
+
+    Slot &slot();
+
+    const int capacity_;
+    // 最后一个slot由租不到slot的线程共用
+    std::unique_ptr<Slot[]> slots_;
+    std::shared_ptr<SlotRegistry> registry_;
+    std::atomic<bool> closed_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+};
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include "def.h"
+
+// 连续num条定长记录(RecordSize字节)的拷贝，进程启动时根据CPUID选择kernel
+// CopyRecords: 普通store，用于写入之后马上还会读的目标(比如pmem的buffer)
+// StreamRecords: non-temporal store，结束时sfence，用于写入之后不会再读的page cache/pmem，
+//   不污染cache，也不需要先把目标cache line读进来。dst必须16字节对齐
+typedef void (*RecordCopyFn)(char *dst, const char *src, size_t num);
+
+extern RecordCopyFn CopyRecords;
+extern RecordCopyFn StreamRecords;
+
+// CPU支持的最宽的kernel
+int BestRecordCopyKernel();
+// 切换kernel(测试/benchmark用)，CPU不支持时返回-1
+int SetRecordCopyKernel(int kernel);
+int CurrentRecordCopyKernel();
+const char *RecordCopyKernelName(int kernel);
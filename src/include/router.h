@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include "def.h"
+
+// 在ssd和aep之间分配写入：每RouteWindow次写入中前aep_share_次写aep，其余写ssd。
+// 写线程随机抽样一部分写入的耗时(包含了pmem buffer刷盘、mmap缺页等摊还开销)，
+// 累计到一定数量之后按照两个设备的吞吐重新计算比例；设备越满，越按照剩余容量的比例分配，
+// 这样容量不同的设备会同时写满。比例在正常关闭时保存在disk_dir中(MANIFEST也记录一份)，重启之后沿用;
+// 重新计算发生在写线程上，不写文件。
+class WriteRouter {
+  public:
+    WriteRouter();
+    WriteRouter(const WriteRouter&) = delete;
+    WriteRouter& operator=(const WriteRouter&) = delete;
+
+    // 加载上一次保存的比例，文件不存在时使用default_share
+    void Load(const std::string &path, int default_share);
+    // 只在没有写入时调用(deinit)，会fsync
+    int Save() const;
+
+    bool IsWriteAEP(uint64_t write_cnt) const {
+      return static_cast<int>(write_cnt % RouteWindow) < aep_share_.load(std::memory_order_relaxed);
+    }
+
+    // 从write_cnt开始，连续写到同一个设备的记录数
+    size_t RunLength(uint64_t write_cnt) const {
+      int pos = write_cnt % RouteWindow;
+      int share = aep_share_.load(std::memory_order_relaxed);
+      return pos < share ? share - pos : RouteWindow - pos;
+    }
+
+    // 每个线程平均每RouteSampleInterval次写入抽样一次，间隔随机避免和buffer刷盘周期对齐
+    bool ShouldSample() {
+      static thread_local uint32_t countdown = 0;
+      static thread_local uint32_t seed = 0x9E3779B9u ^ reinterpret_cast<uintptr_t>(&countdown);
+      if (likely(countdown-- != 0)) {
+        return false;
+      }
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      countdown = seed % (2 * RouteSampleInterval);
+      return true;
+    }
+
+    // 记录一次抽样: 写入设备、耗时、记录数，以及本线程两个设备writer的剩余/总容量(记录数)
+    void Sample(bool aep, uint64_t ns, uint64_t records,
+                uint64_t aep_free, uint64_t aep_capacity,
+                uint64_t ssd_free, uint64_t ssd_capacity);
+
+    int AEPShare() const { return aep_share_.load(std::memory_order_relaxed); }
+
+  private:
+    void rebalance();
+
+    std::string path_;
+    std::atomic<int> aep_share_;
+    std::atomic<bool> rebalancing_;
+    // 下标0: ssd, 1: aep
+    std::atomic<uint64_t> sample_ns_[2];
+    std::atomic<uint64_t> sample_records_[2];
+    std::atomic<uint64_t> free_[2];
+    std::atomic<uint64_t> capacity_[2];
+};
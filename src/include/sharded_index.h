@@ -0,0 +1,268 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "user.h"
+#include "def.h"
+
+// 只追加的记录数组，按(1 << RecordChunkBits)条分块分配，块一旦分配地址就不再变化，
+// 因此多个线程可以并发Append，并发读取已经Append的记录也不会碰到扩容。
+// 每条记录带一个link，由索引用来把salary相同的记录串起来
+class RecordStore {
+  public:
+    RecordStore();
+    ~RecordStore();
+    RecordStore(const RecordStore&) = delete;
+    RecordStore& operator=(const RecordStore&) = delete;
+
+    // 返回记录的位置
+    size_t Append(const User &user);
+    // 连续追加n条记录，返回第一条的位置
+    size_t AppendBatch(const User *users, size_t n);
+    // 只能读取已经Append完成的位置，由调用者通过索引保证可见性
+    const User &operator[](size_t slot) const { return record(slot).user; }
+    uint64_t Link(size_t slot) const { return record(slot).link; }
+    void SetLink(size_t slot, uint64_t link) { record(slot).link = link; }
+    size_t Size() const { return size_.load(std::memory_order_acquire); }
+
+    // 以下调用者保证没有并发的读写
+    // 预先分配能放下n条记录的块，避免写入时分配
+    void Reserve(size_t n);
+    // 清空并释放所有的块
+    void Clear();
+
+  private:
+    struct Record {
+      User user;
+      uint64_t link;
+    };
+
+    Record &record(size_t slot) const {
+      return chunks_[slot >> RecordChunkBits].load(std::memory_order_acquire)[slot & ((1 << RecordChunkBits) - 1)];
+    }
+    Record *chunk(size_t index);
+
+    std::atomic<size_t> size_;
+    std::unique_ptr<std::atomic<Record *>[]> chunks_; // 长度为MaxRecordChunks，还没有分配的为nullptr
+};
+
+// 索引key的hash: 高位选shard，低位作为SlotTable中的位置
+inline uint64_t IndexHash(int64_t key) {
+  uint64_t h = static_cast<uint64_t>(key);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+// 只插入不删除的开放寻址hash表(线性探测)，key为int64，value为记录位置 + 1(0表示空)。
+// 所有项都是atomic，写入时先写key再release地写value，所以读者不加锁也不会读到不完整的项;
+// 扩容时整张表复制到新表，旧表保留到Clear，读者拿着旧表也不会访问已经释放的内存
+class SlotTable {
+  public:
+    // capacity必须是2的幂
+    explicit SlotTable(size_t capacity);
+    SlotTable(const SlotTable&) = delete;
+    SlotTable& operator=(const SlotTable&) = delete;
+
+    uint64_t Find(uint64_t hash, int64_t key) const {
+      for (size_t i = hash & mask_;; i = (i + 1) & mask_) {
+        uint64_t value = entries_[i].value.load(std::memory_order_acquire);
+        if (value == 0) {
+          return 0;
+        }
+        if (entries_[i].key.load(std::memory_order_relaxed) == key) {
+          return value;
+        }
+      }
+    }
+    // 以下只由持有shard写锁的线程调用
+    // key已经存在时: overwrite为true则覆盖value，否则保留原来的value。返回原来的value(没有为0)
+    uint64_t Insert(uint64_t hash, int64_t key, uint64_t value, bool overwrite);
+    bool Full() const { return (size_ + 1) * 4 > (mask_ + 1) * 3; }
+    // 原地清空，并发的读者可能读到清空了一半的表，由调用者检测并丢弃
+    void Reset();
+    // 按新的容量(2的幂)复制一张表
+    SlotTable *Grow(size_t capacity) const;
+    size_t Capacity() const { return mask_ + 1; }
+
+  private:
+    struct Entry {
+      std::atomic<int64_t> key;
+      std::atomic<uint64_t> value;
+    };
+
+    const size_t mask_;
+    size_t size_;
+    std::unique_ptr<Entry[]> entries_;
+};
+
+// 会扩容的SlotTable: 只有一个写者(由调用者保证互斥)，读者不加锁。
+// 写满3/4时复制到两倍大小的新表，替换下来的旧表保留到Clear
+class GrowableTable {
+  public:
+    GrowableTable();
+    ~GrowableTable();
+    GrowableTable(const GrowableTable&) = delete;
+    GrowableTable& operator=(const GrowableTable&) = delete;
+
+    uint64_t Find(uint64_t hash, int64_t key) const {
+      return table_.load(std::memory_order_acquire)->Find(hash, key);
+    }
+    // 见SlotTable::Insert
+    uint64_t Insert(uint64_t hash, int64_t key, uint64_t value, bool overwrite);
+
+    // 以下调用者保证没有并发的读写
+    // 插入n个key之前不再扩容
+    void Reserve(size_t n);
+    void Clear();
+
+  private:
+    std::atomic<SlotTable *> table_;
+    std::vector<SlotTable *> retired_;
+};
+
+// 按key的hash分成(1 << IndexShardBits)个shard，每个shard一个seqlock和一张SlotTable。
+// 写者用CAS把版本号改成奇数来互斥，修改完再加1; 读者不写任何共享的cache line:
+// 记下版本号，查表，再检查版本号没有变化(否则重试)，只和同一个shard上并发的写冲突
+class SeqShards {
+  public:
+    SeqShards();
+    SeqShards(const SeqShards&) = delete;
+    SeqShards& operator=(const SeqShards&) = delete;
+
+    // 返回value(记录位置 + 1)，没有找到返回0
+    uint64_t Find(int64_t key) const;
+    // 见SlotTable::Insert
+    uint64_t Insert(int64_t key, uint64_t value, bool overwrite);
+    // 不加锁地插入，调用者保证没有并发的读者，并且同一个shard只有一个写者(并行回放时按shard分工)
+    uint64_t InsertUnlocked(uint64_t hash, int64_t key, uint64_t value, bool overwrite) {
+      return shards_[ShardOf(hash)].table.Insert(hash, key, value, overwrite);
+    }
+    // 在写锁中插入，插入之前调用before(原来的value)，用来在读者可见之前准备好记录的link
+    template <typename Before>
+    void Upsert(int64_t key, uint64_t value, Before before) {
+      uint64_t hash = IndexHash(key);
+      Shard &s = shards_[ShardOf(hash)];
+      lock(s);
+      before(s.table.Find(hash, key));
+      s.table.Insert(hash, key, value, true);
+      unlock(s);
+    }
+
+    // 以下调用者保证没有并发的读写
+    void Reserve(size_t n);
+    void Clear();
+
+    static int ShardOf(uint64_t hash) { return hash >> (64 - IndexShardBits); }
+
+  private:
+    struct alignas(64) Shard {
+      std::atomic<uint64_t> seq;
+      GrowableTable table;  // 写者持有seq的写锁
+    };
+
+    static void lock(Shard &s);
+    static void unlock(Shard &s);
+
+    std::unique_ptr<Shard[]> shards_;
+};
+
+// hybrid阶段的三个索引和记录本身，所有读写都是并发安全的，不需要engine的全局锁，读者不加锁。
+// 插入时先写记录，再依次插入三个索引，所以同一条记录可能短暂地只能从一部分索引查到，
+// 但查到的记录一定是完整的。salary相同的记录通过RecordStore的link串成链表(后写入的在前)，
+// 索引中只保存链表头，链表中已有的link不再修改
+class ShardedIndex {
+  public:
+    ShardedIndex() = default;
+    ShardedIndex(const ShardedIndex&) = delete;
+    ShardedIndex& operator=(const ShardedIndex&) = delete;
+
+    void Insert(const User *user);
+
+    // 对每条匹配的记录调用f(const User &)，返回匹配的记录数
+    template <typename F>
+    size_t FindId(int64_t id, F f) const {
+      uint64_t value = idx_id_.Find(id);
+      if (value == 0) {
+        return 0;
+      }
+      f(users_[value - 1]);
+      return 1;
+    }
+
+    template <typename F>
+    size_t FindUserId(const char *user_id, F f) const {
+      uint64_t value = idx_user_id_.Find(BlizardHashWrapper(user_id, UseridLen).Hash());
+      if (value == 0) {
+        return 0;
+      }
+      f(users_[value - 1]);
+      return 1;
+    }
+
+    template <typename F>
+    size_t FindSalary(int64_t salary, F f) const {
+      size_t n = 0;
+      for (uint64_t value = idx_salary_.Find(salary); value != 0; value = users_.Link(value - 1)) {
+        f(users_[value - 1]);
+        n++;
+      }
+      return n;
+    }
+
+    size_t Size() const { return users_.Size(); }
+
+    // 以下调用者保证没有并发的读写
+    void Reserve(size_t n);
+    // 清空并释放内存
+    void Clear();
+
+  private:
+    friend class ShardedIndexLoader;
+
+    RecordStore users_;
+    SeqShards idx_id_;
+    SeqShards idx_user_id_;  // key是user_id的前8字节，和BlizardHashWrapper相同
+    SeqShards idx_salary_;   // value是salary链表的头
+};
+
+// 回放时多个线程并行地建ShardedIndex，期间没有读者。分两步:
+// 1. 每个扫描线程把记录成批追加到RecordStore，并把三个索引的(key, 位置)按key所在的shard分到自己的桶中;
+// 2. Build时每个线程负责一部分shard，把所有扫描线程对应桶中的key插入这些shard。
+// 一个shard只有一个线程写，不需要加锁，也没有线程之间的cache line竞争
+class ShardedIndexLoader {
+  public:
+    // threads是扫描线程数，也是Build的线程数
+    ShardedIndexLoader(ShardedIndex *index, int threads);
+    ShardedIndexLoader(const ShardedIndexLoader&) = delete;
+    ShardedIndexLoader& operator=(const ShardedIndexLoader&) = delete;
+
+    // 第worker个扫描线程调用，不同的worker可以并发
+    void Add(int worker, const User *user);
+    // 所有扫描线程结束之后调用
+    void Build();
+
+  private:
+    struct Entry {
+      int64_t key;
+      uint64_t value;  // 记录位置 + 1
+    };
+    // 每个扫描线程的缓冲区和桶，按cache line对齐避免和别的线程共享
+    struct alignas(64) Worker {
+      std::vector<User> pending;  // 还没有追加到RecordStore的记录
+      std::vector<Entry> buckets[3][1 << IndexShardBits];  // id/user_id/salary, shard
+    };
+
+    void flush(Worker &w);
+    void build_shard(int shard);
+
+    ShardedIndex *index_;
+    const int threads_;
+    std::unique_ptr<Worker[]> workers_;
+};
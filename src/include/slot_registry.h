@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include "def.h"
+
+// 写线程和writer slot的登记表。每个写线程第一次写入时无锁地租用一个空闲slot(下标最小的优先)，
+// 独占这个slot对应的一组writer，线程退出时归还，之后新的线程可以复用，
+// 因此任意数量的线程(包括不断创建/销毁线程的线程池)都不会共用同一个writer。
+class SlotRegistry {
+  public:
+    explicit SlotRegistry(int capacity);
+    SlotRegistry(const SlotRegistry&) = delete;
+    SlotRegistry& operator=(const SlotRegistry&) = delete;
+
+    // 返回租到的slot，所有slot都被占用时返回-1
+    int Acquire();
+    void Release(int slot);
+
+    // 曾经被租用过的最大slot + 1
+    int HighWater() const { return high_water_.load(std::memory_order_acquire); }
+    int Capacity() const { return capacity_; }
+
+  private:
+    const int capacity_;
+    std::unique_ptr<std::atomic<bool>[]> used_;
+    std::atomic<int> high_water_;
+};
+
+// 线程持有的租约(thread_local)，线程退出时析构并归还slot。
+// 租约共享登记表的所有权，所以engine先于线程销毁时归还也是安全的
+class SlotLease {
+  public:
+    SlotLease() : registry_(), slot_(-1) {}
+    ~SlotLease() { Reset(); }
+    SlotLease(const SlotLease&) = delete;
+    SlotLease& operator=(const SlotLease&) = delete;
+
+    // 从registry租用一个slot，之前持有的slot先归还
+    int Acquire(const std::shared_ptr<SlotRegistry> &registry);
+    void Reset();
+
+    bool HeldBy(const SlotRegistry *registry) const { return registry_.get() == registry; }
+    int Slot() const { return slot_; }
+
+  private:
+    std::shared_ptr<SlotRegistry> registry_;
+    int slot_;
+};
@@ -0,0 +1,254 @@
+#include "indexer.h"
+
+#include <chrono>
+
+#include "spdlog/spdlog.h"
+
+// delta表的hash表按2倍记录数分配，永远不会满
+static size_t delta_table_capacity() {
+  size_t capacity = 1;
+  while (capacity < (size_t)DeltaTableRecords * 2) {
+    capacity <<= 1;
+  }
+  return capacity;
+}
+
+DeltaTable::DeltaTable()
+  : gen_(0), size_(0), merged_(0), records_(new User[DeltaTableRecords])
+  , link_(new std::atomic<uint32_t>[DeltaTableRecords]), idx_id_(delta_table_capacity())
+  , idx_user_id_(delta_table_capacity()), idx_salary_(delta_table_capacity()) {
+  for (int i = 0; i < DeltaTableRecords; i++) {
+    link_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+bool DeltaTable::Append(const User *user) {
+  // 和清空同步: 看到size为0时清空已经完成
+  uint32_t i = size_.load(std::memory_order_acquire);
+  if (unlikely(i == DeltaTableRecords)) {
+    return false;
+  }
+  records_[i] = *user;
+  uint64_t hash = IndexHash(user->id);
+  idx_id_.Insert(hash, user->id, i + 1, false);
+  int64_t user_id = BlizardHashWrapper(user->user_id, UseridLen).Hash();
+  idx_user_id_.Insert(IndexHash(user_id), user_id, i + 1, false);
+  hash = IndexHash(user->salary);
+  link_[i].store(idx_salary_.Find(hash, user->salary), std::memory_order_relaxed);
+  idx_salary_.Insert(hash, user->salary, i + 1, true);
+  size_.store(i + 1, std::memory_order_release);
+  return true;
+}
+
+void DeltaTable::Reset() {
+  gen_.store(gen_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  // gen变成奇数之后才能修改表
+  std::atomic_thread_fence(std::memory_order_release);
+  idx_id_.Reset();
+  idx_user_id_.Reset();
+  idx_salary_.Reset();
+  merged_.store(0, std::memory_order_relaxed);
+  gen_.store(gen_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  size_.store(0, std::memory_order_release);
+}
+
+bool DeltaTable::find_unique(const SlotTable &table, uint64_t hash, int64_t key, User *out) const {
+  uint64_t gen = gen_.load(std::memory_order_acquire);
+  if (gen & 1) {
+    return false;
+  }
+  uint64_t value = table.Find(hash, key);
+  if (value == 0) {
+    return false;
+  }
+  *out = records_[value - 1];
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return gen_.load(std::memory_order_relaxed) == gen;
+}
+
+BackgroundIndexer::BackgroundIndexer(HybridIndex *index, int max_slots, int threads)
+  : index_(index), max_slots_(max_slots), threads_(threads), deltas_(new std::atomic<SlotDelta *>[max_slots])
+  , slot_num_(0), workers_(), stop_(false), indexed_(0) {
+  for (int i = 0; i < max_slots_; i++) {
+    deltas_[i].store(nullptr, std::memory_order_relaxed);
+  }
+  for (int i = 0; i < threads_; i++) {
+    workers_.emplace_back(&BackgroundIndexer::run, this, i);
+  }
+  spdlog::info("[BackgroundIndexer] start {} threads", threads);
+}
+
+BackgroundIndexer::~BackgroundIndexer() {
+  if (!workers_.empty()) {
+    Finish();
+  }
+  for (int i = 0; i < max_slots_; i++) {
+    delete deltas_[i].load(std::memory_order_relaxed);
+  }
+}
+
+SlotDelta *BackgroundIndexer::delta(int slot) {
+  SlotDelta *d = deltas_[slot].load(std::memory_order_acquire);
+  if (unlikely(d == nullptr)) {
+    // 只有持有slot的写线程会创建，不会有竞争
+    d = new SlotDelta();
+    deltas_[slot].store(d, std::memory_order_release);
+    int num = slot_num_.load(std::memory_order_relaxed);
+    while (num < slot + 1 && !slot_num_.compare_exchange_weak(num, slot + 1, std::memory_order_release)) {
+    }
+  }
+  return d;
+}
+
+void BackgroundIndexer::Add(int slot, const User *user) {
+  SlotDelta *d = delta(slot);
+  const int active = d->active.load(std::memory_order_relaxed);
+  if (likely(d->tables[active].Append(user))) {
+    return;
+  }
+  // 当前的表写满了，换到下一张表; 它还没有清空时说明后台线程没跟上
+  const int next = (active + 1) % DeltaTables;
+  DeltaTable &t = d->tables[next];
+  if (unlikely(t.Size() != 0)) {
+    // 不能绕过delta表直接插入索引: 前面的表里可能还有同一个id的记录没有合并，
+    // 插入索引的顺序必须和写入的顺序一致，等后台线程清空最老的一张表
+    d->overflow++;
+    while (t.Size() != 0) {
+      std::this_thread::yield();
+    }
+  }
+  d->active.store(next, std::memory_order_release);
+  t.Append(user);
+}
+
+size_t BackgroundIndexer::merge_slot(int slot, SlotDelta *d, size_t max) {
+  const int active = d->active.load(std::memory_order_acquire);
+  size_t n = 0;
+  // 从最老的表开始，写线程正在写入的表最后合并
+  for (int i = 1; i <= DeltaTables && n < max; i++) {
+    const int table = (active + i) % DeltaTables;
+    DeltaTable &t = d->tables[table];
+    const bool reset = table != active && t.Size() == DeltaTableRecords;
+    if (t.Merged() == t.Size() && !(reset && t.Drained())) {
+      continue;
+    }
+    // 只有这个线程修改seq
+    d->seq.store(d->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    n += t.Merge(max - n, [this, slot](const User *user) { index_->Insert(slot, false, user); });
+    if (reset && t.Drained()) {
+      t.Reset();
+    }
+    d->seq.store(d->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+  return n;
+}
+
+void BackgroundIndexer::run(int id) {
+  while (!stop_.load(std::memory_order_acquire)) {
+    uint64_t n = 0;
+    for (int slot = id; slot < max_slots_; slot += threads_) {
+      SlotDelta *d = deltas_[slot].load(std::memory_order_acquire);
+      if (d != nullptr) {
+        n += merge_slot(slot, d, IndexerBatch);
+      }
+    }
+    if (n == 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(IndexerIdleMicros));
+    } else {
+      indexed_.fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+}
+
+uint64_t BackgroundIndexer::Finish() {
+  stop_.store(true, std::memory_order_release);
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+  uint64_t rest = 0, overflow = 0;
+  for (int slot = 0; slot < max_slots_; slot++) {
+    SlotDelta *d = deltas_[slot].load(std::memory_order_acquire);
+    if (d != nullptr) {
+      while (size_t n = merge_slot(slot, d, DeltaTableRecords * DeltaTables)) {
+        rest += n;
+      }
+      overflow += d->overflow;
+      d->overflow = 0;
+    }
+  }
+  spdlog::info("[BackgroundIndexer] background indexed {} records, delta tables full {} times, catch up {} records",
+               indexed_.exchange(0), overflow, rest);
+  return rest;
+}
+
+bool BackgroundIndexer::find_delta(uint64_t hash, int64_t key, DeltaFind find, User *out) const {
+  const int n = slot_num_.load(std::memory_order_acquire);
+  for (int slot = 0; slot < n; slot++) {
+    const SlotDelta *d = deltas_[slot].load(std::memory_order_acquire);
+    if (d == nullptr) {
+      continue;
+    }
+    for (const DeltaTable &t : d->tables) {
+      // 先读merged再读size: 两者相等时表中的记录都已经在索引中
+      if (t.Merged() < t.Size() && (t.*find)(hash, key, out)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+const std::vector<User> &BackgroundIndexer::collect_salary(int64_t salary) const {
+  static thread_local std::vector<User> found;
+  static thread_local std::vector<uint64_t> seqs;  // 没有delta的slot为1
+  const uint64_t hash = IndexHash(salary);
+  auto push = [](const User &user) { found.push_back(user); };
+  int spins = 0;
+  while (true) {
+    // 1. 记下每个slot的seq(等到没有进行中的合并)
+    const int n = slot_num_.load(std::memory_order_acquire);
+    seqs.assign(n, 1);
+    for (int slot = 0; slot < n; slot++) {
+      const SlotDelta *d = deltas_[slot].load(std::memory_order_acquire);
+      if (d == nullptr) {
+        continue;
+      }
+      uint64_t seq = d->seq.load(std::memory_order_acquire);
+      while (seq & 1) {
+        std::this_thread::yield();
+        seq = d->seq.load(std::memory_order_acquire);
+      }
+      seqs[slot] = seq;
+    }
+    // 2. 索引中的记录，和每张表中merged之后的记录，两者没有重复
+    found.clear();
+    index_->FindSalary(salary, push);
+    for (int slot = 0; slot < n; slot++) {
+      if (seqs[slot] == 1) {
+        continue;
+      }
+      for (const DeltaTable &t : deltas_[slot].load(std::memory_order_relaxed)->tables) {
+        uint32_t merged = t.Merged();
+        if (merged < t.Size()) {
+          t.FindSalary(hash, salary, merged, push);
+        }
+      }
+    }
+    // 3. 期间没有合并过才成立，否则重试
+    std::atomic_thread_fence(std::memory_order_acquire);
+    bool stable = true;
+    for (int slot = 0; slot < n && stable; slot++) {
+      if (seqs[slot] != 1) {
+        stable = deltas_[slot].load(std::memory_order_relaxed)->seq.load(std::memory_order_relaxed) == seqs[slot];
+      }
+    }
+    if (stable) {
+      return found;
+    }
+    if (++spins > 64) {
+      std::this_thread::yield();
+    }
+  }
+}
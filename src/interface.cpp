@@ -14,6 +14,12 @@ void engine_write( void *ctx, const void *data, size_t len) {
     spdlog::debug("[engine_write] [id: {:08d}]", user.id);
  }
 
+void engine_write_batch( void *ctx, const void *datas, size_t num) {
+    for (size_t i = 0; i < num; i++) {
+        engine_write(ctx, (const char *)datas + i * sizeof(User), sizeof(User));
+    }
+}
+
 size_t engine_read( void *ctx, int32_t select_column,
     int32_t where_column, const void *column_key, size_t column_key_len, void *res) {
     spdlog::debug("[engine_read] [select_column:{0:d}] [where_column:{1:d}] [column_key_len:{2:d}]", select_column, where_column, column_key_len);
@@ -0,0 +1,134 @@
+#include "io_ring.h"
+
+#include <string.h>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "spdlog/spdlog.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+IoRing::IoRing(unsigned entries)
+    : ring_fd_(-1), entries_(entries), in_flight_(0), done_()
+    , sq_ptr_(MAP_FAILED), sq_size_(0), cq_ptr_(MAP_FAILED), cq_size_(0), sqes_ptr_(MAP_FAILED), sqes_size_(0)
+    , sq_tail_(nullptr), sq_mask_(nullptr), sq_array_(nullptr)
+    , cq_head_(nullptr), cq_tail_(nullptr), cq_mask_(nullptr), cqes_(nullptr) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = io_uring_setup(entries, &p);
+  if (fd < 0) {
+    spdlog::warn("[IoRing] io_uring_setup failed ({}), fall back to pwrite", strerror(errno));
+    return;
+  }
+  sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+  }
+  sq_ptr_ = mmap(NULL, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr_ = sq_ptr_;
+  } else if (sq_ptr_ != MAP_FAILED) {
+    cq_ptr_ = mmap(NULL, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+  sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ptr_ = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED || sqes_ptr_ == MAP_FAILED) {
+    spdlog::error("[IoRing] mmap io_uring failed, errno is {}", strerror(errno));
+    exit(1);
+  }
+  char *sq = reinterpret_cast<char *>(sq_ptr_);
+  char *cq = reinterpret_cast<char *>(cq_ptr_);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+  cqes_ = cq + p.cq_off.cqes;
+  entries_ = p.sq_entries;
+  ring_fd_ = fd;
+}
+
+IoRing::~IoRing() {
+  // 调用者负责在析构之前等待所有请求完成
+  while (in_flight_ > 0) {
+    collect(true);
+  }
+  if (ring_fd_ < 0) {
+    return;
+  }
+  munmap(sqes_ptr_, sqes_size_);
+  if (cq_ptr_ != sq_ptr_) {
+    munmap(cq_ptr_, cq_size_);
+  }
+  munmap(sq_ptr_, sq_size_);
+  close(ring_fd_);
+}
+
+void IoRing::Write(int fd, const void *buf, size_t len, off_t offset, uint64_t user_data) {
+  if (ring_fd_ < 0) {
+    ssize_t ret = pwrite(fd, buf, len, offset);
+    done_.emplace_back(user_data, ret < 0 ? -errno : static_cast<int>(ret));
+    return;
+  }
+  // 提交队列和完成队列都不能溢出: 同时在进行中的请求不超过entries_
+  while (in_flight_ >= entries_) {
+    collect(true);
+  }
+  unsigned tail = *sq_tail_;
+  unsigned index = tail & *sq_mask_;
+  struct io_uring_sqe *sqe = reinterpret_cast<struct io_uring_sqe *>(sqes_ptr_) + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = static_cast<uint32_t>(len);
+  sqe->off = static_cast<uint64_t>(offset);
+  sqe->user_data = user_data;
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  int ret;
+  do {
+    ret = io_uring_enter(ring_fd_, 1, 0, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret != 1) {
+    spdlog::error("[IoRing] io_uring_enter submit failed, ret {}, errno is {}", ret, strerror(errno));
+    exit(1);
+  }
+  in_flight_++;
+}
+
+void IoRing::collect(bool wait) {
+  if (ring_fd_ < 0 || in_flight_ == 0) {
+    return;
+  }
+  while (true) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const struct io_uring_cqe *cqe = reinterpret_cast<const struct io_uring_cqe *>(cqes_) + (head & *cq_mask_);
+      done_.emplace_back(cqe->user_data, cqe->res);
+      in_flight_--;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    if (!wait || !done_.empty()) {
+      return;
+    }
+    int ret = io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS);
+    if (ret < 0 && errno != EINTR) {
+      spdlog::error("[IoRing] io_uring_enter wait failed, errno is {}", strerror(errno));
+      exit(1);
+    }
+  }
+}
@@ -1,57 +1,155 @@
 #include <functional>
+#include <algorithm>
 #include <sys/mman.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "spdlog/spdlog.h"
 #include "log.h"
 #include "util.h"
 
 //--------------------- mmap file-----------------------------------
+// 已提交的记录总是一个前缀[0, cnt)，也就是说committed(slot)是单调的，因此不需要从头扫描:
+// 已知lo之前的记录都已提交，从lo开始按1,2,4...的步长往后探测，找到未提交的slot之后在最后一段中二分。
+// lo正好是结尾时只需要一次探测，返回cnt
+template <typename Committed>
+static uint64_t search_committed(uint64_t lo, uint64_t max_slot, Committed committed) {
+  uint64_t hi = lo;
+  uint64_t step = 1;
+  while (hi < max_slot && committed(hi)) {
+    lo = hi + 1;
+    hi = lo + step;
+    step *= 2;
+  }
+  hi = std::min(hi, max_slot);
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (committed(mid)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// 行存的记录数: 第slot条记录提交 <=> 下一个slot的第一个word不为0。
+// 文件头中的tail只是提示(crash时可能没有写回)，验证通过时从tail开始找，否则从头二分
+static uint64_t mmap_log_count(const char *data_start, uint64_t max_slot, uint64_t tail) {
+  auto committed = [data_start](uint64_t slot) {
+    return *(const uint64_t *)(data_start + (slot + 1) * RecordSize) != 0;
+  };
+  if (tail > max_slot || (tail > 0 && !committed(tail - 1))) {
+    spdlog::warn("[MmapLog] invalid tail {} in header, search from start", tail);
+    tail = 0;
+  }
+  return search_committed(tail, max_slot, committed);
+}
+
+// 行存文件的大小: 文件头 + 数据(mmap_size，包括最后的commit标记) + 每块一个crc
+static size_t mmap_log_file_size(int mmap_size) {
+  size_t blocks = ((mmap_size - 8) / RecordSize + CrcBlockRecords - 1) / CrcBlockRecords;
+  return MmapHeaderSize + mmap_size + blocks * sizeof(uint32_t);
+}
+
+// path所在文件系统中非特权用户还可以使用的字节数，statvfs失败时返回0
+static uint64_t available_bytes(const std::string &path) {
+  struct statvfs st;
+  if (statvfs(path.c_str(), &st) != 0) {
+    spdlog::warn("[available_bytes] statvfs {} failed, errno is {}", path, strerror(errno));
+    return 0;
+  }
+  return static_cast<uint64_t>(st.f_bavail) * st.f_frsize;
+}
+
+// 创建(如果不存在)并分配size字节的文件。空间不足时返回false，新建的文件会被删除，
+// 这样segment要么完整分配，要么不存在，写线程不会在写入过程中因为空间不足而退出
+static bool allocate_file(const std::string &filename, size_t size) {
+  const bool created = !Util::FileExists(filename);
+  int fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    spdlog::warn("[allocate_file] can't open file {}, errno is {}", filename, strerror(errno));
+    return false;
+  }
+  int ret = posix_fallocate(fd, 0, size);
+  close(fd);
+  if (ret != 0) {
+    spdlog::warn("[allocate_file] posix_fallocate {} bytes for {} failed: {}", size, filename, strerror(ret));
+    if (created) {
+      unlink(filename.c_str());
+    }
+    return false;
+  }
+  return true;
+}
+
+// 为新建(或者没有分配完整)的日志文件分配空间。fallocate分配的extent处于unwritten状态，
+// 读出来一定是0，commit标记和crc都依赖这一点，所以不需要再memset + msync整个文件;
+// 已经写入的内容不受影响
+static void reserve_log_file(int fd, const std::string &filename, size_t size) {
+  off_t off = lseek(fd, 0, SEEK_END);
+  if (off < 0) {
+    spdlog::error("[reserve_log_file] lseek end failed");
+    exit(1);
+  }
+  if (static_cast<size_t>(off) < size && posix_fallocate(fd, off, size - off) != 0) {
+    spdlog::error("[reserve_log_file] posix_fallocate {} failed", filename);
+    exit(1);
+  }
+}
+
 MmapWriter::MmapWriter(const std::string &filename, int mmap_size)
     : filename_(filename), mmap_size_(mmap_size), fd_(-1)
-    , data_start_(nullptr), data_curr_(nullptr) {
+    , tail_(nullptr), data_start_(nullptr), data_curr_(nullptr), crcs_(nullptr), block_crc_(0) {
+  size_t file_size = mmap_log_file_size(mmap_size_);
   // 1. open fd; (must have been create)
   fd_ = open(filename_.c_str(), O_RDWR, 0644);
   if (fd_ < 0) {
     spdlog::error("[MmapWriter] can't open file {}", filename_);
     exit(1);
   }
-  int off = (int)lseek(fd_, 0, SEEK_END);
-  if (off < 0) {
-    spdlog::error("[MmapWriter] lseek end failed");
-    exit(1);
-  }
-  if (off == 0) {
-    if (posix_fallocate(fd_, 0, mmap_size_) != 0) {
-      spdlog::error("[MmapWriter] posix_fallocate failed");
-      exit(1);
-    }
-  }
+  reserve_log_file(fd_, filename_, file_size);
   // 2. mmap
-  void* ptr = mmap(NULL, mmap_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  void* ptr = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
   if (ptr == MAP_FAILED) {
     spdlog::error("[MmapWriter] mmap failed, errno is {}", strerror(errno));
     exit(1);
   }
-  if (off == 0) {
-    memset(ptr, 0, mmap_size_);
-    msync(ptr, mmap_size_, MS_SYNC);
-  }
-  data_start_ = reinterpret_cast<char *>(ptr);
-  data_curr_ = data_start_;
-  while (*(uint64_t *)(data_curr_ + RecordSize) != 0) {
-    data_curr_ += RecordSize;
-  }
+  tail_ = reinterpret_cast<uint64_t *>(ptr);
+  data_start_ = reinterpret_cast<char *>(ptr) + MmapHeaderSize;
+  crcs_ = reinterpret_cast<uint32_t *>(data_start_ + mmap_size_);
+  *tail_ = mmap_log_count(data_start_, MaxSlot(), *tail_);
+  data_curr_ = data_start_ + *tail_ * RecordSize;
+  // 最后一个没写满的块重新计算crc
+  uint64_t block_records = *tail_ % CrcBlockRecords;
+  block_crc_ = Crc32c(data_curr_ - block_records * RecordSize, block_records * RecordSize);
 }
 
 MmapWriter::~MmapWriter() {
-  munmap(data_start_, mmap_size_);
+  munmap(data_start_ - MmapHeaderSize, mmap_log_file_size(mmap_size_));
   close(fd_);
 }
 
+void MmapWriter::Truncate(uint64_t cnt) {
+  if (cnt >= *tail_) {
+    return;
+  }
+  // 第slot条记录的commit标记在第slot+1条记录的位置，从后往前清除，任何时候已提交的都是一个前缀
+  for (uint64_t slot = *tail_; slot > cnt; slot--) {
+    *(uint64_t *)(data_start_ + slot * RecordSize) = 0;
+  }
+  *tail_ = cnt;
+  data_curr_ = data_start_ + cnt * RecordSize;
+  uint64_t block_records = cnt % CrcBlockRecords;
+  block_crc_ = Crc32c(data_curr_ - block_records * RecordSize, block_records * RecordSize);
+}
+
 MmapReader::MmapReader(const std::string &filename, int mmap_size)
     : filename_(filename), mmap_size_(mmap_size), fd_(-1)
-    , cnt_(0), data_start_(nullptr), data_curr_(nullptr) {
+    , cnt_(0), data_start_(nullptr), data_curr_(nullptr), crcs_(nullptr) {
+  size_t file_size = mmap_log_file_size(mmap_size_);
   Util::CreateIfNotExists(filename_);
   // 1. open fd;
   fd_ = open(filename_.c_str(), O_RDWR, 0644);
@@ -59,89 +157,876 @@ MmapReader::MmapReader(const std::string &filename, int mmap_size)
     spdlog::error("[MmapReader] can't open file {}", filename_);
     exit(1);
   }
-  int off = (int)lseek(fd_, 0, SEEK_END);
-  if (off < 0) {
-    spdlog::error("[MmapReader] lseek end failed");
-    exit(1);
-  }
-  if (off == 0) {
-    if (posix_fallocate(fd_, 0, mmap_size_) != 0) {
-      spdlog::error("[MmapReader] posix_fallocate failed");
-      exit(1);
-    }
-  }
+  reserve_log_file(fd_, filename_, file_size);
   // 2. mmap
-  void* ptr = mmap(NULL, mmap_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  void* ptr = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
   if (ptr == MAP_FAILED) {
     spdlog::error("[MmapReader] mmap failed, errno is {}", strerror(errno));
     exit(1);
   }
-  if (off == 0) {
-    memset(ptr, 0, mmap_size_);
-    msync(ptr, mmap_size_, MS_SYNC);
-  }
-  data_start_ = reinterpret_cast<char *>(ptr);
-  data_curr_ = data_start_;
-  while (*(uint64_t *)(data_curr_ + RecordSize) != 0) {
-    cnt_++;
-    data_curr_ += RecordSize;
-  }
+  data_start_ = reinterpret_cast<char *>(ptr) + MmapHeaderSize;
   data_curr_ = data_start_;
+  crcs_ = reinterpret_cast<const uint32_t *>(data_start_ + mmap_size_);
+  cnt_ = mmap_log_count(data_start_, (mmap_size_ - 8) / RecordSize, *reinterpret_cast<uint64_t *>(ptr));
 }
 
 MmapReader::~MmapReader() {
-  munmap(data_start_, mmap_size_);
+  munmap(data_start_ - MmapHeaderSize, mmap_log_file_size(mmap_size_));
   close(fd_);
 }
 
 bool MmapReader::ReadRecord(char *&record, int len) {
+  // 写满的segment读完时正常返回false
+  if (static_cast<uint64_t>(data_curr_ - data_start_) / RecordSize >= cnt_) {
+    return false;
+  }
   if (data_curr_ + len > data_start_ + mmap_size_) {
     spdlog::warn("[MmapReader::ReadRecord] read done, otherwise overflow mmap_size");
     return false;
   }
-  if (static_cast<uint64_t>(data_curr_ - data_start_) / RecordSize < cnt_) {
-    record = data_curr_;
-    data_curr_ += len;
-    return true;
+  record = data_curr_;
+  data_curr_ += len;
+  return true;
+}
+
+uint64_t MmapReader::Verify() {
+  // 最后一个不完整的块没有crc
+  uint64_t blocks = cnt_ / CrcBlockRecords;
+  std::vector<uint32_t> crcs(blocks);
+  Crc32cBlocks(data_start_, CrcBlockRecords * RecordSize, blocks, crcs.data());
+  for (uint64_t b = 0; b < blocks; b++) {
+    if (crcs[b] != crcs_[b]) {
+      spdlog::warn("[MmapReader] {} block {} checksum mismatch, drop {} records after it",
+                   filename_, b, cnt_ - b * CrcBlockRecords);
+      cnt_ = b * CrcBlockRecords;
+      break;
+    }
   }
-  return false;
+  return cnt_;
 }
 
-//--------------------- pmem file-----------------------------------
-MmapBufferWriter::MmapBufferWriter(const std::string &filename, int mmap_size)
-    : filename_(filename), mmap_size_(mmap_size), fd_(-1)
-    , commit_cnt_(nullptr), data_start_(nullptr), data_curr_(nullptr) {
+bool MmapReader::ReadColumns(int columns, User *user) {
+  char *record;
+  if (!ReadRecord(record, RecordSize)) {
+    return false;
+  }
+  const User *src = reinterpret_cast<const User *>(record);
+  if (columns & ColumnMask(Id)) {
+    user->id = src->id;
+  }
+  if (columns & ColumnMask(Userid)) {
+    memcpy(user->user_id, src->user_id, UseridLen);
+  }
+  if (columns & ColumnMask(Name)) {
+    memcpy(user->name, src->name, NameLen);
+  }
+  if (columns & ColumnMask(Salary)) {
+    user->salary = src->salary;
+  }
+  return true;
+}
+
+//--------------------- direct io file-----------------------------------
+static int64_t direct_page(uint64_t off) {
+  return off / DirectPageSize;
+}
+
+DirectWriter::DirectWriter(const std::string &filename, int mmap_size)
+    : filename_(filename), mmap_size_(mmap_size), fd_(-1), tail_(0), data_off_(0)
+    , crc_start_(MmapHeaderSize + mmap_size), crc_off_(0), block_crc_(0)
+    , ring_(DirectStagingPages + DirectSnapshots + 1), bufs_(nullptr), pages_(), crc_page_()
+    , snapshots_(), free_snapshots_() {
+  size_t file_size = mmap_log_file_size(mmap_size_);
   // 1. open fd; (must have been create)
-  fd_ = open(filename_.c_str(), O_RDWR, 0644);
+  fd_ = open(filename_.c_str(), O_RDWR | O_DIRECT, 0644);
+  if (fd_ < 0 && errno == EINVAL) {
+    // 文件系统不支持O_DIRECT(比如tmpfs)，退化为经过page cache的写入
+    spdlog::warn("[DirectWriter] {} doesn't support O_DIRECT", filename_);
+    fd_ = open(filename_.c_str(), O_RDWR, 0644);
+  }
   if (fd_ < 0) {
-    spdlog::error("[MmapBufferWriter] can't open file {}", filename_);
+    spdlog::error("[DirectWriter] can't open file {}", filename_);
     exit(1);
   }
-  int off = (int)lseek(fd_, 0, SEEK_END);
-  if (off < 0) {
-    spdlog::error("[MmapBufferWriter] lseek end failed");
+  reserve_log_file(fd_, filename_, file_size);
+  // 2. staging页，O_DIRECT要求buffer按页对齐
+  size_t buf_pages = DirectStagingPages + 1 + DirectSnapshots;
+  if (posix_memalign(reinterpret_cast<void **>(&bufs_), DirectPageSize, buf_pages * DirectPageSize) != 0) {
+    spdlog::error("[DirectWriter] alloc staging pages failed");
     exit(1);
   }
-  if (off == 0) {
-    if (posix_fallocate(fd_, 0, mmap_size_) != 0) {
-      spdlog::error("[MmapBufferWriter] posix_fallocate failed");
+  for (int i = 0; i < DirectStagingPages; i++) {
+    pages_[i].buf = bufs_ + static_cast<size_t>(i) * DirectPageSize;
+  }
+  crc_page_.buf = bufs_ + static_cast<size_t>(DirectStagingPages) * DirectPageSize;
+  for (int i = 0; i < DirectSnapshots; i++) {
+    snapshots_[i] = bufs_ + static_cast<size_t>(DirectStagingPages + 1 + i) * DirectPageSize;
+    free_snapshots_.push_back(i);
+  }
+  // 3. 和MmapWriter一样从文件头的提示开始找到已提交的记录数，并重新计算最后一个没写满的块的crc
+  void* ptr = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd_, 0);
+  if (ptr == MAP_FAILED) {
+    spdlog::error("[DirectWriter] mmap failed, errno is {}", strerror(errno));
+    exit(1);
+  }
+  const char *data_start = reinterpret_cast<const char *>(ptr) + MmapHeaderSize;
+  tail_ = mmap_log_count(data_start, MaxSlot(), *reinterpret_cast<const uint64_t *>(ptr));
+  uint64_t block_records = tail_ % CrcBlockRecords;
+  block_crc_ = Crc32c(data_start + (tail_ - block_records) * RecordSize, block_records * RecordSize);
+  munmap(ptr, file_size);
+
+  data_off_ = MmapHeaderSize + tail_ * RecordSize;
+  crc_off_ = crc_start_ + tail_ / CrcBlockRecords * sizeof(uint32_t);
+  // crc页先载入: 数据和crc在同一页时共用crc页
+  load_crc_page(direct_page(crc_off_));
+  if (lookup(direct_page(data_off_)) == nullptr) {
+    load_data_page(direct_page(data_off_), true);
+  }
+}
+
+DirectWriter::~DirectWriter() {
+  // 等所有的写入(包括完成之后再提交的dirty页)完成
+  for (Page &p : pages_) {
+    submit(&p);
+  }
+  submit(&crc_page_);
+  while (ring_.Pending() > 0) {
+    reap(true);
+  }
+  // 文件头中的tail所在的页已经写入完成，读出来修改之后写回
+  char *header = snapshots_[0];
+  read_page(0, header);
+  *reinterpret_cast<uint64_t *>(header) = tail_;
+  if (pwrite(fd_, header, DirectPageSize, 0) != DirectPageSize) {
+    spdlog::error("[DirectWriter] write header of {} failed, errno is {}", filename_, strerror(errno));
+    exit(1);
+  }
+  close(fd_);
+  free(bufs_);
+}
+
+int DirectWriter::AppendBatch(const void* datas, size_t num) {
+  reap(false);
+  const char *src = reinterpret_cast<const char *>(datas);
+  update_crc(src, num);
+  write(data_off_, src, num * RecordSize, true);
+  write(data_off_, reinterpret_cast<const char *>(&CommitFlag), sizeof(CommitFlag), false);
+  tail_ += num;
+  // 当前记录和commit标记所在的页，以及crc页(没有变化时不会重复提交同样的内容)
+  submit(lookup(direct_page(data_off_)));
+  submit(&crc_page_);
+  // 返回之前所有修改过的页都必须在写入中: 还在等前一次写入或者等快照的页，等到能提交为止
+  while (has_unsubmitted()) {
+    reap(true);
+  }
+  return 0;
+}
+
+DirectWriter::Page *DirectWriter::lookup(int64_t page) {
+  if (crc_page_.page == page) {
+    return &crc_page_;
+  }
+  Page *p = &pages_[page % DirectStagingPages];
+  return p->page == page ? p : nullptr;
+}
+
+DirectWriter::Page *DirectWriter::load_data_page(int64_t page, bool load) {
+  Page *p = &pages_[page % DirectStagingPages];
+  // 原来的页已经不会再写入，等它的写入完成
+  submit(p);
+  while (p->in_flight || p->dirty) {
+    reap(true);
+  }
+  p->page = page;
+  if (load) {
+    read_page(page, p->buf);
+  } else {
+    memset(p->buf, 0, DirectPageSize);
+  }
+  return p;
+}
+
+void DirectWriter::load_crc_page(int64_t page) {
+  if (crc_page_.page >= 0) {
+    submit(&crc_page_);
+    while (crc_page_.in_flight || crc_page_.dirty) {
+      reap(true);
+    }
+  }
+  crc_page_.page = page;
+  read_page(page, crc_page_.buf);
+}
+
+void DirectWriter::read_page(int64_t page, char *buf) {
+  ssize_t ret = pread(fd_, buf, DirectPageSize, page * DirectPageSize);
+  if (ret < 0) {
+    spdlog::error("[DirectWriter] read {} page {} failed, errno is {}", filename_, page, strerror(errno));
+    exit(1);
+  }
+  // 文件最后一页可能不完整
+  memset(buf + ret, 0, DirectPageSize - ret);
+}
+
+void DirectWriter::write(uint64_t off, const char *src, size_t len, bool record) {
+  while (len > 0) {
+    int64_t page = direct_page(off);
+    size_t in_page = off % DirectPageSize;
+    size_t n = std::min<size_t>(len, DirectPageSize - in_page);
+    Page *p = lookup(page);
+    if (p == nullptr) {
+      // 新写入的页在文件中还是0，只有和crc数组重叠的页要读出原来的内容
+      p = load_data_page(page, page >= direct_page(crc_start_));
+    }
+    memcpy(p->buf + in_page, src, n);
+    p->dirty = true;
+    off += n;
+    src += n;
+    len -= n;
+    if (record) {
+      data_off_ = off;
+      if (in_page + n == DirectPageSize) {
+        // 写满的页马上提交，大batch跨过整个staging环时这一页已经在写入中了
+        submit(p);
+      }
+    }
+  }
+}
+
+void DirectWriter::update_crc(const char *src, size_t num) {
+  uint64_t slot = tail_;
+  while (num > 0) {
+    size_t n = std::min<size_t>(num, CrcBlockRecords - slot % CrcBlockRecords);
+    block_crc_ = Crc32cExtend(block_crc_, src, n * RecordSize);
+    src += n * RecordSize;
+    num -= n;
+    slot += n;
+    if (slot % CrcBlockRecords == 0) {
+      if (direct_page(crc_off_) != crc_page_.page) {
+        load_crc_page(direct_page(crc_off_));
+      }
+      write(crc_off_, reinterpret_cast<const char *>(&block_crc_), sizeof(uint32_t), false);
+      crc_off_ += sizeof(uint32_t);
+      block_crc_ = 0;
+    }
+  }
+}
+
+bool DirectWriter::has_unsubmitted() const {
+  for (const Page &p : pages_) {
+    if (p.dirty) {
+      return true;
+    }
+  }
+  return crc_page_.dirty;
+}
+
+bool DirectWriter::sealed(int64_t page) const {
+  bool data_done = page < direct_page(data_off_) || page > direct_page(crc_start_ - 1);
+  bool crc_done = page < direct_page(crc_off_) || page < direct_page(crc_start_);
+  return data_done && crc_done;
+}
+
+void DirectWriter::submit(Page *page) {
+  if (!page->dirty) {
+    return;
+  }
+  if (page->in_flight) {
+    // 写入完成之后由reap再提交
+    return;
+  }
+  const char *src = page->buf;
+  int snapshot = -1;
+  if (!sealed(page->page)) {
+    if (free_snapshots_.empty()) {
+      // 等某个快照的写入完成之后由reap再提交
+      return;
+    }
+    snapshot = free_snapshots_.back();
+    free_snapshots_.pop_back();
+    memcpy(snapshots_[snapshot], page->buf, DirectPageSize);
+    src = snapshots_[snapshot];
+  }
+  page->dirty = false;
+  page->in_flight = true;
+  ring_.Write(fd_, src, DirectPageSize, page->page * DirectPageSize,
+              static_cast<uint64_t>(page->page) << 8 | (snapshot + 1));
+}
+
+void DirectWriter::reap(bool wait) {
+  size_t n = ring_.Reap(wait, [this](uint64_t user_data, int res) {
+    int64_t page = user_data >> 8;
+    int snapshot = static_cast<int>(user_data & 0xFF) - 1;
+    if (res != DirectPageSize) {
+      spdlog::error("[DirectWriter] write {} page {} failed, res {}", filename_, page, res);
       exit(1);
     }
+    if (snapshot >= 0) {
+      free_snapshots_.push_back(snapshot);
+    }
+    // 写入中的页不会被换出staging
+    lookup(page)->in_flight = false;
+  });
+  if (n == 0) {
+    return;
+  }
+  // 写入过程中又修改过的页，以及等待快照的页
+  for (Page &p : pages_) {
+    submit(&p);
+  }
+  submit(&crc_page_);
+}
+
+//--------------------- column mmap file-----------------------------------
+// 打开(不存在则创建)并mmap一个大小为size的文件，新建的文件读出来是0
+static char *map_log_file(const std::string &filename, size_t size, int *fd) {
+  Util::CreateIfNotExists(filename);
+  *fd = open(filename.c_str(), O_RDWR, 0644);
+  if (*fd < 0) {
+    spdlog::error("[map_log_file] can't open file {}", filename);
+    exit(1);
+  }
+  reserve_log_file(*fd, filename, size);
+  void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  if (ptr == MAP_FAILED) {
+    spdlog::error("[map_log_file] mmap failed, errno is {}", strerror(errno));
+    exit(1);
+  }
+  return reinterpret_cast<char *>(ptr);
+}
+
+// id列多留开头的8字节给已提交的记录数
+static size_t column_file_size(int column, size_t max_slot) {
+  return max_slot * ColumnWidth[column] + (column == Id ? 8 : 0);
+}
+
+ColumnMmapWriter::ColumnMmapWriter(const std::string &filename, int mmap_size)
+    : filename_(filename), max_slot_((mmap_size - 8) / RecordSize), slot_(0)
+    , fds_{-1, -1, -1, -1}, sizes_{0, 0, 0, 0}, columns_{nullptr, nullptr, nullptr, nullptr}, count_(nullptr) {
+  for (int c = 0; c < 4; c++) {
+    sizes_[c] = column_file_size(c, max_slot_);
+    columns_[c] = map_log_file(filename_ + ColumnFileSuffix[c], sizes_[c], &fds_[c]);
+  }
+  count_ = reinterpret_cast<std::atomic<uint64_t> *>(columns_[Id]);
+  slot_ = std::min<uint64_t>(count_->load(std::memory_order_acquire), max_slot_);
+}
+
+ColumnMmapWriter::~ColumnMmapWriter() {
+  for (int c = 0; c < 4; c++) {
+    munmap(columns_[c], sizes_[c]);
+    close(fds_[c]);
+  }
+}
+
+void ColumnMmapWriter::Truncate(uint64_t cnt) {
+  if (cnt < slot_) {
+    slot_ = cnt;
+    count_->store(cnt, std::memory_order_release);
+  }
+}
+
+ColumnMmapReader::ColumnMmapReader(const std::string &filename, int mmap_size)
+    : filename_(filename), max_slot_((mmap_size - 8) / RecordSize), cnt_(0), slot_(0)
+    , fds_{-1, -1, -1, -1}, sizes_{0, 0, 0, 0}, columns_{nullptr, nullptr, nullptr, nullptr}
+    , record_() {
+  // 统计记录数只需要id列
+  open_column(Id);
+  cnt_ = std::min<uint64_t>(reinterpret_cast<const std::atomic<uint64_t> *>(columns_[Id])->load(std::memory_order_acquire), max_slot_);
+}
+
+ColumnMmapReader::~ColumnMmapReader() {
+  for (int c = 0; c < 4; c++) {
+    if (columns_[c] != nullptr) {
+      munmap(columns_[c], sizes_[c]);
+      close(fds_[c]);
+    }
+  }
+}
+
+void ColumnMmapReader::open_column(int column) {
+  if (columns_[column] != nullptr) {
+    return;
+  }
+  sizes_[column] = column_file_size(column, max_slot_);
+  columns_[column] = map_log_file(filename_ + ColumnFileSuffix[column], sizes_[column], &fds_[column]);
+  // 顺序扫描，提示内核预读
+  madvise(columns_[column], sizes_[column], MADV_SEQUENTIAL);
+}
+
+bool ColumnMmapReader::ReadRecord(char *&record, int len) {
+  if (len != RecordSize || !ReadColumns(AllColumns, &record_)) {
+    return false;
+  }
+  record = reinterpret_cast<char *>(&record_);
+  return true;
+}
+
+bool ColumnMmapReader::ReadColumns(int columns, User *user) {
+  if (slot_ >= cnt_) {
+    return false;
+  }
+  if (columns & ColumnMask(Id)) {
+    user->id = *(int64_t *)(columns_[Id] + column_offset(Id, slot_));
+  }
+  if (columns & ColumnMask(Userid)) {
+    open_column(Userid);
+    memcpy(user->user_id, columns_[Userid] + column_offset(Userid, slot_), UseridLen);
+  }
+  if (columns & ColumnMask(Name)) {
+    open_column(Name);
+    memcpy(user->name, columns_[Name] + column_offset(Name, slot_), NameLen);
+  }
+  if (columns & ColumnMask(Salary)) {
+    open_column(Salary);
+    user->salary = *(int64_t *)(columns_[Salary] + column_offset(Salary, slot_));
+  }
+  slot_++;
+  return true;
+}
+
+//--------------------- compressed mmap file-----------------------------------
+CompressedMmapWriter::CompressedMmapWriter(const std::string &filename, int mmap_size)
+    : filename_(filename), mmap_size_(mmap_size), block_num_(mmap_size / CompressBlockSize), fd_(-1)
+    , data_start_(nullptr), block_(nullptr), block_used_(8), block_cnt_(0), cnt_(0) {
+  data_start_ = map_log_file(filename_, mmap_size_, &fd_);
+  // 有记录的块也是一个前缀，二分找到最后一个有记录的块，继续往里面写
+  const char *blocks = data_start_;
+  size_t used_blocks = search_committed(0, block_num_, [blocks](uint64_t block) {
+    return (uint32_t)*(const uint64_t *)(blocks + block * CompressBlockSize) != 0;
+  });
+  block_ = data_start_;
+  if (used_blocks > 0) {
+    block_ = data_start_ + (used_blocks - 1) * CompressBlockSize;
+    uint64_t header = *(uint64_t *)block_;
+    block_used_ = header >> 32;
+    block_cnt_ = (uint32_t)header;
+  }
+  // 记录数只需要读每个块的块头
+  for (size_t i = 0; i < used_blocks; i++) {
+    cnt_ += (uint32_t)*(const uint64_t *)(blocks + i * CompressBlockSize);
+  }
+}
+
+CompressedMmapWriter::~CompressedMmapWriter() {
+  munmap(data_start_, mmap_size_);
+  close(fd_);
+}
+
+void CompressedMmapWriter::Truncate(uint64_t cnt) {
+  if (cnt >= cnt_) {
+    return;
+  }
+  // 找到第cnt条记录所在的块，正好在块的边界时保留前一个写满的块
+  size_t last = (block_ - data_start_) / CompressBlockSize;
+  size_t block = 0;
+  uint64_t base = 0;
+  for (; block < last; block++) {
+    uint32_t n = (uint32_t)*(const uint64_t *)(data_start_ + block * CompressBlockSize);
+    if (base + n >= cnt) {
+      break;
+    }
+    base += n;
+  }
+  for (size_t i = last; i > block; i--) {
+    *(uint64_t *)(data_start_ + i * CompressBlockSize) = 0;
+  }
+  // 跳过块中保留的记录，得到下一条记录的偏移
+  block_ = data_start_ + block * CompressBlockSize;
+  block_cnt_ = cnt - base;
+  block_used_ = 8;
+  User user;
+  for (uint32_t i = 0; i < block_cnt_; i++) {
+    block_used_ += DecodeRecord(block_ + block_used_, &user);
+  }
+  *(uint64_t *)block_ = block_cnt_ == 0 ? 0 : (uint64_t)block_used_ << 32 | block_cnt_;
+  cnt_ = cnt;
+}
+
+void CompressedMmapWriter::next_block() {
+  if (block_ + 2 * CompressBlockSize > data_start_ + block_num_ * CompressBlockSize) {
+    spdlog::error("[CompressedMmapWriter] {} is full", filename_);
+    exit(1);
+  }
+  block_ += CompressBlockSize;
+  block_used_ = 8;
+  block_cnt_ = 0;
+}
+
+CompressedMmapReader::CompressedMmapReader(const std::string &filename, int mmap_size)
+    : filename_(filename), mmap_size_(mmap_size), block_num_(mmap_size / CompressBlockSize), fd_(-1)
+    , cnt_(0), read_cnt_(0), data_start_(nullptr), block_(nullptr), block_read_(0), block_off_(8), record_() {
+  data_start_ = map_log_file(filename_, mmap_size_, &fd_);
+  madvise(data_start_, mmap_size_, MADV_SEQUENTIAL);
+  // 统计记录数只需要读块头
+  for (size_t i = 0; i < block_num_; i++) {
+    uint32_t block_cnt = *(uint64_t *)(data_start_ + i * CompressBlockSize);
+    if (block_cnt == 0) {
+      break;
+    }
+    cnt_ += block_cnt;
+  }
+  block_ = data_start_;
+}
+
+CompressedMmapReader::~CompressedMmapReader() {
+  munmap(data_start_, mmap_size_);
+  close(fd_);
+}
+
+bool CompressedMmapReader::ReadRecord(char *&record, int len) {
+  if (len != RecordSize || !ReadColumns(AllColumns, &record_)) {
+    return false;
+  }
+  record = reinterpret_cast<char *>(&record_);
+  return true;
+}
+
+bool CompressedMmapReader::ReadColumns(int columns, User *user) {
+  if (read_cnt_ >= cnt_ || block_ >= data_start_ + block_num_ * CompressBlockSize) {
+    return false;
+  }
+  uint32_t block_cnt = *(uint64_t *)block_;
+  if (block_read_ == block_cnt) {
+    // 当前块读完，切换到下一块
+    block_ += CompressBlockSize;
+    block_read_ = 0;
+    block_off_ = 8;
+    if (block_ >= data_start_ + block_num_ * CompressBlockSize || *(uint32_t *)block_ == 0) {
+      return false;
+    }
+  }
+  if (columns == AllColumns) {
+    block_off_ += DecodeRecord(block_ + block_off_, user);
+  } else {
+    block_off_ += DecodeRecord(block_ + block_off_, &record_);
+    if (columns & ColumnMask(Id)) {
+      user->id = record_.id;
+    }
+    if (columns & ColumnMask(Userid)) {
+      memcpy(user->user_id, record_.user_id, UseridLen);
+    }
+    if (columns & ColumnMask(Name)) {
+      memcpy(user->name, record_.name, NameLen);
+    }
+    if (columns & ColumnMask(Salary)) {
+      user->salary = record_.salary;
+    }
+  }
+  block_read_++;
+  read_cnt_++;
+  return true;
+}
+
+DiskLogWriter *NewDiskLogWriter(int format, const std::string &filename, int mmap_size, int backend) {
+  if (format == DiskLogFormat::ColumnLog) {
+    return new ColumnMmapWriter(filename, mmap_size);
+  }
+  if (format == DiskLogFormat::CompressedLog) {
+    return new CompressedMmapWriter(filename, mmap_size);
+  }
+  if (backend == DiskBackend::DirectBackend) {
+    return new DirectWriter(filename, mmap_size);
+  }
+  return new MmapWriter(filename, mmap_size);
+}
+
+DiskLogReader *NewDiskLogReader(int format, const std::string &filename, int mmap_size) {
+  if (format == DiskLogFormat::ColumnLog) {
+    return new ColumnMmapReader(filename, mmap_size);
+  }
+  if (format == DiskLogFormat::CompressedLog) {
+    return new CompressedMmapReader(filename, mmap_size);
+  }
+  return new MmapReader(filename, mmap_size);
+}
+
+//--------------------- segmented disk log-----------------------------------
+std::string SegmentFileName(const std::string &filename, size_t segment) {
+  if (segment == 0) {
+    return filename;
   }
+  return filename + SegmentFileSuffix + std::to_string(segment);
+}
+
+// 列存没有filename本身这个文件，用id列判断segment是否存在
+static bool segment_exists(int format, const std::string &segment_filename) {
+  if (format == DiskLogFormat::ColumnLog) {
+    return Util::FileExists(segment_filename + ColumnFileSuffix[Id]);
+  }
+  return Util::FileExists(segment_filename);
+}
+
+// 一个segment的所有文件和各自的大小。列存的id列放在最后: segment_exists用id列判断，
+// 依次分配时id列存在就说明其它列都已经分配好了
+static std::vector<std::pair<std::string, size_t>> segment_files(int format, const std::string &segment_filename,
+                                                                 int segment_size) {
+  std::vector<std::pair<std::string, size_t>> files;
+  if (format == DiskLogFormat::ColumnLog) {
+    size_t max_slot = (segment_size - 8) / RecordSize;
+    for (int c : {Userid, Name, Salary, Id}) {
+      files.emplace_back(segment_filename + ColumnFileSuffix[c], column_file_size(c, max_slot));
+    }
+  } else if (format == DiskLogFormat::CompressedLog) {
+    files.emplace_back(segment_filename, segment_size);
+  } else {
+    files.emplace_back(segment_filename, mmap_log_file_size(segment_size));
+  }
+  return files;
+}
+
+// 返回已经存在的segment个数(至少为1，第0个segment由writer/reader创建)
+static size_t count_segments(int format, const std::string &filename) {
+  size_t segments = 1;
+  while (segment_exists(format, SegmentFileName(filename, segments))) {
+    segments++;
+  }
+  return segments;
+}
+
+SegmentedLogWriter::SegmentedLogWriter(int format, const std::string &filename,
+                                       int segment_size, size_t max_segments, int backend)
+    : format_(format), backend_(backend), filename_(filename), segment_size_(segment_size)
+    , max_segments_(max_segments), segment_slots_(0), segment_(0), spare_segments_(0), base_cnt_(0), writer_() {
+  // 只有最后一个segment可能没有写满
+  size_t last = count_segments(format_, filename_) - 1;
+  for (size_t i = 0; i < last; i++) {
+    std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(format_, SegmentFileName(filename_, i), segment_size_));
+    base_cnt_ += reader->Count();
+  }
+  open_segment(last);
+  segment_slots_ = writer_->MaxSlot();
+  update_spare_segments();
+}
+
+SegmentedLogWriter::~SegmentedLogWriter() {
+}
+
+void SegmentedLogWriter::open_segment(size_t segment) {
+  std::string segment_filename = SegmentFileName(filename_, segment);
+  if (format_ == DiskLogFormat::RowLog) {
+    // MmapWriter要求文件已经存在
+    Util::CreateIfNotExists(segment_filename);
+  }
+  // 先关闭当前segment
+  writer_.reset();
+  writer_.reset(NewDiskLogWriter(format_, segment_filename, segment_size_, backend_));
+  segment_ = segment;
+}
+
+bool SegmentedLogWriter::next_segment() {
+  if (max_segments_ > 0 && segment_ + 1 >= max_segments_) {
+    spdlog::warn("[SegmentedLogWriter] {} reach max segments {}", filename_, max_segments_);
+    spare_segments_ = 0;
+    return false;
+  }
+  const std::string segment_filename = SegmentFileName(filename_, segment_ + 1);
+  auto files = segment_files(format_, segment_filename, segment_size_);
+  for (size_t i = 0; i < files.size(); i++) {
+    if (!allocate_file(files[i].first, files[i].second)) {
+      // 删掉已经分配的列，没有分配完整的segment不存在
+      for (size_t j = 0; j < i; j++) {
+        unlink(files[j].first.c_str());
+      }
+      spdlog::warn("[SegmentedLogWriter] no space for segment {} of {}", segment_ + 1, filename_);
+      spare_segments_ = 0;
+      return false;
+    }
+  }
+  base_cnt_ += writer_->Count();
+  open_segment(segment_ + 1);
+  update_spare_segments();
+  return true;
+}
+
+void SegmentedLogWriter::update_spare_segments() {
+  auto files = segment_files(format_, SegmentFileName(filename_, segment_), segment_size_);
+  size_t segment_bytes = 0;
+  for (auto &file : files) {
+    segment_bytes += file.second;
+  }
+  // 当前segment的文件一定存在，用它statvfs所在的文件系统
+  spare_segments_ = available_bytes(files.back().first) / segment_bytes;
+  if (max_segments_ > 0) {
+    spare_segments_ = std::min(spare_segments_, max_segments_ - segment_ - 1);
+  }
+}
+
+// 列存的segment由每一列一个文件组成
+static void remove_segment(int format, const std::string &segment_filename) {
+  if (format == DiskLogFormat::ColumnLog) {
+    for (int c = 0; c < 4; c++) {
+      unlink((segment_filename + ColumnFileSuffix[c]).c_str());
+    }
+  } else {
+    unlink(segment_filename.c_str());
+  }
+}
+
+void SegmentedLogWriter::Truncate(uint64_t cnt) {
+  if (cnt >= Count()) {
+    return;
+  }
+  writer_.reset();
+  size_t segments = count_segments(format_, filename_);
+  // 找到第cnt条记录所在的segment，正好在segment的边界时保留前一个写满的segment
+  size_t segment = 0;
+  base_cnt_ = 0;
+  for (; segment + 1 < segments; segment++) {
+    std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(format_, SegmentFileName(filename_, segment), segment_size_));
+    if (base_cnt_ + reader->Count() >= cnt) {
+      break;
+    }
+    base_cnt_ += reader->Count();
+  }
+  for (size_t i = segments - 1; i > segment; i--) {
+    remove_segment(format_, SegmentFileName(filename_, i));
+  }
+  // 截断总是通过mmap完成，和写入时的backend无关(写出的文件相同)
+  const std::string segment_filename = SegmentFileName(filename_, segment);
+  if (format_ == DiskLogFormat::ColumnLog) {
+    ColumnMmapWriter(segment_filename, segment_size_).Truncate(cnt - base_cnt_);
+  } else if (format_ == DiskLogFormat::CompressedLog) {
+    CompressedMmapWriter(segment_filename, segment_size_).Truncate(cnt - base_cnt_);
+  } else {
+    MmapWriter(segment_filename, segment_size_).Truncate(cnt - base_cnt_);
+  }
+  open_segment(segment);
+  update_spare_segments();
+}
+
+SegmentedLogReader::SegmentedLogReader(int format, const std::string &filename, int segment_size)
+    : format_(format), filename_(filename), segment_size_(segment_size)
+    , segments_(count_segments(format, filename)), segment_(0), cnt_(-1)
+    , verified_(), limit_(UINT64_MAX), read_cnt_(0)
+    , reader_(NewDiskLogReader(format, filename, segment_size)) {
+}
+
+SegmentedLogReader::~SegmentedLogReader() {
+}
+
+uint64_t SegmentedLogReader::Count() const {
+  if (cnt_ < 0) {
+    cnt_ = reader_->Count();
+    for (size_t i = 1; i < segments_; i++) {
+      std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(format_, SegmentFileName(filename_, i), segment_size_));
+      cnt_ += reader->Count();
+    }
+  }
+  return std::min<uint64_t>(cnt_, limit_);
+}
+
+uint64_t SegmentedLogReader::Verify() {
+  verified_.clear();
+  cnt_ = 0;
+  for (size_t i = 0; i < segments_; i++) {
+    std::unique_ptr<DiskLogReader> reader;
+    DiskLogReader *r = reader_.get();
+    if (i > 0) {
+      reader.reset(NewDiskLogReader(format_, SegmentFileName(filename_, i), segment_size_));
+      r = reader.get();
+    }
+    uint64_t cnt = r->Count();
+    verified_.push_back(r->Verify());
+    cnt_ += verified_.back();
+    if (verified_.back() < cnt) {
+      if (i + 1 < segments_) {
+        spdlog::warn("[SegmentedLogReader] {} segment {} is corrupted, drop {} segments after it",
+                     filename_, i, segments_ - i - 1);
+      }
+      segments_ = i + 1;
+      break;
+    }
+  }
+  return Count();
+}
+
+bool SegmentedLogReader::next_segment() {
+  if (segment_ + 1 >= segments_) {
+    return false;
+  }
+  segment_++;
+  reader_.reset();
+  reader_.reset(NewDiskLogReader(format_, SegmentFileName(filename_, segment_), segment_size_));
+  if (segment_ < verified_.size()) {
+    reader_->Truncate(verified_[segment_]);
+  }
+  return true;
+}
+
+bool SegmentedLogReader::ReadRecord(char *&record, int len) {
+  if (read_cnt_ >= limit_) {
+    return false;
+  }
+  do {
+    if (reader_->ReadRecord(record, len)) {
+      read_cnt_++;
+      return true;
+    }
+  } while (next_segment());
+  return false;
+}
+
+bool SegmentedLogReader::ReadColumns(int columns, User *user) {
+  if (read_cnt_ >= limit_) {
+    return false;
+  }
+  do {
+    if (reader_->ReadColumns(columns, user)) {
+      read_cnt_++;
+      return true;
+    }
+  } while (next_segment());
+  return false;
+}
+
+//--------------------- pmem file-----------------------------------
+void ScatterXPLineRecords(char *block, size_t slot, const char *src, size_t num) {
+  for (size_t i = 0; i < num; i++, slot++, src += RecordSize) {
+    const User *user = reinterpret_cast<const User *>(src);
+    memcpy(block + slot * XPLineSize, user->user_id, XPLineSize);
+    int64_t *side = reinterpret_cast<int64_t *>(XPLineSide(block, slot));
+    side[0] = user->id;
+    side[1] = user->salary;
+  }
+}
+
+void GatherXPLineRecord(const char *block, size_t slot, char *dst) {
+  User *user = reinterpret_cast<User *>(dst);
+  memcpy(user->user_id, block + slot * XPLineSize, XPLineSize);
+  const int64_t *side = reinterpret_cast<const int64_t *>(XPLineSide(const_cast<char *>(block), slot));
+  user->id = side[0];
+  user->salary = side[1];
+}
+
+MmapBufferWriter::MmapBufferWriter(const std::string &filename, int mmap_size, int layout)
+    : filename_(filename), mmap_size_(mmap_size), layout_(layout), fd_(-1), is_pmem_(false)
+    , flush_cnt_(nullptr), commit_cnt_(nullptr), data_start_(nullptr), block_start_(nullptr), used_(0) {
+  // 1. open fd; (must have been create)
+  fd_ = open(filename_.c_str(), O_RDWR, 0644);
+  if (fd_ < 0) {
+    spdlog::error("[MmapBufferWriter] can't open file {}", filename_);
+    exit(1);
+  }
+  reserve_log_file(fd_, filename_, mmap_size_);
   // 2. mmap
   void* ptr = mmap(NULL, mmap_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
   if (ptr == MAP_FAILED) {
     spdlog::error("[MmapBufferWriter] mmap failed, errno is {}", strerror(errno));
     exit(1);
   }
-  if (off == 0) {
-    memset(ptr, 0, mmap_size_);
-    msync(ptr, mmap_size_, MS_SYNC);
-  }
   data_start_ = reinterpret_cast<char *>(ptr);
+  is_pmem_ = pmem_is_pmem(ptr, mmap_size_);
+  flush_cnt_ = reinterpret_cast<uint64_t *>(data_start_ + mmap_size - 16);
   commit_cnt_ = reinterpret_cast<uint64_t *>(data_start_ + mmap_size - 8);
-  uint64_t record_num_per_round_buffer = (mmap_size_ - 8) / RecordSize;
-  data_curr_ = data_start_ + (*commit_cnt_ % record_num_per_round_buffer) * RecordSize;
+  Restore();
+}
+
+void MmapBufferWriter::Restore() {
+  // 每次刷入的都是写满的buffer，所以flush_cnt总是buffer的整数倍。
+  // 还没有刷入pmem的记录可能不止一个buffer(后台刷入还没有完成)，调用者要先把写满的buffer刷入pmem
+  uint64_t ring_blocks = (mmap_size_ - PmapBufferWriterMetaSize) / PmapBufferWriterSize;
+  uint64_t unflushed = std::min<uint64_t>(*commit_cnt_ - *flush_cnt_, PmapBufferRecords);
+  block_start_ = data_start_ + *flush_cnt_ / PmapBufferRecords % ring_blocks * PmapBufferWriterSize;
+  used_ = unflushed;
 }
 
 MmapBufferWriter::~MmapBufferWriter() {
@@ -149,9 +1034,10 @@ MmapBufferWriter::~MmapBufferWriter() {
   close(fd_);
 }
 
-MmapBufferReader::MmapBufferReader(const std::string &filename, int mmap_size)
-    : filename_(filename), mmap_size_(mmap_size), fd_(-1)
-    , commit_cnt_(nullptr), data_start_(nullptr), data_curr_(nullptr) {
+MmapBufferReader::MmapBufferReader(const std::string &filename, int mmap_size, int layout)
+    : filename_(filename), mmap_size_(mmap_size), layout_(layout), fd_(-1)
+    , ring_slots_((mmap_size - PmapBufferWriterMetaSize) / RecordSize)
+    , flush_cnt_(nullptr), commit_cnt_(nullptr), data_start_(nullptr) {
   Util::CreateIfNotExists(filename_);
   // 1. open fd;
   fd_ = open(filename_.c_str(), O_RDWR, 0644);
@@ -159,30 +1045,16 @@ MmapBufferReader::MmapBufferReader(const std::string &filename, int mmap_size)
     spdlog::error("[MmapBufferReader] can't open file {}", filename_);
     exit(1);
   }
-  int off = (int)lseek(fd_, 0, SEEK_END);
-  if (off < 0) {
-    spdlog::error("[MmapBufferReader] lseek end failed");
-    exit(1);
-  }
-  if (off == 0) {
-    if (posix_fallocate(fd_, 0, mmap_size_) != 0) {
-      spdlog::error("[MmapBufferReader] posix_fallocate failed");
-      exit(1);
-    }
-  }
+  reserve_log_file(fd_, filename_, mmap_size_);
   // 2. mmap
   void* ptr = mmap(NULL, mmap_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
   if (ptr == MAP_FAILED) {
     spdlog::error("[MmapBufferReader] mmap failed, errno is {}", strerror(errno));
     exit(1);
   }
-  if (off == 0) {
-    memset(ptr, 0, mmap_size_);
-    msync(ptr, mmap_size_, MS_SYNC);
-  }
   data_start_ = reinterpret_cast<char *>(ptr);
+  flush_cnt_ = reinterpret_cast<uint64_t *>(data_start_ + mmap_size - 16);
   commit_cnt_ = reinterpret_cast<uint64_t *>(data_start_ + mmap_size - 8);
-  data_curr_ = data_start_;
 }
 
 MmapBufferReader::~MmapBufferReader() {
@@ -190,121 +1062,552 @@ MmapBufferReader::~MmapBufferReader() {
   close(fd_);
 }
 
-bool MmapBufferReader::ReadRecord(char *&record, int len) {
-  if (data_curr_ + len > data_start_ + mmap_size_ - 8) {
-    spdlog::error("[MmapBufferReader::ReadRecord] read overflow mmap_size error");
-    exit(1);
+char *MmapBufferReader::Record(uint64_t cnt, char *scratch) {
+  uint64_t slot = cnt % ring_slots_;
+  if (layout_ == PmemLayout::PmemRowLayout) {
+    return data_start_ + slot * RecordSize;
   }
-  if (static_cast<uint64_t>(data_curr_ - data_start_) / RecordSize < *commit_cnt_) {
-    record = data_curr_;
-    data_curr_ += len;
-    return true;
-  }
-  return false;
+  GatherXPLineRecord(data_start_ + slot / PmapBufferRecords * PmapBufferWriterSize, slot % PmapBufferRecords, scratch);
+  return scratch;
 }
 
 
-PmapBufferWriter::PmapBufferWriter(const std::string &filename, size_t pool_size)
-    : mmap_writer_(nullptr), pool_size_(pool_size), start_(nullptr), curr_(nullptr) {
 
-  buff_filename_ = filename + PmapBufferWriterFileNameSuffix;
-  pmem_filename_ = filename;
-  mmap_writer_ = new MmapBufferWriter(buff_filename_, PmapBufferWriterFileSize);
+// pmem segment的文件大小: 数据 + 每个块(PmapBufferWriterSize)一个crc
+static size_t pmem_segment_file_size(size_t segment_size) {
+  return segment_size + segment_size / PmapBufferWriterSize * sizeof(uint32_t);
+}
 
-  bool create_file = !Util::FileExists(pmem_filename_);
-  // 2. pmap
+// 映射一个pmem segment(size是文件大小)。新创建的segment由pmem_map_file预分配，读出来是0，不需要清零
+static char *map_pmem_segment(const std::string &filename, size_t size, bool *is_pmem_out) {
   void* pmemaddr = NULL;
 	size_t mapped_len;
 	int is_pmem;
-	if ((pmemaddr = pmem_map_file(pmem_filename_.c_str(), pool_size_,
+	if ((pmemaddr = pmem_map_file(filename.c_str(), size,
 				PMEM_FILE_CREATE, 0666, &mapped_len, &is_pmem)) == NULL) {
 		perror("pmem_map_file");
 		exit(1);
 	}
-  if (mapped_len != pool_size_ || is_pmem == 0) {
-    spdlog::warn("[PmapReader] unexpected error happen when pmem_map_file, mapped_len: {}, is_pmem: {}", mapped_len, is_pmem);
+  if (mapped_len != size || is_pmem == 0) {
+    spdlog::warn("[PmapSegment] unexpected error happen when pmem_map_file {}, mapped_len: {}, is_pmem: {}", filename, mapped_len, is_pmem);
   }
-  start_ = reinterpret_cast<char *>(pmemaddr);
-  const uint64_t record_num_per_round_buffer = (PmapBufferWriterSize) / RecordSize;
-  // 每次刷的字节数
-  const uint64_t bytes_per_round_buffer = record_num_per_round_buffer * RecordSize;
-  curr_ = start_ + (mmap_writer_->GetCommitCnt() / record_num_per_round_buffer) * bytes_per_round_buffer;
+  if (is_pmem_out != nullptr) {
+    *is_pmem_out = is_pmem != 0;
+  }
+  return reinterpret_cast<char *>(pmemaddr);
+}
 
-  if (create_file) {
-    pmem_memset_nodrain(start_, 0, pool_size_);
+PmapBufferWriter::PmapBufferWriter(const std::string &filename, size_t segment_size, size_t max_segments,
+                                   int durability, GroupCommitter *committer, BufferFlusher *flusher, int layout)
+    : mmap_writer_(nullptr), segment_size_(segment_size), max_segments_(max_segments)
+    , segment_slots_(segment_size / RecordSize), segment_(0), reserved_segments_(0), spare_segments_(0)
+    , is_pmem_(false), start_(nullptr), curr_(nullptr), crcs_(nullptr)
+    , durability_(durability), committer_(committer), uncommitted_(0), group_done_(false)
+    , flusher_(durability == Durability::Async ? flusher : nullptr), flush_src_(nullptr), flushing_(false) {
+  static_assert(PmapBufferCount >= 2, "background flush needs at least two buffers");
+
+  buff_filename_ = filename + PmapBufferWriterFileNameSuffix;
+  pmem_filename_ = filename;
+  if (segment_size_ % PmapBufferWriterSize != 0) {
+    spdlog::error("[PmapBufferWriter] segment size {} is not a multiple of buffer size", segment_size_);
+    exit(1);
+  }
+  if (durability_ == Durability::GroupCommit && committer_ == nullptr) {
+    spdlog::error("[PmapBufferWriter] group commit without committer");
+    exit(1);
+  }
+  // MmapBufferWriter要求文件已经存在
+  Util::CreateIfNotExists(buff_filename_);
+  mmap_writer_ = new MmapBufferWriter(buff_filename_, PmapBufferWriterFileSize, layout);
+  if (mmap_writer_->GetFlushCnt() > mmap_writer_->GetCommitCnt()) {
+    // 上次截断到一半时crash
+    mmap_writer_->SetFlushCnt(mmap_writer_->GetCommitCnt());
+    flush_meta();
     pmem_drain();
+    mmap_writer_->Restore();
+  }
+  open_flushed_segment();
+
+  // 上次退出(或crash)时还没有刷入pmem的、写满的buffer先刷入，之后当前buffer一定没有写满，
+  // 这样durable_append中写buffer一定成功
+  while (mmap_writer_->GetCommitCnt() - mmap_writer_->GetFlushCnt() >= PmapBufferRecords) {
+    flush_block(mmap_writer_->Data());
+    mmap_writer_->Restore();
+  }
+
+  // 已经存在的segment都是分配好的(包括截断之后留下的)，buffer中的记录所在的segment也要分配好
+  reserved_segments_ = segment_ + 1;
+  while (Util::FileExists(SegmentFileName(pmem_filename_, reserved_segments_))) {
+    reserved_segments_++;
+  }
+  if (!reserve_segments(0)) {
+    spdlog::error("[PmapBufferWriter] no space for the segments of {} committed records", Count());
+    exit(1);
   }
 }
 
 PmapBufferWriter::~PmapBufferWriter() {
   // don't need to flush buffer (mmap always there, havn't disappear)
+  wait_flush();
   delete mmap_writer_;
   pmem_drain();
-  pmem_unmap(start_, pool_size_);
+  pmem_unmap(start_, pmem_segment_file_size(segment_size_));
 }
 
-PmapBufferReader::PmapBufferReader(const std::string &filename, size_t pool_size)
-    : mmap_reader_(nullptr), pool_size_(pool_size)
-    , start_(nullptr), curr_(nullptr), must_have_flush_cnt_(0) {
+int PmapBufferWriter::durable_append(const void* datas, size_t num) {
+  auto start = std::chrono::steady_clock::now();
+  const char *data = reinterpret_cast<const char *>(datas);
+  stats_.records += num;
+  while (num > 0) {
+    // buffer写满时已经提前刷入pmem，因此这里至少写入一条
+    size_t n = mmap_writer_->WriteBatch(data, num);
+    data += n * RecordSize;
+    num -= n;
+    uncommitted_ += n;
+    if (durability_ == Durability::PerRecord) {
+      // 先保证数据持久化，再提交commit_cnt，否则crash之后可能读到写了一半的记录
+      flush_uncommitted();
+      pmem_drain();
+      commit_uncommitted();
+      pmem_drain();
+      stats_.drains += 2;
+    } else {
+      committer_->Commit(this);
+    }
+    if (mmap_writer_->Full()) {
+      flush_buffer();
+    }
+  }
+  uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+  stats_.commit_ns += ns;
+  stats_.max_commit_ns = std::max(stats_.max_commit_ns, ns);
+  return 0;
+}
 
-  buff_filename_ = filename + PmapBufferWriterFileNameSuffix;
-  pmem_filename_ = filename;
-  mmap_reader_ = new MmapBufferReader(buff_filename_, PmapBufferWriterFileSize);
+void PmapBufferWriter::flush_buffer() {
+  if (flusher_ != nullptr) {
+    // 每个writer最多一个buffer在后台刷入: 等上一个buffer刷完，环中的下一个buffer就一定是空闲的
+    wait_flush();
+    flush_src_ = mmap_writer_->Data();
+    flushing_.store(true, std::memory_order_relaxed);
+    mmap_writer_->Reset();
+    flusher_->Submit(this);
+    return;
+  }
+  flush_block(mmap_writer_->Data());
+  mmap_writer_->Reset();
+}
 
-  bool create_file = !Util::FileExists(pmem_filename_);
-  // 2. mmap
-  void* pmemaddr = NULL;
-	size_t mapped_len;
-	int is_pmem;
-	if ((pmemaddr = pmem_map_file(pmem_filename_.c_str(), pool_size_,
-				PMEM_FILE_CREATE, 0666, &mapped_len, &is_pmem)) == NULL) {
-		perror("pmem_map_file");
-		exit(1);
-	}
-  if (mapped_len != pool_size_ || is_pmem == 0) {
-    spdlog::warn("[PmapBufferReader] unexpected error happen when pmem_map_file, mapped_len: {}, is_pmem: {}", mapped_len, is_pmem);
+void PmapBufferWriter::wait_flush() {
+  if (likely(!flushing_.load(std::memory_order_acquire))) {
+    return;
   }
+  auto start = std::chrono::steady_clock::now();
+  for (int spin = 0; flushing_.load(std::memory_order_acquire); spin++) {
+    if (spin < 1024 && flusher_->Spin()) {
+      _mm_pause();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  stats_.flush_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
 
-  start_ = reinterpret_cast<char *>(pmemaddr);
-  curr_ = start_;
-  if (create_file) {
-    pmem_memset_nodrain(start_, 0, pool_size_);
+void PmapBufferWriter::flush_block(const char *block) {
+  auto start = std::chrono::steady_clock::now();
+  if (unlikely(curr_ == start_ + segment_size_)) {
+    next_segment();
+  }
+  const size_t bytes = PmapBufferWriterSize;
+  // buffer还在cache中，和数据一起写入crc，crc和数据共用一次drain
+  uint32_t *crc = crcs_ + (curr_ - start_) / PmapBufferWriterSize;
+  *crc = Crc32c(block, bytes);
+  pmem_memcpy(curr_, block, bytes, PMEM_F_MEM_NODRAIN|PMEM_F_MEM_NONTEMPORAL|PMEM_F_MEM_WC);
+  pmem_flush(crc, sizeof(uint32_t));
+  stats_.CountXPLines(curr_, bytes);
+  stats_.CountXPLines(crc, sizeof(uint32_t));
+  if (durability_ != Durability::Async) {
+    // buffer马上会被覆盖，因此必须等数据在pmem上持久化之后再修改flush_cnt
+    if (!is_pmem_) {
+      pmem_msync(curr_, bytes);
+      pmem_msync(crc, sizeof(uint32_t));
+    }
     pmem_drain();
+    stats_.drains++;
+  } else if (flusher_ != nullptr) {
+    // 后台刷入时drain不占用writer的时间: drain之后再修改flush_cnt，flush_cnt不会超前于pmem中的数据
+    pmem_drain();
+    stats_.drains++;
   }
-  uint64_t record_num_per_round_buffer = PmapBufferWriterSize / RecordSize;
-  if (mmap_reader_->CommitCnt() != 0 && mmap_reader_->CommitCnt() % record_num_per_round_buffer == 0) {
-    // 当buffer刚刚写满时，下一次写，才会刷buffer到pmem中
-    must_have_flush_cnt_ = mmap_reader_->CommitCnt() - record_num_per_round_buffer;
+  curr_ += bytes;
+  mmap_writer_->SetFlushCnt(mmap_writer_->GetFlushCnt() + PmapBufferRecords);
+  if (durability_ != Durability::Async) {
+    flush_meta();
+    pmem_drain();
+    stats_.drains++;
+  }
+  stats_.flushes++;
+  stats_.flush_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+// 记录写入buffer之前所在的segment就已经分配好，这里只需要映射
+void PmapBufferWriter::next_segment() {
+  // Async模式下之前的non-temporal store还没有drain
+  pmem_drain();
+  pmem_unmap(start_, pmem_segment_file_size(segment_size_));
+  segment_++;
+  start_ = map_pmem_segment(SegmentFileName(pmem_filename_, segment_), pmem_segment_file_size(segment_size_), &is_pmem_);
+  crcs_ = reinterpret_cast<uint32_t *>(start_ + segment_size_);
+  curr_ = start_;
+}
+
+bool PmapBufferWriter::reserve_segments(size_t num) {
+  const uint64_t need = Count() + uncommitted_ + num;
+  while (need > reserved_slots()) {
+    if (max_segments_ > 0 && reserved_segments_ >= max_segments_) {
+      spdlog::warn("[PmapBufferWriter] {} reach max segments {}", pmem_filename_, max_segments_);
+      spare_segments_ = 0;
+      return false;
+    }
+    if (!allocate_file(SegmentFileName(pmem_filename_, reserved_segments_), pmem_segment_file_size(segment_size_))) {
+      spdlog::warn("[PmapBufferWriter] no space for segment {} of {}", reserved_segments_, pmem_filename_);
+      spare_segments_ = 0;
+      return false;
+    }
+    reserved_segments_++;
+  }
+  update_spare_segments();
+  return true;
+}
+
+void PmapBufferWriter::update_spare_segments() {
+  spare_segments_ = available_bytes(pmem_filename_) / pmem_segment_file_size(segment_size_);
+  if (max_segments_ > 0) {
+    spare_segments_ = std::min(spare_segments_, max_segments_ - std::min(max_segments_, reserved_segments_));
+  }
+}
+
+void PmapBufferWriter::flush_uncommitted() {
+  // 未提交的记录都在当前buffer的末尾
+  char *block = mmap_writer_->Data();
+  size_t first = mmap_writer_->Used() - uncommitted_;
+  if (mmap_writer_->Layout() == PmemLayout::PmemRowLayout) {
+    flush_range(block + first * RecordSize, uncommitted_ * RecordSize);
   } else {
-    must_have_flush_cnt_ = mmap_reader_->CommitCnt() - mmap_reader_->CommitCnt() % record_num_per_round_buffer;
+    flush_range(block + first * XPLineSize, uncommitted_ * XPLineSize);
+    flush_range(XPLineSide(block, first), uncommitted_ * XPLineSideWidth);
   }
-  read_cnt_ = 0;
+}
+
+void PmapBufferWriter::commit_uncommitted() {
+  mmap_writer_->Commit(uncommitted_);
+  flush_meta();
+  uncommitted_ = 0;
+}
+
+void PmapBufferWriter::open_flushed_segment() {
+  // 前flush_cnt条记录已经刷入pmem，刚好写满一个segment时停在这个segment的末尾，下次刷buffer时再创建新的segment
+  uint64_t flush_cnt = mmap_writer_->GetFlushCnt();
+  segment_ = flush_cnt / segment_slots_;
+  uint64_t offset = flush_cnt % segment_slots_;
+  if (flush_cnt > 0 && offset == 0) {
+    segment_--;
+    offset = segment_slots_;
+  }
+  start_ = map_pmem_segment(SegmentFileName(pmem_filename_, segment_), pmem_segment_file_size(segment_size_), &is_pmem_);
+  crcs_ = reinterpret_cast<uint32_t *>(start_ + segment_size_);
+  curr_ = start_ + offset * RecordSize;
+}
+
+void PmapBufferWriter::Truncate(uint64_t cnt) {
+  wait_flush();
+  if (cnt >= Count()) {
+    return;
+  }
+  const bool flushed = cnt < mmap_writer_->GetFlushCnt();
+  if (flushed && cnt % PmapBufferRecords != 0) {
+    spdlog::error("[PmapBufferWriter] {} can't truncate to {} inside a flushed block", pmem_filename_, cnt);
+    exit(1);
+  }
+  // 先持久化commit_cnt，crash时flush_cnt > commit_cnt的状态由构造函数修复
+  mmap_writer_->SetCommitCnt(cnt);
+  flush_meta();
+  pmem_drain();
+  if (flushed) {
+    mmap_writer_->SetFlushCnt(cnt);
+    flush_meta();
+    pmem_drain();
+    pmem_unmap(start_, pmem_segment_file_size(segment_size_));
+    open_flushed_segment();
+  }
+  mmap_writer_->Restore();
+}
+
+void PmapBufferWriter::flush_range(const char *addr, size_t len) {
+  mmap_writer_->Flush(addr, len);
+  stats_.CountXPLines(addr, len);
+}
+
+void PmapBufferWriter::flush_meta() {
+  flush_range(mmap_writer_->Meta(), PmapBufferWriterMetaSize);
+}
+
+PmapBufferReader::PmapBufferReader(const std::string &filename, size_t segment_size, int layout)
+    : mmap_reader_(nullptr), segment_size_(segment_size), segment_slots_(segment_size / RecordSize), layout_(layout)
+    , segment_(0), start_(nullptr), must_have_flush_cnt_(0), read_cnt_(0), limit_(UINT64_MAX) {
+
+  buff_filename_ = filename + PmapBufferWriterFileNameSuffix;
+  pmem_filename_ = filename;
+  mmap_reader_ = new MmapBufferReader(buff_filename_, PmapBufferWriterFileSize, layout_);
+
+  start_ = map_pmem_segment(SegmentFileName(pmem_filename_, segment_), pmem_segment_file_size(segment_size_), nullptr);
+  // 前flush_cnt条记录已经刷入pmem，剩下的在buffer中
+  must_have_flush_cnt_ = mmap_reader_->FlushCnt();
 }
 
 PmapBufferReader::~PmapBufferReader() {
   delete mmap_reader_;
-  pmem_unmap(start_, pool_size_);
+  pmem_unmap(start_, pmem_segment_file_size(segment_size_));
+}
+
+uint64_t PmapBufferReader::Verify() {
+  const size_t block_records = PmapBufferWriterSize / RecordSize;
+  const size_t segment_blocks = segment_size_ / PmapBufferWriterSize;
+  uint64_t blocks = must_have_flush_cnt_ / block_records;
+  std::vector<uint32_t> crcs(segment_blocks);
+  for (uint64_t first = 0; first < blocks; first += segment_blocks) {
+    size_t segment = first / segment_blocks;
+    // 第0个segment已经映射了
+    char *start = start_;
+    if (segment > 0) {
+      start = map_pmem_segment(SegmentFileName(pmem_filename_, segment), pmem_segment_file_size(segment_size_), nullptr);
+    }
+    size_t n = std::min<uint64_t>(segment_blocks, blocks - first);
+    Crc32cBlocks(start, PmapBufferWriterSize, n, crcs.data());
+    const uint32_t *expected = reinterpret_cast<const uint32_t *>(start + segment_size_);
+    size_t bad = std::mismatch(crcs.begin(), crcs.begin() + n, expected).first - crcs.begin();
+    if (segment > 0) {
+      pmem_unmap(start, pmem_segment_file_size(segment_size_));
+    }
+    if (bad < n) {
+      limit_ = (first + bad) * block_records;
+      must_have_flush_cnt_ = limit_;
+      spdlog::warn("[PmapBufferReader] {} block {} checksum mismatch, drop {} records after it",
+                   pmem_filename_, first + bad, mmap_reader_->CommitCnt() - limit_);
+      break;
+    }
+  }
+  return Count();
 }
 
 bool PmapBufferReader::ReadRecord(char *&record, int len) {
-  if (curr_ + len > start_ + pool_size_) {
-    spdlog::error("[PmapBufferReader] error");
-    exit(1);
+  if (read_cnt_ >= limit_) {
+    return false;
   }
   // 1. reader from pmem
   if (read_cnt_ < must_have_flush_cnt_) {
-    record = curr_;
-    curr_ += len;
+    // 还有已经刷入pmem的记录，所以下一个segment一定存在
+    if (read_cnt_ / segment_slots_ != segment_) {
+      pmem_unmap(start_, pmem_segment_file_size(segment_size_));
+      segment_++;
+      start_ = map_pmem_segment(SegmentFileName(pmem_filename_, segment_), pmem_segment_file_size(segment_size_), nullptr);
+    }
+    size_t slot = read_cnt_ % segment_slots_;
+    if (layout_ == PmemLayout::PmemRowLayout) {
+      record = start_ + slot * len;
+    } else {
+      GatherXPLineRecord(start_ + slot / PmapBufferRecords * PmapBufferWriterSize, slot % PmapBufferRecords, scratch_);
+      record = scratch_;
+    }
     read_cnt_++;
     return true;
   }
   // 2. read from mmap buffer
-  // 因为封装的mmap_reader作为buffer重复利用，因此mmap_reader中的commit_cnt_作为所有record的个数，
-  // 因此mmap_reader_->ReadRecord的返回值不可信，可能溢出coredump, 需要在调用之前做判断
+  // 还没有刷入pmem的记录在buffer环中(最多PmapBufferCount个buffer)
   if (read_cnt_ >= mmap_reader_->CommitCnt()) {
     return false;
   }
-  mmap_reader_->ReadRecord(record, len);
+  record = mmap_reader_->Record(read_cnt_, scratch_);
   read_cnt_++;
   return true;
 }
+
+//--------------------- durability -----------------------------------
+void DurabilityStats::Merge(const DurabilityStats &other) {
+  records += other.records;
+  flushes += other.flushes;
+  flush_ns += other.flush_ns;
+  drains += other.drains;
+  commit_ns += other.commit_ns;
+  max_commit_ns = std::max(max_commit_ns, other.max_commit_ns);
+  flush_wait_ns += other.flush_wait_ns;
+  xplines += other.xplines;
+  partial_xplines += other.partial_xplines;
+}
+
+void DurabilityStats::Report(int durability) const {
+  static const char *durability_name[3] = {"Async", "PerRecord", "GroupCommit"};
+  double records_per_drain = drains == 0 ? 0 : double(records) / drains;
+  double avg_commit_us = records == 0 ? 0 : double(commit_ns) / records / 1000;
+  double flush_mbps = flush_ns == 0 ? 0 : double(flushes) * PmapBufferWriterSize * 1000 / flush_ns;
+  double write_amp = records == 0 ? 0 : double(xplines) * XPLineSize / (records * RecordSize);
+  spdlog::info("[Durability:{}] records: {}, drains: {}, records per drain: {:.2f}, "
+               "avg commit latency: {:.3f}us, max commit latency: {:.3f}us, "
+               "flushes: {}, flush bandwidth: {:.1f}MB/s, waiting for background flush: {:.3f}ms, "
+               "xplines: {} ({} partial), write amplification: {:.2f}",
+               durability_name[durability], records, drains, records_per_drain,
+               avg_commit_us, max_commit_ns / 1000.0, flushes, flush_mbps, flush_wait_ns / 1e6,
+               xplines, partial_xplines, write_amp);
+}
+
+GroupCommitter::GroupCommitter(size_t max_batch, int window_us)
+  : mtx_(), cv_(), pending_(), leader_active_(false)
+  , max_batch_(max_batch), window_(window_us) {
+}
+
+void GroupCommitter::Commit(PmapBufferWriter *writer) {
+  std::unique_lock<std::mutex> lock(mtx_);
+  writer->group_done_ = false;
+  pending_.push_back(writer);
+  if (leader_active_) {
+    // follower: 等待leader把本writer的记录持久化
+    if (pending_.size() >= max_batch_) {
+      cv_.notify_all();
+    }
+    cv_.wait(lock, [writer]{ return writer->group_done_; });
+    return;
+  }
+  // leader: 等待时间窗口或者攒够一组
+  leader_active_ = true;
+  cv_.wait_for(lock, window_, [this]{ return pending_.size() >= max_batch_; });
+  std::vector<PmapBufferWriter *> group;
+  group.swap(pending_);
+  // 之后到达的writer由新的leader负责，和本组并行持久化
+  leader_active_ = false;
+  lock.unlock();
+
+  // follower都阻塞在Commit中，因此leader可以安全地操作它们的buffer
+  for (auto w: group) {
+    w->flush_uncommitted();
+  }
+  pmem_drain();
+  for (auto w: group) {
+    w->commit_uncommitted();
+  }
+  pmem_drain();
+  writer->stats_.drains += 2;
+
+  lock.lock();
+  for (auto w: group) {
+    w->group_done_ = true;
+  }
+  cv_.notify_all();
+}
+
+// 每个cpu所在的socket，读不到时当作socket 0
+static std::vector<int> cpu_sockets() {
+  long cpus = sysconf(_SC_NPROCESSORS_CONF);
+  std::vector<int> sockets(cpus > 0 ? cpus : 1, 0);
+  for (size_t cpu = 0; cpu < sockets.size(); cpu++) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%zu/topology/physical_package_id", cpu);
+    FILE *fp = fopen(path, "r");
+    if (fp == nullptr) {
+      continue;
+    }
+    if (fscanf(fp, "%d", &sockets[cpu]) != 1 || sockets[cpu] < 0) {
+      sockets[cpu] = 0;
+    }
+    fclose(fp);
+  }
+  return sockets;
+}
+
+BufferFlusher::BufferFlusher() : workers_(), cpu_worker_(), spin_(std::thread::hardware_concurrency() > 1) {
+  std::vector<int> sockets = cpu_sockets();
+  std::vector<int> socket_worker;  // socket id -> worker
+  std::vector<cpu_set_t> worker_cpus;
+  for (size_t cpu = 0; cpu < sockets.size(); cpu++) {
+    int socket = sockets[cpu];
+    if (socket >= (int)socket_worker.size()) {
+      socket_worker.resize(socket + 1, -1);
+    }
+    if (socket_worker[socket] < 0) {
+      socket_worker[socket] = worker_cpus.size();
+      worker_cpus.emplace_back();
+      CPU_ZERO(&worker_cpus.back());
+    }
+    CPU_SET(cpu, &worker_cpus[socket_worker[socket]]);
+    cpu_worker_.push_back(socket_worker[socket]);
+  }
+  for (size_t i = 0; i < worker_cpus.size(); i++) {
+    workers_.emplace_back(new Worker());
+    Worker *worker = workers_.back().get();
+    worker->thread = std::thread(&BufferFlusher::run, this, worker);
+    if (pthread_setaffinity_np(worker->thread.native_handle(), sizeof(cpu_set_t), &worker_cpus[i]) != 0) {
+      spdlog::warn("[BufferFlusher] failed to bind flusher {} to its socket", i);
+    }
+  }
+  spdlog::info("[BufferFlusher] {} background flusher(s), one per socket", workers_.size());
+}
+
+BufferFlusher::~BufferFlusher() {
+  for (auto &worker: workers_) {
+    {
+      std::lock_guard<std::mutex> lock(worker->mtx);
+      worker->stop = true;
+    }
+    worker->cv.notify_one();
+    worker->thread.join();
+  }
+}
+
+void BufferFlusher::Submit(PmapBufferWriter *writer) {
+  int cpu = sched_getcpu();
+  Worker *worker = workers_[cpu >= 0 && cpu < (int)cpu_worker_.size() ? cpu_worker_[cpu] : 0].get();
+  bool wake;
+  {
+    std::lock_guard<std::mutex> lock(worker->mtx);
+    worker->queue.push_back(writer);
+    worker->pending.fetch_add(1, std::memory_order_release);
+    wake = worker->sleeping;
+  }
+  // worker空闲一段时间之后才会睡眠，忙的时候提交不需要唤醒(系统调用)
+  if (wake) {
+    worker->cv.notify_one();
+  }
+}
+
+void BufferFlusher::run(Worker *worker) {
+  // 空闲超过idle之后才睡眠，连续写入时writer提交buffer不需要唤醒flusher
+  const auto idle = std::chrono::microseconds(100);
+  auto last_work = std::chrono::steady_clock::now();
+  while (true) {
+    while (spin_ && worker->pending.load(std::memory_order_acquire) == 0 &&
+           std::chrono::steady_clock::now() - last_work < idle) {
+      _mm_pause();
+    }
+    std::unique_lock<std::mutex> lock(worker->mtx);
+    if (worker->queue.empty()) {
+      if (worker->stop) {
+        return;
+      }
+      worker->sleeping = true;
+      worker->cv.wait(lock, [worker]{ return !worker->queue.empty() || worker->stop; });
+      worker->sleeping = false;
+      if (worker->queue.empty()) {
+        return;
+      }
+    }
+    PmapBufferWriter *writer = worker->queue.front();
+    worker->queue.pop_front();
+    worker->pending.fetch_sub(1, std::memory_order_relaxed);
+    lock.unlock();
+    writer->flush_block(writer->flush_src_);
+    writer->flushing_.store(false, std::memory_order_release);
+    last_work = std::chrono::steady_clock::now();
+  }
+}
@@ -0,0 +1,131 @@
+#include "manifest.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "spdlog/spdlog.h"
+#include "crc32c.h"
+
+struct ManifestHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t crc;  // 整个文件的crc32c，计算时这个字段为0
+  uint32_t layout_version;
+  int32_t disk_log_format;
+  int32_t pmem_layout;
+  int32_t aep_share;
+  uint64_t disk_segment_size;
+  uint64_t pmem_segment_size;
+  int32_t last_phase;
+  int32_t clean;
+  uint64_t log_num;
+};
+
+// buf是副本，crc字段清零之后计算
+static uint32_t manifest_crc(std::vector<char> buf) {
+  reinterpret_cast<ManifestHeader *>(buf.data())->crc = 0;
+  return Crc32c(buf.data(), buf.size());
+}
+
+uint64_t EngineManifest::RecordNum() const {
+  uint64_t record_num = 0;
+  for (uint64_t cnt : disk_counts) {
+    record_num += cnt;
+  }
+  for (uint64_t cnt : pmem_counts) {
+    record_num += cnt;
+  }
+  return record_num;
+}
+
+bool EngineManifest::Usable(const EngineConfig &config) const {
+  return clean && layout_version == ManifestLayoutVersion && disk_log_format == config.disk_log_format
+    && pmem_layout == config.pmem_layout && disk_segment_size == config.disk_segment_size
+    && pmem_segment_size == config.pmem_segment_size;
+}
+
+bool EngineManifest::Load(const std::string &path, EngineManifest *manifest) {
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (fp == nullptr) {
+    return false;
+  }
+  std::vector<char> buf;
+  char chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+    buf.insert(buf.end(), chunk, chunk + n);
+  }
+  fclose(fp);
+
+  const ManifestHeader *h = reinterpret_cast<const ManifestHeader *>(buf.data());
+  bool valid = buf.size() >= sizeof(ManifestHeader) && h->magic == ManifestMagic && h->version == ManifestVersion
+    && buf.size() == sizeof(ManifestHeader) + h->log_num * 2 * sizeof(uint64_t) && h->crc == manifest_crc(buf)
+    && h->last_phase >= Phase::Hybrid && h->last_phase <= Phase::ReadOnly;
+  if (!valid) {
+    spdlog::warn("[EngineManifest] invalid manifest {}, ignore it", path);
+    return false;
+  }
+  manifest->layout_version = h->layout_version;
+  manifest->disk_log_format = h->disk_log_format;
+  manifest->pmem_layout = h->pmem_layout;
+  manifest->aep_share = h->aep_share;
+  manifest->disk_segment_size = h->disk_segment_size;
+  manifest->pmem_segment_size = h->pmem_segment_size;
+  manifest->last_phase = h->last_phase;
+  manifest->clean = h->clean != 0;
+  const uint64_t *counts = reinterpret_cast<const uint64_t *>(buf.data() + sizeof(ManifestHeader));
+  manifest->disk_counts.assign(counts, counts + h->log_num);
+  manifest->pmem_counts.assign(counts + h->log_num, counts + h->log_num * 2);
+  return true;
+}
+
+int EngineManifest::Save(const std::string &path) const {
+  if (disk_counts.size() != pmem_counts.size()) {
+    spdlog::error("[EngineManifest] {} disk logs but {} pmem logs", disk_counts.size(), pmem_counts.size());
+    return -1;
+  }
+  const uint64_t log_num = disk_counts.size();
+  std::vector<char> buf(sizeof(ManifestHeader) + log_num * 2 * sizeof(uint64_t));
+  ManifestHeader *h = reinterpret_cast<ManifestHeader *>(buf.data());
+  h->magic = ManifestMagic;
+  h->version = ManifestVersion;
+  h->layout_version = layout_version;
+  h->disk_log_format = disk_log_format;
+  h->pmem_layout = pmem_layout;
+  h->aep_share = aep_share;
+  h->disk_segment_size = disk_segment_size;
+  h->pmem_segment_size = pmem_segment_size;
+  h->last_phase = last_phase;
+  h->clean = clean;
+  h->log_num = log_num;
+  uint64_t *counts = reinterpret_cast<uint64_t *>(buf.data() + sizeof(ManifestHeader));
+  std::copy(disk_counts.begin(), disk_counts.end(), counts);
+  std::copy(pmem_counts.begin(), pmem_counts.end(), counts + log_num);
+  h->crc = manifest_crc(buf);
+
+  // 先写临时文件再rename，crash时不会留下写了一半的文件
+  std::string tmp_path = path + ".tmp";
+  FILE *fp = fopen(tmp_path.c_str(), "wb");
+  if (fp == nullptr) {
+    spdlog::error("[EngineManifest] can't open {}", tmp_path);
+    return -1;
+  }
+  bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size() && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  fclose(fp);
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    spdlog::error("[EngineManifest] write {} failed", path);
+    unlink(tmp_path.c_str());
+    return -1;
+  }
+  std::vector<char> dir(path.begin(), path.end());
+  dir.push_back('\0');
+  int dir_fd = open(dirname(dir.data()), O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include "partitioned_index.h"
+
+#include "spdlog/spdlog.h"
+
+PartitionFilter::PartitionFilter(size_t keys) : block_mask_(0), blocks_() {
+  size_t blocks = 1;
+  while (blocks * 512 < keys * PartitionFilterBitsPerKey) {
+    blocks <<= 1;
+  }
+  block_mask_ = blocks - 1;
+  blocks_.reset(new Block[blocks]);
+  for (size_t i = 0; i < blocks; i++) {
+    for (int j = 0; j < 8; j++) {
+      blocks_[i].words[j].store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+void PartitionFilter::Add(uint64_t hash) {
+  Block &block = blocks_[block_index(hash)];
+  uint64_t h = hash;
+  for (int i = 0; i < PartitionFilterHashes; i++) {
+    h = h * 0x9E3779B97F4A7C15ull + i;
+    uint32_t bit = h >> 55;
+    // 只有一个写者，不需要原子的或
+    std::atomic<uint64_t> &word = block.words[bit >> 6];
+    word.store(word.load(std::memory_order_relaxed) | (1ull << (bit & 63)), std::memory_order_relaxed);
+  }
+}
+
+IndexPartition::IndexPartition(size_t records)
+  : users_(), idx_id_(), idx_user_id_(), idx_salary_(), id_filter_(records), user_id_filter_(records) {
+  users_.Reserve(records);
+  idx_id_.Reserve(records);
+  idx_user_id_.Reserve(records);
+  idx_salary_.Reserve(records);
+}
+
+void IndexPartition::Insert(const User *user) {
+  size_t record_slot = users_.Append(*user);
+  // filter先于表可见: 查到filter之后才会查表
+  uint64_t hash = IndexHash(user->id);
+  id_filter_.Add(hash);
+  idx_id_.Insert(hash, user->id, record_slot + 1, false);
+
+  int64_t user_id = BlizardHashWrapper(user->user_id, UseridLen).Hash();
+  hash = IndexHash(user_id);
+  user_id_filter_.Add(hash);
+  idx_user_id_.Insert(hash, user_id, record_slot + 1, false);
+
+  // 先把原来的链表头挂到新记录上，再让新记录成为链表头
+  hash = IndexHash(user->salary);
+  users_.SetLink(record_slot, idx_salary_.Find(hash, user->salary));
+  idx_salary_.Insert(hash, user->salary, record_slot + 1, true);
+}
+
+PartitionedIndex::PartitionedIndex(int max_partitions)
+  : max_partitions_(max_partitions), partitions_(new std::atomic<IndexPartition *>[max_partitions])
+  , partition_num_(0), records_per_partition_(MinPartitionRecords) {
+  for (int i = 0; i < max_partitions_; i++) {
+    partitions_[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+PartitionedIndex::~PartitionedIndex() {
+  Clear();
+}
+
+void PartitionedIndex::Insert(int partition, const User *user) {
+  if (unlikely(partition < 0 || partition >= max_partitions_)) {
+    spdlog::error("[PartitionedIndex] partition {} out of range [0, {})", partition, max_partitions_);
+    exit(1);
+  }
+  IndexPartition *part = partitions_[partition].load(std::memory_order_relaxed);
+  if (unlikely(part == nullptr)) {
+    // 只有这个分区的写者会创建
+    part = new IndexPartition(std::max(records_per_partition_, MinPartitionRecords));
+    partitions_[partition].store(part, std::memory_order_release);
+    int num = partition_num_.load(std::memory_order_relaxed);
+    while (num < partition + 1 && !partition_num_.compare_exchange_weak(num, partition + 1, std::memory_order_release)) {
+    }
+  }
+  part->Insert(user);
+}
+
+size_t PartitionedIndex::Size() const {
+  size_t size = 0;
+  const int n = partition_num_.load(std::memory_order_acquire);
+  for (int p = 0; p < n; p++) {
+    const IndexPartition *part = partitions_[p].load(std::memory_order_acquire);
+    if (part != nullptr) {
+      size += part->Users().Size();
+    }
+  }
+  return size;
+}
+
+void PartitionedIndex::Clear() {
+  for (int p = 0; p < max_partitions_; p++) {
+    delete partitions_[p].exchange(nullptr, std::memory_order_relaxed);
+  }
+  partition_num_.store(0, std::memory_order_relaxed);
+}
@@ -16,6 +16,14 @@ void engine_write( void *ctx, const void *data, size_t len) {
     engine->Append(data);
  }
 
+void engine_write_batch( void * /* ctx */, const void *datas, size_t num) {
+    if (datas == nullptr && num > 0) {
+      spdlog::error("engine_write_batch datas is null, num = {}", num);
+      return;
+    }
+    engine->AppendBatch(datas, num);
+}
+
 size_t engine_read( void *ctx, int32_t select_column,
     int32_t where_column, const void *column_key, size_t column_key_len, void *res) {
     size_t res_num = engine->Read(ctx, select_column, where_column, column_key, column_key_len, res);
@@ -0,0 +1,379 @@
+#include "pmem_index.h"
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <string.h>
+#include <unistd.h>
+#include <libpmem.h>
+
+#include "spdlog/spdlog.h"
+#include "crc32c.h"
+#include "util.h"
+
+static uint64_t align64(uint64_t n) {
+  return (n + 63) & ~(uint64_t)63;
+}
+
+static uint32_t header_crc(const PmemIndexHeader &header) {
+  PmemIndexHeader h = header;
+  h.crc = 0;
+  h.commit = 0;
+  memset(h.counts, 0, sizeof(h.counts));
+  return Crc32c(reinterpret_cast<const char *>(&h), sizeof(h));
+}
+
+// 能放capacity条记录的分区的header，表最多3/4满
+static PmemIndexHeader make_header(uint64_t capacity) {
+  uint64_t table_capacity = 16;
+  while (table_capacity * 3 < capacity * 4) {
+    table_capacity <<= 1;
+  }
+  PmemIndexHeader h;
+  memset(&h, 0, sizeof(h));
+  h.magic = PmemIndexMagic;
+  h.version = PmemIndexVersion;
+  h.capacity = capacity;
+  h.table_capacity = table_capacity;
+  h.records_offset = align64(sizeof(PmemIndexHeader));
+  h.links_offset = align64(h.records_offset + capacity * sizeof(User));
+  h.tables_offset = align64(h.links_offset + capacity * sizeof(uint64_t));
+  h.file_size = h.tables_offset + table_capacity * 3 * 2 * sizeof(uint64_t);
+  h.crc = header_crc(h);
+  return h;
+}
+
+// 创建并映射一个空的分区文件: 新建的文件全部是0，三张表都是空的，只需要写header
+static char *create_partition(const std::string &path, uint64_t capacity, size_t *size, int *is_pmem) {
+  const PmemIndexHeader h = make_header(capacity);
+  size_t mapped_len = 0;
+  void *base = pmem_map_file(path.c_str(), h.file_size, PMEM_FILE_CREATE | PMEM_FILE_EXCL, 0644, &mapped_len, is_pmem);
+  if (base == nullptr || mapped_len != h.file_size) {
+    spdlog::error("[PmemIndex] can't create {} with size {}", path, h.file_size);
+    if (base != nullptr) {
+      pmem_unmap(base, mapped_len);
+      unlink(path.c_str());
+    }
+    return nullptr;
+  }
+  memcpy(base, &h, sizeof(h));
+  if (*is_pmem) {
+    pmem_persist(base, sizeof(h));
+  } else {
+    pmem_msync(base, sizeof(h));
+  }
+  *size = h.file_size;
+  return static_cast<char *>(base);
+}
+
+static void sync_dir(const std::string &path) {
+  std::vector<char> dir(path.begin(), path.end());
+  dir.push_back('\0');
+  int dir_fd = open(dirname(dir.data()), O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+}
+
+PmemIndexPartition *PmemIndexPartition::Open(const std::string &path, uint64_t capacity) {
+  if (Util::FileExists(path)) {
+    size_t mapped_len = 0;
+    int is_pmem = 0;
+    void *base = pmem_map_file(path.c_str(), 0, 0, 0, &mapped_len, &is_pmem);
+    if (base == nullptr) {
+      spdlog::error("[PmemIndex] can't map {}", path);
+      return nullptr;
+    }
+    // 除了commit和counts，header必须和按capacity重新计算的完全一样
+    const PmemIndexHeader &h = *static_cast<const PmemIndexHeader *>(base);
+    PmemIndexHeader expect;
+    bool valid = mapped_len >= sizeof(PmemIndexHeader) && h.magic == PmemIndexMagic && h.version == PmemIndexVersion;
+    if (valid) {
+      expect = make_header(h.capacity);
+      expect.commit = h.commit;
+      memcpy(expect.counts, h.counts, sizeof(h.counts));
+      const uint64_t *counts = h.counts[h.commit & 1];
+      valid = memcmp(&expect, &h, sizeof(h)) == 0 && h.file_size == mapped_len
+        && counts[0] <= h.capacity && counts[1] <= h.capacity - counts[0];
+    }
+    if (valid) {
+      PmemIndexPartition *part = new PmemIndexPartition(path, static_cast<char *>(base), mapped_len, is_pmem);
+      part->rollback();
+      return part;
+    }
+    // 创建到一半时crash，或者文件损坏: 从空的分区开始，调用者会发现分区不再是log的前缀而重新回放
+    spdlog::warn("[PmemIndex] invalid index partition {}, recreate it", path);
+    pmem_unmap(base, mapped_len);
+    unlink(path.c_str());
+  }
+  size_t size = 0;
+  int is_pmem = 0;
+  char *base = create_partition(path, capacity, &size, &is_pmem);
+  if (base == nullptr) {
+    return nullptr;
+  }
+  sync_dir(path);
+  return new PmemIndexPartition(path, base, size, is_pmem);
+}
+
+PmemIndexPartition *PmemIndexPartition::Grow(const std::string &path, const PmemIndexPartition &part, uint64_t capacity) {
+  const std::string tmp_path = path + ".tmp";
+  unlink(tmp_path.c_str());
+  size_t size = 0;
+  int is_pmem = 0;
+  char *base = create_partition(tmp_path, capacity, &size, &is_pmem);
+  if (base == nullptr) {
+    return nullptr;
+  }
+  std::unique_ptr<PmemIndexPartition> grown(new PmemIndexPartition(path, base, size, is_pmem));
+  // 按原来的顺序插入，id/user_id重复时保留的记录和原来相同。最后一起持久化
+  const uint64_t n = part.Size();
+  for (uint64_t i = 0; i < n; i++) {
+    grown->write_record(i, &part.Record(i));
+    grown->insert_entries(i, false);
+  }
+  grown->header_->counts[0][0] = part.DiskCount();
+  grown->header_->counts[0][1] = part.PmemCount();
+  if (is_pmem) {
+    pmem_persist(base, size);
+  } else if (pmem_msync(base, size) != 0) {
+    spdlog::error("[PmemIndex] msync {} failed", tmp_path);
+    grown.reset();
+    unlink(tmp_path.c_str());
+    return nullptr;
+  }
+  // rename之后path就是新的分区，原来的文件在unmap之前仍然可以读
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    spdlog::error("[PmemIndex] rename {} failed", tmp_path);
+    grown.reset();
+    unlink(tmp_path.c_str());
+    return nullptr;
+  }
+  sync_dir(path);
+  return grown.release();
+}
+
+PmemIndexPartition::PmemIndexPartition(const std::string &path, char *base, size_t size, int is_pmem)
+  : path_(path), base_(base), size_(size), is_pmem_(is_pmem), header_(reinterpret_cast<PmemIndexHeader *>(base))
+  , records_(reinterpret_cast<User *>(base + header_->records_offset))
+  , links_(reinterpret_cast<std::atomic<uint64_t> *>(base + header_->links_offset))
+  , tables_(reinterpret_cast<Entry *>(base + header_->tables_offset))
+  , mask_(header_->table_capacity - 1) {
+}
+
+PmemIndexPartition::~PmemIndexPartition() {
+  pmem_unmap(base_, size_);
+}
+
+PmemIndexPartition::Entry *PmemIndexPartition::slot(int table, int64_t key) const {
+  Entry *entries = tables_ + table * (mask_ + 1);
+  size_t i = IndexHash(key) & mask_;
+  while (entries[i].value.load(std::memory_order_relaxed) != 0 && entries[i].key.load(std::memory_order_relaxed) != key) {
+    i = (i + 1) & mask_;
+  }
+  return &entries[i];
+}
+
+void PmemIndexPartition::write_record(uint64_t n, const User *user) {
+  memcpy(&records_[n], user, sizeof(User));
+  // 新记录成为salary链表头，原来的链表头挂在它后面
+  links_[n].store(slot(2, user->salary)->value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void PmemIndexPartition::insert_entries(uint64_t n, bool flush) {
+  const User &user = records_[n];
+  const int64_t keys[3] = {user.id, static_cast<int64_t>(BlizardHashWrapper(user.user_id, UseridLen).Hash()), user.salary};
+  for (int table = 0; table < 3; table++) {
+    Entry *e = slot(table, keys[table]);
+    if (e->value.load(std::memory_order_relaxed) == 0) {
+      e->key.store(keys[table], std::memory_order_relaxed);
+    } else if (table != 2) {
+      // id和user_id重复时保留先写入的记录
+      continue;
+    }
+    e->value.store(n + 1, std::memory_order_release);
+    if (flush) {
+      this->flush(e, sizeof(Entry));
+    }
+  }
+}
+
+bool PmemIndexPartition::Insert(bool pmem, const User *user) {
+  const uint64_t commit = this->commit();
+  const uint64_t disk_cnt = count(commit & 1, 0), pmem_cnt = count(commit & 1, 1);
+  const uint64_t n = disk_cnt + pmem_cnt;
+  if (n == header_->capacity) {
+    return false;
+  }
+  write_record(n, user);
+  flush(&records_[n], sizeof(User));
+  flush(&links_[n], sizeof(uint64_t));
+  drain();
+  insert_entries(n, true);
+  // 另一组counts在提交之前不会被读到，和表项一起持久化
+  uint64_t *next = header_->counts[(commit + 1) & 1];
+  reinterpret_cast<std::atomic<uint64_t> *>(&next[0])->store(disk_cnt + (pmem ? 0 : 1), std::memory_order_relaxed);
+  reinterpret_cast<std::atomic<uint64_t> *>(&next[1])->store(pmem_cnt + (pmem ? 1 : 0), std::memory_order_relaxed);
+  flush(next, 2 * sizeof(uint64_t));
+  drain();
+  std::atomic<uint64_t> *c = reinterpret_cast<std::atomic<uint64_t> *>(&header_->commit);
+  c->store(commit + 1, std::memory_order_release);
+  flush(c, sizeof(uint64_t));
+  drain();
+  return true;
+}
+
+void PmemIndexPartition::rollback() {
+  const uint64_t n = Size();
+  if (n == header_->capacity) {
+    return;
+  }
+  // 第2步开始之前第1步已经持久化，所以records_[n]是完整的; 表中value为n + 1的项只可能来自这次插入
+  const User &user = records_[n];
+  const int64_t keys[3] = {user.id, static_cast<int64_t>(BlizardHashWrapper(user.user_id, UseridLen).Hash()), user.salary};
+  bool undone = false;
+  for (int table = 0; table < 3; table++) {
+    Entry *e = slot(table, keys[table]);
+    if (e->value.load(std::memory_order_relaxed) != n + 1) {
+      continue;
+    }
+    // salary表恢复原来的链表头，原来没有这个salary(以及id/user_id表)时清空这一项
+    const uint64_t old = table == 2 ? links_[n].load(std::memory_order_relaxed) : 0;
+    e->value.store(old, std::memory_order_relaxed);
+    if (old == 0) {
+      e->key.store(0, std::memory_order_relaxed);
+    }
+    flush(e, sizeof(Entry));
+    undone = true;
+  }
+  drain();
+  if (undone) {
+    spdlog::warn("[PmemIndex] roll back uncommitted record {} in {}", n, path_);
+  }
+}
+
+void PmemIndexPartition::flush(const void *addr, size_t len) const {
+  if (is_pmem_) {
+    pmem_flush(addr, len);
+  } else {
+    pmem_msync(addr, len);
+  }
+}
+
+void PmemIndexPartition::drain() const {
+  if (is_pmem_) {
+    pmem_drain();
+  }
+}
+
+PmemIndex::PmemIndex(const std::string &dir, int max_partitions)
+  : dir_(dir), max_partitions_(max_partitions), partitions_(new std::atomic<PmemIndexPartition *>[max_partitions])
+  , partition_num_(0), records_per_partition_(MinPartitionRecords), retired_mtx_(), retired_() {
+  for (int i = 0; i < max_partitions_; i++) {
+    partitions_[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+PmemIndex::~PmemIndex() {
+  // 只unmap，分区文件留给下一次启动
+  for (int p = 0; p < max_partitions_; p++) {
+    delete partitions_[p].exchange(nullptr, std::memory_order_relaxed);
+  }
+  for (PmemIndexPartition *part : retired_) {
+    delete part;
+  }
+}
+
+std::string PmemIndex::path(int partition) const {
+  return Util::DataFileName(dir_, PmemIndexFileNamePrefix, partition);
+}
+
+void PmemIndex::publish(int partition, PmemIndexPartition *part) {
+  partitions_[partition].store(part, std::memory_order_release);
+  int num = partition_num_.load(std::memory_order_relaxed);
+  while (num < partition + 1 && !partition_num_.compare_exchange_weak(num, partition + 1, std::memory_order_release)) {
+  }
+}
+
+void PmemIndex::Insert(int partition, bool pmem, const User *user) {
+  if (unlikely(partition < 0 || partition >= max_partitions_)) {
+    spdlog::error("[PmemIndex] partition {} out of range [0, {})", partition, max_partitions_);
+    exit(1);
+  }
+  PmemIndexPartition *part = partitions_[partition].load(std::memory_order_relaxed);
+  if (unlikely(part == nullptr)) {
+    // 只有这个分区的写者会创建
+    part = PmemIndexPartition::Open(path(partition), std::max(records_per_partition_, MinPartitionRecords));
+    if (part == nullptr) {
+      exit(1);
+    }
+    publish(partition, part);
+  }
+  if (likely(part->Insert(pmem, user))) {
+    return;
+  }
+  PmemIndexPartition *grown = PmemIndexPartition::Grow(path(partition), *part, part->Capacity() * 2);
+  if (grown == nullptr) {
+    exit(1);
+  }
+  publish(partition, grown);
+  {
+    std::lock_guard<std::mutex> lock(retired_mtx_);
+    retired_.push_back(part);
+  }
+  spdlog::info("[PmemIndex] grow partition {} to {} records", partition, grown->Capacity());
+  grown->Insert(pmem, user);
+}
+
+size_t PmemIndex::Size() const {
+  size_t size = 0;
+  const int n = partition_num_.load(std::memory_order_acquire);
+  for (int p = 0; p < n; p++) {
+    const PmemIndexPartition *part = partitions_[p].load(std::memory_order_acquire);
+    if (part != nullptr) {
+      size += part->Size();
+    }
+  }
+  return size;
+}
+
+uint64_t PmemIndex::DiskCount(int partition) const {
+  const PmemIndexPartition *part = partition < max_partitions_ ? partitions_[partition].load(std::memory_order_acquire) : nullptr;
+  return part != nullptr ? part->DiskCount() : 0;
+}
+
+uint64_t PmemIndex::PmemCount(int partition) const {
+  const PmemIndexPartition *part = partition < max_partitions_ ? partitions_[partition].load(std::memory_order_acquire) : nullptr;
+  return part != nullptr ? part->PmemCount() : 0;
+}
+
+void PmemIndex::Recover() {
+  for (int p = 0; p < max_partitions_; p++) {
+    // 扩容到一半时crash留下的临时文件
+    unlink((path(p) + ".tmp").c_str());
+    if (partitions_[p].load(std::memory_order_relaxed) != nullptr || !Util::FileExists(path(p))) {
+      continue;
+    }
+    PmemIndexPartition *part = PmemIndexPartition::Open(path(p), std::max(records_per_partition_, MinPartitionRecords));
+    if (part == nullptr) {
+      exit(1);
+    }
+    publish(p, part);
+  }
+}
+
+void PmemIndex::Drop(int partition) {
+  delete partitions_[partition].exchange(nullptr, std::memory_order_relaxed);
+  unlink(path(partition).c_str());
+}
+
+void PmemIndex::Clear() {
+  for (int p = 0; p < max_partitions_; p++) {
+    Drop(p);
+  }
+  for (PmemIndexPartition *part : retired_) {
+    delete part;
+  }
+  retired_.clear();
+  partition_num_.store(0, std::memory_order_relaxed);
+}
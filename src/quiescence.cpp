@@ -0,0 +1,66 @@
+#include "quiescence.h"
+
+#include <thread>
+
+static thread_local SlotLease gate_lease_;
+static thread_local int gate_slot_ = -1;
+
+QuiescenceGate::QuiescenceGate(int capacity)
+  : capacity_(capacity), slots_(new Slot[capacity + 1])
+  , registry_(std::make_shared<SlotRegistry>(capacity)), closed_(false), mtx_(), cv_() {
+  for (int i = 0; i <= capacity_; i++) {
+    slots_[i].active.store(0, std::memory_order_relaxed);
+  }
+}
+
+QuiescenceGate::Slot &QuiescenceGate::slot() {
+  if (__builtin_expect(!gate_lease_.HeldBy(registry_.get()), 0)) {
+    gate_slot_ = gate_lease_.Acquire(registry_);
+    if (gate_slot_ < 0) {
+      gate_slot_ = capacity_;
+    }
+  }
+  return slots_[gate_slot_];
+}
+
+void QuiescenceGate::Enter() {
+  Slot &s = slot();
+  s.active.fetch_add(1, std::memory_order_seq_cst);
+  while (__builtin_expect(closed_.load(std::memory_order_seq_cst), 0)) {
+    // 先退出，否则切换的线程永远等不到静默
+    s.active.fetch_sub(1, std::memory_order_seq_cst);
+    {
+      std::unique_lock<std::mutex> lock(mtx_);
+      cv_.wait(lock, [this] { return !closed_.load(); });
+    }
+    s.active.fetch_add(1, std::memory_order_seq_cst);
+  }
+}
+
+void QuiescenceGate::Exit() {
+  slot().active.fetch_sub(1, std::memory_order_release);
+}
+
+bool QuiescenceGate::TryClose() {
+  return !closed_.exchange(true, std::memory_order_seq_cst);
+}
+
+void QuiescenceGate::Drain() {
+  // 扫描全部slot(几千次load)，不依赖租用slot和计数之间的顺序
+  for (int i = 0; i <= capacity_; i++) {
+    int spins = 0;
+    while (slots_[i].active.load(std::memory_order_seq_cst) != 0) {
+      if (++spins > 64) {
+        std::this_thread::yield();
+      }
+    }
+  }
+}
+
+void QuiescenceGate::Open() {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    closed_.store(false, std::memory_order_seq_cst);
+  }
+  cv_.notify_all();
+}
@@ -0,0 +1,162 @@
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "spdlog/spdlog.h"
+#include "record_copy.h"
+#include "rte_memcpy.h"
+
+static_assert(RecordSize == 17 * 16, "record copy kernels assume 272 bytes records");
+
+//--------------------- SSE2 -----------------------------------
+static void copy_records_sse2(char *dst, const char *src, size_t num) {
+  for (size_t i = 0; i < num; i++) {
+    rte_mov272(reinterpret_cast<uint8_t *>(dst), reinterpret_cast<const uint8_t *>(src));
+    dst += RecordSize;
+    src += RecordSize;
+  }
+}
+
+static void stream_records_sse2(char *dst, const char *src, size_t num) {
+  size_t len = num * RecordSize;
+  for (size_t i = 0; i < len; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    _mm_stream_si128(reinterpret_cast<__m128i *>(dst + i), v);
+  }
+  _mm_sfence();
+}
+
+//--------------------- AVX2 -----------------------------------
+// 272 = 8 * 32 + 16
+__attribute__((target("avx2")))
+static void copy_records_avx2(char *dst, const char *src, size_t num) {
+  for (size_t i = 0; i < num; i++) {
+    for (int j = 0; j < 256; j += 32) {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + j));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + j), v);
+    }
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 256));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 256), v);
+    dst += RecordSize;
+    src += RecordSize;
+  }
+}
+
+// 记录只保证16字节对齐: 先用16字节的store对齐到32字节，中间用32字节的store，最后不足32字节的部分再用16字节
+__attribute__((target("avx2")))
+static void stream_records_avx2(char *dst, const char *src, size_t num) {
+  size_t len = num * RecordSize;
+  size_t i = 0;
+  if ((reinterpret_cast<uintptr_t>(dst) & 31) != 0) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    _mm_stream_si128(reinterpret_cast<__m128i *>(dst), v);
+    i = 16;
+  }
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    _mm256_stream_si256(reinterpret_cast<__m256i *>(dst + i), v);
+  }
+  if (i < len) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    _mm_stream_si128(reinterpret_cast<__m128i *>(dst + i), v);
+  }
+  _mm_sfence();
+}
+
+//--------------------- AVX-512 -----------------------------------
+// 272 = 4 * 64 + 16
+__attribute__((target("avx512f")))
+static void copy_records_avx512(char *dst, const char *src, size_t num) {
+  for (size_t i = 0; i < num; i++) {
+    for (int j = 0; j < 256; j += 64) {
+      __m512i v = _mm512_loadu_si512(src + j);
+      _mm512_storeu_si512(dst + j, v);
+    }
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 256));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 256), v);
+    dst += RecordSize;
+    src += RecordSize;
+  }
+}
+
+// 和avx2一样先对齐到64字节(最多3个16字节的store)，每条non-temporal store正好写满一个cache line
+__attribute__((target("avx512f")))
+static void stream_records_avx512(char *dst, const char *src, size_t num) {
+  size_t len = num * RecordSize;
+  size_t i = 0;
+  for (; i < len && ((reinterpret_cast<uintptr_t>(dst) + i) & 63) != 0; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    _mm_stream_si128(reinterpret_cast<__m128i *>(dst + i), v);
+  }
+  for (; i + 64 <= len; i += 64) {
+    __m512i v = _mm512_loadu_si512(src + i);
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + i), v);
+  }
+  for (; i < len; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    _mm_stream_si128(reinterpret_cast<__m128i *>(dst + i), v);
+  }
+  _mm_sfence();
+}
+
+//--------------------- dispatch -----------------------------------
+static const char *kernel_name[3] = {"SSE2", "AVX2", "AVX512"};
+static const RecordCopyFn copy_kernels[3] = {copy_records_sse2, copy_records_avx2, copy_records_avx512};
+static const RecordCopyFn stream_kernels[3] = {stream_records_sse2, stream_records_avx2, stream_records_avx512};
+
+// 静态初始化为SSE2(x86-64都支持)，这样其他编译单元的静态初始化中也可以使用
+RecordCopyFn CopyRecords = copy_records_sse2;
+RecordCopyFn StreamRecords = stream_records_sse2;
+static int current_kernel = RecordCopyKernel::CopySSE2;
+
+static bool kernel_supported(int kernel) {
+  __builtin_cpu_init();
+  switch (kernel) {
+    case RecordCopyKernel::CopySSE2:
+      return true;
+    case RecordCopyKernel::CopyAVX2:
+      return __builtin_cpu_supports("avx2");
+    case RecordCopyKernel::CopyAVX512:
+      return __builtin_cpu_supports("avx512f");
+    default:
+      return false;
+  }
+}
+
+int BestRecordCopyKernel() {
+  for (int kernel = RecordCopyKernel::CopyAVX512; kernel > RecordCopyKernel::CopySSE2; kernel--) {
+    if (kernel_supported(kernel)) {
+      return kernel;
+    }
+  }
+  return RecordCopyKernel::CopySSE2;
+}
+
+int SetRecordCopyKernel(int kernel) {
+  if (!kernel_supported(kernel)) {
+    return -1;
+  }
+  CopyRecords = copy_kernels[kernel];
+  StreamRecords = stream_kernels[kernel];
+  current_kernel = kernel;
+  return 0;
+}
+
+int CurrentRecordCopyKernel() {
+  return current_kernel;
+}
+
+const char *RecordCopyKernelName(int kernel) {
+  if (kernel < 0 || kernel > RecordCopyKernel::CopyAVX512) {
+    return "unknown";
+  }
+  return kernel_name[kernel];
+}
+
+static int init_record_copy() {
+  int kernel = BestRecordCopyKernel();
+  SetRecordCopyKernel(kernel);
+  spdlog::info("[RecordCopy] use {} kernel", kernel_name[kernel]);
+  return kernel;
+}
+
+static int record_copy_kernel_init = init_record_copy();
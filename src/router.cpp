@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+
+#include "spdlog/spdlog.h"
+#include "router.h"
+#include "util.h"
+
+WriteRouter::WriteRouter()
+  : path_(), aep_share_(AEPNum), rebalancing_(false)
+  , sample_ns_{{0}, {0}}, sample_records_{{0}, {0}}
+  , free_{{0}, {0}}, capacity_{{0}, {0}} {
+}
+
+void WriteRouter::Load(const std::string &path, int default_share) {
+  path_ = path;
+  aep_share_.store(default_share);
+  FILE *fp = fopen(path_.c_str(), "r");
+  if (fp == nullptr) {
+    spdlog::info("[WriteRouter] {} not exist, use default aep share {}/{}", path_, default_share, RouteWindow);
+    return;
+  }
+  int share = 0, window = 0;
+  if (fscanf(fp, "%d/%d", &share, &window) == 2 && window == RouteWindow
+      && share >= RouteMinShare && share <= RouteWindow - RouteMinShare) {
+    aep_share_.store(share);
+    spdlog::info("[WriteRouter] load aep share {}/{} from {}", share, window, path_);
+  } else {
+    spdlog::warn("[WriteRouter] invalid route file {}, use default aep share {}/{}", path_, default_share, RouteWindow);
+  }
+  fclose(fp);
+}
+
+int WriteRouter::Save() const {
+  if (path_.empty()) {
+    return -1;
+  }
+  // 先写临时文件再rename，crash时不会留下写了一半的文件
+  std::string tmp_path = path_ + ".tmp";
+  FILE *fp = fopen(tmp_path.c_str(), "w");
+  if (fp == nullptr) {
+    spdlog::error("[WriteRouter] can't open {}", tmp_path);
+    return -1;
+  }
+  fprintf(fp, "%d/%d\n", aep_share_.load(), RouteWindow);
+  fflush(fp);
+  fsync(fileno(fp));
+  fclose(fp);
+  if (rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    spdlog::error("[WriteRouter] rename {} failed", tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+void WriteRouter::Sample(bool aep, uint64_t ns, uint64_t records,
+                         uint64_t aep_free, uint64_t aep_capacity,
+                         uint64_t ssd_free, uint64_t ssd_capacity) {
+  sample_ns_[aep].fetch_add(ns, std::memory_order_relaxed);
+  sample_records_[aep].fetch_add(records, std::memory_order_relaxed);
+  free_[0].fetch_add(ssd_free, std::memory_order_relaxed);
+  free_[1].fetch_add(aep_free, std::memory_order_relaxed);
+  capacity_[0].fetch_add(ssd_capacity, std::memory_order_relaxed);
+  capacity_[1].fetch_add(aep_capacity, std::memory_order_relaxed);
+  if (sample_records_[0].load(std::memory_order_relaxed) < RouteRebalanceSamples
+      || sample_records_[1].load(std::memory_order_relaxed) < RouteRebalanceSamples) {
+    return;
+  }
+  // 只让一个线程重新计算比例
+  if (rebalancing_.exchange(true)) {
+    return;
+  }
+  rebalance();
+  rebalancing_.store(false);
+}
+
+void WriteRouter::rebalance() {
+  double ns[2], records[2], free[2], capacity[2];
+  for (int i = 0; i < 2; i++) {
+    ns[i] = sample_ns_[i].exchange(0);
+    records[i] = sample_records_[i].exchange(0);
+    free[i] = free_[i].exchange(0);
+    capacity[i] = capacity_[i].exchange(0);
+  }
+  if (records[0] == 0 || records[1] == 0 || ns[0] == 0 || ns[1] == 0) {
+    return;
+  }
+  // 1. 按吞吐分配: 两个设备写完各自份额的时间相同
+  double ssd_throughput = records[0] / ns[0];
+  double aep_throughput = records[1] / ns[1];
+  double perf_share = RouteWindow * aep_throughput / (aep_throughput + ssd_throughput);
+  // 2. 按剩余容量分配: 两个设备同时写满
+  double total_free = free[0] + free[1];
+  double total_capacity = capacity[0] + capacity[1];
+  double capacity_share = total_free == 0 ? perf_share : RouteWindow * free[1] / total_free;
+  // 3. 设备越满，越偏向按容量分配
+  double pressure = total_capacity == 0 ? 0 : 1 - total_free / total_capacity;
+  double target = (1 - pressure) * perf_share + pressure * capacity_share;
+
+  int cur = aep_share_.load();
+  int next = static_cast<int>(std::lround(target));
+  next = std::max(cur - RouteMaxStep, std::min(cur + RouteMaxStep, next));
+  next = std::max(RouteMinShare, std::min(RouteWindow - RouteMinShare, next));
+  if (next == cur) {
+    return;
+  }
+  aep_share_.store(next);
+  spdlog::info("[WriteRouter] aep share {} -> {}/{}, ssd {:.1f}ns/record, aep {:.1f}ns/record, pressure {:.2f}",
+               cur, next, RouteWindow, ns[0] / records[0], ns[1] / records[1], pressure);
+  // 这里在写线程上，不做文件IO; 比例在deinit时和MANIFEST一起保存
+}
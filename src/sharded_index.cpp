@@ -0,0 +1,317 @@
+#include "sharded_index.h"
+
+#include <stdlib.h>
+#include <new>
+#include <thread>
+
+#include "spdlog/spdlog.h"
+
+static const size_t RecordChunkSize = (size_t)1 << RecordChunkBits;
+static const size_t MinSlotTableCapacity = 16;
+
+RecordStore::RecordStore() : size_(0), chunks_(new std::atomic<Record *>[MaxRecordChunks]) {
+  for (int i = 0; i < MaxRecordChunks; i++) {
+    chunks_[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+RecordStore::~RecordStore() {
+  Clear();
+}
+
+size_t RecordStore::Append(const User &user) {
+  size_t slot = size_.fetch_add(1, std::memory_order_relaxed);
+  Record *c = chunk(slot >> RecordChunkBits);
+  new (&c[slot & (RecordChunkSize - 1)]) Record{user, 0};
+  return slot;
+}
+
+size_t RecordStore::AppendBatch(const User *users, size_t n) {
+  size_t first = size_.fetch_add(n, std::memory_order_relaxed);
+  for (size_t i = 0; i < n; i++) {
+    size_t slot = first + i;
+    Record *c = chunk(slot >> RecordChunkBits);
+    new (&c[slot & (RecordChunkSize - 1)]) Record{users[i], 0};
+  }
+  return first;
+}
+
+RecordStore::Record *RecordStore::chunk(size_t index) {
+  if (unlikely(index >= (size_t)MaxRecordChunks)) {
+    spdlog::error("[RecordStore] exceed max record chunks {}", MaxRecordChunks);
+    exit(1);
+  }
+  Record *c = chunks_[index].load(std::memory_order_acquire);
+  if (likely(c != nullptr)) {
+    return c;
+  }
+  // 多个线程同时分配同一块时只保留一个
+  Record *fresh = static_cast<Record *>(malloc(sizeof(Record) * RecordChunkSize));
+  if (fresh == nullptr) {
+    spdlog::error("[RecordStore] malloc record chunk failed");
+    exit(1);
+  }
+  if (chunks_[index].compare_exchange_strong(c, fresh, std::memory_order_acq_rel)) {
+    return fresh;
+  }
+  free(fresh);
+  return c;
+}
+
+void RecordStore::Reserve(size_t n) {
+  for (size_t i = 0; i < (n + RecordChunkSize - 1) / RecordChunkSize && i < (size_t)MaxRecordChunks; i++) {
+    chunk(i);
+  }
+}
+
+void RecordStore::Clear() {
+  for (int i = 0; i < MaxRecordChunks; i++) {
+    free(chunks_[i].exchange(nullptr, std::memory_order_relaxed));
+  }
+  size_.store(0, std::memory_order_release);
+}
+
+SlotTable::SlotTable(size_t capacity) : mask_(capacity - 1), size_(0), entries_(new Entry[capacity]) {
+  for (size_t i = 0; i < capacity; i++) {
+    entries_[i].key.store(0, std::memory_order_relaxed);
+    entries_[i].value.store(0, std::memory_order_relaxed);
+  }
+}
+
+uint64_t SlotTable::Insert(uint64_t hash, int64_t key, uint64_t value, bool overwrite) {
+  size_t i = hash & mask_;
+  for (;; i = (i + 1) & mask_) {
+    uint64_t old = entries_[i].value.load(std::memory_order_relaxed);
+    if (old == 0) {
+      break;
+    }
+    if (entries_[i].key.load(std::memory_order_relaxed) == key) {
+      if (overwrite) {
+        entries_[i].value.store(value, std::memory_order_release);
+      }
+      return old;
+    }
+  }
+  entries_[i].key.store(key, std::memory_order_relaxed);
+  entries_[i].value.store(value, std::memory_order_release);
+  size_++;
+  return 0;
+}
+
+void SlotTable::Reset() {
+  for (size_t i = 0; i <= mask_; i++) {
+    entries_[i].value.store(0, std::memory_order_relaxed);
+  }
+  size_ = 0;
+}
+
+SlotTable *SlotTable::Grow(size_t capacity) const {
+  SlotTable *table = new SlotTable(capacity);
+  for (size_t i = 0; i <= mask_; i++) {
+    uint64_t value = entries_[i].value.load(std::memory_order_relaxed);
+    if (value != 0) {
+      int64_t key = entries_[i].key.load(std::memory_order_relaxed);
+      table->Insert(IndexHash(key), key, value, false);
+    }
+  }
+  return table;
+}
+
+GrowableTable::GrowableTable() : table_(new SlotTable(MinSlotTableCapacity)), retired_() {
+}
+
+GrowableTable::~GrowableTable() {
+  for (SlotTable *table : retired_) {
+    delete table;
+  }
+  delete table_.load(std::memory_order_relaxed);
+}
+
+uint64_t GrowableTable::Insert(uint64_t hash, int64_t key, uint64_t value, bool overwrite) {
+  SlotTable *table = table_.load(std::memory_order_relaxed);
+  if (unlikely(table->Full())) {
+    SlotTable *grown = table->Grow(table->Capacity() * 2);
+    table_.store(grown, std::memory_order_release);
+    retired_.push_back(table);
+    table = grown;
+  }
+  return table->Insert(hash, key, value, overwrite);
+}
+
+void GrowableTable::Reserve(size_t n) {
+  size_t capacity = MinSlotTableCapacity;
+  while (capacity * 3 < n * 4 + 4) {
+    capacity <<= 1;
+  }
+  SlotTable *table = table_.load(std::memory_order_relaxed);
+  if (table->Capacity() < capacity) {
+    table_.store(table->Grow(capacity), std::memory_order_relaxed);
+    delete table;
+  }
+}
+
+void GrowableTable::Clear() {
+  for (SlotTable *table : retired_) {
+    delete table;
+  }
+  retired_ = std::vector<SlotTable *>();
+  delete table_.exchange(new SlotTable(MinSlotTableCapacity), std::memory_order_relaxed);
+}
+
+SeqShards::SeqShards() : shards_(new Shard[1 << IndexShardBits]) {
+  for (int i = 0; i < (1 << IndexShardBits); i++) {
+    shards_[i].seq.store(0, std::memory_order_relaxed);
+  }
+}
+
+void SeqShards::lock(Shard &s) {
+  uint64_t seq = s.seq.load(std::memory_order_relaxed);
+  int spins = 0;
+  while ((seq & 1) || !s.seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+    if (++spins > 64) {
+      std::this_thread::yield();
+    }
+    seq = s.seq.load(std::memory_order_relaxed);
+  }
+  // 版本号变成奇数之后才能修改表
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void SeqShards::unlock(Shard &s) {
+  s.seq.fetch_add(1, std::memory_order_release);
+}
+
+uint64_t SeqShards::Find(int64_t key) const {
+  uint64_t hash = IndexHash(key);
+  const Shard &s = shards_[ShardOf(hash)];
+  int spins = 0;
+  while (true) {
+    uint64_t seq = s.seq.load(std::memory_order_acquire);
+    if (likely((seq & 1) == 0)) {
+      uint64_t value = s.table.Find(hash, key);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (likely(s.seq.load(std::memory_order_relaxed) == seq)) {
+        return value;
+      }
+    }
+    // 同一个shard上有并发的写，写者可能被调度出去，不能一直空转
+    if (++spins > 64) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+uint64_t SeqShards::Insert(int64_t key, uint64_t value, bool overwrite) {
+  uint64_t hash = IndexHash(key);
+  Shard &s = shards_[ShardOf(hash)];
+  lock(s);
+  uint64_t old = s.table.Insert(hash, key, value, overwrite);
+  unlock(s);
+  return old;
+}
+
+void SeqShards::Reserve(size_t n) {
+  for (int i = 0; i < (1 << IndexShardBits); i++) {
+    shards_[i].table.Reserve(n >> IndexShardBits);
+  }
+}
+
+void SeqShards::Clear() {
+  for (int i = 0; i < (1 << IndexShardBits); i++) {
+    shards_[i].table.Clear();
+  }
+}
+
+void ShardedIndex::Insert(const User *user) {
+  size_t record_slot = users_.Append(*user);
+  idx_id_.Insert(user->id, record_slot + 1, false);
+  idx_user_id_.Insert(BlizardHashWrapper(user->user_id, UseridLen).Hash(), record_slot + 1, false);
+  // 先把原来的链表头挂到新记录上，再让新记录成为链表头
+  idx_salary_.Upsert(user->salary, record_slot + 1, [&](uint64_t head) {
+    users_.SetLink(record_slot, head);
+  });
+}
+
+void ShardedIndex::Reserve(size_t n) {
+  users_.Reserve(n);
+  idx_id_.Reserve(n);
+  idx_user_id_.Reserve(n);
+  idx_salary_.Reserve(n);
+}
+
+void ShardedIndex::Clear() {
+  users_.Clear();
+  idx_id_.Clear();
+  idx_user_id_.Clear();
+  idx_salary_.Clear();
+}
+
+ShardedIndexLoader::ShardedIndexLoader(ShardedIndex *index, int threads)
+  : index_(index), threads_(threads), workers_(new Worker[threads]) {
+  for (int w = 0; w < threads_; w++) {
+    workers_[w].pending.reserve(LoaderBatch);
+  }
+}
+
+void ShardedIndexLoader::Add(int worker, const User *user) {
+  Worker &w = workers_[worker];
+  w.pending.push_back(*user);
+  if (w.pending.size() == (size_t)LoaderBatch) {
+    flush(w);
+  }
+}
+
+// 一批记录只竞争一次RecordStore的size
+void ShardedIndexLoader::flush(Worker &w) {
+  if (w.pending.empty()) {
+    return;
+  }
+  const uint64_t first = index_->users_.AppendBatch(w.pending.data(), w.pending.size()) + 1;
+  for (size_t i = 0; i < w.pending.size(); i++) {
+    const User &user = w.pending[i];
+    int64_t user_id = BlizardHashWrapper(user.user_id, UseridLen).Hash();
+    w.buckets[0][SeqShards::ShardOf(IndexHash(user.id))].push_back(Entry{user.id, first + i});
+    w.buckets[1][SeqShards::ShardOf(IndexHash(user_id))].push_back(Entry{user_id, first + i});
+    w.buckets[2][SeqShards::ShardOf(IndexHash(user.salary))].push_back(Entry{user.salary, first + i});
+  }
+  w.pending.clear();
+}
+
+void ShardedIndexLoader::Build() {
+  for (int w = 0; w < threads_; w++) {
+    flush(workers_[w]);
+  }
+  std::vector<std::thread> builders;
+  for (int t = 0; t < threads_; t++) {
+    builders.emplace_back([this, t]() {
+      for (int shard = t; shard < (1 << IndexShardBits); shard += threads_) {
+        build_shard(shard);
+      }
+    });
+  }
+  for (auto &builder : builders) {
+    builder.join();
+  }
+}
+
+void ShardedIndexLoader::build_shard(int shard) {
+  // 按扫描线程的顺序插入，id/user_id重复时保留先插入的
+  for (int w = 0; w < threads_; w++) {
+    std::vector<Entry> *buckets[3] = {&workers_[w].buckets[0][shard], &workers_[w].buckets[1][shard],
+                                      &workers_[w].buckets[2][shard]};
+    for (const Entry &e : *buckets[0]) {
+      index_->idx_id_.InsertUnlocked(IndexHash(e.key), e.key, e.value, false);
+    }
+    for (const Entry &e : *buckets[1]) {
+      index_->idx_user_id_.InsertUnlocked(IndexHash(e.key), e.key, e.value, false);
+    }
+    for (const Entry &e : *buckets[2]) {
+      // 新记录成为链表头，原来的链表头挂在它后面
+      index_->users_.SetLink(e.value - 1, index_->idx_salary_.InsertUnlocked(IndexHash(e.key), e.key, e.value, true));
+    }
+    // 插入完马上释放，降低内存峰值
+    for (std::vector<Entry> *bucket : buckets) {
+      std::vector<Entry>().swap(*bucket);
+    }
+  }
+}
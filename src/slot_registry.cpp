@@ -0,0 +1,47 @@
+#include "slot_registry.h"
+
+SlotRegistry::SlotRegistry(int capacity)
+  : capacity_(capacity), used_(new std::atomic<bool>[capacity]), high_water_(0) {
+  for (int i = 0; i < capacity_; i++) {
+    used_[i].store(false, std::memory_order_relaxed);
+  }
+}
+
+int SlotRegistry::Acquire() {
+  // 从小到大找空闲slot，尽量复用已经有writer的slot；只在线程第一次写入时调用，线性扫描的开销可以忽略
+  for (int i = 0; i < capacity_; i++) {
+    if (used_[i].load(std::memory_order_relaxed)) {
+      continue;
+    }
+    bool expected = false;
+    if (used_[i].compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+      int high = high_water_.load(std::memory_order_relaxed);
+      while (high < i + 1 && !high_water_.compare_exchange_weak(high, i + 1, std::memory_order_release)) {
+      }
+      return i;
+    }
+  }
+  return -1;
+}
+
+void SlotRegistry::Release(int slot) {
+  // release: 上一个持有者对writer的写入对下一个租到这个slot的线程可见
+  used_[slot].store(false, std::memory_order_release);
+}
+
+int SlotLease::Acquire(const std::shared_ptr<SlotRegistry> &registry) {
+  Reset();
+  slot_ = registry->Acquire();
+  if (slot_ >= 0) {
+    registry_ = registry;
+  }
+  return slot_;
+}
+
+void SlotLease::Reset() {
+  if (registry_) {
+    registry_->Release(slot_);
+    registry_.reset();
+  }
+  slot_ = -1;
+}
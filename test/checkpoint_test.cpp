@@ -0,0 +1,115 @@
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <memory>
+#include "test_util.h"
+#include "util.h"
+#include "checkpoint.h"
+
+const char checkpoint_test_dir[] = "/tmp/checkpoint_test";
+const int checkpoint_test_logs = 4;
+const int checkpoint_test_records = 10000;
+const int checkpoint_test_salaries = 100;
+
+class CheckpointTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        EXPECT_EQ(0, rmtree(checkpoint_test_dir));
+        EXPECT_EQ(0, mkdir(checkpoint_test_dir, 0755));
+        path_ = std::string(checkpoint_test_dir) + "/" + CheckpointFileName;
+    }
+    void TearDown() override {
+        EXPECT_EQ(0, rmtree(checkpoint_test_dir));
+    }
+    // 第i条记录写到第i % logs个log，偶数log在ssd，奇数log在pmem
+    void Write(int records) {
+        CheckpointWriter writer(path_, checkpoint_test_logs, records + 10);
+        User user;
+        for (int i = 0; i < records; i++) {
+            FillUser(&user, i, checkpoint_test_salaries);
+            int log = i % checkpoint_test_logs;
+            writer.Add(log / 2, log % 2 == 1, &user);
+        }
+        ASSERT_EQ(0, writer.Finish());
+    }
+    std::string path_;
+};
+
+TEST_F(CheckpointTest, WriteOpenFind) {
+    Write(checkpoint_test_records);
+    std::unique_ptr<IndexCheckpoint> checkpoint(IndexCheckpoint::Open(path_));
+    ASSERT_NE(nullptr, checkpoint);
+    EXPECT_EQ((uint64_t)checkpoint_test_records, checkpoint->RecordNum());
+    EXPECT_EQ(checkpoint_test_logs, checkpoint->LogNum());
+    // 每个log的记录数，没有写过的log为0
+    EXPECT_EQ((uint64_t)checkpoint_test_records / 4, checkpoint->DiskCount(0));
+    EXPECT_EQ((uint64_t)checkpoint_test_records / 4, checkpoint->PmemCount(1));
+    EXPECT_EQ(0u, checkpoint->DiskCount(2));
+    EXPECT_EQ(0u, checkpoint->PmemCount(checkpoint_test_logs));
+    EXPECT_FALSE(Util::FileExists(path_ + ".tmp"));
+
+    for (int i = 0; i < checkpoint_test_records; i++) {
+        User expect;
+        FillUser(&expect, i, checkpoint_test_salaries);
+        ASSERT_EQ(1u, checkpoint->FindId(expect.id, [&](const User &u) { EXPECT_TRUE(expect == const_cast<User &>(u)); }));
+        ASSERT_EQ(1u, checkpoint->FindUserId(expect.user_id, [&](const User &u) { EXPECT_EQ(expect.id, u.id); }));
+    }
+    EXPECT_EQ(0u, checkpoint->FindId(0, [](const User &) {}));
+    EXPECT_EQ(0u, checkpoint->FindId(checkpoint_test_records + 1, [](const User &) {}));
+    for (int s = 0; s < checkpoint_test_salaries; s++) {
+        EXPECT_EQ((size_t)checkpoint_test_records / checkpoint_test_salaries,
+                  checkpoint->FindSalary(s, [&](const User &u) { EXPECT_EQ(s, u.salary); }));
+    }
+    EXPECT_EQ(0u, checkpoint->FindSalary(checkpoint_test_salaries, [](const User &) {}));
+}
+
+// 没有Finish的writer不影响原来的checkpoint
+TEST_F(CheckpointTest, UnfinishedWriter) {
+    Write(100);
+    {
+        CheckpointWriter writer(path_, checkpoint_test_logs, 1000);
+        User user;
+        FillUser(&user, 1000, checkpoint_test_salaries);
+        writer.Add(0, false, &user);
+    }
+    std::unique_ptr<IndexCheckpoint> checkpoint(IndexCheckpoint::Open(path_));
+    ASSERT_NE(nullptr, checkpoint);
+    EXPECT_EQ(100u, checkpoint->RecordNum());
+    EXPECT_FALSE(Util::FileExists(path_ + ".tmp"));
+}
+
+// header或者后面任何一段被改坏，以及文件被截断时拒绝使用
+TEST_F(CheckpointTest, RejectCorrupted) {
+    EXPECT_EQ(nullptr, IndexCheckpoint::Open(path_));
+    Write(100);
+    int fd = open(path_.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    uint64_t record_num = 1000;
+    ASSERT_EQ((ssize_t)sizeof(record_num), pwrite(fd, &record_num, sizeof(record_num), offsetof(CheckpointHeader, record_num)));
+    close(fd);
+    EXPECT_EQ(nullptr, IndexCheckpoint::Open(path_));
+
+    Write(100);
+    struct stat st;
+    ASSERT_EQ(0, stat(path_.c_str(), &st));
+    fd = open(path_.c_str(), O_RDWR);
+    ASSERT_EQ(0, ftruncate(fd, st.st_size - 8));
+    close(fd);
+    EXPECT_EQ(nullptr, IndexCheckpoint::Open(path_));
+
+    // 记录和表中的一个字节
+    Write(100);
+    CheckpointHeader header;
+    fd = open(path_.c_str(), O_RDWR);
+    ASSERT_EQ((ssize_t)sizeof(header), pread(fd, &header, sizeof(header), 0));
+    for (uint64_t offset : {header.records_offset + 10 * sizeof(User) + 1, header.tables_offset + 8}) {
+        char c;
+        ASSERT_EQ(1, pread(fd, &c, 1, offset));
+        c = ~c;
+        ASSERT_EQ(1, pwrite(fd, &c, 1, offset));
+        EXPECT_EQ(nullptr, IndexCheckpoint::Open(path_));
+        c = ~c;
+        ASSERT_EQ(1, pwrite(fd, &c, 1, offset));
+        EXPECT_NE(nullptr, std::unique_ptr<IndexCheckpoint>(IndexCheckpoint::Open(path_)));
+    }
+    close(fd);
+}
@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include "test_util.h"
+#include "config.h"
+
+const char config_test_dir[] = "/tmp/config_test";
+
+TEST(EngineConfigTest, Defaults) {
+    EXPECT_EQ(0, rmtree(config_test_dir));
+    EXPECT_EQ(0, mkdir(config_test_dir, 0755));
+    EngineConfig config = EngineConfig::Load(config_test_dir);
+    EXPECT_EQ(ClientNum, config.client_num);
+    EXPECT_EQ(WritePerClient, config.write_per_client);
+    EXPECT_EQ(AEPNum, config.aep_share);
+    EXPECT_EQ((size_t)DiskSegmentSize, config.disk_segment_size);
+    EXPECT_EQ(PmemSegmentSize, config.pmem_segment_size);
+    EXPECT_EQ((uint64_t)ClientNum * WritePerClient, config.ExpectedRecords());
+    EXPECT_EQ(0, rmtree(config_test_dir));
+}
+
+TEST(EngineConfigTest, Parse) {
+    EngineConfig config;
+    EXPECT_EQ(0, config.Parse(""));
+    EXPECT_EQ(0, config.Parse("   # comment"));
+    EXPECT_EQ(0, config.Parse("client_num = 4  # 4 clients"));
+    EXPECT_EQ(0, config.Parse("write_per_client=1000"));
+    EXPECT_EQ(0, config.Parse("\tdisk_segment_records = 100\r"));
+    EXPECT_EQ(0, config.Parse("pmem_segment_buffers = 2"));
+    EXPECT_EQ(0, config.Parse("pmem_layout = 1"));
+    EXPECT_EQ(PmemLayout::PmemXPLineLayout, config.pmem_layout);
+    EXPECT_EQ(0, config.Parse("disk_backend = 1"));
+    EXPECT_EQ(DiskBackend::DirectBackend, config.disk_backend);
+    EXPECT_EQ(0, config.Parse("index_layout = 1"));
+    EXPECT_EQ(IndexLayout::WriterPartitionedLayout, config.index_layout);
+    EXPECT_EQ(0, config.Parse("index_threads = 0"));
+    EXPECT_EQ(0, config.index_threads);
+    EXPECT_EQ(0, config.Parse("checkpoint = 0"));
+    EXPECT_FALSE(config.checkpoint);
+    EXPECT_EQ(0, config.Parse("checkpoint_interval = 60"));
+    EXPECT_EQ(60, config.checkpoint_interval);
+    EXPECT_EQ(0, config.Parse("checkpoint_on_pmem = 1"));
+    EXPECT_TRUE(config.checkpoint_on_pmem);
+    EXPECT_EQ(4, config.client_num);
+    EXPECT_EQ(4000, config.ExpectedRecords());
+    EXPECT_EQ((size_t)RecordSize * 100 + 8, config.disk_segment_size);
+    EXPECT_EQ((size_t)PmapBufferWriterSize * 2, config.pmem_segment_size);
+
+    // 无效的配置项不修改原来的值
+    EXPECT_NE(0, config.Parse("client_num = 0"));
+    EXPECT_NE(0, config.Parse("client_num = 4x"));
+    EXPECT_NE(0, config.Parse("client_num"));
+    EXPECT_NE(0, config.Parse("unknown_key = 1"));
+    EXPECT_NE(0, config.Parse("aep_share = 0"));
+    EXPECT_NE(0, config.Parse("disk_log_format = 3"));
+    EXPECT_NE(0, config.Parse("pmem_layout = 2"));
+    EXPECT_EQ(4, config.client_num);
+    EXPECT_EQ(AEPNum, config.aep_share);
+    EXPECT_EQ(DefaultDiskLogFormat, config.disk_log_format);
+}
+
+TEST(EngineConfigTest, LoadFile) {
+    EXPECT_EQ(0, rmtree(config_test_dir));
+    EXPECT_EQ(0, mkdir(config_test_dir, 0755));
+    {
+        std::ofstream out(std::string(config_test_dir) + "/" + ConfigFileName);
+        out << "# small deployment\n"
+            << "client_num = 8\n"
+            << "write_per_client = 100\n"
+            << "max_writer_slots = 4\n"
+            << "bad line\n"
+            << "durability = 1\n";
+    }
+    EngineConfig config = EngineConfig::Load(config_test_dir);
+    EXPECT_EQ(8, config.client_num);
+    EXPECT_EQ(800, config.ExpectedRecords());
+    EXPECT_EQ(Durability::PerRecord, config.durability);
+    // 同时写入的线程数上限至少是client_num
+    EXPECT_EQ(8, config.max_writer_slots);
+    EXPECT_EQ(0, rmtree(config_test_dir));
+}
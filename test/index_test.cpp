@@ -0,0 +1,289 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "sharded_index.h"
+#include "partitioned_index.h"
+#include "indexer.h"
+#include "test_util.h"
+
+const int index_test_threads = 8;
+const int index_test_per_thread = 20000;
+const int index_test_salaries = 1000;
+
+TEST(ShardedIndexTest, InsertFind) {
+    ShardedIndex index;
+    index.Reserve(1000);
+    User user;
+    for (int i = 0; i < 1000; i++) {
+        FillUser(&user, i, index_test_salaries);
+        index.Insert(&user);
+    }
+    EXPECT_EQ(1000u, index.Size());
+    for (int i = 0; i < 1000; i++) {
+        User expect;
+        FillUser(&expect, i, index_test_salaries);
+        EXPECT_EQ(1u, index.FindId(expect.id, [&](const User &u) { EXPECT_TRUE(expect == const_cast<User &>(u)); }));
+        EXPECT_EQ(1u, index.FindUserId(expect.user_id, [&](const User &u) { EXPECT_EQ(expect.id, u.id); }));
+    }
+    EXPECT_EQ(0u, index.FindId(0, [](const User &) {}));
+    // id重复时保留先写入的记录，salary链表中两条都有
+    FillUser(&user, 3, index_test_salaries);
+    user.salary = 7;
+    snprintf(user.name, sizeof(user.name), "dup");
+    index.Insert(&user);
+    EXPECT_EQ(1u, index.FindId(user.id, [](const User &u) { EXPECT_STREQ("name3", u.name); }));
+    size_t n = index.FindSalary(7, [](const User &u) { EXPECT_EQ(7, u.salary); });
+    EXPECT_EQ(2u, n);
+
+    index.Clear();
+    EXPECT_EQ(0u, index.Size());
+    EXPECT_EQ(0u, index.FindId(1, [](const User &) {}));
+}
+
+// 多个线程同时写入和查询: 自己写过的记录必须能查到并且完整，别的线程的记录查到时也必须完整
+TEST(ShardedIndexTest, ConcurrentInsertFind) {
+    ShardedIndex index;
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < index_test_threads; t++) {
+        threads.emplace_back([&, t]() {
+            User user, expect;
+            for (int i = 0; i < index_test_per_thread; i++) {
+                int64_t k = (int64_t)i * index_test_threads + t;
+                FillUser(&user, k, index_test_salaries);
+                index.Insert(&user);
+                if (index.FindId(user.id, [&](const User &u) { errors += !(user == const_cast<User &>(u)); }) != 1) {
+                    errors++;
+                }
+                // 随机查一条其他线程可能已经写入的记录
+                int64_t other = (k * 7919) % ((int64_t)index_test_threads * index_test_per_thread);
+                FillUser(&expect, other, index_test_salaries);
+                index.FindUserId(expect.user_id, [&](const User &u) { errors += !(expect == const_cast<User &>(u)); });
+                index.FindSalary(expect.salary, [&](const User &u) { errors += u.salary != expect.salary; });
+            }
+        });
+    }
+    for (auto &th : threads) {
+        th.join();
+    }
+    EXPECT_EQ(0, errors.load());
+
+    const int total = index_test_threads * index_test_per_thread;
+    EXPECT_EQ((size_t)total, index.Size());
+    for (int64_t k = 0; k < total; k++) {
+        User expect;
+        FillUser(&expect, k, index_test_salaries);
+        ASSERT_EQ(1u, index.FindUserId(expect.user_id, [&](const User &u) { EXPECT_EQ(expect.id, u.id); }));
+    }
+    for (int s = 0; s < index_test_salaries; s++) {
+        EXPECT_EQ((size_t)total / index_test_salaries, index.FindSalary(s, [](const User &) {}));
+    }
+}
+
+// 每个线程只写自己的分区，同时查询所有分区
+TEST(PartitionedIndexTest, ConcurrentInsertFind) {
+    PartitionedIndex index(index_test_threads);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < index_test_threads; t++) {
+        threads.emplace_back([&, t]() {
+            User user, expect;
+            for (int i = 0; i < index_test_per_thread; i++) {
+                int64_t k = (int64_t)i * index_test_threads + t;
+                FillUser(&user, k, index_test_salaries);
+                index.Insert(t, &user);
+                if (index.FindUserId(user.user_id, [&](const User &u) { errors += !(user == const_cast<User &>(u)); }) != 1) {
+                    errors++;
+                }
+                int64_t other = (k * 7919) % ((int64_t)index_test_threads * index_test_per_thread);
+                FillUser(&expect, other, index_test_salaries);
+                index.FindId(expect.id, [&](const User &u) { errors += !(expect == const_cast<User &>(u)); });
+                index.FindSalary(expect.salary, [&](const User &u) { errors += u.salary != expect.salary; });
+            }
+        });
+    }
+    for (auto &th : threads) {
+        th.join();
+    }
+    EXPECT_EQ(0, errors.load());
+
+    const int total = index_test_threads * index_test_per_thread;
+    EXPECT_EQ((size_t)total, index.Size());
+    for (int64_t k = 0; k < total; k++) {
+        User expect;
+        FillUser(&expect, k, index_test_salaries);
+        ASSERT_EQ(1u, index.FindId(expect.id, [&](const User &u) { EXPECT_EQ(expect.salary, u.salary); }));
+    }
+    EXPECT_EQ(0u, index.FindId(total + 1, [](const User &) {}));
+    for (int s = 0; s < index_test_salaries; s++) {
+        EXPECT_EQ((size_t)total / index_test_salaries, index.FindSalary(s, [](const User &) {}));
+    }
+    index.Clear();
+    EXPECT_EQ(0u, index.Size());
+}
+
+class HybridIndexLoadTest : public ::testing::TestWithParam<int> {};
+
+// 回放时多个线程并行建索引，每个线程负责自己的partition，结果和逐条插入相同
+TEST_P(HybridIndexLoadTest, ParallelLoad) {
+    HybridIndex index(GetParam(), index_test_threads);
+    index.BeginLoad(index_test_threads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < index_test_threads; t++) {
+        threads.emplace_back([&, t]() {
+            User user;
+            for (int i = 0; i < index_test_per_thread; i++) {
+                FillUser(&user, (int64_t)i * index_test_threads + t, index_test_salaries);
+                index.Load(t, t, false, &user);
+            }
+        });
+    }
+    for (auto &th : threads) {
+        th.join();
+    }
+    index.FinishLoad();
+
+    const int total = index_test_threads * index_test_per_thread;
+    EXPECT_EQ((size_t)total, index.Size());
+    for (int64_t k = 0; k < total; k++) {
+        User expect;
+        FillUser(&expect, k, index_test_salaries);
+        ASSERT_EQ(1u, index.FindId(expect.id, [&](const User &u) { EXPECT_TRUE(expect == const_cast<User &>(u)); }));
+        ASSERT_EQ(1u, index.FindUserId(expect.user_id, [&](const User &u) { EXPECT_EQ(expect.id, u.id); }));
+    }
+    for (int s = 0; s < index_test_salaries; s++) {
+        EXPECT_EQ((size_t)total / index_test_salaries, index.FindSalary(s, [&](const User &u) { EXPECT_EQ(s, u.salary); }));
+    }
+    // 之后可以正常地并发插入
+    User user;
+    FillUser(&user, total, index_test_salaries);
+    index.Insert(0, false, &user);
+    EXPECT_EQ(1u, index.FindId(user.id, [](const User &) {}));
+    EXPECT_EQ((size_t)total / index_test_salaries + 1, index.FindSalary(user.salary, [](const User &) {}));
+}
+
+INSTANTIATE_TEST_SUITE_P(IndexLayout, HybridIndexLoadTest,
+                         ::testing::Values(IndexLayout::ShardedIndexLayout, IndexLayout::WriterPartitionedLayout));
+
+class BackgroundIndexerTest : public ::testing::TestWithParam<int> {};
+
+// 多个写线程交给后台线程建索引，delta表很快会满，Finish之后所有记录都能查到
+TEST_P(BackgroundIndexerTest, AddFinish) {
+    HybridIndex index(GetParam(), index_test_threads);
+    {
+        BackgroundIndexer indexer(&index, index_test_threads, 2);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < index_test_threads; t++) {
+            threads.emplace_back([&, t]() {
+                User user;
+                for (int i = 0; i < index_test_per_thread; i++) {
+                    FillUser(&user, (int64_t)i * index_test_threads + t, index_test_salaries);
+                    indexer.Add(t, &user);
+                }
+            });
+        }
+        for (auto &th : threads) {
+            th.join();
+        }
+        indexer.Finish();
+        // Finish之后不再有后台线程修改索引
+        EXPECT_EQ(0u, indexer.Finish());
+    }
+    const int total = index_test_threads * index_test_per_thread;
+    EXPECT_EQ((size_t)total, index.Size());
+    for (int64_t k = 0; k < total; k++) {
+        User expect;
+        FillUser(&expect, k, index_test_salaries);
+        ASSERT_EQ(1u, index.FindId(expect.id, [&](const User &u) { EXPECT_TRUE(expect == const_cast<User &>(u)); }));
+    }
+}
+
+// 只有一个后台线程，多个写线程很快写满所有delta表。每个id连续写两次(正好跨过表的边界)，
+// 写线程等到最老的表清空之后才继续，索引中保留的总是先写入的记录
+TEST_P(BackgroundIndexerTest, OverflowKeepsFirstWritten) {
+    HybridIndex index(GetParam(), index_test_threads);
+    const int per_thread = DeltaTableRecords * DeltaTables * 4;
+    {
+        BackgroundIndexer indexer(&index, index_test_threads, 1);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < index_test_threads; t++) {
+            threads.emplace_back([&, t]() {
+                User user;
+                for (int i = 0; i < per_thread; i++) {
+                    // 第i条记录的id为(i + 1) / 2，salary是写入的顺序
+                    FillUser(&user, (int64_t)((i + 1) / 2) * index_test_threads + t);
+                    user.salary = i;
+                    indexer.Add(t, &user);
+                }
+            });
+        }
+        for (auto &th : threads) {
+            th.join();
+        }
+        indexer.Finish();
+    }
+    for (int t = 0; t < index_test_threads; t++) {
+        for (int k = 0; k * 2 - 1 < per_thread; k++) {
+            User expect;
+            FillUser(&expect, (int64_t)k * index_test_threads + t);
+            const int64_t first = k == 0 ? 0 : k * 2 - 1;
+            ASSERT_EQ(1u, index.FindId(expect.id, [&](const User &u) { EXPECT_EQ(first, u.salary); }));
+            ASSERT_EQ(1u, index.FindUserId(expect.user_id, [&](const User &u) { EXPECT_EQ(first, u.salary); }));
+        }
+    }
+}
+
+// 一边写入一边查询: 自己写过的记录必须能查到，后台线程还在合并时salary查询的结果也不能重复或缺少
+TEST_P(BackgroundIndexerTest, FindWhileAdding) {
+    HybridIndex index(GetParam(), index_test_threads);
+    BackgroundIndexer indexer(&index, index_test_threads, 2);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < index_test_threads; t++) {
+        threads.emplace_back([&, t]() {
+            User user, expect;
+            for (int i = 0; i < index_test_per_thread; i++) {
+                int64_t k = (int64_t)i * index_test_threads + t;
+                FillUser(&user, k, index_test_salaries);
+                indexer.Add(t, &user);
+                if (indexer.FindId(user.id, [&](const User &u) { errors += !(user == const_cast<User &>(u)); }) != 1) {
+                    errors++;
+                }
+                if (i % 16 == 0 && indexer.FindUserId(user.user_id, [](const User &) {}) != 1) {
+                    errors++;
+                }
+                int64_t other = (k * 7919) % ((int64_t)index_test_threads * index_test_per_thread);
+                FillUser(&expect, other, index_test_salaries);
+                indexer.FindUserId(expect.user_id, [&](const User &u) { errors += !(expect == const_cast<User &>(u)); });
+            }
+        });
+    }
+    // 写入期间每个salary的记录数只增不减
+    std::vector<size_t> last(index_test_salaries, 0);
+    for (int round = 0; round < 20; round++) {
+        for (int s = 0; s < index_test_salaries; s += 37) {
+            size_t n = indexer.FindSalary(s, [&](const User &u) { errors += u.salary != s; });
+            errors += n < last[s];
+            last[s] = n;
+        }
+    }
+    for (auto &th : threads) {
+        th.join();
+    }
+    EXPECT_EQ(0, errors.load());
+
+    // 后台线程可能还没合并完
+    const int total = index_test_threads * index_test_per_thread;
+    for (int s = 0; s < index_test_salaries; s++) {
+        EXPECT_EQ((size_t)total / index_test_salaries, indexer.FindSalary(s, [](const User &) {}));
+    }
+    indexer.Finish();
+    EXPECT_EQ((size_t)total, index.Size());
+    for (int s = 0; s < index_test_salaries; s++) {
+        EXPECT_EQ((size_t)total / index_test_salaries, index.FindSalary(s, [](const User &) {}));
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(IndexLayout, BackgroundIndexerTest,
+                         ::testing::Values(IndexLayout::ShardedIndexLayout, IndexLayout::WriterPartitionedLayout));
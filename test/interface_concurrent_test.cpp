@@ -1,5 +1,7 @@
 #include <stdint.h>
 #include <thread>
+#include <atomic>
+#include <fstream>
 #include <vector>
 #include <gtest/gtest.h>
 #include "interface.h"
@@ -158,6 +160,27 @@ void HackReadOnlyHelper(void *ctx, int writeNumPerThread,
     delete res;
 }
 
+// 第wave批线程写入的key紧接在前面几批之后；每个线程写入一条之后等同一批的线程都开始写入，
+// 保证同时写入的线程数确实是threadNum
+std::atomic<int> wave_started(0);
+void WaveWriteOnlyHelper(void *ctx, int writeNumPerThread, int wave, int threadNum, uint64_t thread_itr) {
+    TestUser user;
+    memcpy(&user.name, "name", 5);
+    int64_t start = writeNumPerThread * (wave * threadNum + thread_itr);
+    for (int64_t i = start; i < start + writeNumPerThread; i++) {
+      user.id = i;
+      snprintf(user.user_id, sizeof(user.user_id), "%lld", (long long)i);
+      user.salary = -start; // negtive!
+      engine_write(ctx, &user, sizeof(user));
+      if (i == start) {
+        wave_started++;
+        while (wave_started.load() < (wave + 1) * threadNum) {
+          std::this_thread::yield();
+        }
+      }
+    }
+}
+
 
 // TEST(InterfaceConcurrentTest, BasicConcurrent) {
 //   EXPECT_EQ(0, rmtree(disk_dir));
@@ -213,3 +236,90 @@ TEST(InterfaceConcurrentTest, HackReadConcurrent) {
   EXPECT_EQ(0, rmtree(disk_dir));
   EXPECT_EQ(0, rmtree(aep_dir));
 }
+
+// 写线程多于ClientNum，并且线程不断退出、新建: 每个线程独占一组writer，重启之后所有数据都能读到
+TEST(InterfaceConcurrentTest, ChurningWritersBeyondClientNum) {
+  EXPECT_EQ(0, rmtree(disk_dir));
+  EXPECT_EQ(0, rmtree(aep_dir));
+  void* ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+
+  const int threadNum = ClientNum + ClientNum / 2;
+  const int waves = 3;
+  const int writeNumPerThread = 100;
+  for (int wave = 0; wave < waves; wave++) {
+    LaunchParallelTest(threadNum, WaveWriteOnlyHelper, ctx, writeNumPerThread, wave, threadNum);
+  }
+  // 退出的线程归还了slot，后面几批线程复用之前创建的writer，不会再创建新的log
+  EXPECT_TRUE(Util::FileExists(Util::DataFileName(disk_dir, WALFileNamePrefix, threadNum - 1)));
+  EXPECT_FALSE(Util::FileExists(Util::DataFileName(disk_dir, WALFileNamePrefix, threadNum)));
+  engine_deinit(ctx);
+
+  ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+  LaunchParallelTest(waves * threadNum, ReadOnlyHelper, ctx, writeNumPerThread);
+  engine_deinit(ctx);
+  EXPECT_EQ(0, rmtree(disk_dir));
+  EXPECT_EQ(0, rmtree(aep_dir));
+}
+
+// disk_dir下的CONFIG按实际规模配置(再加上option中的配置): 写满预计的记录数之后，同一次运行中马上读，
+// 重启之后再读一遍
+static void RunSmallDeployment(const std::string &option) {
+  EXPECT_EQ(0, rmtree(disk_dir));
+  EXPECT_EQ(0, rmtree(aep_dir));
+  EXPECT_EQ(0, mkdir(disk_dir, 0755));
+  const int threadNum = 4;
+  const int writeNumPerThread = 100;
+  {
+    std::ofstream out(std::string(disk_dir) + "/" + ConfigFileName);
+    out << "client_num = " << threadNum << "\n"
+        << "write_per_client = " << writeNumPerThread << "\n"
+        << option;
+  }
+  void* ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+  LaunchParallelTest(threadNum, HackWriteOnlyHelper, ctx, writeNumPerThread);
+  // 只打开了client_num个log
+  EXPECT_TRUE(Util::FileExists(Util::DataFileName(disk_dir, WALFileNamePrefix, threadNum - 1)));
+  EXPECT_FALSE(Util::FileExists(Util::DataFileName(disk_dir, WALFileNamePrefix, threadNum)));
+  LaunchParallelTest(threadNum, HackReadOnlyHelper, ctx, writeNumPerThread);
+  engine_deinit(ctx);
+
+  ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+  LaunchParallelTest(threadNum, HackReadOnlyHelper, ctx, writeNumPerThread);
+  engine_deinit(ctx);
+  EXPECT_EQ(0, rmtree(disk_dir));
+  EXPECT_EQ(0, rmtree(aep_dir));
+}
+
+TEST(InterfaceConcurrentTest, SmallDeploymentConfig) {
+  RunSmallDeployment("");
+}
+
+// pmem的XPLine布局
+TEST(InterfaceConcurrentTest, SmallDeploymentXPLineLayout) {
+  RunSmallDeployment("pmem_layout = " + std::to_string(PmemLayout::PmemXPLineLayout) + "\n");
+}
+
+// ssd的direct io写入
+TEST(InterfaceConcurrentTest, SmallDeploymentDirectBackend) {
+  RunSmallDeployment("disk_backend = " + std::to_string(DiskBackend::DirectBackend) + "\n");
+}
+
+// 写入时不在后台建索引，第一次读时全部回放
+TEST(InterfaceConcurrentTest, SmallDeploymentReplayOnFirstRead) {
+  RunSmallDeployment("index_threads = 0\n");
+}
+
+// 按写线程分区的索引
+TEST(InterfaceConcurrentTest, SmallDeploymentPartitionedIndex) {
+  RunSmallDeployment("index_layout = " + std::to_string(IndexLayout::WriterPartitionedLayout) + "\n");
+}
+
+// pmem上的持久化索引: 写入时直接插入，重启之后不需要回放
+TEST(InterfaceConcurrentTest, SmallDeploymentPmemIndex) {
+  RunSmallDeployment("index_layout = " + std::to_string(IndexLayout::PmemPartitionedLayout) + "\n");
+}
+
+// ssd的log只能放16条记录: 写满之后剩下的记录都写入aep，不会退出
+TEST(InterfaceConcurrentTest, SmallDeploymentDiskFull) {
+  RunSmallDeployment("disk_segment_records = 16\nmax_disk_segments = 1\n");
+}
@@ -1,7 +1,12 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <fstream>
 #include "interface.h"
 #include "test_util.h"
 #include "spdlog/spdlog.h"
+#include "util.h"
+#include "def.h"
+#include "manifest.h"
 
 TEST(InterfaceTest, Basic) {
     EXPECT_EQ(0, rmtree(disk_dir));
@@ -258,3 +263,286 @@ TEST(InterfaceTest, ReadUserIdReplay) {
     EXPECT_EQ(0, rmtree(aep_dir));
     delete res;
 }
+
+TEST(InterfaceTest, WriteBatchReplay) {
+    EXPECT_EQ(0, rmtree(disk_dir));
+    EXPECT_EQ(0, rmtree(aep_dir));
+
+    int write_cnt = 1000;
+    TestUser *users = new TestUser[write_cnt];
+    for (int i = 0; i < write_cnt; i++) {
+        users[i].id = i;
+        snprintf(users[i].user_id, sizeof(users[i].user_id), "%d", i);
+        memcpy(&users[i].name, "name", 5);
+        users[i].salary = i % 2;
+    }
+
+    void* ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    // 不同大小的batch穿插单条写入，跨越ssd/aep的路由边界以及pmem buffer的刷新
+    int written = 0;
+    for (int batch = 1; written < write_cnt; batch = batch * 3 + 1) {
+        int num = std::min(batch, write_cnt - written);
+        engine_write_batch(ctx, &users[written], num);
+        written += num;
+        if (written < write_cnt) {
+            engine_write(ctx, &users[written], sizeof(TestUser));
+            written++;
+        }
+    }
+
+    char *res = new char[write_cnt * 128];
+    size_t read_cnt = engine_read(ctx, Id, Salary, &users[1].salary, 8, res);
+    EXPECT_EQ(write_cnt / 2, read_cnt);
+    read_cnt = engine_read(ctx, Name, Id, &users[777].id, 8, res);
+    EXPECT_EQ(1, read_cnt);
+    EXPECT_EQ(0, memcmp(res, users[777].name, 128));
+
+    engine_deinit(ctx);
+
+    // replay
+    ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    read_cnt = engine_read(ctx, Id, Salary, &users[0].salary, 8, res);
+    EXPECT_EQ(write_cnt / 2, read_cnt);
+    for (int i = 0; i < write_cnt; i++) {
+        read_cnt = engine_read(ctx, Id, Userid, users[i].user_id, 128, res);
+        EXPECT_EQ(1, read_cnt);
+        EXPECT_EQ(i, *(int64_t *)res);
+    }
+
+    // hybrid阶段的batch写入同时维护索引
+    for (int i = 0; i < write_cnt; i++) {
+        users[i].id += write_cnt;
+        snprintf(users[i].user_id, sizeof(users[i].user_id), "%d", i + write_cnt);
+    }
+    engine_write_batch(ctx, users, write_cnt);
+    read_cnt = engine_read(ctx, Id, Salary, &users[0].salary, 8, res);
+    EXPECT_EQ(write_cnt, read_cnt);
+    read_cnt = engine_read(ctx, Id, Userid, users[3].user_id, 128, res);
+    EXPECT_EQ(1, read_cnt);
+    EXPECT_EQ(3 + write_cnt, *(int64_t *)res);
+
+    engine_deinit(ctx);
+    EXPECT_EQ(0, rmtree(disk_dir));
+    EXPECT_EQ(0, rmtree(aep_dir));
+    delete[] res;
+    delete[] users;
+}
+
+// 第二次运行关闭checkpoint，第三次运行时checkpoint只包含第一次写入的记录，之后的记录从log回放
+TEST(InterfaceTest, CheckpointTailReplay) {
+    EXPECT_EQ(0, rmtree(disk_dir));
+    EXPECT_EQ(0, rmtree(aep_dir));
+    const int write_cnt = 1000;
+    TestUser user;
+    memcpy(&user.name, "name1", 5);
+    auto write = [&](void *ctx, int from, int to) {
+        for (int i = from; i < to; i++) {
+            user.id = i;
+            snprintf(user.user_id, sizeof(user.user_id), "%d", i);
+            user.salary = i % 10;
+            engine_write(ctx, &user, sizeof(user));
+        }
+    };
+    auto set_checkpoint = [](int checkpoint) {
+        std::ofstream out(std::string(disk_dir) + "/" + ConfigFileName);
+        out << "checkpoint = " << checkpoint << "\n";
+    };
+    char *res = new char[write_cnt * 3 * 128];
+
+    void* ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    write(ctx, 0, write_cnt);
+    engine_deinit(ctx);
+    EXPECT_TRUE(Util::FileExists(std::string(disk_dir) + "/" + CheckpointFileName));
+    // 正常关闭之后MANIFEST中有所有log的记录数
+    EngineManifest manifest;
+    ASSERT_TRUE(EngineManifest::Load(std::string(disk_dir) + "/" + ManifestFileName, &manifest));
+    EXPECT_TRUE(manifest.clean);
+    EXPECT_EQ((uint64_t)write_cnt, manifest.RecordNum());
+
+    set_checkpoint(0);
+    ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    write(ctx, write_cnt, write_cnt * 2);
+    engine_deinit(ctx);
+
+    set_checkpoint(1);
+    ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    EXPECT_EQ(write_cnt * 2 / 10, engine_read(ctx, Id, Salary, &user.salary, 8, res));
+    for (int i = 0; i < write_cnt * 2; i += 97) {
+        char user_id[128] = {0};
+        snprintf(user_id, sizeof(user_id), "%d", i);
+        ASSERT_EQ(1, engine_read(ctx, Id, Userid, user_id, 128, res));
+        EXPECT_EQ(i, *(int64_t *)res);
+    }
+    // 新的记录和checkpoint中的记录一起查询
+    write(ctx, write_cnt * 2, write_cnt * 3);
+    EXPECT_EQ(write_cnt * 3 / 10, engine_read(ctx, Id, Salary, &user.salary, 8, res));
+    engine_deinit(ctx);
+
+    ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    EXPECT_EQ(write_cnt * 3 / 10, engine_read(ctx, Id, Salary, &user.salary, 8, res));
+    engine_deinit(ctx);
+    EXPECT_EQ(0, rmtree(disk_dir));
+    EXPECT_EQ(0, rmtree(aep_dir));
+    delete[] res;
+}
+
+// checkpoint放在aep_dir: 从disk_dir下的checkpoint切换过去之后，旧的checkpoint被删掉
+TEST(InterfaceTest, CheckpointOnPmem) {
+    EXPECT_EQ(0, rmtree(disk_dir));
+    EXPECT_EQ(0, rmtree(aep_dir));
+    const int write_cnt = 1000;
+    const std::string disk_checkpoint = std::string(disk_dir) + "/" + CheckpointFileName;
+    const std::string pmem_checkpoint = std::string(aep_dir) + "/" + CheckpointFileName;
+    TestUser user;
+    memcpy(&user.name, "name1", 5);
+    user.salary = 7;
+    char *res = new char[write_cnt * 2 * 128];
+
+    void* ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    for (int i = 0; i < write_cnt; i++) {
+        user.id = i;
+        snprintf(user.user_id, sizeof(user.user_id), "%d", i);
+        engine_write(ctx, &user, sizeof(user));
+    }
+    engine_deinit(ctx);
+    EXPECT_TRUE(Util::FileExists(disk_checkpoint));
+    {
+        std::ofstream out(std::string(disk_dir) + "/" + ConfigFileName);
+        out << "checkpoint_on_pmem = 1\n";
+    }
+
+    ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    EXPECT_EQ(write_cnt, engine_read(ctx, Id, Salary, &user.salary, 8, res));
+    user.id = write_cnt;
+    snprintf(user.user_id, sizeof(user.user_id), "%d", write_cnt);
+    engine_write(ctx, &user, sizeof(user));
+    engine_deinit(ctx);
+    EXPECT_TRUE(Util::FileExists(pmem_checkpoint));
+    EXPECT_FALSE(Util::FileExists(disk_checkpoint));
+
+    ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    EXPECT_EQ(write_cnt + 1, engine_read(ctx, Id, Salary, &user.salary, 8, res));
+    ASSERT_EQ(1, engine_read(ctx, Id, Userid, user.user_id, 128, res));
+    EXPECT_EQ(write_cnt, *(int64_t *)res);
+    engine_deinit(ctx);
+    EXPECT_EQ(0, rmtree(disk_dir));
+    EXPECT_EQ(0, rmtree(aep_dir));
+    delete[] res;
+}
+
+// 压缩格式的ssd log: MANIFEST和checkpoint中的记录数都是精确的已提交记录数，
+// 下一次启动只回放checkpoint之后的记录
+TEST(InterfaceTest, CompressedLogManifest) {
+    EXPECT_EQ(0, rmtree(disk_dir));
+    EXPECT_EQ(0, rmtree(aep_dir));
+    EXPECT_EQ(0, mkdir(disk_dir, 0755));
+    {
+        std::ofstream out(std::string(disk_dir) + "/" + ConfigFileName);
+        out << "disk_log_format = " << DiskLogFormat::CompressedLog << "\n";
+    }
+    const int write_cnt = 1000;
+    TestUser user;
+    memcpy(&user.name, "name1", 5);
+    auto write = [&](void *ctx, int from, int to) {
+        for (int i = from; i < to; i++) {
+            user.id = i;
+            snprintf(user.user_id, sizeof(user.user_id), "%d", i);
+            user.salary = i % 10;
+            engine_write(ctx, &user, sizeof(user));
+        }
+    };
+    auto check_manifest = [](uint64_t record_num) {
+        EngineManifest manifest;
+        ASSERT_TRUE(EngineManifest::Load(std::string(disk_dir) + "/" + ManifestFileName, &manifest));
+        EXPECT_TRUE(manifest.clean);
+        EXPECT_EQ(DiskLogFormat::CompressedLog, manifest.disk_log_format);
+        EXPECT_EQ(record_num, manifest.RecordNum());
+        uint64_t disk_num = 0;
+        for (uint64_t cnt : manifest.disk_counts) {
+            disk_num += cnt;
+        }
+        EXPECT_GT(disk_num, 0u);
+    };
+    char *res = new char[write_cnt * 2 * 128];
+
+    void* ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    write(ctx, 0, write_cnt);
+    engine_deinit(ctx);
+    check_manifest(write_cnt);
+
+    ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    write(ctx, write_cnt, write_cnt * 2);
+    engine_deinit(ctx);
+    check_manifest(write_cnt * 2);
+
+    ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    EXPECT_EQ(write_cnt * 2 / 10, engine_read(ctx, Id, Salary, &user.salary, 8, res));
+    for (int i = 0; i < write_cnt * 2; i += 97) {
+        char user_id[128] = {0};
+        snprintf(user_id, sizeof(user_id), "%d", i);
+        ASSERT_EQ(1, engine_read(ctx, Id, Userid, user_id, 128, res));
+        EXPECT_EQ(i, *(int64_t *)res);
+    }
+    engine_deinit(ctx);
+    EXPECT_EQ(0, rmtree(disk_dir));
+    EXPECT_EQ(0, rmtree(aep_dir));
+    delete[] res;
+}
+
+// ssd log中间的块损坏时回放截断到损坏的块之前，之后的写入接在截断的位置，
+// 再次重启时不会因为同一个损坏的块丢掉新写入的记录
+TEST(InterfaceTest, WriteAfterCorruptedBlock) {
+    EXPECT_EQ(0, rmtree(disk_dir));
+    EXPECT_EQ(0, rmtree(aep_dir));
+    EXPECT_EQ(0, mkdir(disk_dir, 0755));
+    {
+        std::ofstream out(std::string(disk_dir) + "/" + ConfigFileName);
+        out << "checkpoint = 0\n";
+    }
+    const int write_cnt = 400;
+    TestUser user;
+    memcpy(&user.name, "name1", 5);
+    user.salary = 7;
+    auto write = [&](void *ctx, int from, int to) {
+        for (int i = from; i < to; i++) {
+            user.id = i;
+            snprintf(user.user_id, sizeof(user.user_id), "%d", i);
+            engine_write(ctx, &user, sizeof(user));
+        }
+    };
+    char *res = new char[write_cnt * 2 * 128];
+
+    void* ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    write(ctx, 0, write_cnt);
+    engine_deinit(ctx);
+    // 第0个ssd log的第一个块中改掉一个字节
+    {
+        int fd = open(Util::DataFileName(disk_dir, WALFileNamePrefix, 0).c_str(), O_RDWR);
+        ASSERT_GE(fd, 0);
+        off_t off = MmapHeaderSize + RecordSize + 20;
+        char c;
+        ASSERT_EQ(1, pread(fd, &c, 1, off));
+        c ^= 0x5a;
+        ASSERT_EQ(1, pwrite(fd, &c, 1, off));
+        close(fd);
+    }
+
+    ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    size_t survived = engine_read(ctx, Id, Salary, &user.salary, 8, res);
+    EXPECT_LT(survived, (size_t)write_cnt);
+    write(ctx, write_cnt, write_cnt * 2);
+    engine_deinit(ctx);
+
+    ctx = engine_init(nullptr, nullptr, 0, aep_dir, disk_dir);
+    EXPECT_EQ(survived + write_cnt, engine_read(ctx, Id, Salary, &user.salary, 8, res));
+    for (int i = write_cnt; i < write_cnt * 2; i++) {
+        char user_id[128] = {0};
+        snprintf(user_id, sizeof(user_id), "%d", i);
+        ASSERT_EQ(1, engine_read(ctx, Id, Userid, user_id, 128, res)) << i;
+        EXPECT_EQ(i, *(int64_t *)res);
+    }
+    engine_deinit(ctx);
+    EXPECT_EQ(0, rmtree(disk_dir));
+    EXPECT_EQ(0, rmtree(aep_dir));
+    delete[] res;
+}
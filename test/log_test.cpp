@@ -0,0 +1,738 @@
+#include <gtest/gtest.h>
+#include <memory>
+#include <fcntl.h>
+#include "test_util.h"
+#include "log.h"
+#include "util.h"
+#include "record_copy.h"
+#include "crc32c.h"
+
+const char log_test_dir[] = "/tmp/log_test";
+const int log_test_mmap_size = RecordSize * 1000 + 8;
+
+class DiskLogTest : public ::testing::TestWithParam<int> {
+  protected:
+    void SetUp() override {
+        EXPECT_EQ(0, rmtree(log_test_dir));
+        EXPECT_EQ(0, mkdir(log_test_dir, 0755));
+        path_ = Util::DataFileName(log_test_dir, WALFileNamePrefix, 0);
+        Util::CreateIfNotExists(path_);
+    }
+    void TearDown() override {
+        EXPECT_EQ(0, rmtree(log_test_dir));
+    }
+    std::string path_;
+};
+
+TEST_P(DiskLogTest, AppendReopenRead) {
+    int format = GetParam();
+    int write_cnt = 300;
+    TestUser user;
+    {
+        std::unique_ptr<DiskLogWriter> writer(NewDiskLogWriter(format, path_, log_test_mmap_size));
+        if (format != DiskLogFormat::CompressedLog) {
+            EXPECT_EQ(1000, writer->MaxSlot());
+        }
+        for (int i = 0; i < write_cnt / 2; i++) {
+            FillUser(&user, i);
+            writer->Append(&user);
+        }
+    }
+    {
+        // 重新打开之后接着写，用batch写剩下的一半
+        std::unique_ptr<DiskLogWriter> writer(NewDiskLogWriter(format, path_, log_test_mmap_size));
+        size_t free_slot = writer->FreeSlot();
+        EXPECT_LT(free_slot, writer->MaxSlot());
+        std::vector<TestUser> users(write_cnt / 2);
+        for (int i = 0; i < write_cnt / 2; i++) {
+            FillUser(&users[i], i + write_cnt / 2);
+        }
+        writer->AppendBatch(users.data(), users.size());
+        EXPECT_LT(writer->FreeSlot(), free_slot);
+        if (format == DiskLogFormat::CompressedLog) {
+            // user_id/name都只有几个字节
+            EXPECT_LT(writer->UsedBytes() * 5, write_cnt * RecordSize);
+        } else {
+            EXPECT_EQ(1000 - write_cnt, writer->FreeSlot());
+            EXPECT_EQ(write_cnt * RecordSize, writer->UsedBytes());
+        }
+    }
+    {
+        std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(format, path_, log_test_mmap_size));
+        EXPECT_EQ(write_cnt, reader->Count());
+        char *record;
+        int i = 0;
+        while (reader->ReadRecord(record, RecordSize)) {
+            FillUser(&user, i++);
+            EXPECT_TRUE(user == *reinterpret_cast<TestUser *>(record));
+        }
+        EXPECT_EQ(write_cnt, i);
+    }
+    {
+        // 只读取id和salary两列
+        std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(format, path_, log_test_mmap_size));
+        TestUser keys;
+        int i = 0;
+        while (reader->ReadColumns(ColumnMask(Id) | ColumnMask(Salary), &keys)) {
+            EXPECT_EQ(i + 1, keys.id);
+            EXPECT_EQ(i, keys.salary);
+            i++;
+        }
+        EXPECT_EQ(write_cnt, i);
+        EXPECT_EQ(0, keys.user_id[0]);
+    }
+}
+
+// id为0的记录不在第一个slot: 记录数不依赖于记录的内容，重新打开之后所有记录都在，并且接着写在后面
+TEST_P(DiskLogTest, ZeroIdRecords) {
+    int format = GetParam();
+    const int64_t ids[] = {100, 101, 102, 0, 104};
+    const int write_cnt = sizeof(ids) / sizeof(ids[0]);
+    std::vector<TestUser> users(write_cnt);
+    for (int i = 0; i < write_cnt; i++) {
+        FillUser(&users[i], i);
+        users[i].id = ids[i];
+    }
+    {
+        std::unique_ptr<DiskLogWriter> writer(NewDiskLogWriter(format, path_, log_test_mmap_size));
+        writer->Append(&users[0]);
+        writer->Append(&users[1]);
+        writer->Append(&users[2]);
+        writer->AppendBatch(&users[3], 2);
+        EXPECT_EQ(write_cnt, writer->Count());
+    }
+    {
+        std::unique_ptr<DiskLogWriter> writer(NewDiskLogWriter(format, path_, log_test_mmap_size));
+        EXPECT_EQ(write_cnt, writer->Count());
+        writer->Append(&users[3]);
+    }
+    std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(format, path_, log_test_mmap_size));
+    EXPECT_EQ(write_cnt + 1, reader->Count());
+    TestUser keys;
+    int i = 0;
+    while (reader->ReadColumns(ColumnMask(Id) | ColumnMask(Salary), &keys)) {
+        const TestUser &expect = users[i < write_cnt ? i : 3];
+        EXPECT_EQ(expect.id, keys.id);
+        EXPECT_EQ(expect.salary, keys.salary);
+        i++;
+    }
+    EXPECT_EQ(write_cnt + 1, i);
+}
+
+INSTANTIATE_TEST_SUITE_P(DiskLogFormats, DiskLogTest,
+                         ::testing::Values(DiskLogFormat::RowLog, DiskLogFormat::ColumnLog,
+                                           DiskLogFormat::CompressedLog));
+
+// 每个segment只能放log_test_segment_slot条记录，写入跨越多个segment
+const int log_test_segment_slot = 64;
+const int log_test_segment_size = RecordSize * log_test_segment_slot + 8;
+
+TEST_P(DiskLogTest, SegmentRolling) {
+    int format = GetParam();
+    int write_cnt = 2000;
+    TestUser user;
+    {
+        SegmentedLogWriter writer(format, path_, log_test_segment_size, 100);
+        EXPECT_EQ(100 * writer.SegmentSlot(), writer.MaxSlot());
+        for (int i = 0; i < write_cnt / 2; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+    }
+    {
+        // 重新打开之后从最后一个segment接着写，batch跨越segment
+        SegmentedLogWriter writer(format, path_, log_test_segment_size, 100);
+        size_t free_slot = writer.FreeSlot();
+        std::vector<TestUser> users(write_cnt / 2);
+        for (int i = 0; i < write_cnt / 2; i++) {
+            FillUser(&users[i], i + write_cnt / 2);
+        }
+        writer.AppendBatch(users.data(), users.size());
+        EXPECT_LE(free_slot - writer.FreeSlot(), write_cnt / 2);
+        if (format != DiskLogFormat::CompressedLog) {
+            EXPECT_EQ(100 * log_test_segment_slot - write_cnt, writer.FreeSlot());
+        }
+    }
+    // 只在需要时创建segment
+    size_t segments = 1;
+    while (Util::FileExists(SegmentFileName(path_, segments) + (format == DiskLogFormat::ColumnLog ? ColumnFileSuffix[Id] : ""))) {
+        segments++;
+    }
+    if (format == DiskLogFormat::CompressedLog) {
+        EXPECT_GE(segments, 2);
+    } else {
+        EXPECT_EQ((write_cnt + log_test_segment_slot - 1) / log_test_segment_slot, segments);
+    }
+    {
+        SegmentedLogReader reader(format, path_, log_test_segment_size);
+        EXPECT_EQ(write_cnt, reader.Count());
+        char *record;
+        int i = 0;
+        while (reader.ReadRecord(record, RecordSize)) {
+            FillUser(&user, i++);
+            EXPECT_TRUE(user == *reinterpret_cast<TestUser *>(record));
+        }
+        EXPECT_EQ(write_cnt, i);
+    }
+}
+
+// 达到max_segments(和设备空间不足一样)时不退出: 写入失败，写入的记录是完整的前缀，FreeSlot变为0
+TEST_P(DiskLogTest, SegmentFull) {
+    int format = GetParam();
+    // 压缩之后一个segment能放下的记录数不确定，按batch一直写到失败为止
+    std::vector<TestUser> users(log_test_segment_slot);
+    uint64_t cnt = 0;
+    {
+        SegmentedLogWriter writer(format, path_, log_test_segment_size, 2);
+        EXPECT_EQ(2 * writer.SegmentSlot(), writer.MaxSlot());
+        for (int batch = 0; batch < 1000; batch++) {
+            for (size_t i = 0; i < users.size(); i++) {
+                FillUser(&users[i], cnt + i);
+            }
+            int ret = writer.AppendBatch(users.data(), users.size());
+            if (ret != 0) {
+                EXPECT_EQ(-1, ret);
+                EXPECT_LT(writer.Count(), cnt + users.size());
+                cnt = writer.Count();
+                break;
+            }
+            cnt += users.size();
+            EXPECT_EQ(cnt, writer.Count());
+        }
+        EXPECT_EQ(0, writer.FreeSlot());
+        EXPECT_EQ(-1, writer.Append(users.data()));
+        EXPECT_EQ(cnt, writer.Count());
+    }
+    if (format != DiskLogFormat::CompressedLog) {
+        EXPECT_EQ(2 * log_test_segment_slot, cnt);
+    }
+    EXPECT_FALSE(Util::FileExists(SegmentFileName(path_, 2) + (format == DiskLogFormat::ColumnLog ? ColumnFileSuffix[Id] : "")));
+    SegmentedLogReader reader(format, path_, log_test_segment_size);
+    EXPECT_EQ(cnt, reader.Verify());
+    TestUser user;
+    char *record;
+    uint64_t i = 0;
+    while (reader.ReadRecord(record, RecordSize)) {
+        FillUser(&user, i++);
+        EXPECT_TRUE(user == *reinterpret_cast<TestUser *>(record));
+    }
+    EXPECT_EQ(cnt, i);
+}
+
+// 截断到中间的某个segment之后接着写，后面的segment被删除
+TEST_P(DiskLogTest, SegmentTruncate) {
+    int format = GetParam();
+    const int write_cnt = 500;
+    const int keep = 150;
+    TestUser user;
+    {
+        SegmentedLogWriter writer(format, path_, log_test_segment_size, 100);
+        for (int i = 0; i < write_cnt; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+        writer.Truncate(keep);
+        EXPECT_EQ(keep, writer.Count());
+        for (int i = keep; i < keep + 100; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+        EXPECT_EQ(keep + 100, writer.Count());
+    }
+    SegmentedLogReader reader(format, path_, log_test_segment_size);
+    EXPECT_EQ(keep + 100, reader.Count());
+    char *record;
+    int i = 0;
+    while (reader.ReadRecord(record, RecordSize)) {
+        FillUser(&user, i++);
+        EXPECT_TRUE(user == *reinterpret_cast<TestUser *>(record)) << i;
+    }
+    EXPECT_EQ(keep + 100, i);
+}
+
+static void CorruptByte(const std::string &filename, off_t offset) {
+    int fd = open(filename.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    char c;
+    ASSERT_EQ(1, pread(fd, &c, 1, offset));
+    c = ~c;
+    ASSERT_EQ(1, pwrite(fd, &c, 1, offset));
+    close(fd);
+}
+
+class RowLogTailTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        EXPECT_EQ(0, rmtree(log_test_dir));
+        EXPECT_EQ(0, mkdir(log_test_dir, 0755));
+        path_ = Util::DataFileName(log_test_dir, WALFileNamePrefix, 0);
+        Util::CreateIfNotExists(path_);
+    }
+    void TearDown() override {
+        EXPECT_EQ(0, rmtree(log_test_dir));
+    }
+    std::string path_;
+};
+
+// 文件头中的tail只是提示，丢失、落后或超前时都要找到正确的结尾
+TEST_F(RowLogTailTest, RecoverFromBadTail) {
+    const int write_cnt = 777;
+    TestUser user;
+    {
+        MmapWriter writer(path_, log_test_mmap_size);
+        for (int i = 0; i < write_cnt; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+    }
+    for (uint64_t tail : {(uint64_t)write_cnt, (uint64_t)0, (uint64_t)100, (uint64_t)write_cnt + 1, (uint64_t)1 << 40}) {
+        int fd = open(path_.c_str(), O_RDWR);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(8, pwrite(fd, &tail, 8, 0));
+        close(fd);
+        {
+            MmapReader reader(path_, log_test_mmap_size);
+            EXPECT_EQ(write_cnt, reader.Count()) << "tail " << tail;
+        }
+        {
+            // writer从正确的位置接着写，并修正tail
+            MmapWriter writer(path_, log_test_mmap_size);
+            EXPECT_EQ(1000 - write_cnt, writer.FreeSlot()) << "tail " << tail;
+        }
+    }
+    // 写满之后也能正确打开
+    {
+        MmapWriter writer(path_, log_test_mmap_size);
+        while (writer.FreeSlot() > 0) {
+            writer.Append(&user);
+        }
+    }
+    MmapReader reader(path_, log_test_mmap_size);
+    EXPECT_EQ(1000, reader.Count());
+}
+
+TEST_F(RowLogTailTest, ExtendShortFile) {
+    const int write_cnt = 100;
+    TestUser user;
+    {
+        MmapWriter writer(path_, log_test_mmap_size);
+        for (int i = 0; i < write_cnt; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+    }
+    // 模拟空间没有分配完整的文件(crc区域也被截掉了，所以这里不校验): 重新打开时补齐剩下的部分，
+    // 已有的记录不变，补出来的部分读出来是0
+    ASSERT_EQ(0, truncate(path_.c_str(), MmapHeaderSize + 2 * write_cnt * RecordSize));
+    {
+        MmapWriter writer(path_, log_test_mmap_size);
+        EXPECT_EQ(1000 - write_cnt, writer.FreeSlot());
+        FillUser(&user, write_cnt);
+        writer.Append(&user);
+    }
+    MmapReader reader(path_, log_test_mmap_size);
+    EXPECT_EQ(write_cnt + 1, reader.Count());
+    char *record;
+    int i = 0;
+    while (reader.ReadRecord(record, RecordSize)) {
+        FillUser(&user, i++);
+        EXPECT_TRUE(user == *reinterpret_cast<TestUser *>(record));
+    }
+    EXPECT_EQ(write_cnt + 1, i);
+}
+
+TEST_F(RowLogTailTest, SegmentChecksum) {
+    const int write_cnt = 200;
+    TestUser user;
+    {
+        SegmentedLogWriter writer(DiskLogFormat::RowLog, path_, log_test_segment_size, 100);
+        for (int i = 0; i < write_cnt; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+    }
+    {
+        SegmentedLogReader reader(DiskLogFormat::RowLog, path_, log_test_segment_size);
+        EXPECT_EQ(write_cnt, reader.Verify());
+    }
+    // 损坏segment 1中第20条记录，它所在的块以及之后的segment都被丢弃
+    CorruptByte(SegmentFileName(path_, 1), MmapHeaderSize + 20 * RecordSize + 10);
+    SegmentedLogReader reader(DiskLogFormat::RowLog, path_, log_test_segment_size);
+    const int valid_cnt = log_test_segment_slot + CrcBlockRecords;
+    EXPECT_EQ(valid_cnt, reader.Verify());
+    EXPECT_EQ(valid_cnt, reader.Count());
+    char *record;
+    int i = 0;
+    while (reader.ReadRecord(record, RecordSize)) {
+        FillUser(&user, i++);
+        EXPECT_TRUE(user == *reinterpret_cast<TestUser *>(record));
+    }
+    EXPECT_EQ(valid_cnt, i);
+}
+
+static void ExpectRowLogRecords(DiskLogReader *reader, int write_cnt) {
+    EXPECT_EQ(write_cnt, reader->Verify());
+    TestUser user;
+    char *record;
+    int i = 0;
+    while (reader->ReadRecord(record, RecordSize)) {
+        FillUser(&user, i++);
+        EXPECT_TRUE(user == *reinterpret_cast<TestUser *>(record)) << i;
+    }
+    EXPECT_EQ(write_cnt, i);
+}
+
+// DirectWriter写出的文件和MmapWriter相同，由MmapReader读取
+TEST_F(RowLogTailTest, DirectBackend) {
+    // 记录数超过staging环，crc数组跨越两页
+    const int slots = 20000;
+    const int mmap_size = RecordSize * slots + 8;
+    TestUser user;
+    {
+        std::unique_ptr<DiskLogWriter> writer(NewDiskLogWriter(DiskLogFormat::RowLog, path_, mmap_size,
+                                                               DiskBackend::DirectBackend));
+        for (int i = 0; i < slots / 4; i++) {
+            FillUser(&user, i);
+            writer->Append(&user);
+        }
+        EXPECT_EQ(slots - slots / 4, writer->FreeSlot());
+    }
+    {
+        std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(DiskLogFormat::RowLog, path_, mmap_size));
+        ExpectRowLogRecords(reader.get(), slots / 4);
+    }
+    {
+        // 重新打开之后接着写，大batch跨过整个staging环，最后写满
+        DirectWriter writer(path_, mmap_size);
+        EXPECT_EQ(slots - slots / 4, writer.FreeSlot());
+        std::vector<TestUser> users(slots);
+        for (int i = slots / 4; i < slots; i++) {
+            FillUser(&users[i], i);
+        }
+        for (int i = slots / 4; i < slots; i += 5000) {
+            writer.AppendBatch(&users[i], std::min(5000, slots - i));
+        }
+        EXPECT_EQ(0, writer.FreeSlot());
+    }
+    std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(DiskLogFormat::RowLog, path_, mmap_size));
+    ExpectRowLogRecords(reader.get(), slots);
+}
+
+// 每次写入返回时所有修改过的页都已经提交，writer不关闭也不再写入，已经写入的记录也会落盘
+TEST_F(RowLogTailTest, DirectBackendNoPendingPages) {
+    const int write_cnt = 100;
+    const int mmap_size = RecordSize * write_cnt + 8;
+    TestUser user;
+    DirectWriter writer(path_, mmap_size);
+    // 连续的小写入反复修改同一页，大部分时候这一页的前一次写入还没有完成
+    for (int i = 0; i < write_cnt; i++) {
+        FillUser(&user, i);
+        writer.Append(&user);
+    }
+    uint64_t cnt = 0;
+    for (int retry = 0; retry < 1000 && cnt < write_cnt; retry++) {
+        std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(DiskLogFormat::RowLog, path_, mmap_size));
+        cnt = reader->Verify();
+        if (cnt < write_cnt) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    std::unique_ptr<DiskLogReader> reader(NewDiskLogReader(DiskLogFormat::RowLog, path_, mmap_size));
+    ExpectRowLogRecords(reader.get(), write_cnt);
+}
+
+TEST_F(RowLogTailTest, DirectBackendSegments) {
+    const int write_cnt = 2000;
+    TestUser user;
+    // 两种写入方式交替打开同一个log
+    for (int round = 0; round < 4; round++) {
+        int backend = round % 2 == 0 ? DiskBackend::DirectBackend : DiskBackend::MmapBackend;
+        SegmentedLogWriter writer(DiskLogFormat::RowLog, path_, log_test_segment_size, 100, backend);
+        for (int i = round * write_cnt / 4; i < (round + 1) * write_cnt / 4; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+    }
+    SegmentedLogReader reader(DiskLogFormat::RowLog, path_, log_test_segment_size);
+    ExpectRowLogRecords(&reader, write_cnt);
+}
+
+class PmemLogTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        EXPECT_EQ(0, rmtree(log_test_dir));
+        EXPECT_EQ(0, mkdir(log_test_dir, 0755));
+        path_ = Util::DataFileName(log_test_dir, WALFileNamePrefix, 0);
+        // MmapBufferWriter要求buffer文件已经存在
+        Util::CreateIfNotExists(path_ + PmapBufferWriterFileNameSuffix);
+    }
+    void TearDown() override {
+        EXPECT_EQ(0, rmtree(log_test_dir));
+    }
+    std::string path_;
+};
+
+TEST_F(PmemLogTest, SegmentRolling) {
+    // 每个segment放两个buffer(32条记录)
+    const size_t segment_size = PmapBufferWriterSize * 2;
+    const int write_cnt = 200;
+    TestUser user;
+    for (int round = 0; round < 2; round++) {
+        PmapBufferWriter writer(path_, segment_size, 100);
+        EXPECT_EQ(100 * 32, writer.MaxSlot());
+        for (int i = round * write_cnt / 2; i < (round + 1) * write_cnt / 2; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+        EXPECT_EQ(100 * 32 - (round + 1) * write_cnt / 2, writer.FreeSlot());
+    }
+    // 192条记录已经刷入6个segment，剩下的8条还在buffer中，它们所在的segment在写入时已经分配
+    EXPECT_TRUE(Util::FileExists(SegmentFileName(path_, 6)));
+    EXPECT_FALSE(Util::FileExists(SegmentFileName(path_, 7)));
+
+    PmapBufferReader reader(path_, segment_size);
+    EXPECT_EQ(write_cnt, reader.Count());
+    char *record;
+    int i = 0;
+    while (reader.ReadRecord(record, RecordSize)) {
+        FillUser(&user, i++);
+        EXPECT_TRUE(user == *reinterpret_cast<TestUser *>(record));
+    }
+    EXPECT_EQ(write_cnt, i);
+}
+
+static void ExpectPmemRecords(const std::string &path, size_t segment_size, int write_cnt,
+                              int layout = DefaultPmemLayout) {
+    PmapBufferReader reader(path, segment_size, layout);
+    EXPECT_EQ(write_cnt, reader.Verify());
+    TestUser user;
+    char *record;
+    int i = 0;
+    while (reader.ReadRecord(record, RecordSize)) {
+        FillUser(&user, i++);
+        EXPECT_TRUE(user == *reinterpret_cast<TestUser *>(record)) << i;
+    }
+    EXPECT_EQ(write_cnt, i);
+}
+
+// 不能再分配segment时只写入已分配的segment能容纳的记录，不会在刷入时失败
+TEST_F(PmemLogTest, SegmentFull) {
+    const size_t segment_size = PmapBufferWriterSize * 2;
+    std::vector<TestUser> users(100);
+    for (size_t i = 0; i < users.size(); i++) {
+        FillUser(&users[i], i);
+    }
+    for (int durability : {Durability::Async, Durability::PerRecord}) {
+        const std::string path = path_ + std::to_string(durability);
+        Util::CreateIfNotExists(path + PmapBufferWriterFileNameSuffix);
+        {
+            PmapBufferWriter writer(path, segment_size, 2, durability);
+            EXPECT_EQ(2 * 32, writer.MaxSlot());
+            EXPECT_EQ(-1, writer.AppendBatch(users.data(), users.size()));
+            EXPECT_EQ(2 * 32, writer.Count());
+            EXPECT_EQ(0, writer.FreeSlot());
+            EXPECT_EQ(-1, writer.Append(users.data()));
+        }
+        EXPECT_FALSE(Util::FileExists(SegmentFileName(path, 2)));
+        ExpectPmemRecords(path, segment_size, 2 * 32);
+    }
+}
+
+// 截断到已经刷入pmem的块的边界，之后的写入从截断的位置开始刷入
+TEST_F(PmemLogTest, Truncate) {
+    const size_t segment_size = PmapBufferWriterSize * 2;
+    const int write_cnt = 200;
+    const int keep = PmapBufferRecords * 3;
+    TestUser user;
+    {
+        PmapBufferWriter writer(path_, segment_size, 100);
+        for (int i = 0; i < write_cnt; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+        writer.Truncate(keep);
+        EXPECT_EQ(keep, writer.Count());
+        for (int i = keep; i < write_cnt; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+        // 再截断到还在buffer中的记录
+        writer.Truncate(write_cnt - 1);
+    }
+    ExpectPmemRecords(path_, segment_size, write_cnt - 1);
+}
+
+TEST_F(PmemLogTest, BackgroundFlush) {
+    const size_t segment_size = PmapBufferWriterSize * 2;
+    const int write_cnt = 200;
+    BufferFlusher flusher;
+    EXPECT_GE(flusher.Threads(), 1);
+    TestUser user;
+    {
+        PmapBufferWriter writer(path_, segment_size, 100, Durability::Async, nullptr, &flusher);
+        for (int i = 0; i < write_cnt / 2; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+        std::vector<TestUser> users(write_cnt / 2);
+        for (int i = 0; i < write_cnt / 2; i++) {
+            FillUser(&users[i], i + write_cnt / 2);
+        }
+        writer.AppendBatch(users.data(), users.size());
+        EXPECT_EQ(write_cnt / PmapBufferRecords, writer.Stats().flushes);
+    }
+    ExpectPmemRecords(path_, segment_size, write_cnt);
+
+    // 模拟crash时最后一个写满的buffer还在后台刷入: flush_cnt少一个buffer，这个buffer的记录还在buffer环中
+    std::string buf_path = path_ + PmapBufferWriterFileNameSuffix;
+    uint64_t flush_cnt = write_cnt / PmapBufferRecords * PmapBufferRecords - PmapBufferRecords;
+    int fd = open(buf_path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(8, pwrite(fd, &flush_cnt, 8, PmapBufferWriterFileSize - PmapBufferWriterMetaSize));
+    close(fd);
+    ExpectPmemRecords(path_, segment_size, write_cnt);
+    {
+        // writer打开时先把这个buffer刷入pmem，然后接着写
+        PmapBufferWriter writer(path_, segment_size, 100, Durability::Async, nullptr, &flusher);
+        for (int i = write_cnt; i < write_cnt * 2; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+    }
+    ExpectPmemRecords(path_, segment_size, write_cnt * 2);
+}
+
+TEST_F(PmemLogTest, XPLineLayout) {
+    const size_t segment_size = PmapBufferWriterSize * 2;
+    const int write_cnt = 200;
+    TestUser user;
+    uint64_t row_partial = 0;
+    {
+        // 同样的写入用行存统计一次partial XPLine
+        std::string row_path = path_ + ".row";
+        Util::CreateIfNotExists(row_path + PmapBufferWriterFileNameSuffix);
+        PmapBufferWriter writer(row_path, segment_size, 100, Durability::PerRecord);
+        for (int i = 0; i < write_cnt / 2; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+        row_partial = writer.Stats().partial_xplines;
+    }
+    {
+        PmapBufferWriter writer(path_, segment_size, 100, Durability::PerRecord, nullptr, nullptr,
+                                PmemLayout::PmemXPLineLayout);
+        for (int i = 0; i < write_cnt / 2; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+        // 每条记录: 主体一个整XPLine + side line和commit_cnt各一个partial;
+        // 每次刷buffer: 17个整XPLine + crc和flush_cnt各一个partial
+        const DurabilityStats &stats = writer.Stats();
+        const uint64_t flushes = write_cnt / 2 / PmapBufferRecords;
+        EXPECT_EQ(flushes, stats.flushes);
+        EXPECT_EQ(write_cnt / 2 * 3 + flushes * 19, stats.xplines);
+        EXPECT_EQ(write_cnt / 2 * 2 + flushes * 2, stats.partial_xplines);
+        EXPECT_LT(stats.partial_xplines, row_partial);
+    }
+    {
+        BufferFlusher flusher;
+        PmapBufferWriter writer(path_, segment_size, 100, Durability::Async, nullptr, &flusher,
+                                PmemLayout::PmemXPLineLayout);
+        std::vector<TestUser> users(write_cnt / 2);
+        for (int i = 0; i < write_cnt / 2; i++) {
+            FillUser(&users[i], i + write_cnt / 2);
+        }
+        writer.AppendBatch(users.data(), users.size());
+    }
+    ExpectPmemRecords(path_, segment_size, write_cnt, PmemLayout::PmemXPLineLayout);
+
+    // 第1条记录的user_id在第1个XPLine的开头，id和salary在side line中
+    int fd = open(path_.c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    char line[XPLineSize];
+    int64_t side[2];
+    ASSERT_EQ(XPLineSize, pread(fd, line, XPLineSize, XPLineSize));
+    ASSERT_EQ(16, pread(fd, side, 16, PmapBufferRecords * XPLineSize + XPLineSideWidth));
+    close(fd);
+    FillUser(&user, 1);
+    EXPECT_EQ(0, memcmp(user.user_id, line, XPLineSize));
+    EXPECT_EQ(user.id, side[0]);
+    EXPECT_EQ(user.salary, side[1]);
+}
+
+TEST_F(PmemLogTest, Checksum) {
+    const size_t segment_size = PmapBufferWriterSize * 2;
+    const int block_records = PmapBufferWriterSize / RecordSize;
+    const int write_cnt = 200;
+    TestUser user;
+    {
+        PmapBufferWriter writer(path_, segment_size, 100);
+        for (int i = 0; i < write_cnt; i++) {
+            FillUser(&user, i);
+            writer.Append(&user);
+        }
+    }
+    {
+        PmapBufferReader reader(path_, segment_size);
+        EXPECT_EQ(write_cnt, reader.Verify());
+    }
+    // 损坏segment 1中的第二个块(全局第3个块)，buffer中还没刷入的记录也一起丢弃
+    CorruptByte(SegmentFileName(path_, 1), PmapBufferWriterSize + 100);
+    PmapBufferReader reader(path_, segment_size);
+    EXPECT_EQ(3 * block_records, reader.Verify());
+    char *record;
+    int i = 0;
+    while (reader.ReadRecord(record, RecordSize)) {
+        FillUser(&user, i++);
+        EXPECT_TRUE(user == *reinterpret_cast<TestUser *>(record));
+    }
+    EXPECT_EQ(3 * block_records, i);
+}
+
+TEST(Crc32cTest, KnownValues) {
+    const char digits[] = "123456789";
+    EXPECT_EQ(0xE3069283u, Crc32c(digits, 9));
+    EXPECT_EQ(0xE3069283u, Crc32cExtend(Crc32c(digits, 4), digits + 4, 5));
+
+    // 分块计算和逐块计算的结果一致，块数覆盖交错计算的尾部
+    const size_t block_size = CrcBlockRecords * RecordSize;
+    std::vector<char> data(block_size * 7);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<char>(i * 131 + 7);
+    }
+    for (size_t n = 0; n <= 7; n++) {
+        std::vector<uint32_t> crcs(n);
+        Crc32cBlocks(data.data(), block_size, n, crcs.data());
+        for (size_t b = 0; b < n; b++) {
+            EXPECT_EQ(Crc32c(data.data() + b * block_size, block_size), crcs[b]) << n << " " << b;
+        }
+    }
+}
+
+TEST(RecordCopyTest, AllKernels) {
+    const int num = 100;
+    std::vector<TestUser> src(num);
+    for (int i = 0; i < num; i++) {
+        FillUser(&src[i], i);
+    }
+    // 目标按16字节对齐，覆盖32/64字节对齐和不对齐的起点
+    std::vector<char> buf((num + 1) * RecordSize + 64 + 64);
+    char *base = buf.data() + (64 - reinterpret_cast<uintptr_t>(buf.data()) % 64);
+    for (int kernel = RecordCopyKernel::CopySSE2; kernel <= RecordCopyKernel::CopyAVX512; kernel++) {
+        if (SetRecordCopyKernel(kernel) != 0) {
+            continue;
+        }
+        for (int offset = 0; offset < 64; offset += 16) {
+            for (int n : {1, 3, num}) {
+                for (RecordCopyFn copy : {CopyRecords, StreamRecords}) {
+                    memset(buf.data(), 0, buf.size());
+                    copy(base + offset, reinterpret_cast<const char *>(src.data()), n);
+                    EXPECT_EQ(0, memcmp(base + offset, src.data(), n * RecordSize)) << RecordCopyKernelName(kernel);
+                    // 不能写越界
+                    EXPECT_EQ(0, base[offset + n * RecordSize]);
+                }
+            }
+        }
+    }
+    EXPECT_EQ(0, SetRecordCopyKernel(BestRecordCopyKernel()));
+}
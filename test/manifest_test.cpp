@@ -0,0 +1,76 @@
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include "test_util.h"
+#include "manifest.h"
+
+const char manifest_test_dir[] = "/tmp/manifest_test";
+
+class ManifestTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        EXPECT_EQ(0, rmtree(manifest_test_dir));
+        EXPECT_EQ(0, mkdir(manifest_test_dir, 0755));
+        path_ = std::string(manifest_test_dir) + "/" + ManifestFileName;
+    }
+    void TearDown() override {
+        EXPECT_EQ(0, rmtree(manifest_test_dir));
+    }
+    std::string path_;
+};
+
+TEST_F(ManifestTest, SaveLoad) {
+    EngineManifest manifest;
+    EXPECT_FALSE(EngineManifest::Load(path_, &manifest));
+
+    manifest.aep_share = 30;
+    manifest.last_phase = Phase::ReadOnly;
+    manifest.clean = true;
+    manifest.disk_counts = {1, 2, 3};
+    manifest.pmem_counts = {10, 20, 30};
+    ASSERT_EQ(0, manifest.Save(path_));
+
+    EngineManifest loaded;
+    ASSERT_TRUE(EngineManifest::Load(path_, &loaded));
+    EXPECT_EQ(30, loaded.aep_share);
+    EXPECT_EQ(Phase::ReadOnly, loaded.last_phase);
+    EXPECT_TRUE(loaded.clean);
+    EXPECT_EQ(manifest.disk_counts, loaded.disk_counts);
+    EXPECT_EQ(manifest.pmem_counts, loaded.pmem_counts);
+    EXPECT_EQ(66u, loaded.RecordNum());
+
+    // 默认配置下可以使用，log格式不同或者没有正常关闭时不能使用
+    EngineConfig config;
+    EXPECT_TRUE(loaded.Usable(config));
+    config.pmem_layout = PmemLayout::PmemXPLineLayout;
+    EXPECT_FALSE(loaded.Usable(config));
+    loaded.clean = false;
+    EXPECT_FALSE(loaded.Usable(EngineConfig()));
+
+    // ssd和pmem的log数必须相同
+    manifest.pmem_counts.pop_back();
+    EXPECT_NE(0, manifest.Save(path_));
+}
+
+TEST_F(ManifestTest, RejectCorrupted) {
+    EngineManifest manifest;
+    manifest.clean = true;
+    manifest.disk_counts = {100, 200};
+    manifest.pmem_counts = {300, 400};
+    ASSERT_EQ(0, manifest.Save(path_));
+
+    // 改动任意一个计数
+    int fd = open(path_.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    struct stat st;
+    ASSERT_EQ(0, fstat(fd, &st));
+    uint64_t cnt = 500;
+    ASSERT_EQ((ssize_t)sizeof(cnt), pwrite(fd, &cnt, sizeof(cnt), st.st_size - sizeof(cnt)));
+    close(fd);
+    EngineManifest loaded;
+    EXPECT_FALSE(EngineManifest::Load(path_, &loaded));
+
+    // 截断
+    ASSERT_EQ(0, manifest.Save(path_));
+    ASSERT_EQ(0, truncate(path_.c_str(), st.st_size - sizeof(cnt)));
+    EXPECT_FALSE(EngineManifest::Load(path_, &loaded));
+}
@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <memory>
+#include "test_util.h"
+#include "util.h"
+#include "pmem_index.h"
+
+const char pmem_index_test_dir[] = "/tmp/pmem_index_test";
+const int pmem_index_test_partitions = 2;
+const int pmem_index_test_salaries = 100;
+
+class PmemIndexTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        EXPECT_EQ(0, rmtree(pmem_index_test_dir));
+        EXPECT_EQ(0, mkdir(pmem_index_test_dir, 0755));
+    }
+    void TearDown() override {
+        EXPECT_EQ(0, rmtree(pmem_index_test_dir));
+    }
+    // 第i条记录写到第i % partitions个分区，每个分区中ssd和pmem log的记录交替
+    static void Insert(PmemIndex *index, int begin, int end) {
+        User user;
+        for (int i = begin; i < end; i++) {
+            FillUser(&user, i, pmem_index_test_salaries);
+            index->Insert(i % pmem_index_test_partitions, (i / pmem_index_test_partitions) % 2 == 1, &user);
+        }
+    }
+    static void ExpectRecords(const PmemIndex &index, int records) {
+        EXPECT_EQ((size_t)records, index.Size());
+        for (int i = 0; i < records; i++) {
+            User expect;
+            FillUser(&expect, i, pmem_index_test_salaries);
+            ASSERT_EQ(1u, index.FindId(expect.id, [&](const User &u) { EXPECT_TRUE(expect == const_cast<User &>(u)); }));
+            ASSERT_EQ(1u, index.FindUserId(expect.user_id, [&](const User &u) { EXPECT_EQ(expect.id, u.id); }));
+        }
+        EXPECT_EQ(0u, index.FindId(records + 1, [](const User &) {}));
+        for (int s = 0; s < pmem_index_test_salaries; s++) {
+            EXPECT_EQ((size_t)records / pmem_index_test_salaries,
+                      index.FindSalary(s, [&](const User &u) { EXPECT_EQ(s, u.salary); }));
+        }
+    }
+    static std::string Path(int partition) {
+        return Util::DataFileName(pmem_index_test_dir, PmemIndexFileNamePrefix, partition);
+    }
+};
+
+// 写满之后扩容，扩容前后的记录都能查到; 重新打开之后不需要任何回放
+TEST_F(PmemIndexTest, InsertGrowReopen) {
+    // 每个分区超过MinPartitionRecords条，至少扩容一次
+    const int records = MinPartitionRecords * pmem_index_test_partitions * 3 / 2 / pmem_index_test_salaries * pmem_index_test_salaries;
+    {
+        PmemIndex index(pmem_index_test_dir, pmem_index_test_partitions);
+        Insert(&index, 0, records);
+        ExpectRecords(index, records);
+        EXPECT_FALSE(Util::FileExists(Path(0) + ".tmp"));
+    }
+    PmemIndex index(pmem_index_test_dir, pmem_index_test_partitions);
+    index.Recover();
+    ExpectRecords(index, records);
+    EXPECT_EQ((uint64_t)records / 4, index.DiskCount(0));
+    EXPECT_EQ((uint64_t)records / 4, index.PmemCount(1));
+    EXPECT_EQ(0u, index.DiskCount(pmem_index_test_partitions));
+    // 之后继续插入
+    Insert(&index, records, records + pmem_index_test_salaries);
+    ExpectRecords(index, records + pmem_index_test_salaries);
+}
+
+// 表项已经写入但counts没有提交时crash: 打开时撤销这条记录，和没有插入一样
+TEST_F(PmemIndexTest, RollbackUncommitted) {
+    const int records = 1000;
+    {
+        PmemIndex index(pmem_index_test_dir, pmem_index_test_partitions);
+        Insert(&index, 0, records + pmem_index_test_partitions);
+    }
+    // 每个分区最后一条记录的commit退回到插入之前: 表项和另一组counts都已经写入
+    for (int p = 0; p < pmem_index_test_partitions; p++) {
+        int fd = open(Path(p).c_str(), O_RDWR);
+        ASSERT_GE(fd, 0);
+        uint64_t commit;
+        ASSERT_EQ((ssize_t)sizeof(commit), pread(fd, &commit, sizeof(commit), offsetof(PmemIndexHeader, commit)));
+        commit--;
+        ASSERT_EQ((ssize_t)sizeof(commit), pwrite(fd, &commit, sizeof(commit), offsetof(PmemIndexHeader, commit)));
+        close(fd);
+    }
+    PmemIndex index(pmem_index_test_dir, pmem_index_test_partitions);
+    index.Recover();
+    ExpectRecords(index, records);
+    EXPECT_EQ((uint64_t)records / 4, index.DiskCount(0));
+    EXPECT_EQ((uint64_t)records / 4, index.PmemCount(1));
+    // 重新插入同样的记录
+    Insert(&index, records, records + pmem_index_test_salaries);
+    ExpectRecords(index, records + pmem_index_test_salaries);
+}
+
+// 损坏的分区从空开始，Drop之后的分区重新插入
+TEST_F(PmemIndexTest, CorruptAndDrop) {
+    const int records = 1000;
+    {
+        PmemIndex index(pmem_index_test_dir, pmem_index_test_partitions);
+        Insert(&index, 0, records);
+    }
+    {
+        int fd = open(Path(0).c_str(), O_RDWR);
+        ASSERT_GE(fd, 0);
+        uint64_t capacity = 7;
+        ASSERT_EQ((ssize_t)sizeof(capacity), pwrite(fd, &capacity, sizeof(capacity), offsetof(PmemIndexHeader, capacity)));
+        close(fd);
+    }
+    PmemIndex index(pmem_index_test_dir, pmem_index_test_partitions);
+    index.Recover();
+    EXPECT_EQ(0u, index.DiskCount(0) + index.PmemCount(0));
+    EXPECT_EQ((uint64_t)records / 2, index.DiskCount(1) + index.PmemCount(1));
+    index.Drop(1);
+    EXPECT_FALSE(Util::FileExists(Path(1)));
+    EXPECT_EQ(0u, index.Size());
+    Insert(&index, 0, records);
+    ExpectRecords(index, records);
+    index.Clear();
+    EXPECT_EQ(0u, index.Size());
+    EXPECT_FALSE(Util::FileExists(Path(0)));
+}
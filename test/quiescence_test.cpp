@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "quiescence.h"
+
+TEST(QuiescenceGateTest, DrainWaitsForInFlight) {
+    QuiescenceGate gate(4);
+    std::atomic<bool> entered(false), exited(false);
+    std::thread worker([&]() {
+        gate.Enter();
+        entered = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        exited = true;
+        gate.Exit();
+    });
+    while (!entered) {
+        std::this_thread::yield();
+    }
+    ASSERT_TRUE(gate.TryClose());
+    EXPECT_FALSE(gate.TryClose());
+    gate.Drain();
+    EXPECT_TRUE(exited.load());
+    gate.Open();
+    worker.join();
+}
+
+TEST(QuiescenceGateTest, EnterBlocksWhileClosed) {
+    QuiescenceGate gate(4);
+    ASSERT_TRUE(gate.TryClose());
+    gate.Drain();
+    std::atomic<bool> entered(false);
+    std::thread worker([&]() {
+        gate.Enter();
+        entered = true;
+        gate.Exit();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(entered.load());
+    gate.Open();
+    worker.join();
+    EXPECT_TRUE(entered.load());
+}
+
+// 比slot更多的线程(共用溢出计数)反复进出，同时不断切换: 关闭期间不能有任何线程在里面
+TEST(QuiescenceGateTest, NoOperationDuringTransition) {
+    const int threads = 8;
+    QuiescenceGate gate(threads / 2);
+    std::atomic<int> inside(0), violations(0);
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            while (!stop) {
+                gate.Enter();
+                inside++;
+                inside--;
+                gate.Exit();
+            }
+        });
+    }
+    for (int i = 0; i < 200; i++) {
+        if (gate.TryClose()) {
+            gate.Drain();
+            violations += inside.load() != 0;
+            gate.Open();
+        }
+    }
+    stop = true;
+    for (auto &w : workers) {
+        w.join();
+    }
+    EXPECT_EQ(0, violations.load());
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string>
 
 // POSIX dependencies
@@ -12,6 +13,15 @@
 
 using TestUser = User;
 
+// 第i条测试记录: id从1开始，user_id的前8字节就是它的hash，salary在[0, salaries)中循环
+inline void FillUser(TestUser *user, int64_t i, int64_t salaries = INT64_MAX) {
+    *user = TestUser();
+    user->id = i + 1;
+    snprintf(user->user_id, sizeof(user->user_id), "%08lld", (long long)i);
+    snprintf(user->name, sizeof(user->name), "name%lld", (long long)i);
+    user->salary = i % salaries;
+}
+
 int drop_datafile(std::string path) {
     if (access(path.c_str(), F_OK) == 0) { // if file exist
         return remove(path.c_str());
@@ -50,7 +60,7 @@ int rmtree(const char path[]) {
             continue;
 
         // determinate a full path of an entry
-        full_path = (char *)malloc(path_len + strlen(entry->d_name) + 1);
+        full_path = (char *)malloc(path_len + strlen(entry->d_name) + 2);  // "/"和结尾的0
         strcpy(full_path, path);
         strcat(full_path, "/");
         strcat(full_path, entry->d_name);